@@ -0,0 +1,192 @@
+#include "AdmissionControl.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+static AdmissionOptions defaultAdmissionOptions() {
+    AdmissionOptions options;
+    // Handlers block on the data lock, so even a small box runs a few more threads than cores
+    options.workerThreads = max(8u, thread::hardware_concurrency());
+    return options;
+}
+
+AdmissionOptions admissionOptions = defaultAdmissionOptions();
+
+struct RouteLimiter {
+    bool limited = false;
+    double limit = 0;
+    int maxLimit = 0;
+    int queueDepth = 0;
+    int inFlight = 0;
+    int waiting = 0;
+    chrono::steady_clock::time_point lastDecrease;
+};
+
+static mutex admissionMutex;
+static condition_variable slotFreed;
+static vector<RouteLimiter> limiters; // Sized while routes register, before the server starts
+static int sharedOccupied = 0;        // Running plus waiting across every limited route
+
+// At most a quarter of the workers are held back for point reads
+static int sharedCapacity() {
+    int reserved = min(admissionOptions.reservedThreads, admissionOptions.workerThreads / 4);
+    return max(1, admissionOptions.workerThreads - reserved);
+}
+
+// Defaults by class, scaled to the threads limited routes may occupy: list/search/sort
+// GETs get half of them each. Writes serialize on the exclusive data lock anyway, so
+// running more than one at a time only parks threads; they just queue deeper.
+static AdmissionLimit defaultLimit(const string& method) {
+    int capacity = sharedCapacity();
+    if (method == "GET") {
+        return {max(2, capacity / 2), max(2, capacity)};
+    }
+    return {1, max(4, capacity)};
+}
+
+bool parseAdmissionFlag(const string& arg) {
+    size_t eq = arg.find('=');
+    if (eq == string::npos) {
+        return false;
+    }
+    string key = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+
+    try {
+        if (key == "--threads") {
+            admissionOptions.workerThreads = max(1, stoi(value));
+        } else if (key == "--reserved-threads") {
+            admissionOptions.reservedThreads = max(0, stoi(value));
+        } else if (key == "--queue-timeout-ms") {
+            admissionOptions.queueTimeoutMillis = max(0, stoi(value));
+        } else if (key == "--retry-after") {
+            admissionOptions.retryAfterSeconds = max(0, stoi(value));
+        } else if (key == "--adaptive-latency-ms") {
+            admissionOptions.adaptiveLatencyMillis = max(0, stoi(value));
+        } else if (key == "--route-limit") {
+            // --route-limit="GET /api/reviews=4:8" (concurrency:queue)
+            size_t split = value.rfind('=');
+            size_t colon = value.rfind(':');
+            if (split == string::npos || colon == string::npos || colon < split) {
+                return false;
+            }
+            AdmissionLimit limit = {max(1, stoi(value.substr(split + 1, colon - split - 1))),
+                                    max(0, stoi(value.substr(colon + 1)))};
+            admissionOptions.routeLimits[value.substr(0, split)] = limit;
+        } else {
+            return false;
+        }
+    } catch (const exception&) {
+        return false;
+    }
+    return true;
+}
+
+void configureAdmission(int route, const string& method, const string& path) {
+    if ((int)limiters.size() <= route) {
+        limiters.resize(route + 1);
+    }
+    RouteLimiter& limiter = limiters[route];
+
+    map<string, AdmissionLimit>::iterator configured = admissionOptions.routeLimits.find(method + " " + path);
+    // Completions are bounded work per call, like a lookup by id. The change feed and
+    // replication routes are how replicas bootstrap and catch up; shedding them only
+    // makes a replica retry.
+    bool pointRead = method == "GET" && (path.find("<id>") != string::npos || path == "/api/books/suggest");
+    bool replicationFeed = path == "/api/changes" || path.compare(0, 17, "/api/replication/") == 0;
+    if ((pointRead || replicationFeed) && configured == admissionOptions.routeLimits.end()) {
+        limiter.limited = false;
+        return;
+    }
+
+    AdmissionLimit limit = configured != admissionOptions.routeLimits.end() ? configured->second : defaultLimit(method);
+    limiter.limited = true;
+    limiter.limit = limit.concurrency;
+    limiter.maxLimit = limit.concurrency;
+    limiter.queueDepth = limit.queueDepth;
+}
+
+double getAdmissionLimit(int route) {
+    if (route >= (int)limiters.size() || !limiters[route].limited) {
+        return -1;
+    }
+    lock_guard<mutex> lock(admissionMutex);
+    return limiters[route].limit;
+}
+
+AdmissionTicket::AdmissionTicket(int route) : route(route), granted(true), limited(false) {
+    if (route >= (int)limiters.size() || !limiters[route].limited) {
+        return;
+    }
+
+    RouteLimiter& limiter = limiters[route];
+    unique_lock<mutex> lock(admissionMutex);
+    auto hasSlot = [&limiter] { return limiter.inFlight < (int)limiter.limit; };
+
+    if (!hasSlot()) {
+        if (limiter.waiting >= limiter.queueDepth || sharedOccupied >= sharedCapacity()) {
+            granted = false;
+            recordShed(route, SHED_QUEUE_FULL);
+            return;
+        }
+        TraceSpan span("admission queue");
+        limiter.waiting++;
+        sharedOccupied++;
+        bool ready = slotFreed.wait_for(lock, chrono::milliseconds(admissionOptions.queueTimeoutMillis), hasSlot);
+        limiter.waiting--;
+        if (!ready) {
+            sharedOccupied--;
+            granted = false;
+            recordShed(route, SHED_TIMEOUT);
+            return;
+        }
+    } else {
+        if (sharedOccupied >= sharedCapacity()) {
+            granted = false;
+            recordShed(route, SHED_QUEUE_FULL);
+            return;
+        }
+        sharedOccupied++;
+    }
+
+    limiter.inFlight++;
+    limited = true;
+    admittedAt = chrono::steady_clock::now();
+}
+
+AdmissionTicket::~AdmissionTicket() {
+    if (!limited) {
+        return;
+    }
+
+    RouteLimiter& limiter = limiters[route];
+    lock_guard<mutex> lock(admissionMutex);
+    limiter.inFlight--;
+    sharedOccupied--;
+
+    // AIMD: grow by one slot per limit's worth of fast calls, cut by a quarter
+    // on a slow one (at most once per target interval)
+    int target = admissionOptions.adaptiveLatencyMillis;
+    if (target > 0) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (now - admittedAt > chrono::milliseconds(target)) {
+            if (now - limiter.lastDecrease > chrono::milliseconds(target)) {
+                limiter.limit = max(1.0, limiter.limit * 0.75);
+                limiter.lastDecrease = now;
+            }
+        } else {
+            limiter.limit = min((double)limiter.maxLimit, limiter.limit + 1.0 / limiter.limit);
+        }
+    }
+    slotFreed.notify_all();
+}
+
+void fillShedResponse(response& res) {
+    res.code = 503;
+    res.set_header("Retry-After", to_string(admissionOptions.retryAfterSeconds));
+    res.body = "Service Unavailable: route is over capacity";
+}
@@ -0,0 +1,58 @@
+#ifndef ADMISSIONCONTROL_H
+#define ADMISSIONCONTROL_H
+
+#include <string>
+#include <map>
+#include <chrono>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Per-route concurrency limit plus a short wait queue. Waiting still occupies
+// a Crow worker thread, so everything outside the priority class (GET by id)
+// also shares one cap that leaves reservedThreads free for point reads.
+struct AdmissionLimit {
+    int concurrency;
+    int queueDepth;
+};
+
+struct AdmissionOptions {
+    int workerThreads;
+    int reservedThreads = 2;
+    int queueTimeoutMillis = 500;
+    int retryAfterSeconds = 1;
+    int adaptiveLatencyMillis = 0; // Non-zero turns on AIMD limits targeting this handler latency
+    map<string, AdmissionLimit> routeLimits; // Keyed "METHOD /path", overriding the class defaults
+};
+
+extern AdmissionOptions admissionOptions;
+
+// Consumes one --flag=value server option; false if it is not an admission flag or is malformed
+bool parseAdmissionFlag(const string& arg);
+
+// Picks the route's class and limits; call right after registerRoute
+void configureAdmission(int route, const string& method, const string& path);
+
+// Current concurrency limit, or -1 for priority routes that are never limited
+double getAdmissionLimit(int route);
+
+// Held for the duration of one handler call
+class AdmissionTicket {
+public:
+    AdmissionTicket(int route);
+    ~AdmissionTicket();
+
+    bool admitted() { return granted; }
+
+private:
+    int route;
+    bool granted;
+    bool limited;
+    chrono::steady_clock::time_point admittedAt;
+};
+
+// 503 with Retry-After; the caller ends or returns the response
+void fillShedResponse(response& res);
+
+#endif
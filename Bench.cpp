@@ -0,0 +1,812 @@
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "Recommendation.h"
+#include "DataGenerator.h"
+#include "Compression.h"
+#include "Instrument.h"
+#include "ListSnapshot.h"
+#include "ReviewSearch.h"
+#include "BookSuggest.h"
+#include "Facets.h"
+#include "Bitmap.h"
+#include "Startup.h"
+#include "MemoryAccounting.h"
+#include <crow.h>
+
+#include <random>
+#include <climits>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace crow;
+
+extern map<string, User> userMap;
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+extern map<string, Recommendation> recommendationMap;
+
+struct BenchOptions {
+    DatasetSpec spec;
+    int iterations = 1000;
+    int scanIterations = 20;
+    string dataDir = "bench_data";
+    string only;
+    bool generateOnly = false;
+};
+
+struct BenchResult {
+    string name;
+    vector<long long> samples;
+    long long totalNanos = 0;
+    unsigned long long totalBytes = 0;
+};
+
+static vector<BenchResult> results;
+static BenchOptions options;
+
+static request makeRequest(string url, string body = "") {
+    request req;
+    req.url = url;
+    req.url_params = query_string(url);
+    req.body = body;
+    return req;
+}
+
+static long long percentile(vector<long long>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+// Runs op(i) for each iteration; op returns the response size in bytes
+template <typename F>
+static void runBench(string name, int iterations, F op) {
+    if (!options.only.empty() && name.find(options.only) == string::npos) {
+        return;
+    }
+    cerr << "bench " << name << " x" << iterations << endl;
+
+    BenchResult result;
+    result.name = name;
+    for (int i = 0; i < iterations; i++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        result.totalBytes += op(i);
+        long long nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        result.samples.push_back(nanos);
+        result.totalNanos += nanos;
+    }
+    results.push_back(result);
+}
+
+static string renderResults() {
+    json::wvalue out;
+    out["dataset"]["seed"] = (uint64_t)options.spec.seed;
+    out["dataset"]["users"] = options.spec.users;
+    out["dataset"]["books"] = options.spec.books;
+    out["dataset"]["reviews"] = options.spec.reviews;
+    out["dataset"]["recommendations"] = (uint64_t)recommendationMap.size();
+
+    for (unsigned int i = 0; i < results.size(); i++) {
+        BenchResult& result = results[i];
+        vector<long long> sorted = result.samples;
+        sort(sorted.begin(), sorted.end());
+        double seconds = result.totalNanos / 1e9;
+        size_t n = sorted.size();
+
+        json::wvalue& j = out["results"][i];
+        j["name"] = result.name;
+        j["iterations"] = (uint64_t)n;
+        j["ops_per_sec"] = seconds > 0 ? n / seconds : 0.0;
+        j["mean_us"] = n ? result.totalNanos / 1e3 / n : 0.0;
+        j["p50_us"] = percentile(sorted, 0.50) / 1e3;
+        j["p90_us"] = percentile(sorted, 0.90) / 1e3;
+        j["p99_us"] = percentile(sorted, 0.99) / 1e3;
+        j["p999_us"] = percentile(sorted, 0.999) / 1e3;
+        j["max_us"] = n ? sorted.back() / 1e3 : 0.0;
+        j["bytes_per_op"] = n ? (double)result.totalBytes / n : 0.0;
+    }
+    return out.dump();
+}
+
+static void parseOptions(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if (key == "--seed") options.spec.seed = stoull(value);
+        else if (key == "--users") options.spec.users = stoi(value);
+        else if (key == "--books") options.spec.books = stoi(value);
+        else if (key == "--reviews") options.spec.reviews = stoi(value);
+        else if (key == "--recs-per-user") options.spec.maxRecommendationsPerUser = stoi(value);
+        else if (key == "--iterations") options.iterations = stoi(value);
+        else if (key == "--scan-iterations") options.scanIterations = stoi(value);
+        else if (key == "--data-dir") options.dataDir = value;
+        else if (key == "--only") options.only = value;
+        else if (key == "--generate-only") options.generateOnly = true;
+        else {
+            cerr << "usage: bench [--seed=N] [--users=N] [--books=N] [--reviews=N] [--recs-per-user=N]\n"
+                 << "             [--iterations=N] [--scan-iterations=N] [--data-dir=DIR] [--only=NAME] [--generate-only]" << endl;
+            exit(arg == "--help" ? 0 : 2);
+        }
+    }
+}
+
+static void benchPersistence() {
+    string dir = options.dataDir;
+    runBench("saveBookToFile", options.scanIterations, [&](int) { saveBookToFile(bookMap, dir + "/books.json"); return 0; });
+    runBench("saveUserToFile", options.scanIterations, [&](int) { saveUserToFile(userMap, dir + "/users.json"); return 0; });
+    runBench("saveReviewToFile", options.scanIterations, [&](int) { saveReviewToFile(reviewMap, dir + "/reviews.json"); return 0; });
+    runBench("saveRecommendationToFile", options.scanIterations, [&](int) {
+        saveRecommendationToFile(recommendationMap, dir + "/recommendations.json");
+        return 0;
+    });
+    runBench("loadBookFromFile", options.scanIterations, [&](int) { return (int)loadBookFromFile(dir + "/books.json").size(); });
+    runBench("loadUserFromFile", options.scanIterations, [&](int) { return (int)loadUserFromFile(dir + "/users.json").size(); });
+    runBench("loadReviewFromFile", options.scanIterations, [&](int) { return (int)loadReviewFromFile(dir + "/reviews.json").size(); });
+    runBench("loadRecommendationFromFile", options.scanIterations, [&](int) {
+        return (int)loadRecommendationFromFile(dir + "/recommendations.json").size();
+    });
+}
+
+// Server startup from the files benchPersistence saved: the four loads and
+// the index builds, at several pool sizes
+static void benchStartup() {
+    string dir = options.dataDir;
+    for (int threads : {1, 4, 16}) {
+        runBench("startup/threads=" + to_string(threads), options.scanIterations, [&](int) {
+            loadDataFiles(dir + "/books.json", dir + "/users.json", dir + "/reviews.json", dir + "/recommendations.json",
+                          threads);
+            runParallel({rebuildReviewIndex, rebuildBookSuggestions, rebuildFacets, []() { rebuildIsbnIndex(); },
+                         []() { rebuildEmailIndex(); }},
+                        threads);
+            return 0;
+        });
+    }
+}
+
+// The /api/admin/memory walk, after checking its estimate against what the
+// allocator and RSS grow by when the maps are loaded from the saved files
+static void benchMemory() {
+    if (!options.only.empty() && options.only.find("memory") == string::npos &&
+        string("memory").find(options.only) == string::npos) {
+        return;
+    }
+    string dir = options.dataDir;
+    saveBookToFile(bookMap, dir + "/books.json");
+    saveUserToFile(userMap, dir + "/users.json");
+    saveReviewToFile(reviewMap, dir + "/reviews.json");
+    saveRecommendationToFile(recommendationMap, dir + "/recommendations.json");
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    malloc_trim(0);
+    AllocatorStats empty = getAllocatorStats();
+    loadDataFiles(dir + "/books.json", dir + "/users.json", dir + "/reviews.json", dir + "/recommendations.json", 1);
+    malloc_trim(0);
+    AllocatorStats loaded = getAllocatorStats();
+    runParallel({rebuildReviewIndex, rebuildBookSuggestions, rebuildFacets, []() { rebuildIsbnIndex(); },
+                 []() { rebuildEmailIndex(); }},
+                1);
+
+    map<string, CollectionMemory> collections = measureCollections(1);
+    unsigned long long estimated = 0;
+    for (map<string, CollectionMemory>::iterator it = collections.begin(); it != collections.end(); ++it) {
+        for (map<string, MemoryUsage>::iterator type = it->second.byType.begin(); type != it->second.byType.end(); ++type) {
+            estimated += type->second.total();
+        }
+    }
+    cerr << "memory: maps estimated at " << estimated / 1024 << " KB; loading them grew the allocator's live bytes by "
+         << (long long)(loaded.liveBytes - empty.liveBytes) / 1024 << " KB and RSS by "
+         << ((long long)loaded.rssBytes - (long long)empty.rssBytes) / 1024 << " KB" << endl;
+
+    for (int sample : {1, 16}) {
+        runBench("memory/measure/sample=" + to_string(sample), options.scanIterations, [&](int) {
+            return (int)measureCollections(sample).size();
+        });
+    }
+}
+
+// The field-list writer and reader against the crow::json DOM they replace
+static void benchSerialize() {
+    runBench("serializeBooks/reflected", options.scanIterations, [&](int) {
+        string out;
+        for (map<string, Book>::iterator it = bookMap.begin(); it != bookMap.end(); ++it) {
+            writeJsonFields(out, it->second);
+        }
+        return out.size();
+    });
+    runBench("serializeBooks/crowJson", options.scanIterations, [&](int) {
+        size_t bytes = 0;
+        for (map<string, Book>::iterator it = bookMap.begin(); it != bookMap.end(); ++it) {
+            json::wvalue j;
+            j["id"] = it->second.getId();
+            j["title"] = it->second.getTitle();
+            j["author"] = it->second.getAuthor();
+            j["genre"] = it->second.getGenre();
+            j["isbn"] = it->second.getIsbn();
+            bytes += j.dump().size();
+        }
+        return bytes;
+    });
+
+    // One create body, checked against the schema or loaded into a DOM and read field by field
+    string body = "{\"id\":\"bench-review-1\",\"user\":{\"id\":\"" + formatEntityId(1, options.spec.users) +
+                  "\"},\"book\":{\"id\":\"" + formatEntityId(1, options.spec.books) +
+                  "\"},\"rating\":4,\"comment\":\"Benchmark review with a few words about pacing and characters.\"}";
+    runBench("parseBody/schema", options.iterations, [&](int) {
+        Review review;
+        response error;
+        readJsonBody(body, review, jsonRequiredFields<Review>(), nullptr, error);
+        return body.size();
+    });
+    runBench("parseBody/crowJson", options.iterations, [&](int) {
+        json::rvalue parsed = json::load(body);
+        Review review(parsed["id"].s(), User(parsed["user"]["id"].s(), "", "", {}), Book(parsed["book"]["id"].s(), "", "", "", ""),
+                      (int)parsed["rating"].i(), parsed["comment"].s());
+        return body.size();
+    });
+
+    // A slice, so the DOM of the whole text stays within memory
+    vector<const string*> fragments;
+    for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end() && fragments.size() < 100000; ++it) {
+        fragments.push_back(&it->second.getJsonFragment());
+    }
+    string text = joinJsonFragments(fragments);
+    runBench("parseReviews/reflected", options.scanIterations, [&](int) {
+        size_t count = 0;
+        JsonReader in(text);
+        readJsonArray<Review>(in, [&](Review&) { count++; });
+        return count;
+    });
+    runBench("parseReviews/crowJson", options.scanIterations, [&](int) {
+        size_t count = 0;
+        json::rvalue parsed = json::load(text);
+        for (const json::rvalue& item : parsed) {
+            const json::rvalue& user = item["user"];
+            const json::rvalue& book = item["book"];
+            vector<string> preferences;
+            for (const json::rvalue& preference : user["preferences"]) {
+                preferences.push_back(preference.s());
+            }
+            Review review(item["id"].s(), User(user["id"].s(), user["name"].s(), user["email"].s(), preferences),
+                          Book(book["id"].s(), book["title"].s(), book["author"].s(), book["genre"].s(), book["isbn"].s()),
+                          (int)item["rating"].i(), item["comment"].s());
+            count++;
+        }
+        return count;
+    });
+}
+
+static void benchReads(mt19937_64& rng) {
+    DatasetSpec& spec = options.spec;
+    uniform_int_distribution<int> anyUser(1, max(spec.users, 1));
+    uniform_int_distribution<int> anyBook(1, max(spec.books, 1));
+    uniform_int_distribution<int> anyReview(1, max(spec.reviews, 1));
+    uniform_int_distribution<int> anyRec(1, max((int)recommendationMap.size(), 1));
+
+    // Point reads
+    runBench("readUser", options.iterations, [&](int) { return readUser(formatEntityId(anyUser(rng), spec.users)).body.size(); });
+    runBench("readBook", options.iterations, [&](int) { return readBook(formatEntityId(anyBook(rng), spec.books)).body.size(); });
+    runBench("readBookByIsbn", options.iterations, [&](int) { return readBookByIsbn(makeIsbn13(anyBook(rng))).body.size(); });
+    runBench("readReview", options.iterations, [&](int) { return readReview(formatEntityId(anyReview(rng), spec.reviews)).body.size(); });
+    // Emails sampled up front so the timed part is the lookup alone; upper case checks the folding
+    vector<string> emails;
+    for (int i = 0; i < 4096 && !userMap.empty(); i++) {
+        string email = userMap[formatEntityId(anyUser(rng), spec.users)].getEmail();
+        if (i % 2) {
+            transform(email.begin(), email.end(), email.begin(), ::toupper);
+        }
+        emails.push_back(email);
+    }
+    runBench("readUserByEmail", emails.empty() ? 0 : options.iterations, [&](int i) {
+        return readUserByEmail(emails[i % emails.size()]).body.size();
+    });
+    runBench("filterUsersByEmail", emails.empty() ? 0 : options.iterations, [&](int i) {
+        return readAllUsers(makeRequest("/api/users?filterKey=email&filterValue=" + emails[i % emails.size()])).body.size();
+    });
+    runBench("readRecommendation", options.iterations, [&](int) {
+        ostringstream ss;
+        ss << setfill('0') << setw(3) << anyRec(rng);
+        return readRecommendation(ss.str()).body.size();
+    });
+
+    // Collection reads: full listing, search, sort and filter per resource
+    const char* lists[][2] = {
+        {"readAllUsers", "/api/users"},
+        {"searchUsers", "/api/users?search=garcia"},
+        {"sortUsers", "/api/users?sort=name"},
+        {"filterUsers", "/api/users?filterKey=email&filterValue=alice.yu.1@example.com"},
+        {"readAllBooks", "/api/books"},
+        {"searchBooks", "/api/books?search=garden"},
+        {"sortBooks", "/api/books?sort=title"},
+        {"filterBooks", "/api/books?filterKey=genre&filterValue=fantasy"},
+        {"readAllReviews", "/api/reviews"},
+        {"searchReviews", "/api/reviews?search=pacing"},
+        {"sortReviews", "/api/reviews?sort=rating"},
+        {"filterReviews", "/api/reviews?filterKey=genre&filterValue=mystery"},
+        {"readAllRecommendations", "/api/recommendations"},
+        {"searchRecommendations", "/api/recommendations?search=harbor"},
+        {"sortRecommendations", "/api/recommendations?sort=title"},
+        {"filterRecommendations", "/api/recommendations?filterKey=genre&filterValue=classic"}
+    };
+    for (unsigned int i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        string name = lists[i][0];
+        request req = makeRequest(lists[i][1]);
+        if (name.find("Users") != string::npos) {
+            runBench(name, options.scanIterations, [&](int) { return readAllUsers(req).body.size(); });
+        } else if (name.find("Books") != string::npos) {
+            runBench(name, options.scanIterations, [&](int) { return readAllBooks(req).body.size(); });
+        } else if (name.find("Reviews") != string::npos) {
+            runBench(name, options.scanIterations, [&](int) { return readAllReviews(req).body.size(); });
+        } else {
+            runBench(name, options.scanIterations, [&](int) { return readAllRecommendations(req).body.size(); });
+        }
+    }
+}
+
+// Ranked review search: index build, top-k queries of growing breadth, and
+// the per-write cost of re-indexing one review
+static void benchSearch(mt19937_64& rng) {
+    uniform_int_distribution<int> anyReview(1, max(options.spec.reviews, 1));
+    runBench("reviewSearch/rebuildIndex", 1, [&](int) {
+        rebuildReviewIndex();
+        return (int)getReviewIndexStats().postings;
+    });
+    if (!reviewIndexReady()) {
+        rebuildReviewIndex();
+    }
+
+    const char* queries[][2] = {
+        {"reviewSearch/rare", "/api/reviews?q=audiobook&k=10"},
+        {"reviewSearch/common", "/api/reviews?q=the&k=10"},
+        {"reviewSearch/threeTerms", "/api/reviews?q=pacing+slow+ending&k=10"},
+        {"reviewSearch/titleAndComment", "/api/reviews?q=harbor+twist&k=100"}
+    };
+    for (unsigned int i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        request req = makeRequest(queries[i][1]);
+        runBench(queries[i][0], options.iterations, [&](int) { return readAllReviews(req).body.size(); });
+    }
+
+    runBench("reviewSearch/indexReview", options.iterations, [&](int) {
+        ReviewStore::iterator review = reviewMap.find(formatEntityId(anyReview(rng), options.spec.reviews));
+        indexReview(review->second);
+        return 0;
+    });
+}
+
+// Search-as-you-type: trie build, completions for short (cached) and long
+// (scanned) prefixes, and the upkeep a retitle or a new review costs
+static void benchSuggest(mt19937_64& rng) {
+    uniform_int_distribution<int> anyBook(1, max(options.spec.books, 1));
+    uniform_int_distribution<int> anyUser(1, max(options.spec.users, 1));
+    runBench("bookSuggest/rebuild", 1, [&](int) {
+        rebuildBookSuggestions();
+        return (int)getBookSuggestStats().bytes;
+    });
+    if (!bookSuggestionsReady()) {
+        rebuildBookSuggestions();
+    }
+    BookSuggestStats stats = getBookSuggestStats();
+    cerr << "suggest trie: " << stats.suggestions << " suggestions, " << stats.nodes << " nodes, "
+         << stats.bytes / (1024 * 1024) << " MiB" << endl;
+
+    const char* queries[][2] = {
+        {"bookSuggest/oneLetter", "/api/books/suggest?prefix=t"},
+        {"bookSuggest/twoWords", "/api/books/suggest?prefix=the+si"},
+        {"bookSuggest/miss", "/api/books/suggest?prefix=qqq"}
+    };
+    for (unsigned int i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        request req = makeRequest(queries[i][1]);
+        runBench(queries[i][0], options.iterations, [&](int) { return readBookSuggestions(req).body.size(); });
+    }
+    // Every prefix a user types on the way to a real title or author
+    runBench("bookSuggest/keystrokes", options.iterations, [&](int) {
+        Book& book = bookMap[formatEntityId(anyBook(rng), options.spec.books)];
+        string prefix = rng() % 2 ? book.getTitle() : book.getAuthor();
+        prefix.resize(1 + rng() % prefix.size());
+        replace(prefix.begin(), prefix.end(), ' ', '+');
+        return readBookSuggestions(makeRequest("/api/books/suggest?prefix=" + prefix)).body.size();
+    });
+
+    runBench("bookSuggest/retitleBook", options.iterations, [&](int i) {
+        string id = formatEntityId(anyBook(rng), options.spec.books);
+        bookMap[id].setTitle("The Retitled Book " + to_string(i));
+        refreshBookSuggestions("books", id, false);
+        return 0;
+    });
+    runBench("bookSuggest/addReview", options.iterations, [&](int i) {
+        string id = "bench-suggest-" + to_string(i);
+        Review review(id, userMap[formatEntityId(anyUser(rng), options.spec.users)],
+                      bookMap[formatEntityId(anyBook(rng), options.spec.books)], 5, "Suggested");
+        reviewMap.insert_or_assign(id, review);
+        refreshBookSuggestions("reviews", id, false);
+        return 0;
+    });
+    for (int i = 0; i < options.iterations; i++) {
+        string id = "bench-suggest-" + to_string(i);
+        reviewMap.erase(id);
+        refreshBookSuggestions("reviews", id, true);
+    }
+}
+
+// Facet counting alone (the items are left out), over the whole collection,
+// a filter and a search, plus the bitmap kernels and the upkeep of a write
+static void benchFacets(mt19937_64& rng) {
+    uniform_int_distribution<int> anyReview(1, max(options.spec.reviews, 1));
+    runBench("facets/rebuild", 1, [&](int) {
+        rebuildFacets();
+        return (int)getFacetStats().bytes;
+    });
+    if (!facetsReady()) {
+        rebuildFacets();
+    }
+    FacetStats stats = getFacetStats();
+    cerr << "facets: " << stats.values << " values, " << stats.containers << " containers, "
+         << stats.bytes / (1024 * 1024) << " MiB" << endl;
+
+    vector<string> mystery, pacing;
+    for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end(); ++it) {
+        if (it->second.getBook().getGenre() == "Mystery") {
+            mystery.push_back(it->first);
+        }
+        if (toLower(it->second.getComment()).find("pacing") != string::npos) {
+            pacing.push_back(it->first);
+        }
+    }
+    request reviewFacets = makeRequest("/api/reviews?facets=genre,author,rating");
+    request bookAuthors = makeRequest("/api/books?facets=author,genre");
+    // A filter on a faceted field is read from the bitmaps; a search's matches are looked up by id
+    request filtered = makeRequest("/api/reviews?filterKey=genre&filterValue=mystery&facets=author,rating");
+    request searched = makeRequest("/api/reviews?search=pacing&facets=author,rating");
+    runBench("facets/reviewsAll", options.iterations, [&](int) { return facetedList("reviews", reviewFacets, "[]", nullptr).body.size(); });
+    runBench("facets/booksAll", options.iterations, [&](int) { return facetedList("books", bookAuthors, "[]", nullptr).body.size(); });
+    runBench("facets/reviewsFilterGenre", options.scanIterations, [&](int) { return facetedList("reviews", filtered, "[]", &mystery).body.size(); });
+    runBench("facets/reviewsSearch", options.scanIterations, [&](int) { return facetedList("reviews", searched, "[]", &pacing).body.size(); });
+    // End to end, to compare with filterReviews above
+    runBench("facets/filterReviewsFaceted", options.scanIterations, [&](int) { return readAllReviews(filtered).body.size(); });
+
+    // Two dense bitmaps over every review slot: the popcount kernel alone
+    Bitmap halves, thirds;
+    for (uint32_t v = 0; v < (uint32_t)reviewMap.size(); v++) {
+        if (v % 2 == 0) {
+            halves.add(v);
+        }
+        if (v % 3 == 0) {
+            thirds.add(v);
+        }
+    }
+    runBench("facets/andCardinalityDense", options.iterations, [&](int) { return (int)halves.andCardinality(thirds); });
+
+    runBench("facets/rerateReview", options.iterations, [&](int i) {
+        string id = formatEntityId(anyReview(rng), options.spec.reviews);
+        reviewMap.find(id)->second.setRating(1 + i % 5);
+        refreshFacets("reviews", id, false);
+        return 0;
+    });
+}
+
+// Rating ranges from the facet bitmaps: the intersection alone, then whole
+// requests to compare with filterReviews and sortReviews above
+static void benchRatings(mt19937_64& rng) {
+    if (!facetsReady()) {
+        rebuildFacets();
+    }
+    uniform_int_distribution<int> anyUser(1, max(options.spec.users, 1));
+    vector<string> names;
+    for (int i = 0; i < options.iterations; i++) {
+        names.push_back(userMap[formatEntityId(anyUser(rng), options.spec.users)].getName());
+    }
+    vector<ReviewStore::Position> reviews;
+    runBench("ratings/topRated", options.scanIterations, [&](int) {
+        ratedReviews(5, 5, nullptr, nullptr, reviews);
+        return (int)reviews.size();
+    });
+    runBench("ratings/genreMinRating", options.iterations, [&](int) {
+        ratedReviews(4, INT_MAX, "genre", "mystery", reviews);
+        return (int)reviews.size();
+    });
+    runBench("ratings/userMaxRating", options.iterations, [&](int i) {
+        ratedReviews(INT_MIN, 2, "user", names[i % names.size()].c_str(), reviews);
+        return (int)reviews.size();
+    });
+    request genre = makeRequest("/api/reviews?minRating=5&filterKey=genre&filterValue=mystery");
+    runBench("ratings/readGenreMinRating", options.scanIterations, [&](int) { return readAllReviews(genre).body.size(); });
+}
+
+// CPU versus bytes: bytes per op is the compressed size, compare it with the
+// plain list result of the same name
+static void benchCompression() {
+    const char* lists[][2] = {
+        {"readAllReviews", "/api/reviews"},
+        {"readAllRecommendations", "/api/recommendations"}
+    };
+    for (unsigned int i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        string name = lists[i][0];
+        request req = makeRequest(lists[i][1]);
+        string body = name == "readAllReviews" ? readAllReviews(req).body : readAllRecommendations(req).body;
+
+        int levels[] = {1, 6, 9};
+        for (int level : levels) {
+            runBench("gzip-" + to_string(level) + "/" + name, options.scanIterations, [&](int) {
+                return compressBody(body, GZIP, level).size();
+            });
+        }
+        runBench("deflate-6/" + name, options.scanIterations, [&](int) { return compressBody(body, DEFLATE, 6).size(); });
+
+        // Same data version again: served from the compressed cache without the handler
+        int route = registerRoute("GET", lists[i][1]);
+        req.add_header("Accept-Encoding", "gzip");
+        response warm(200, body);
+        compressResponse(route, req, dataVersion.load(), warm);
+        runBench("cachedGzip/" + name, options.scanIterations, [&](int) {
+            response res;
+            readCompressed(route, req, res);
+            return res.body.size();
+        });
+    }
+}
+
+// Review updates through the route wrapper while other threads keep listing
+// every review: first with scans holding the shared lock, then served from
+// list snapshots. Writer latency is what the results report.
+static void benchWritesDuringScans(mt19937_64& rng) {
+    const int SCANNERS = 3;
+    const int WRITE_PACING_MICROS = 500;
+    uniform_int_distribution<int> anyReview(1, max(options.spec.reviews, 1));
+    // Enough worker threads that admission control never sheds the writer
+    admissionOptions.workerThreads = max(admissionOptions.workerThreads, SCANNERS + 4);
+    auto scanReviews = instrument("GET", "/api/reviews", readAllReviews);
+    auto writeReview = instrument("PUT", "/api/reviews/<id>", updateReview);
+
+    const char* modes[] = {"locked", "snapshot"};
+    for (const char* mode : modes) {
+        string name = string("writeDuringScans/") + mode;
+        if (!options.only.empty() && name.find(options.only) == string::npos) {
+            continue;
+        }
+        if (string(mode) == "snapshot") {
+            startListSnapshots();
+        }
+        atomic<bool> done(false);
+        atomic<int> scans(0);
+        vector<thread> scanners;
+        for (int t = 0; t < SCANNERS; t++) {
+            scanners.emplace_back([&]() {
+                request req = makeRequest("/api/reviews");
+                while (!done.load()) {
+                    scanReviews(req);
+                    scans++;
+                }
+            });
+        }
+        // Writes start once every scanner is past its first, cold scan
+        while (scans.load() < SCANNERS) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        // Paced rather than back to back, so the writes spread over many scans
+        cerr << "bench " << name << " x" << options.iterations << endl;
+        BenchResult result;
+        result.name = name;
+        for (int i = 0; i < options.iterations; i++) {
+            this_thread::sleep_for(chrono::microseconds(WRITE_PACING_MICROS));
+            json::wvalue body;
+            body["rating"] = i % 5 + 1;
+            body["comment"] = "Updated while scans run " + to_string(i);
+            request req = makeRequest("/api/reviews/x", body.dump());
+            string id = formatEntityId(anyReview(rng), options.spec.reviews);
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            response res;
+            writeReview(req, res, id);
+            long long nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            result.samples.push_back(nanos);
+            result.totalNanos += nanos;
+            result.totalBytes += res.body.size();
+        }
+        results.push_back(result);
+        done = true;
+        for (unsigned int t = 0; t < scanners.size(); t++) {
+            scanners[t].join();
+        }
+        stopListSnapshots();
+    }
+}
+
+static void benchWrites(mt19937_64& rng) {
+    DatasetSpec& spec = options.spec;
+    uniform_int_distribution<int> anyUser(1, max(spec.users, 1));
+    uniform_int_distribution<int> anyBook(1, max(spec.books, 1));
+    uniform_int_distribution<int> anyReview(1, max(spec.reviews, 1));
+
+    runBench("createReview", options.iterations, [&](int i) {
+        json::wvalue body;
+        body["id"] = "bench-review-" + to_string(i);
+        body["user"]["id"] = formatEntityId(anyUser(rng), spec.users);
+        body["book"]["id"] = formatEntityId(anyBook(rng), spec.books);
+        body["rating"] = 4;
+        body["comment"] = "Benchmark review with a few words about pacing and characters.";
+        return createReview(makeRequest("/api/reviews", body.dump())).body.size();
+    });
+    runBench("updateReview", options.iterations, [&](int i) {
+        json::wvalue body;
+        body["rating"] = i % 5 + 1;
+        body["comment"] = "Updated during benchmark run " + to_string(i);
+        response res;
+        updateReview(makeRequest("/api/reviews/x", body.dump()), res, formatEntityId(anyReview(rng), spec.reviews));
+        return res.body.size();
+    });
+    runBench("deleteReview", options.iterations, [&](int i) {
+        return deleteReview("bench-review-" + to_string(i)).body.size();
+    });
+
+    // Book and user writes only enqueue a recommendation rebuild; each run is
+    // followed by one flush that applies the whole coalesced batch
+    auto benchFlush = [&](string name) {
+        runBench(name, 1, [&](int) {
+            flushRecommendations();
+            return (int)recommendationMap.size();
+        });
+    };
+    runBench("createBook", options.scanIterations, [&](int i) {
+        json::wvalue body;
+        body["id"] = "bench-book-" + to_string(i);
+        body["title"] = "Benchmark Edition " + to_string(i);
+        body["author"] = "Bench Author";
+        body["genre"] = "Fantasy";
+        body["isbn"] = makeIsbn13(spec.books + 1 + i);
+        return createBook(makeRequest("/api/books", body.dump())).body.size();
+    });
+    benchFlush("recommendationBatch/createBook");
+    runBench("updateBook", options.scanIterations, [&](int i) {
+        json::wvalue body;
+        body["title"] = "Benchmark Revised " + to_string(i);
+        body["author"] = "Bench Author";
+        body["genre"] = i % 2 ? "Mystery" : "Fantasy";
+        string id = formatEntityId(anyBook(rng), spec.books);
+        body["isbn"] = bookMap[id].getIsbn(); // ISBNs are unique, so each book keeps its own
+        response res;
+        updateBook(makeRequest("/api/books/x", body.dump()), res, id);
+        return res.body.size();
+    });
+    benchFlush("recommendationBatch/updateBook");
+    runBench("createUser", options.scanIterations, [&](int i) {
+        json::wvalue body;
+        body["id"] = "bench-user-" + to_string(i);
+        body["name"] = "Bench User " + to_string(i);
+        body["email"] = "bench." + to_string(i) + "@example.com";
+        body["preferences"] = vector<string>{"Fantasy", "Mystery"};
+        return createUser(makeRequest("/api/users", body.dump())).body.size();
+    });
+    benchFlush("recommendationBatch/createUser");
+    runBench("updateUser", options.scanIterations, [&](int i) {
+        json::wvalue body;
+        body["name"] = "Renamed " + to_string(i);
+        body["email"] = "renamed." + to_string(i) + "@example.com";
+        body["preferences"] = vector<string>{i % 2 ? "Classic" : "Fiction"};
+        response res;
+        updateUser(makeRequest("/api/users/x", body.dump()), res, formatEntityId(anyUser(rng), spec.users));
+        return res.body.size();
+    });
+    benchFlush("recommendationBatch/updateUser");
+    runBench("deleteBook", options.scanIterations, [&](int i) {
+        return deleteBook("bench-book-" + to_string(i)).body.size();
+    });
+    runBench("deleteUser", options.scanIterations, [&](int i) {
+        return deleteUser("bench-user-" + to_string(i)).body.size();
+    });
+}
+
+// Point reads and updates with the reviews paged out under a cache of about
+// a quarter of them, over working sets that fit it and that do not, against
+// the same reads with every review resident
+static void benchReviewStore(mt19937_64& rng) {
+    // Paging every review out is slow, so skipped unless --only names these
+    if (!options.only.empty() && options.only.find("reviewStore") == string::npos &&
+        string("reviewStore").find(options.only) == string::npos) {
+        return;
+    }
+    DatasetSpec& spec = options.spec;
+    int percents[] = {10, 50, 100};
+    auto readWithin = [&](int percent) {
+        uniform_int_distribution<int> anyReview(1, max(spec.reviews * percent / 100, 1));
+        return [&spec, anyReview](mt19937_64& rng) mutable {
+            return readReview(formatEntityId(anyReview(rng), spec.reviews)).body.size();
+        };
+    };
+    for (int percent : percents) {
+        auto read = readWithin(percent);
+        runBench("reviewStore/resident/readReview/ws=" + to_string(percent) + "%", options.iterations,
+                 [&](int) { return read(rng); });
+    }
+
+    unsigned long long jsonBytes = 0;
+    for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end(); ++it) {
+        jsonBytes += it->second.getJsonFragment().size();
+    }
+    ReviewStoreOptions store;
+    store.dir = options.dataDir + "/review-store";
+    store.cacheBytes = (size_t)(2 * jsonBytes + reviewMap.size() * sizeof(ReviewStore::value_type)) / 4;
+    if (!reviewMap.open(store)) {
+        cerr << "review store: cannot write to " << store.dir << endl;
+        return;
+    }
+    for (int percent : percents) {
+        // Warmed first, so the timed reads see the steady hit rate
+        auto read = readWithin(percent);
+        for (int i = 0; i < options.iterations; i++) {
+            read(rng);
+        }
+        runBench("reviewStore/paged/readReview/ws=" + to_string(percent) + "%", options.iterations,
+                 [&](int) { return read(rng); });
+    }
+    uniform_int_distribution<int> anyReview(1, max(spec.reviews, 1));
+    runBench("reviewStore/paged/updateReview/ws=100%", options.iterations, [&](int i) {
+        response res;
+        updateReview(makeRequest("/api/reviews/x", "{\"rating\":" + to_string(i % 5 + 1) + "}"), res,
+                     formatEntityId(anyReview(rng), spec.reviews));
+        return res.body.size();
+    });
+    runBench("reviewStore/paged/compact", 1, [&](int) { return reviewMap.compact(); });
+
+    ReviewStoreStats stats = reviewMap.stats();
+    cerr << "review store: " << stats.cachedReviews << " of " << reviewMap.size() << " reviews cached in "
+         << stats.cachedBytes / 1024 << " KB, " << stats.hits << " hits, " << stats.misses << " misses, "
+         << stats.appends << " appends, " << stats.segments << " segments of " << stats.diskBytes / 1024 << " KB ("
+         << stats.liveBytes / 1024 << " KB live), " << stats.compactions << " compactions" << endl;
+    reviewMap.close();
+    rmdir(store.dir.c_str());
+}
+
+int main(int argc, char* argv[]) {
+    parseOptions(argc, argv);
+    mkdir(options.dataDir.c_str(), 0755);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Dataset dataset = generateDataset(options.spec);
+    cerr << "generated " << dataset.users.size() << " users, " << dataset.books.size() << " books, "
+         << dataset.reviews.size() << " reviews, " << dataset.recommendations.size() << " recommendations in "
+         << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+
+    if (options.generateOnly) {
+        writeDataset(dataset, options.dataDir);
+        cerr << "wrote dataset to " << options.dataDir << endl;
+        return 0;
+    }
+
+    userMap = dataset.users;
+    bookMap = dataset.books;
+    reviewMap = dataset.reviews;
+    recommendationMap = dataset.recommendations;
+    rebuildIsbnIndex();
+    rebuildEmailIndex();
+
+    mt19937_64 rng(options.spec.seed + 1);
+    benchPersistence();
+    benchStartup();
+    benchMemory();
+    benchSerialize();
+    benchReads(rng);
+    benchSearch(rng);
+    benchSuggest(rng);
+    benchFacets(rng);
+    benchRatings(rng);
+    benchCompression();
+    benchWritesDuringScans(rng);
+    benchWrites(rng);
+    benchReviewStore(rng);
+
+    cout << renderResults() << endl;
+    return 0;
+}
@@ -0,0 +1,367 @@
+#include "Bitmap.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+static const size_t WORDS = 1024; // 65536 bits per bitmap container
+
+// Popcount of a[i] & b[i] over n words, n a multiple of 32
+static size_t andPopcountPortable(const uint64_t* a, const uint64_t* b, size_t n) {
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += __builtin_popcountll(a[i] & b[i]);
+    }
+    return total;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("popcnt")))
+static size_t andPopcountPopcnt(const uint64_t* a, const uint64_t* b, size_t n) {
+    size_t total = 0;
+    for (size_t i = 0; i < n; i += 4) {
+        total += __builtin_popcountll(a[i] & b[i]) + __builtin_popcountll(a[i + 1] & b[i + 1]) +
+                 __builtin_popcountll(a[i + 2] & b[i + 2]) + __builtin_popcountll(a[i + 3] & b[i + 3]);
+    }
+    return total;
+}
+
+// Nibble lookup through vpshufb, summed into 64-bit lanes with vpsadbw.
+// Byte counters take 8 vectors (at most 64 per byte) before they are widened.
+__attribute__((target("avx2")))
+static size_t andPopcountAvx2(const uint64_t* a, const uint64_t* b, size_t n) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    for (size_t i = 0; i < n; i += 32) {
+        __m256i bytes = zero;
+        for (size_t j = i; j < i + 32; j += 4) {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(a + j)),
+                                         _mm256_loadu_si256((const __m256i*)(b + j)));
+            __m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, lowNibble));
+            __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibble));
+            bytes = _mm256_add_epi8(bytes, _mm256_add_epi8(low, high));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, zero));
+    }
+    return _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+           _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+}
+#endif
+
+typedef size_t (*AndPopcount)(const uint64_t*, const uint64_t*, size_t);
+
+static AndPopcount chooseAndPopcount() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return andPopcountAvx2;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return andPopcountPopcnt;
+    }
+#endif
+    return andPopcountPortable;
+}
+
+static const AndPopcount andPopcount = chooseAndPopcount();
+
+static bool testBit(const vector<uint64_t>& words, uint16_t low) {
+    return (words[low >> 6] >> (low & 63)) & 1;
+}
+
+Bitmap Bitmap::fromSorted(const uint32_t* values, size_t n) {
+    Bitmap bitmap;
+    for (size_t i = 0; i < n;) {
+        uint16_t key = values[i] >> 16;
+        size_t end = i;
+        while (end < n && (values[end] >> 16) == key) {
+            end++;
+        }
+        Container container;
+        container.key = key;
+        container.cardinality = end - i;
+        if (container.cardinality > ARRAY_MAX) {
+            container.words.assign(WORDS, 0);
+            for (size_t v = i; v < end; v++) {
+                container.words[(values[v] & 0xffff) >> 6] |= 1ULL << (values[v] & 63);
+            }
+        } else {
+            container.array.reserve(container.cardinality);
+            for (size_t v = i; v < end; v++) {
+                container.array.push_back(values[v] & 0xffff);
+            }
+        }
+        bitmap.count += container.cardinality;
+        bitmap.cost += containerCost(container);
+        bitmap.containers.push_back(move(container));
+        i = end;
+    }
+    return bitmap;
+}
+
+vector<Bitmap::Container>::iterator Bitmap::find(uint16_t key) {
+    return lower_bound(containers.begin(), containers.end(), key,
+                       [](const Container& c, uint16_t k) { return c.key < k; });
+}
+
+vector<Bitmap::Container>::const_iterator Bitmap::find(uint16_t key) const {
+    return lower_bound(containers.begin(), containers.end(), key,
+                       [](const Container& c, uint16_t k) { return c.key < k; });
+}
+
+size_t Bitmap::containerCost(const Container& container) {
+    return GROUP_COST + (container.words.empty() ? container.array.size() : WORDS);
+}
+
+bool Bitmap::add(uint32_t value) {
+    uint16_t key = value >> 16;
+    uint16_t low = value & 0xffff;
+    vector<Container>::iterator it = find(key);
+    size_t before = 0;
+    if (it == containers.end() || it->key != key) {
+        it = containers.insert(it, Container());
+        it->key = key;
+    } else {
+        before = containerCost(*it);
+    }
+    if (!it->words.empty()) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (it->words[low >> 6] & bit) {
+            return false;
+        }
+        it->words[low >> 6] |= bit;
+    } else {
+        vector<uint16_t>::iterator at = lower_bound(it->array.begin(), it->array.end(), low);
+        if (at != it->array.end() && *at == low) {
+            return false;
+        }
+        it->array.insert(at, low);
+        if (it->array.size() > ARRAY_MAX) {
+            it->words.assign(WORDS, 0);
+            for (unsigned int i = 0; i < it->array.size(); i++) {
+                it->words[it->array[i] >> 6] |= 1ULL << (it->array[i] & 63);
+            }
+            vector<uint16_t>().swap(it->array);
+        }
+    }
+    it->cardinality++;
+    count++;
+    cost = cost - before + containerCost(*it);
+    return true;
+}
+
+bool Bitmap::remove(uint32_t value) {
+    uint16_t key = value >> 16;
+    uint16_t low = value & 0xffff;
+    vector<Container>::iterator it = find(key);
+    if (it == containers.end() || it->key != key) {
+        return false;
+    }
+    size_t before = containerCost(*it);
+    if (!it->words.empty()) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (!(it->words[low >> 6] & bit)) {
+            return false;
+        }
+        it->words[low >> 6] &= ~bit;
+        // Back to an array only well below the threshold, so a set that
+        // hovers around it does not convert on every write
+        if (it->cardinality - 1 <= ARRAY_MAX / 2) {
+            for (size_t w = 0; w < WORDS; w++) {
+                for (uint64_t bits = it->words[w]; bits; bits &= bits - 1) {
+                    it->array.push_back(w * 64 + __builtin_ctzll(bits));
+                }
+            }
+            vector<uint64_t>().swap(it->words);
+        }
+    } else {
+        vector<uint16_t>::iterator at = lower_bound(it->array.begin(), it->array.end(), low);
+        if (at == it->array.end() || *at != low) {
+            return false;
+        }
+        it->array.erase(at);
+    }
+    it->cardinality--;
+    count--;
+    cost -= before;
+    if (it->cardinality == 0) {
+        containers.erase(it);
+    } else {
+        cost += containerCost(*it);
+    }
+    return true;
+}
+
+bool Bitmap::contains(uint32_t value) const {
+    uint16_t key = value >> 16;
+    uint16_t low = value & 0xffff;
+    vector<Container>::const_iterator it = find(key);
+    if (it == containers.end() || it->key != key) {
+        return false;
+    }
+    if (!it->words.empty()) {
+        return testBit(it->words, low);
+    }
+    return binary_search(it->array.begin(), it->array.end(), low);
+}
+
+size_t Bitmap::andCardinality(const Container& a, const Container& b) {
+    if (!a.words.empty() && !b.words.empty()) {
+        return andPopcount(a.words.data(), b.words.data(), WORDS);
+    }
+    if (!a.words.empty() || !b.words.empty()) {
+        const Container& bits = a.words.empty() ? b : a;
+        const Container& array = a.words.empty() ? a : b;
+        size_t total = 0;
+        for (unsigned int i = 0; i < array.array.size(); i++) {
+            total += testBit(bits.words, array.array[i]);
+        }
+        return total;
+    }
+    const vector<uint16_t>& small = a.array.size() <= b.array.size() ? a.array : b.array;
+    const vector<uint16_t>& large = a.array.size() <= b.array.size() ? b.array : a.array;
+    size_t total = 0;
+    if (small.size() * 16 < large.size()) {
+        // A binary search per value keeps a small group against a big one near O(small log large)
+        vector<uint16_t>::const_iterator from = large.begin();
+        for (unsigned int i = 0; i < small.size(); i++) {
+            from = lower_bound(from, large.end(), small[i]);
+            if (from == large.end()) {
+                break;
+            }
+            total += *from == small[i];
+        }
+        return total;
+    }
+    size_t i = 0, j = 0;
+    while (i < small.size() && j < large.size()) {
+        if (small[i] < large[j]) {
+            i++;
+        } else if (large[j] < small[i]) {
+            j++;
+        } else {
+            total++;
+            i++;
+            j++;
+        }
+    }
+    return total;
+}
+
+size_t Bitmap::andCardinality(const Bitmap& other) const {
+    // Walk the side with fewer groups and look each key up in the other
+    const Bitmap& fewer = containers.size() <= other.containers.size() ? *this : other;
+    const Bitmap& more = containers.size() <= other.containers.size() ? other : *this;
+    size_t total = 0;
+    vector<Container>::const_iterator from = more.containers.begin();
+    for (unsigned int i = 0; i < fewer.containers.size(); i++) {
+        const Container& container = fewer.containers[i];
+        from = lower_bound(from, more.containers.end(), container.key,
+                           [](const Container& c, uint16_t k) { return c.key < k; });
+        if (from == more.containers.end()) {
+            break;
+        }
+        if (from->key == container.key) {
+            total += andCardinality(container, *from);
+        }
+    }
+    return total;
+}
+
+void Bitmap::andValues(const Container& a, const Container& b, vector<uint32_t>& out) {
+    uint32_t high = (uint32_t)a.key << 16;
+    if (!a.words.empty() && !b.words.empty()) {
+        for (size_t w = 0; w < WORDS; w++) {
+            for (uint64_t bits = a.words[w] & b.words[w]; bits; bits &= bits - 1) {
+                out.push_back(high | (uint32_t)(w * 64 + __builtin_ctzll(bits)));
+            }
+        }
+        return;
+    }
+    if (!a.words.empty() || !b.words.empty()) {
+        const Container& bits = a.words.empty() ? b : a;
+        const Container& array = a.words.empty() ? a : b;
+        for (unsigned int i = 0; i < array.array.size(); i++) {
+            if (testBit(bits.words, array.array[i])) {
+                out.push_back(high | array.array[i]);
+            }
+        }
+        return;
+    }
+    const vector<uint16_t>& small = a.array.size() <= b.array.size() ? a.array : b.array;
+    const vector<uint16_t>& large = a.array.size() <= b.array.size() ? b.array : a.array;
+    if (small.size() * 16 < large.size()) {
+        vector<uint16_t>::const_iterator from = large.begin();
+        for (unsigned int i = 0; i < small.size(); i++) {
+            from = lower_bound(from, large.end(), small[i]);
+            if (from == large.end()) {
+                break;
+            }
+            if (*from == small[i]) {
+                out.push_back(high | small[i]);
+            }
+        }
+        return;
+    }
+    size_t i = 0, j = 0;
+    while (i < small.size() && j < large.size()) {
+        if (small[i] < large[j]) {
+            i++;
+        } else if (large[j] < small[i]) {
+            j++;
+        } else {
+            out.push_back(high | small[i]);
+            i++;
+            j++;
+        }
+    }
+}
+
+void Bitmap::andValues(const Bitmap& other, vector<uint32_t>& out) const {
+    const Bitmap& fewer = containers.size() <= other.containers.size() ? *this : other;
+    const Bitmap& more = containers.size() <= other.containers.size() ? other : *this;
+    vector<Container>::const_iterator from = more.containers.begin();
+    for (unsigned int i = 0; i < fewer.containers.size(); i++) {
+        const Container& container = fewer.containers[i];
+        from = lower_bound(from, more.containers.end(), container.key,
+                           [](const Container& c, uint16_t k) { return c.key < k; });
+        if (from == more.containers.end()) {
+            break;
+        }
+        if (from->key == container.key) {
+            andValues(container, *from, out);
+        }
+    }
+}
+
+size_t Bitmap::bytes() const {
+    size_t total = sizeof(Bitmap) + containers.capacity() * sizeof(Container);
+    for (unsigned int i = 0; i < containers.size(); i++) {
+        total += containers[i].array.capacity() * sizeof(uint16_t) + containers[i].words.capacity() * sizeof(uint64_t);
+    }
+    return total;
+}
+
+void Bitmap::values(vector<uint32_t>& out) const {
+    out.clear();
+    out.reserve(count);
+    for (unsigned int i = 0; i < containers.size(); i++) {
+        uint32_t high = (uint32_t)containers[i].key << 16;
+        if (containers[i].words.empty()) {
+            for (unsigned int v = 0; v < containers[i].array.size(); v++) {
+                out.push_back(high | containers[i].array[v]);
+            }
+            continue;
+        }
+        for (size_t w = 0; w < WORDS; w++) {
+            for (uint64_t bits = containers[i].words[w]; bits; bits &= bits - 1) {
+                out.push_back(high | (uint32_t)(w * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+// Compressed set of 32-bit integers in the Roaring layout: values are grouped
+// by their high 16 bits, and each group is a sorted array of the low halves
+// while sparse, or a 65536-bit bitmap once it holds more than ARRAY_MAX.
+class Bitmap {
+public:
+    static const size_t ARRAY_MAX = 4096;
+
+    Bitmap() : count(0), cost(0) {}
+
+    // From n ascending values without repeats
+    static Bitmap fromSorted(const uint32_t* values, size_t n);
+
+    bool add(uint32_t value);    // False when already present
+    bool remove(uint32_t value); // False when absent
+    bool contains(uint32_t value) const;
+    size_t cardinality() const { return count; }
+
+    // Size of the intersection, without building it. Bitmap groups on both
+    // sides are counted with the widest popcount the CPU has.
+    size_t andCardinality(const Bitmap& other) const;
+    // Appends the intersection to out, ascending
+    void andValues(const Bitmap& other, vector<uint32_t>& out) const;
+
+    // What andCardinality may spend on this side, in words read: array
+    // lengths, 1024 per bitmap group, and GROUP_COST per group for finding
+    // its partner in the other set
+    static const size_t GROUP_COST = 64;
+    size_t scanCost() const { return cost; }
+    size_t containerCount() const { return containers.size(); }
+    size_t bytes() const;
+    void values(vector<uint32_t>& out) const;
+
+private:
+    struct Container {
+        uint16_t key;
+        uint32_t cardinality = 0;
+        vector<uint16_t> array; // Ascending, while cardinality <= ARRAY_MAX
+        vector<uint64_t> words; // 1024 words once denser
+    };
+
+    vector<Container> containers; // Ascending key
+    size_t count;
+    size_t cost;
+
+    vector<Container>::iterator find(uint16_t key);
+    vector<Container>::const_iterator find(uint16_t key) const;
+    static size_t containerCost(const Container& container);
+    static size_t andCardinality(const Container& a, const Container& b);
+    static void andValues(const Container& a, const Container& b, vector<uint32_t>& out);
+};
+
+#endif
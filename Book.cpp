@@ -2,20 +2,75 @@
 #include "Book.h"
 #include "Recommendation.h"
 #include "Review.h"
+#include "ReviewStore.h"
+#include "Metrics.h"
+#include "Startup.h"
+#include "Trace.h"
+#include "ChangeLog.h"
+#include "BookSuggest.h"
+#include "Facets.h"
+
+#include <unordered_map>
 
 extern map<string, User> userMap;
 extern map<string, Recommendation> recommendationMap;
 extern map<string, Book> bookMap;
-extern map<string, Review> reviewMap;
-
-json::wvalue convertBookToJson(Book book) {
-    json::wvalue j;
-    j["id"] = book.getId();
-    j["title"] = book.getTitle();
-    j["author"] = book.getAuthor();
-    j["genre"] = book.getGenre();
-    j["isbn"] = book.getIsbn();
-    return j;
+extern ReviewStore reviewMap;
+
+static const int DEFAULT_BOOK_SUGGESTIONS = 10;
+
+// Canonical ISBN-13 to the id of the book that has it
+static unordered_map<string, string> isbnIndex;
+
+// Readers build fragments while holding the data lock shared, so two of them
+// may race on the same entity; they serialize on one of these stripes
+mutex& fragmentLock(const void* entity) {
+    static mutex stripes[64];
+    return stripes[((uintptr_t)entity >> 4) % 64];
+}
+
+const string& Book::getJsonFragment() {
+    if (__atomic_load_n(&cachedVersion, __ATOMIC_ACQUIRE) != version + 1) {
+        lock_guard<mutex> lock(fragmentLock(this));
+        if (cachedVersion != version + 1) {
+            string json;
+            writeJsonFields(json, *this);
+            cachedJson = make_shared<const string>(move(json));
+            __atomic_store_n(&cachedVersion, version + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return *cachedJson;
+}
+
+shared_ptr<const string> Book::getSharedJsonFragment() {
+    getJsonFragment();
+    return cachedJson;
+}
+
+shared_ptr<const string> Book::getJsonCache() const {
+    lock_guard<mutex> lock(fragmentLock(this));
+    return cachedJson;
+}
+
+// Concatenates pre-serialized JSON objects into a JSON array
+string joinJsonFragments(const vector<const string*>& fragments) {
+    TraceSpan span("dump");
+    size_t total = 2 + fragments.size();
+    for (unsigned int i = 0; i < fragments.size(); i++) {
+        total += fragments[i]->size();
+    }
+
+    string json;
+    json.reserve(total);
+    json += '[';
+    for (unsigned int i = 0; i < fragments.size(); i++) {
+        if (i > 0) {
+            json += ',';
+        }
+        json += *fragments[i];
+    }
+    json += ']';
+    return json;
 }
 
 string toLower(string input) {
@@ -25,186 +80,305 @@ string toLower(string input) {
     return input;
 }
 
-// Template helper method to remove entries associated with a specific book
-template <typename T>
-void removeEntriesWithBook(map<string, T>& m, const string& bookId) {
-    map<string, T> updatedMap;
-    for (auto it = m.begin(); it != m.end(); ++it) {
-        if (it->second.getBook().getId() != bookId) {
-            updatedMap[it->first] = it->second;
+static char isbn13CheckDigit(const string& digits) {
+    int sum = 0;
+    for (int i = 0; i < 12; i++) {
+        sum += (digits[i] - '0') * (i % 2 == 0 ? 1 : 3);
+    }
+    return '0' + (10 - sum % 10) % 10;
+}
+
+bool normalizeIsbn(const string& input, string& isbn13) {
+    string digits;
+    for (size_t i = 0; i < input.size(); i++) {
+        char c = input[i];
+        if (c == '-' || c == ' ') {
+            continue;
         }
+        if (c >= '0' && c <= '9') {
+            digits += c;
+        } else if ((c == 'X' || c == 'x') && digits.size() == 9) {
+            digits += 'X'; // Check digit 10 of an ISBN-10
+        } else {
+            return false;
+        }
+    }
+
+    if (digits.size() == 10) {
+        int sum = 0;
+        for (int i = 0; i < 10; i++) {
+            sum += (digits[i] == 'X' ? 10 : digits[i] - '0') * (10 - i);
+        }
+        if (sum % 11 != 0) {
+            return false;
+        }
+        digits = "978" + digits.substr(0, 9);
+        digits += isbn13CheckDigit(digits);
+    } else if (digits.size() != 13 || digits.find('X') != string::npos ||
+               (digits.compare(0, 3, "978") != 0 && digits.compare(0, 3, "979") != 0) ||
+               isbn13CheckDigit(digits) != digits[12]) {
+        return false;
     }
-    m = updatedMap;
+    isbn13 = digits;
+    return true;
 }
 
-response searchBooks(string searchStr) {
-    vector<Book> foundBooks;
+// The book the index names for isbn, as long as bookMap still agrees
+static map<string, Book>::iterator findIsbnOwner(const string& isbn) {
+    unordered_map<string, string>::iterator known = isbnIndex.find(isbn);
+    if (known == isbnIndex.end()) {
+        return bookMap.end();
+    }
+    map<string, Book>::iterator it = bookMap.find(known->second);
+    if (it == bookMap.end() || it->second.getIsbn() != isbn) {
+        return bookMap.end();
+    }
+    return it;
+}
+
+size_t rebuildIsbnIndex() {
+    isbnIndex.clear();
+    isbnIndex.reserve(bookMap.size());
+    size_t duplicates = 0;
+    for (map<string, Book>::iterator it = bookMap.begin(); it != bookMap.end(); ++it) {
+        string isbn = it->second.getIsbn();
+        if (!isbn.empty() && !isbnIndex.emplace(isbn, it->first).second) {
+            duplicates++;
+        }
+    }
+    return duplicates;
+}
+
+void indexBookIsbn(Book& book) {
+    if (!book.getIsbn().empty()) {
+        isbnIndex[book.getIsbn()] = book.getId();
+    }
+}
+
+void unindexBookIsbn(Book& book) {
+    unordered_map<string, string>::iterator known = isbnIndex.find(book.getIsbn());
+    if (known != isbnIndex.end() && known->second == book.getId()) {
+        isbnIndex.erase(known);
+    }
+}
+
+// Removes the reviews of a book. Reviews of other books are not read in.
+static void removeEntriesWithBook(ReviewStore& m, const string& bookId, const string& collection) {
+    TraceSpan span("removeEntriesWithBook");
+    // Erased in place: other entries keep their nodes, which indexes point into
+    for (ReviewStore::iterator it = m.begin(); it != m.end();) {
+        if (!m.refersToBook(it, bookId)) {
+            ++it;
+        } else {
+            string removed = it->first;
+            it = m.erase(it);
+            recordDelete(collection, removed);
+        }
+    }
+}
+
+static vector<Book*> searchBooks(string searchStr) {
+    TraceSpan span("searchBooks");
+    vector<Book*> foundBooks;
     string loweredSearch = toLower(searchStr);
 
     map<string, Book>::iterator it;
     for (it = bookMap.begin(); it != bookMap.end(); ++it) {
-        Book b = it->second;
+        Book& b = it->second;
         if (toLower(b.getTitle()).find(loweredSearch) != string::npos ||
             toLower(b.getAuthor()).find(loweredSearch) != string::npos ||
             toLower(b.getGenre()).find(loweredSearch) != string::npos ||
             toLower(b.getIsbn()).find(loweredSearch) != string::npos) {
-            foundBooks.push_back(b);
+            foundBooks.push_back(&b);
         }
     }
 
-    json::wvalue json;
-    int index = 0;
-    for (unsigned int i = 0; i < foundBooks.size(); i++) {
-        json[index++] = convertBookToJson(foundBooks[i]);
-    }
-
-    return response(json.dump());
+    return foundBooks;
 }
 
-response sortBooks(string sortKey) {
-    vector< pair<string, Book> > sortedItems;
+static vector<Book*> sortBooks(string sortKey) {
+    TraceSpan span("sortBooks");
+    vector<Book*> sortedItems;
 
     map<string, Book>::iterator it;
     for (it = bookMap.begin(); it != bookMap.end(); ++it) {
-        sortedItems.push_back(make_pair(it->first, it->second));
+        sortedItems.push_back(&it->second);
     }
 
+    // Stable, so equal keys stay in id order; the shard router merges the same way
     if (sortKey == "title") {
-        sort(sortedItems.begin(), sortedItems.end(), [](pair<string, Book> a, pair<string, Book> b) {
-            return a.second.getTitle() < b.second.getTitle();
+        stable_sort(sortedItems.begin(), sortedItems.end(), [](Book* a, Book* b) {
+            return a->getTitle() < b->getTitle();
         });
     } else if (sortKey == "author") {
-        sort(sortedItems.begin(), sortedItems.end(), [](pair<string, Book> a, pair<string, Book> b) {
-            return a.second.getAuthor() < b.second.getAuthor();
+        stable_sort(sortedItems.begin(), sortedItems.end(), [](Book* a, Book* b) {
+            return a->getAuthor() < b->getAuthor();
         });
     } else if (sortKey == "genre") {
-        sort(sortedItems.begin(), sortedItems.end(), [](pair<string, Book> a, pair<string, Book> b) {
-            return a.second.getGenre() < b.second.getGenre();
+        stable_sort(sortedItems.begin(), sortedItems.end(), [](Book* a, Book* b) {
+            return a->getGenre() < b->getGenre();
         });
     } else if (sortKey == "isbn") {
-        sort(sortedItems.begin(), sortedItems.end(), [](pair<string, Book> a, pair<string, Book> b) {
-            return a.second.getIsbn() < b.second.getIsbn();
+        stable_sort(sortedItems.begin(), sortedItems.end(), [](Book* a, Book* b) {
+            return a->getIsbn() < b->getIsbn();
         });
     }
 
-    json::wvalue json;
-    int index = 0;
-    for (unsigned int i = 0; i < sortedItems.size(); i++) {
-        json[index++] = convertBookToJson(sortedItems[i].second);
-    }
-
-    return response(json.dump());
+    return sortedItems;
 }
 
-response filterBooks(string key, string value) {
-    vector<Book> filteredBooks;
+static vector<Book*> filterBooks(string key, string value) {
+    TraceSpan span("filterBooks");
+    vector<Book*> filteredBooks;
     string loweredVal = toLower(value);
 
     map<string, Book>::iterator it;
     for (it = bookMap.begin(); it != bookMap.end(); ++it) {
-        Book b = it->second;
+        Book& b = it->second;
         if ((key == "genre" && toLower(b.getGenre()) == loweredVal) ||
             (key == "author" && toLower(b.getAuthor()) == loweredVal)) {
-            filteredBooks.push_back(b);
+            filteredBooks.push_back(&b);
         }
     }
 
-    json::wvalue json;
-    int index = 0;
-    for (unsigned int i = 0; i < filteredBooks.size(); i++) {
-        json[index++] = convertBookToJson(filteredBooks[i]);
-    }
-
-    return response(json.dump());
+    return filteredBooks;
 }
 
 response createBook(request req) {
-    json::rvalue body = json::load(req.body);
-    if (!body) {
-        return response(400, "Invalid JSON");
+    TraceSpan parseSpan("readJson");
+    Book book;
+    response invalid;
+    bool parsed = readJsonBody(req.body, book, jsonRequiredFields<Book>(), nullptr, invalid);
+    parseSpan.end();
+    if (!parsed) {
+        return invalid;
     }
 
-    string id = body["id"].s();
+    // Reading already canonicalized a valid ISBN
+    string id = book.getId();
+    string isbn = book.getIsbn();
+    if (!isbn.empty() && !normalizeIsbn(isbn, isbn)) {
+        return response(400, "Invalid ISBN");
+    }
+    map<string, Book>::iterator owner = findIsbnOwner(isbn);
+    if (owner != bookMap.end() && owner->first != id) {
+        return response(409, "ISBN already belongs to book " + owner->first);
+    }
 
-    Book book(body["id"].s(), body["title"].s(), body["author"].s(), body["genre"].s(), body["isbn"].s());
+    book.getJsonFragment(); // Serialize once so every copy fanned out below carries it
+    map<string, Book>::iterator replaced = bookMap.find(id);
+    if (replaced != bookMap.end()) {
+        unindexBookIsbn(replaced->second);
+    }
     bookMap[id] = book;
+    indexBookIsbn(book);
+    recordUpsert("books", id, book.getJsonFragment());
 
+    TraceSpan fanOutSpan("review fan-out");
     // Step 1: Update existing Reviews that reference this Book
     for (auto it = reviewMap.begin(); it != reviewMap.end(); ++it) {
-        if (it->second.getBook().getId() == id) {
+        if (reviewMap.refersToBook(it, id)) {
             it->second.setBook(book); // Reassign the updated book to existing review
+            recordUpsert("reviews", it->first, it->second.getJsonFragment());
         }
     }
 
-    // Step 2: Remove all Recommendations associated with this Book
-    removeEntriesWithBook(recommendationMap, id);
+    fanOutSpan.end();
 
-    // Step 3: Rebuild Recommendations
-    vector<Recommendation> keptRecs;
-    for (auto it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        keptRecs.push_back(it->second);
-    }
-
-    // Add new Recommendations based on User preferences
-    for (auto it = userMap.begin(); it != userMap.end(); ++it) {
-        User user = it->second;
-        vector<string> preferences = user.getPreferences();
-        for (int i = 0; i < (int)preferences.size(); i++) {
-            if (book.getGenre() == preferences[i]) {
-                Recommendation newRec("", user, book); // ID to be set during reindexing
-                keptRecs.push_back(newRec);
-                break;
-            }
-        }
-    }
+    // Step 2: Recommendations are rebuilt off the request path
+    enqueueRecommendationsForBook(id);
 
-    // Step 4: Reindex all Recommendations
-    map<string, Recommendation> updatedRecommendationMap;
-    for (int i = 0; i < (int)keptRecs.size(); ++i) {
-        stringstream ss;
-        ss << setfill('0') << setw(3) << (i + 1);
-        string recId = ss.str();
-        keptRecs[i].setId(recId);
-        updatedRecommendationMap[recId] = keptRecs[i];
-    }
-    recommendationMap = updatedRecommendationMap;
-
-    return response(201, convertBookToJson(book).dump());
+    return response(201, book.getJsonFragment());
 }
 
 response readBook(string id) {
     map<string, Book>::iterator it = bookMap.find(id);
     if (it != bookMap.end()) {
-        Book book = it->second;
-        return response(convertBookToJson(book).dump());
+        return response(it->second.getJsonFragment());
     }
     return response(404, "Book Not Found");
 }
 
+response readBookByIsbn(string isbn) {
+    string canonical;
+    if (!normalizeIsbn(isbn, canonical)) {
+        return response(400, "Invalid ISBN");
+    }
+    map<string, Book>::iterator it = findIsbnOwner(canonical);
+    if (it == bookMap.end()) {
+        return response(404, "Book Not Found");
+    }
+    return response(it->second.getJsonFragment());
+}
+
 response readAllBooks(request req) {
     char* searchParam = req.url_params.get("search");
     char* sortParam = req.url_params.get("sort");
     char* filterKey = req.url_params.get("filterKey");
     char* filterValue = req.url_params.get("filterValue");
+    char* facetsParam = req.url_params.get("facets");
 
+    vector<Book*> books;
+    bool everything = false;
     if (searchParam) {
-        return searchBooks(string(searchParam));
+        books = searchBooks(string(searchParam));
+    } else if (sortParam) {
+        books = sortBooks(string(sortParam));
+        everything = true;
+    } else if (filterKey && filterValue) {
+        books = filterBooks(string(filterKey), string(filterValue));
+    } else {
+        map<string, Book>::iterator it;
+        for (it = bookMap.begin(); it != bookMap.end(); ++it) {
+            books.push_back(&it->second);
+        }
+        everything = true;
     }
-    if (sortParam) {
-        return sortBooks(string(sortParam));
+
+    vector<const string*> fragments;
+    for (unsigned int i = 0; i < books.size(); i++) {
+        fragments.push_back(&books[i]->getJsonFragment());
     }
-    if (filterKey && filterValue) {
-        return filterBooks(string(filterKey), string(filterValue));
+    if (!facetsParam) {
+        return response(joinJsonFragments(fragments));
     }
 
-    json::wvalue json;
-    int index = 0;
-    map<string, Book>::iterator it;
-    for (it = bookMap.begin(); it != bookMap.end(); ++it) {
-        json[index++] = convertBookToJson(it->second);
+    vector<string> ids;
+    if (!everything) {
+        for (unsigned int i = 0; i < books.size(); i++) {
+            ids.push_back(books[i]->getId());
+        }
     }
+    return facetedList("books", req, joinJsonFragments(fragments), everything ? nullptr : &ids);
+}
 
-    return response(json.dump());
+response readBookSuggestions(request req) {
+    char* prefixParam = req.url_params.get("prefix");
+    char* limitParam = req.url_params.get("k");
+    if (!prefixParam) {
+        return response(400, "prefix is required");
+    }
+    int k = limitParam ? atoi(limitParam) : DEFAULT_BOOK_SUGGESTIONS;
+    if (k < 1 || k > (int)MAX_BOOK_SUGGESTIONS) {
+        return response(400, "k must be between 1 and " + to_string(MAX_BOOK_SUGGESTIONS));
+    }
+    if (!bookSuggestionsReady()) {
+        return response(503, "Suggestion index is not built");
+    }
+
+    vector<BookSuggestion> found = suggestBooks(string(prefixParam), k);
+    // Written out directly: building a wvalue object per entry costs more than the lookup
+    string json = "[";
+    for (unsigned int i = 0; i < found.size(); i++) {
+        if (i > 0) {
+            json += ',';
+        }
+        json += "{\"text\":" + json::wvalue(found[i].text).dump();
+        json += found[i].author ? ",\"type\":\"author\"" : ",\"type\":\"title\"";
+        json += ",\"reviews\":" + to_string(found[i].reviews) + ",\"books\":" + to_string(found[i].books) + "}";
+    }
+    json += ']';
+    return response(json);
 }
 
 void updateBook(request req, response& res, string id) {
@@ -215,64 +389,68 @@ void updateBook(request req, response& res, string id) {
         return;
     }
 
-    json::rvalue body = json::load(req.body);
-    if (!body) {
-        res.code = 400;
-        res.end("Invalid JSON");
+    // Members left out of the body keep their value
+    TraceSpan parseSpan("readJson");
+    Book patch;
+    unsigned seen;
+    bool parsed = readJsonBody(req.body, patch, 0, &seen, res);
+    parseSpan.end();
+    if (!parsed) {
+        res.end();
         return;
     }
 
+    // Only an ISBN the body sets is checked, so a book loaded with an invalid
+    // or repeated one can still have its other fields updated
     Book book = it->second;
-    book.setTitle(body["title"].s());
-    book.setAuthor(body["author"].s());
-    book.setGenre(body["genre"].s());
-    book.setIsbn(body["isbn"].s());
+    if (seen & jsonFieldBit<Book>("isbn")) {
+        string isbn = patch.getIsbn();
+        if (!isbn.empty() && !normalizeIsbn(isbn, isbn)) {
+            res.code = 400;
+            res.end("Invalid ISBN");
+            return;
+        }
+        map<string, Book>::iterator owner = findIsbnOwner(isbn);
+        if (owner != bookMap.end() && owner->first != id) {
+            res.code = 409;
+            res.end("ISBN already belongs to book " + owner->first);
+            return;
+        }
+        book.setIsbn(isbn);
+    }
+    if (seen & jsonFieldBit<Book>("title")) {
+        book.setTitle(patch.getTitle());
+    }
+    if (seen & jsonFieldBit<Book>("author")) {
+        book.setAuthor(patch.getAuthor());
+    }
+    if (seen & jsonFieldBit<Book>("genre")) {
+        book.setGenre(patch.getGenre());
+    }
+    book.getJsonFragment(); // Serialize once so every copy fanned out below carries it
 
+    unindexBookIsbn(it->second);
     bookMap[id] = book;
+    indexBookIsbn(book);
+    recordUpsert("books", id, book.getJsonFragment());
 
+    TraceSpan fanOutSpan("review fan-out");
     // Step 1: Update existing Reviews that reference this Book
     for (auto it = reviewMap.begin(); it != reviewMap.end(); ++it) {
-        if (it->second.getBook().getId() == id) {
+        if (reviewMap.refersToBook(it, id)) {
             it->second.setBook(book); // Reassign the updated book to existing review
+            recordUpsert("reviews", it->first, it->second.getJsonFragment());
         }
     }
 
-    // Step 2: Remove all Recommendations associated with this Book
-    removeEntriesWithBook(recommendationMap, id);
+    fanOutSpan.end();
 
-    // Step 3: Rebuild Recommendations
-    vector<Recommendation> keptRecs;
-    for (auto it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        keptRecs.push_back(it->second);
-    }
-
-    // Add new Recommendations based on User preferences
-    for (auto it = userMap.begin(); it != userMap.end(); ++it) {
-        User user = it->second;
-        vector<string> preferences = user.getPreferences();
-        for (int i = 0; i < (int)preferences.size(); i++) {
-            if (book.getGenre() == preferences[i]) {
-                Recommendation newRec("", user, book); // ID to be set during reindexing
-                keptRecs.push_back(newRec);
-                break;
-            }
-        }
-    }
-
-    // Step 4: Reindex all Recommendations
-    map<string, Recommendation> updatedRecommendationMap;
-    for (int i = 0; i < (int)keptRecs.size(); ++i) {
-        stringstream ss;
-        ss << setfill('0') << setw(3) << (i + 1);
-        string recId = ss.str();
-        keptRecs[i].setId(recId);
-        updatedRecommendationMap[recId] = keptRecs[i];
-    }
-    recommendationMap = updatedRecommendationMap;
+    // Step 2: Recommendations are rebuilt off the request path
+    enqueueRecommendationsForBook(id);
 
     res.code = 200;
     res.set_header("Content-Type", "application/json");
-    res.write(convertBookToJson(book).dump());
+    res.write(book.getJsonFragment());
     res.end();
 }
 
@@ -284,71 +462,53 @@ response deleteBook(string id) {
     }
 
     // Step 1: Erase the book
+    unindexBookIsbn(it->second);
     bookMap.erase(it);
+    recordDelete("books", id);
 
     // Step 2: Remove all reviews associated with the book
-    removeEntriesWithBook(reviewMap, id);
-
-    // Step 3: Remove all recommendations associated with the book
-    removeEntriesWithBook(recommendationMap, id);
-
-    // Step 4: Reindex remaining recommendations
-    vector<Recommendation> keptRecs;
-    for (auto it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        keptRecs.push_back(it->second);
-    }
-
-    map<string, Recommendation> reindexedMap;
-    for (int i = 0; i < (int)keptRecs.size(); i++) {
-        stringstream ss;
-        ss << setfill('0') << setw(3) << (i + 1);
-        string newId = ss.str();
-        keptRecs[i].setId(newId);
-        reindexedMap[newId] = keptRecs[i];
-    }
+    removeEntriesWithBook(reviewMap, id, "reviews");
 
-    recommendationMap = reindexedMap;
+    // Step 3: Its recommendations are dropped off the request path
+    enqueueRecommendationsForBook(id);
 
     return response(204);
 }
 
 
 void saveBookToFile(map<string, Book> data, string filename) {
+    TraceRoot trace("saveBookToFile");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
     ofstream file(filename);
     if (file.is_open()) {
-        json::wvalue json;
-        int index = 0;
+        vector<const string*> fragments;
         map<string, Book>::iterator it;
         for (it = data.begin(); it != data.end(); ++it) {
-            json[index++] = convertBookToJson(it->second);
+            fragments.push_back(&it->second.getJsonFragment());
         }
-        file << json.dump();
+        string json = joinJsonFragments(fragments);
+
+        TraceSpan writeSpan("write file");
+        file << json;
         file.close();
     }
+    recordPersistence(SAVE_BOOKS, start);
 }
 
-map<string, Book> loadBookFromFile(string filename) {
-    map<string, Book> data;
-    ifstream file(filename);
-
-    if (file.is_open()) {
-        ostringstream ss;
-        ss << file.rdbuf();
-        file.close();
-
-        json::rvalue json = json::load(ss.str());
-
-        for (json::rvalue& item : json) {
-            string id = item["id"].s();
-            string title = item["title"].s();
-            string author = item["author"].s();
-            string genre = item["genre"].s();
-            string isbn = item["isbn"].s();
+void Book::finishJsonRead() {
+    // An invalid ISBN stays out of reach of ISBN lookups
+    normalizeIsbn(isbn, isbn);
+}
 
-            Book book(id, title, author, genre, isbn);
-            data[book.getId()] = book;
-        }
-    }
+bool parseBookJson(const json::rvalue& item, Book& book) {
+    return readJson(item, book);
+}
 
+map<string, Book> loadBookFromFile(string filename) {
+    TraceRoot trace("loadBookFromFile");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    // Cut into runs parsed side by side; a file that does not parse loads nothing
+    map<string, Book> data = loadMapFile<Book>(filename, loadThreadCount());
+    recordPersistence(LOAD_BOOKS, start);
     return data;
 }
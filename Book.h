@@ -3,7 +3,10 @@
 
 #include <string>
 #include <vector>
+#include <mutex>
+#include <memory>
 #include <crow.h>
+#include "Serialize.h"
 
 using namespace std;
 using namespace crow;
@@ -20,10 +23,27 @@ public:
     string getGenre() { return genre; }
     string getIsbn() { return isbn; }
 
-    void setTitle(string value) { title = value; }
-    void setAuthor(string value) { author = value; }
-    void setGenre(string value) { genre = value; }
-    void setIsbn(string value) { isbn = value; }
+    void setTitle(string value) { title = value; version++; }
+    void setAuthor(string value) { author = value; version++; }
+    void setGenre(string value) { genre = value; version++; }
+    void setIsbn(string value) { isbn = value; version++; }
+
+    // Serialized JSON, rebuilt lazily once a setter has moved the version on.
+    // Safe to call concurrently under the shared data lock.
+    unsigned long getVersion() { return version; }
+    const string& getJsonFragment();
+    shared_ptr<const string> getSharedJsonFragment(); // The same bytes, for holders that outlive this version
+    shared_ptr<const string> getJsonCache() const; // For memory accounting; null until built
+
+    // What getJsonFragment writes and the parsers read, in that order
+    static constexpr auto jsonFields() {
+        return make_tuple(jsonField("id", &Book::id, JSON_REQUIRED),
+                          jsonField("title", &Book::title, JSON_REQUIRED),
+                          jsonField("author", &Book::author, JSON_REQUIRED),
+                          jsonField("genre", &Book::genre, JSON_REQUIRED),
+                          jsonField("isbn", &Book::isbn));
+    }
+    void finishJsonRead(); // Any accepted ISBN form becomes ISBN-13; an invalid one is kept as written
 
 private:
     string id;
@@ -31,20 +51,42 @@ private:
     string author;
     string genre;
     string isbn;
+
+    unsigned long version = 0;
+    unsigned long cachedVersion = 0; // version + 1 once cachedJson is built
+    shared_ptr<const string> cachedJson; // Shared with the list snapshots
 };
 
 // Helpers
-json::wvalue convertBookToJson(Book book);
 string toLower(string input);
+string joinJsonFragments(const vector<const string*>& fragments);
+
+// ISBN-10 or ISBN-13, hyphens and spaces allowed, as ISBN-13 digits.
+// False when the check digit does not match.
+bool normalizeIsbn(const string& input, string& isbn13);
+
+// Unique index from canonical ISBN to book id, kept by the book handlers.
+// Rebuild after replacing bookMap wholesale; returns the books whose ISBN
+// was already taken (the first book by id keeps it).
+size_t rebuildIsbnIndex();
+void indexBookIsbn(Book& book);
+void unindexBookIsbn(Book& book);
+mutex& fragmentLock(const void* entity);
 
 // CRUD Handlers
 response createBook(request req);
 response readBook(string id);
+response readBookByIsbn(string isbn); // Any accepted ISBN form
 response readAllBooks(request req);
+response readBookSuggestions(request req); // GET /api/books/suggest?prefix=&k=
 void updateBook(request req, response& res, string id);
 response deleteBook(string id);
 
 void saveBookToFile(map<string, Book> data, string filename);
 map<string, Book> loadBookFromFile(string filename);
 
+// Inverse of getJsonFragment for an already parsed value (the replication change feed);
+// false when a member has the wrong type
+bool parseBookJson(const json::rvalue& item, Book& book);
+
 #endif
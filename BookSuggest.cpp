@@ -0,0 +1,572 @@
+#include "BookSuggest.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "ChangeLog.h"
+#include "Trace.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+
+static const uint32_t NONE = UINT32_MAX;
+static const uint32_t SCAN_LIMIT = 256;       // Subtrees up to this many suggestions are ranked per query
+static const uint32_t UNCACHE_LIMIT = 128;    // A cached subtree shrunk below this goes back to scanning
+static const size_t CACHED_SUGGESTIONS = 32;  // Kept per cached subtree; refilled once under MAX_BOOK_SUGGESTIONS
+
+enum Kind { TITLE, AUTHOR };
+
+struct Suggestion {
+    string text;          // As the first book with it spelled it
+    uint32_t reviews = 0;
+    uint32_t books = 0;
+    uint8_t kind = TITLE;
+};
+
+// Edges carry a run of characters stored in the shared label arena
+struct Node {
+    uint32_t labelStart = 0;
+    uint32_t labelLength = 0;
+    uint32_t firstChild = NONE;
+    uint32_t nextSibling = NONE;
+    uint32_t count = 0;                  // Suggestions in the subtree
+    uint32_t top = NONE;                 // Cached best of the subtree, once it outgrows SCAN_LIMIT
+    uint32_t terminal[2] = {NONE, NONE}; // Title and author spelled by the path to here
+};
+
+// A book id seen in bookMap or in a review, with what it contributes
+struct IndexedBook {
+    string id;
+    uint32_t title = NONE;
+    uint32_t author = NONE;
+    uint32_t reviews = 0;
+    bool present = false;
+};
+
+static bool ready = false;
+static bool listening = false;
+static vector<Node> nodes; // Root first
+static vector<uint32_t> freeNodes;
+static string labels;      // Only grows; a rebuild compacts it
+static vector<Suggestion> suggestions;
+static vector<uint32_t> freeSuggestions;
+static size_t liveSuggestions = 0;
+static size_t textBytes = 0;
+static vector<vector<uint32_t> > topLists;
+static vector<uint32_t> freeTopLists;
+static vector<IndexedBook> books;
+static vector<uint32_t> freeBooks;
+static unordered_map<string, uint32_t> bookOf;
+static unordered_map<string, uint32_t> reviewBook; // Review id to the book it counts for
+
+static string foldText(const string& text) {
+    string folded(text);
+    for (size_t i = 0; i < folded.size(); i++) {
+        if (folded[i] >= 'A' && folded[i] <= 'Z') {
+            folded[i] += 'a' - 'A';
+        }
+    }
+    return folded;
+}
+
+// Most reviewed first, then by text; titles before authors of the same name
+static bool ranksBefore(uint32_t a, uint32_t b) {
+    const Suggestion& x = suggestions[a];
+    const Suggestion& y = suggestions[b];
+    if (x.reviews != y.reviews) {
+        return x.reviews > y.reviews;
+    }
+    int order = x.text.compare(y.text);
+    return order != 0 ? order < 0 : x.kind < y.kind;
+}
+
+static uint32_t newNode(uint32_t labelStart, uint32_t labelLength) {
+    uint32_t n;
+    if (!freeNodes.empty()) {
+        n = freeNodes.back();
+        freeNodes.pop_back();
+        nodes[n] = Node();
+    } else {
+        n = nodes.size();
+        nodes.push_back(Node());
+    }
+    nodes[n].labelStart = labelStart;
+    nodes[n].labelLength = labelLength;
+    return n;
+}
+
+static uint32_t newTopList() {
+    if (!freeTopLists.empty()) {
+        uint32_t list = freeTopLists.back();
+        freeTopLists.pop_back();
+        return list;
+    }
+    topLists.push_back(vector<uint32_t>());
+    return topLists.size() - 1;
+}
+
+static void dropTopList(uint32_t node) {
+    vector<uint32_t>().swap(topLists[nodes[node].top]);
+    freeTopLists.push_back(nodes[node].top);
+    nodes[node].top = NONE;
+}
+
+static uint32_t childStartingWith(uint32_t node, char c) {
+    for (uint32_t child = nodes[node].firstChild; child != NONE; child = nodes[child].nextSibling) {
+        if (labels[nodes[child].labelStart] == c) {
+            return child;
+        }
+    }
+    return NONE;
+}
+
+static void replaceChild(uint32_t parent, uint32_t child, uint32_t replacement) {
+    if (nodes[parent].firstChild == child) {
+        nodes[parent].firstChild = replacement;
+        return;
+    }
+    uint32_t previous = nodes[parent].firstChild;
+    while (nodes[previous].nextSibling != child) {
+        previous = nodes[previous].nextSibling;
+    }
+    nodes[previous].nextSibling = replacement;
+}
+
+// Cuts child's edge after `at` characters; the new node above it covers the same subtree
+static uint32_t splitEdge(uint32_t parent, uint32_t child, uint32_t at) {
+    uint32_t middle = newNode(nodes[child].labelStart, at);
+    nodes[middle].count = nodes[child].count;
+    if (nodes[child].top != NONE) {
+        uint32_t list = newTopList();
+        topLists[list] = topLists[nodes[child].top];
+        nodes[middle].top = list;
+    }
+    nodes[middle].nextSibling = nodes[child].nextSibling;
+    nodes[middle].firstChild = child;
+    replaceChild(parent, child, middle);
+    nodes[child].nextSibling = NONE;
+    nodes[child].labelStart += at;
+    nodes[child].labelLength -= at;
+    return middle;
+}
+
+// Nodes from the root to the one spelling key, created as needed
+static void insertPath(const string& key, vector<uint32_t>& path) {
+    path.assign(1, 0);
+    uint32_t node = 0;
+    size_t pos = 0;
+    while (pos < key.size()) {
+        uint32_t child = childStartingWith(node, key[pos]);
+        if (child == NONE) {
+            uint32_t leaf = newNode(labels.size(), key.size() - pos);
+            labels.append(key, pos, string::npos);
+            nodes[leaf].nextSibling = nodes[node].firstChild;
+            nodes[node].firstChild = leaf;
+            path.push_back(leaf);
+            return;
+        }
+        uint32_t start = nodes[child].labelStart;
+        uint32_t length = nodes[child].labelLength;
+        uint32_t common = 1;
+        while (common < length && pos + common < key.size() && labels[start + common] == key[pos + common]) {
+            common++;
+        }
+        if (common < length) {
+            child = splitEdge(node, child, common);
+        }
+        node = child;
+        pos += common;
+        path.push_back(node);
+    }
+}
+
+// Nodes from the root to the one spelling key exactly; false if there is none
+static bool findPath(const string& key, vector<uint32_t>& path) {
+    path.assign(1, 0);
+    uint32_t node = 0;
+    size_t pos = 0;
+    while (pos < key.size()) {
+        node = childStartingWith(node, key[pos]);
+        if (node == NONE || nodes[node].labelLength > key.size() - pos ||
+            labels.compare(nodes[node].labelStart, nodes[node].labelLength, key, pos, nodes[node].labelLength) != 0) {
+            return false;
+        }
+        pos += nodes[node].labelLength;
+        path.push_back(node);
+    }
+    return true;
+}
+
+static void collectSubtree(uint32_t root, vector<uint32_t>& out) {
+    vector<uint32_t> stack(1, root);
+    while (!stack.empty()) {
+        uint32_t node = stack.back();
+        stack.pop_back();
+        for (int kind = TITLE; kind <= AUTHOR; kind++) {
+            if (nodes[node].terminal[kind] != NONE) {
+                out.push_back(nodes[node].terminal[kind]);
+            }
+        }
+        for (uint32_t child = nodes[node].firstChild; child != NONE; child = nodes[child].nextSibling) {
+            stack.push_back(child);
+        }
+    }
+}
+
+// Fills the cache from the children's caches and scans of the small subtrees
+static void rebuildTopList(uint32_t node) {
+    vector<uint32_t> candidates;
+    for (int kind = TITLE; kind <= AUTHOR; kind++) {
+        if (nodes[node].terminal[kind] != NONE) {
+            candidates.push_back(nodes[node].terminal[kind]);
+        }
+    }
+    for (uint32_t child = nodes[node].firstChild; child != NONE; child = nodes[child].nextSibling) {
+        if (nodes[child].top == NONE) {
+            collectSubtree(child, candidates);
+            continue;
+        }
+        // A partial cache is exact only as far as it goes
+        if (topLists[nodes[child].top].size() < CACHED_SUGGESTIONS) {
+            rebuildTopList(child);
+        }
+        const vector<uint32_t>& best = topLists[nodes[child].top];
+        candidates.insert(candidates.end(), best.begin(), best.end());
+    }
+    size_t keep = min(CACHED_SUGGESTIONS, candidates.size());
+    partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), ranksBefore);
+    candidates.resize(keep);
+    if (nodes[node].top == NONE) {
+        nodes[node].top = newTopList();
+    }
+    topLists[nodes[node].top].swap(candidates);
+}
+
+// Keeps a cache exact after a suggestion moved in the ranking, arrived or left.
+// Whatever is not cached never ranks before the last cached entry, so a
+// suggestion that falls behind it simply drops out, and the cache only has
+// to be refilled once too few entries remain.
+static void adjustTopList(uint32_t node, uint32_t suggestion, bool present) {
+    vector<uint32_t>& best = topLists[nodes[node].top];
+    vector<uint32_t>::iterator it = find(best.begin(), best.end(), suggestion);
+    if (it != best.end()) {
+        best.erase(it);
+    }
+    if (present && !best.empty() && ranksBefore(suggestion, best.back())) {
+        best.insert(upper_bound(best.begin(), best.end(), suggestion, ranksBefore), suggestion);
+        if (best.size() > CACHED_SUGGESTIONS) {
+            best.pop_back();
+        }
+    }
+    if (best.size() < MAX_BOOK_SUGGESTIONS) {
+        rebuildTopList(node);
+    }
+}
+
+static uint32_t newSuggestion(const string& text, int kind) {
+    uint32_t s;
+    if (!freeSuggestions.empty()) {
+        s = freeSuggestions.back();
+        freeSuggestions.pop_back();
+    } else {
+        s = suggestions.size();
+        suggestions.push_back(Suggestion());
+    }
+    suggestions[s].text = text;
+    suggestions[s].reviews = 0;
+    suggestions[s].books = 0;
+    suggestions[s].kind = kind;
+    liveSuggestions++;
+    textBytes += text.size();
+    return s;
+}
+
+static void changeReviews(uint32_t s, int delta) {
+    if (delta == 0) {
+        return;
+    }
+    suggestions[s].reviews += delta;
+    vector<uint32_t> path;
+    if (!findPath(foldText(suggestions[s].text), path)) {
+        return;
+    }
+    // Deepest first: refilling a cache reads the caches below it
+    for (size_t i = path.size(); i-- > 0;) {
+        if (nodes[path[i]].top != NONE) {
+            adjustTopList(path[i], s, true);
+        }
+    }
+}
+
+// Counts one more book under text, adding the suggestion if it is new
+static uint32_t attach(int kind, const string& text, uint32_t reviews) {
+    string key = foldText(text);
+    if (key.empty()) {
+        return NONE;
+    }
+    vector<uint32_t> path;
+    insertPath(key, path);
+    uint32_t s = nodes[path.back()].terminal[kind];
+    if (s != NONE) {
+        suggestions[s].books++;
+        changeReviews(s, reviews);
+        return s;
+    }
+
+    s = newSuggestion(text, kind);
+    suggestions[s].books = 1;
+    suggestions[s].reviews = reviews;
+    nodes[path.back()].terminal[kind] = s;
+    for (size_t i = path.size(); i-- > 0;) {
+        uint32_t node = path[i];
+        nodes[node].count++;
+        if (nodes[node].top != NONE) {
+            adjustTopList(node, s, true);
+        } else if (nodes[node].count > SCAN_LIMIT) {
+            rebuildTopList(node);
+        }
+    }
+    return s;
+}
+
+// Counts one book less under a suggestion, removing it with the last one
+static void detach(uint32_t s, uint32_t reviews) {
+    if (s == NONE) {
+        return;
+    }
+    if (--suggestions[s].books > 0) {
+        changeReviews(s, -(int)reviews);
+        return;
+    }
+    vector<uint32_t> path;
+    if (findPath(foldText(suggestions[s].text), path)) {
+        nodes[path.back()].terminal[suggestions[s].kind] = NONE;
+        for (size_t i = path.size(); i-- > 0;) {
+            uint32_t node = path[i];
+            nodes[node].count--;
+            if (nodes[node].top != NONE && nodes[node].count < UNCACHE_LIMIT) {
+                dropTopList(node);
+            } else if (nodes[node].top != NONE) {
+                adjustTopList(node, s, false);
+            }
+        }
+        // Unlink nodes left with nothing under them; single-child chains stay split until a rebuild
+        for (size_t i = path.size() - 1; i > 0; i--) {
+            uint32_t node = path[i];
+            if (nodes[node].firstChild != NONE || nodes[node].terminal[TITLE] != NONE || nodes[node].terminal[AUTHOR] != NONE) {
+                break;
+            }
+            replaceChild(path[i - 1], node, nodes[node].nextSibling);
+            if (nodes[node].top != NONE) {
+                dropTopList(node);
+            }
+            freeNodes.push_back(node);
+        }
+    }
+    textBytes -= suggestions[s].text.size();
+    string().swap(suggestions[s].text);
+    freeSuggestions.push_back(s);
+    liveSuggestions--;
+}
+
+static uint32_t bookSlot(const string& id) {
+    unordered_map<string, uint32_t>::iterator known = bookOf.find(id);
+    if (known != bookOf.end()) {
+        return known->second;
+    }
+    uint32_t slot;
+    if (!freeBooks.empty()) {
+        slot = freeBooks.back();
+        freeBooks.pop_back();
+        books[slot] = IndexedBook();
+    } else {
+        slot = books.size();
+        books.push_back(IndexedBook());
+    }
+    books[slot].id = id;
+    bookOf[id] = slot;
+    return slot;
+}
+
+static void releaseIfUnused(uint32_t slot) {
+    IndexedBook& book = books[slot];
+    if (!book.present && book.reviews == 0) {
+        bookOf.erase(book.id);
+        book = IndexedBook();
+        freeBooks.push_back(slot);
+    }
+}
+
+// Swaps one of a book's suggestions for text, unless only its case changed
+static void retarget(uint32_t& s, int kind, const string& text, uint32_t reviews) {
+    if (s != NONE && foldText(suggestions[s].text) == foldText(text)) {
+        return;
+    }
+    detach(s, reviews);
+    s = attach(kind, text, reviews);
+}
+
+static void placeBook(const string& id, Book& book) {
+    uint32_t slot = bookSlot(id);
+    books[slot].present = true;
+    uint32_t reviews = books[slot].reviews;
+    retarget(books[slot].title, TITLE, book.getTitle(), reviews);
+    retarget(books[slot].author, AUTHOR, book.getAuthor(), reviews);
+}
+
+static void removeBook(const string& id) {
+    unordered_map<string, uint32_t>::iterator known = bookOf.find(id);
+    if (known == bookOf.end()) {
+        return;
+    }
+    uint32_t slot = known->second;
+    detach(books[slot].title, books[slot].reviews);
+    detach(books[slot].author, books[slot].reviews);
+    books[slot].title = NONE;
+    books[slot].author = NONE;
+    books[slot].present = false;
+    releaseIfUnused(slot);
+}
+
+static void countReview(uint32_t slot, int delta) {
+    books[slot].reviews += delta;
+    if (books[slot].title != NONE) {
+        changeReviews(books[slot].title, delta);
+    }
+    if (books[slot].author != NONE) {
+        changeReviews(books[slot].author, delta);
+    }
+}
+
+// Moves the review's count to the book it now points at; most review changes leave it in place
+static void followReview(const string& id, bool deleted) {
+    unordered_map<string, uint32_t>::iterator known = reviewBook.find(id);
+    ReviewStore::iterator it = deleted ? reviewMap.end() : reviewMap.find(id);
+    string bookId = it != reviewMap.end() ? it->second.getBook().getId() : "";
+    if (known != reviewBook.end() && !bookId.empty() && books[known->second].id == bookId) {
+        return;
+    }
+    if (known != reviewBook.end()) {
+        uint32_t before = known->second;
+        reviewBook.erase(known);
+        countReview(before, -1);
+        releaseIfUnused(before);
+    }
+    if (!bookId.empty()) {
+        uint32_t after = bookSlot(bookId);
+        reviewBook[id] = after;
+        countReview(after, 1);
+    }
+}
+
+void refreshBookSuggestions(const string& collection, const string& id, bool deleted) {
+    if (!ready) {
+        return;
+    }
+    if (collection == "books") {
+        map<string, Book>::iterator it = deleted ? bookMap.end() : bookMap.find(id);
+        if (it == bookMap.end()) {
+            removeBook(id);
+        } else {
+            placeBook(id, it->second);
+        }
+    } else if (collection == "reviews") {
+        followReview(id, deleted);
+    }
+}
+
+static void followChange(const Change& change) {
+    // Writers update the map before they record the change
+    refreshBookSuggestions(change.collection, change.id, change.deleted);
+}
+
+void rebuildBookSuggestions() {
+    TraceSpan span("rebuildBookSuggestions");
+    nodes.assign(1, Node());
+    freeNodes.clear();
+    labels.clear();
+    suggestions.clear();
+    freeSuggestions.clear();
+    liveSuggestions = 0;
+    textBytes = 0;
+    topLists.clear();
+    freeTopLists.clear();
+    books.clear();
+    freeBooks.clear();
+    bookOf.clear();
+    reviewBook.clear();
+
+    // Counts first, so each suggestion enters the trie at its final rank
+    reviewBook.reserve(reviewMap.size());
+    for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end(); ++it) {
+        uint32_t slot = bookSlot(it->second.getBook().getId());
+        books[slot].reviews++;
+        reviewBook[it->first] = slot;
+    }
+    for (map<string, Book>::iterator it = bookMap.begin(); it != bookMap.end(); ++it) {
+        placeBook(it->first, it->second);
+    }
+    ready = true;
+    if (!listening) {
+        addChangeListener(followChange);
+        listening = true;
+    }
+}
+
+bool bookSuggestionsReady() {
+    return ready;
+}
+
+vector<BookSuggestion> suggestBooks(const string& prefix, size_t k) {
+    vector<BookSuggestion> found;
+    k = min(k, MAX_BOOK_SUGGESTIONS);
+    if (!ready || k == 0) {
+        return found;
+    }
+
+    // The prefix may end part way along an edge; the whole subtree below still matches
+    string key = foldText(prefix);
+    uint32_t node = 0;
+    size_t pos = 0;
+    while (pos < key.size()) {
+        node = childStartingWith(node, key[pos]);
+        if (node == NONE) {
+            return found;
+        }
+        size_t length = min((size_t)nodes[node].labelLength, key.size() - pos);
+        if (labels.compare(nodes[node].labelStart, length, key, pos, length) != 0) {
+            return found;
+        }
+        pos += length;
+    }
+
+    vector<uint32_t> best;
+    if (nodes[node].top != NONE) {
+        const vector<uint32_t>& cached = topLists[nodes[node].top];
+        best.assign(cached.begin(), cached.begin() + min(k, cached.size()));
+    } else {
+        collectSubtree(node, best);
+        size_t keep = min(k, best.size());
+        partial_sort(best.begin(), best.begin() + keep, best.end(), ranksBefore);
+        best.resize(keep);
+    }
+
+    for (unsigned int i = 0; i < best.size(); i++) {
+        const Suggestion& s = suggestions[best[i]];
+        BookSuggestion suggestion = {s.text, s.kind == AUTHOR, s.reviews, s.books};
+        found.push_back(suggestion);
+    }
+    return found;
+}
+
+BookSuggestStats getBookSuggestStats() {
+    BookSuggestStats stats;
+    stats.suggestions = liveSuggestions;
+    stats.nodes = nodes.size() - freeNodes.size();
+    stats.bytes = nodes.capacity() * sizeof(Node) + labels.capacity() + suggestions.capacity() * sizeof(Suggestion) +
+                  textBytes + topLists.size() * CACHED_SUGGESTIONS * sizeof(uint32_t);
+    return stats;
+}
@@ -0,0 +1,44 @@
+#ifndef BOOKSUGGEST_H
+#define BOOKSUGGEST_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Prefix completion over book titles and authors for GET /api/books/suggest.
+// A radix trie over the lowercased text; subtrees too large to scan per query
+// keep their best completions cached, ranked by the reviews of the books
+// behind each one. Follows book and review changes in the change log.
+// Written under the exclusive data lock, queried under the shared one.
+static const size_t MAX_BOOK_SUGGESTIONS = 16;
+
+struct BookSuggestion {
+    string text;
+    bool author;      // An author name rather than a title
+    unsigned reviews; // Of every book with this title / by this author
+    unsigned books;
+};
+
+struct BookSuggestStats {
+    size_t suggestions; // Distinct titles and authors
+    size_t nodes;
+    size_t bytes;       // Trie, labels and suggestion text
+};
+
+// Indexes bookMap and the review counts in reviewMap from scratch and starts
+// following the change log. Call before the server threads start, or with the exclusive lock.
+void rebuildBookSuggestions();
+bool bookSuggestionsReady();
+
+// Re-reads one book or review from the maps; for writers that bypass the
+// change log (replication). Exclusive lock held.
+void refreshBookSuggestions(const string& collection, const string& id, bool deleted);
+
+// Up to k (at most MAX_BOOK_SUGGESTIONS) completions of prefix, ignoring case:
+// most reviewed first, then alphabetical, titles before authors
+vector<BookSuggestion> suggestBooks(const string& prefix, size_t k);
+
+BookSuggestStats getBookSuggestStats();
+
+#endif
@@ -0,0 +1,147 @@
+#include "ChangeLog.h"
+#include "Trace.h"
+
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+static const int DEFAULT_LIMIT = 1000;
+static const int MAX_LIMIT = 10000;
+
+static deque<Change> changes;
+static size_t changeLogCapacity = 100000;
+static atomic<unsigned long long> changeSeq(0);
+static unsigned long long compactedThrough = 0; // Highest sequence no longer in the log
+static vector<ChangeListener> listeners;          // Registered at startup
+static mutex listenersLock;                       // Index builds register side by side
+static mutex changesLock;                         // For readers that do not hold the data lock
+
+static void append(const string& collection, const string& id, bool deleted, const string& fragment) {
+    Change change;
+    change.collection = collection;
+    change.id = id;
+    change.deleted = deleted;
+    change.fragment = fragment;
+    change.committedAtMillis =
+        chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    {
+        lock_guard<mutex> lock(changesLock);
+        change.seq = ++changeSeq;
+        changes.push_back(change);
+        while (changes.size() > changeLogCapacity) {
+            compactedThrough = changes.front().seq;
+            changes.pop_front();
+        }
+    }
+    for (unsigned int i = 0; i < listeners.size(); i++) {
+        listeners[i](change);
+    }
+}
+
+void recordUpsert(const string& collection, const string& id, const string& fragment) {
+    append(collection, id, false, fragment);
+}
+
+void recordDelete(const string& collection, const string& id) {
+    append(collection, id, true, "");
+}
+
+void addChangeListener(ChangeListener listener) {
+    lock_guard<mutex> lock(listenersLock);
+    listeners.push_back(listener);
+}
+
+string renderChange(const Change& change) {
+    json::wvalue j;
+    j["seq"] = (uint64_t)change.seq;
+    j["ts"] = (uint64_t)change.committedAtMillis;
+    j["collection"] = change.collection;
+    j["id"] = change.id;
+    j["op"] = change.deleted ? "delete" : "upsert";
+
+    // Splice the cached entity fragment in as "data"
+    string entry = j.dump();
+    if (!change.deleted) {
+        entry.pop_back();
+        entry += ",\"data\":" + change.fragment + "}";
+    }
+    return entry;
+}
+
+bool copyChangesSince(unsigned long long since, vector<Change>& out) {
+    lock_guard<mutex> lock(changesLock);
+    if (since < compactedThrough || since > changeSeq.load()) {
+        return false;
+    }
+    size_t first = changes.empty() ? 0 : (size_t)(since + 1 - changes.front().seq);
+    out.insert(out.end(), changes.begin() + first, changes.end());
+    return true;
+}
+
+unsigned long long latestChangeSeq() {
+    return changeSeq.load();
+}
+
+void setChangeLogCapacity(size_t capacity) {
+    lock_guard<mutex> lock(changesLock);
+    changeLogCapacity = max((size_t)1, capacity);
+    while (changes.size() > changeLogCapacity) {
+        compactedThrough = changes.front().seq;
+        changes.pop_front();
+    }
+}
+
+bool parseChangeLogFlag(const string& arg) {
+    const string flag = "--change-log-size=";
+    if (arg.compare(0, flag.size(), flag) != 0) {
+        return false;
+    }
+    try {
+        setChangeLogCapacity(stoul(arg.substr(flag.size())));
+    } catch (const exception&) {
+        return false;
+    }
+    return true;
+}
+
+response readChanges(request req) {
+    TraceSpan span("readChanges");
+    char* sinceParam = req.url_params.get("since");
+    char* limitParam = req.url_params.get("limit");
+    unsigned long long since = sinceParam ? strtoull(sinceParam, nullptr, 10) : 0;
+    int limit = limitParam ? atoi(limitParam) : DEFAULT_LIMIT;
+    if (limit <= 0 || limit > MAX_LIMIT) {
+        limit = limit <= 0 ? DEFAULT_LIMIT : MAX_LIMIT;
+    }
+    unsigned long long latest = changeSeq.load();
+
+    // Changes after since were dropped, or since comes from before a restart
+    if (since < compactedThrough || since > latest) {
+        json::wvalue error;
+        error["error"] = "resync_required";
+        error["oldest"] = (uint64_t)(changes.empty() ? latest : changes.front().seq);
+        error["latest"] = (uint64_t)latest;
+        return response(410, error.dump());
+    }
+
+    // Sequences are dense, so since maps straight to a deque offset
+    size_t first = changes.empty() ? 0 : (size_t)(since + 1 - changes.front().seq);
+    size_t last = min(changes.size(), first + limit);
+
+    string body;
+    for (size_t i = first; i < last; i++) {
+        body += (i > first ? "," : "") + renderChange(changes[i]);
+    }
+
+    json::wvalue envelope;
+    envelope["since"] = (uint64_t)since;
+    envelope["next"] = (uint64_t)(last > first ? changes[last - 1].seq : since);
+    envelope["latest"] = (uint64_t)latest;
+    envelope["more"] = last < changes.size();
+
+    string json = envelope.dump();
+    json.pop_back();
+    json += ",\"changes\":[" + body + "]}";
+    return response(json);
+}
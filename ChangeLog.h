@@ -0,0 +1,51 @@
+#ifndef CHANGELOG_H
+#define CHANGELOG_H
+
+#include <string>
+#include <vector>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+struct Change {
+    unsigned long long seq;
+    string collection;
+    string id;
+    bool deleted;
+    string fragment;                      // Empty for tombstones
+    unsigned long long committedAtMillis; // Wall clock, for replication lag
+};
+
+// Bounded in-memory log of entity changes, one global sequence across all
+// collections. Appended under the exclusive data lock, read under the shared one;
+// appends also take the log's own mutex, which copyChangesSince takes instead.
+void recordUpsert(const string& collection, const string& id, const string& fragment);
+void recordDelete(const string& collection, const string& id);
+
+// Called for every change as it is appended, still under the exclusive lock;
+// listeners must not block
+typedef void (*ChangeListener)(const Change& change);
+void addChangeListener(ChangeListener listener);
+
+// {"seq","ts","collection","id","op"[,"data"]} as served by the change feed
+string renderChange(const Change& change);
+
+// Appends every change after since to out; false when since was compacted away
+// or is in the future. Needs no data lock, so the stream's event loop can call it.
+bool copyChangesSince(unsigned long long since, vector<Change>& out);
+
+// Sequence of the newest change, 0 before any write
+unsigned long long latestChangeSeq();
+
+// Oldest changes are dropped past this many entries (default 100000)
+void setChangeLogCapacity(size_t capacity);
+
+// Consumes --change-log-size=N
+bool parseChangeLogFlag(const string& arg);
+
+// GET /api/changes?since=<seq>&limit=<n>: upserts and tombstones after since,
+// or 410 with "resync_required" once since has been compacted away
+response readChanges(request req);
+
+#endif
@@ -0,0 +1,584 @@
+#include "ChangeStream.h"
+
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cctype>
+
+ChangeStreamOptions changeStreamOptions;
+
+static const size_t MAX_REQUEST_BYTES = 8192;
+static const int KERNEL_SEND_BUFFER = 32 * 1024; // Keeps a stalled client from parking megabytes in the kernel
+static const int MAX_EVENTS = 256;
+
+// Intrusive multi-producer single-consumer queue (Vyukov). Writers push with
+// one atomic exchange; only the event loop pops.
+struct QueuedChange {
+    atomic<QueuedChange*> next;
+    Change change;
+};
+
+static QueuedChange queueStub;
+static atomic<QueuedChange*> queueHead(&queueStub);
+static QueuedChange* queueTail = &queueStub;
+
+static void pushChange(QueuedChange* node) {
+    node->next.store(nullptr, memory_order_relaxed);
+    QueuedChange* prev = queueHead.exchange(node, memory_order_acq_rel);
+    prev->next.store(node, memory_order_release);
+}
+
+// Null when empty, or when a producer is between its exchange and its link;
+// that producer's wakeup follows, so the loop just tries again then
+static QueuedChange* popChange() {
+    QueuedChange* tail = queueTail;
+    QueuedChange* next = tail->next.load(memory_order_acquire);
+    if (tail == &queueStub) {
+        if (next == nullptr) {
+            return nullptr;
+        }
+        queueTail = next;
+        tail = next;
+        next = next->next.load(memory_order_acquire);
+    }
+    if (next != nullptr) {
+        queueTail = next;
+        return tail;
+    }
+    if (tail != queueHead.load(memory_order_acquire)) {
+        return nullptr;
+    }
+    pushChange(&queueStub);
+    next = tail->next.load(memory_order_acquire);
+    if (next != nullptr) {
+        queueTail = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+struct Subscriber {
+    int fd;
+    bool streaming = false;        // Handshake answered
+    bool waitingWritable = false;  // EPOLLOUT armed
+    bool closeWhenFlushed = false;
+    string request;                // Until the blank line of the request arrives
+    unsigned collections = 0;      // Bit per collection, 0 for all
+    unsigned long long lastSeq = 0;
+    deque<shared_ptr<const string> > pending; // Frames are shared between subscribers
+    size_t offset = 0;             // Bytes of pending.front() already sent
+    size_t pendingBytes = 0;
+};
+
+static atomic<bool> streaming(false);
+static atomic<bool> wakePending(false);
+static int listenFd = -1;
+static int wakeFd = -1;
+static int epollFd = -1;
+static int boundPort = 0;
+static thread loopThread;
+static unordered_map<int, Subscriber> subscribers; // Event loop only
+
+static atomic<size_t> subscriberCount(0);
+static atomic<unsigned long long> eventsQueued(0);
+static atomic<unsigned long long> slowDisconnects(0);
+
+static unsigned collectionBit(const string& collection) {
+    if (collection == "books") return 1;
+    if (collection == "users") return 2;
+    if (collection == "reviews") return 4;
+    if (collection == "recommendations") return 8;
+    return 16;
+}
+
+bool parseChangeStreamFlag(const string& arg) {
+    size_t eq = arg.find('=');
+    if (eq == string::npos) {
+        return false;
+    }
+    string key = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+
+    try {
+        if (key == "--stream-port") {
+            changeStreamOptions.port = max(0, stoi(value));
+        } else if (key == "--stream-buffer-kb") {
+            changeStreamOptions.bufferBytes = max(1, stoi(value)) * (size_t)1024;
+        } else if (key == "--stream-heartbeat-s") {
+            changeStreamOptions.heartbeatSeconds = max(1, stoi(value));
+        } else {
+            return false;
+        }
+    } catch (const exception&) {
+        return false;
+    }
+    return true;
+}
+
+void publishChange(const Change& change) {
+    if (!streaming.load(memory_order_acquire)) {
+        return;
+    }
+    QueuedChange* node = new QueuedChange;
+    node->change = change;
+    pushChange(node);
+
+    // One wakeup per drain rather than one per change
+    if (!wakePending.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+static void closeSubscriber(int fd) {
+    unordered_map<int, Subscriber>::iterator it = subscribers.find(fd);
+    if (it == subscribers.end()) {
+        return;
+    }
+    if (it->second.streaming) {
+        subscriberCount--;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    subscribers.erase(it);
+}
+
+static void watchWritable(Subscriber& sub, bool writable) {
+    if (sub.waitingWritable == writable) {
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (writable) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = sub.fd;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, sub.fd, &ev);
+    sub.waitingWritable = writable;
+}
+
+// Sends as much as the socket takes; false once the subscriber has been closed
+static bool flushSubscriber(Subscriber& sub) {
+    while (!sub.pending.empty()) {
+        const string& frame = *sub.pending.front();
+        ssize_t sent = send(sub.fd, frame.data() + sub.offset, frame.size() - sub.offset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watchWritable(sub, true);
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            closeSubscriber(sub.fd);
+            return false;
+        }
+        sub.offset += sent;
+        if (sub.offset == frame.size()) {
+            sub.pendingBytes -= frame.size();
+            sub.pending.pop_front();
+            sub.offset = 0;
+        }
+    }
+    watchWritable(sub, false);
+    if (sub.closeWhenFlushed) {
+        closeSubscriber(sub.fd);
+        return false;
+    }
+    return true;
+}
+
+// Queues a frame without sending; false if the buffer is full, in which case the
+// caller disconnects the subscriber instead of slowing anyone else down
+static bool queueFrame(Subscriber& sub, const shared_ptr<const string>& frame) {
+    if (sub.pendingBytes + frame->size() > changeStreamOptions.bufferBytes) {
+        return false;
+    }
+    sub.pending.push_back(frame);
+    sub.pendingBytes += frame->size();
+    return true;
+}
+
+static shared_ptr<const string> renderFrame(const Change& change) {
+    return make_shared<const string>("id: " + to_string(change.seq) + "\ndata: " + renderChange(change) + "\n\n");
+}
+
+static void dropSlow(const vector<int>& slow) {
+    for (unsigned int i = 0; i < slow.size(); i++) {
+        slowDisconnects++;
+        closeSubscriber(slow[i]);
+    }
+}
+
+// Fans every queued change out to the matching subscribers, then flushes them
+static void drainQueue() {
+    wakePending.store(false);
+    uint64_t count;
+    ssize_t ignored = read(wakeFd, &count, sizeof(count));
+    (void)ignored;
+
+    vector<int> slow;
+    bool queuedAny = false;
+    QueuedChange* node;
+    while ((node = popChange()) != nullptr) {
+        unsigned bit = collectionBit(node->change.collection);
+        shared_ptr<const string> frame;
+        for (unordered_map<int, Subscriber>::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+            Subscriber& sub = it->second;
+            if (!sub.streaming || sub.closeWhenFlushed || node->change.seq <= sub.lastSeq ||
+                (sub.collections != 0 && (sub.collections & bit) == 0)) {
+                continue;
+            }
+            if (!frame) {
+                frame = renderFrame(node->change);
+            }
+            sub.lastSeq = node->change.seq;
+            if (!queueFrame(sub, frame)) {
+                sub.closeWhenFlushed = true; // Skipped until it is closed below
+                slow.push_back(sub.fd);
+                continue;
+            }
+            eventsQueued++;
+            queuedAny = true;
+        }
+        delete node;
+    }
+    dropSlow(slow);
+
+    if (queuedAny) {
+        vector<int> ready;
+        for (unordered_map<int, Subscriber>::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+            if (!it->second.pending.empty() && !it->second.waitingWritable) {
+                ready.push_back(it->first);
+            }
+        }
+        for (unsigned int i = 0; i < ready.size(); i++) {
+            flushSubscriber(subscribers.find(ready[i])->second);
+        }
+    }
+}
+
+static void sendHeartbeats() {
+    static const shared_ptr<const string> heartbeat = make_shared<const string>(": ping\n\n");
+    vector<int> slow;
+    vector<int> ready;
+    for (unordered_map<int, Subscriber>::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+        if (!it->second.streaming) {
+            continue;
+        }
+        if (!queueFrame(it->second, heartbeat)) {
+            slow.push_back(it->first);
+        } else if (!it->second.waitingWritable) {
+            ready.push_back(it->first);
+        }
+    }
+    dropSlow(slow);
+    for (unsigned int i = 0; i < ready.size(); i++) {
+        flushSubscriber(subscribers.find(ready[i])->second);
+    }
+}
+
+static void rejectRequest(Subscriber& sub, const string& status) {
+    sub.pending.push_back(make_shared<const string>("HTTP/1.1 " + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"));
+    sub.pendingBytes = sub.pending.back()->size();
+    sub.closeWhenFlushed = true;
+    flushSubscriber(sub);
+}
+
+// Answers the request line once the headers are in: the event-stream headers,
+// then any replay requested with Last-Event-ID or ?since=
+static void startStreaming(Subscriber& sub) {
+    size_t lineEnd = sub.request.find("\r\n");
+    string line = sub.request.substr(0, lineEnd);
+    size_t firstSpace = line.find(' ');
+    size_t secondSpace = line.find(' ', firstSpace + 1);
+    if (firstSpace == string::npos || secondSpace == string::npos || line.substr(0, firstSpace) != "GET") {
+        rejectRequest(sub, "405 Method Not Allowed");
+        return;
+    }
+    string target = line.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+    string path = target.substr(0, target.find('?'));
+    if (path != "/api/stream") {
+        rejectRequest(sub, "404 Not Found");
+        return;
+    }
+
+    query_string params(target);
+    const char* filter = params.get("collections");
+    if (filter == nullptr) {
+        filter = params.get("collection");
+    }
+    if (filter != nullptr) {
+        string names = filter;
+        size_t start = 0;
+        while (start <= names.size()) {
+            size_t comma = names.find(',', start);
+            if (comma == string::npos) {
+                comma = names.size();
+            }
+            if (comma > start) {
+                sub.collections |= collectionBit(names.substr(start, comma - start));
+            }
+            start = comma + 1;
+        }
+    }
+
+    // Header names are case-insensitive
+    string lowered = sub.request;
+    for (unsigned int i = 0; i < lowered.size(); i++) {
+        lowered[i] = tolower(lowered[i]);
+    }
+    string resumeFrom;
+    size_t lastEventId = lowered.find("\r\nlast-event-id:");
+    if (lastEventId != string::npos) {
+        size_t valueStart = lastEventId + strlen("\r\nlast-event-id:");
+        resumeFrom = sub.request.substr(valueStart, sub.request.find("\r\n", valueStart) - valueStart);
+    } else if (params.get("since") != nullptr) {
+        resumeFrom = params.get("since");
+    }
+    sub.request.clear();
+    sub.request.shrink_to_fit();
+
+    sub.pending.push_back(make_shared<const string>(
+        "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+        "Connection: keep-alive\r\nX-Accel-Buffering: no\r\n\r\nretry: 1000\n\n"));
+
+    // Without the data lock: the event loop must not wait for loading or a long write.
+    // A change appended in between may be both replayed and queued; lastSeq skips the copy.
+    vector<Change> replay;
+    bool resumable = true;
+    sub.lastSeq = latestChangeSeq();
+    if (!resumeFrom.empty()) {
+        resumable = copyChangesSince(strtoull(resumeFrom.c_str(), nullptr, 10), replay);
+        if (!replay.empty()) {
+            sub.lastSeq = max(sub.lastSeq, replay.back().seq);
+        }
+    }
+    if (!resumable) {
+        sub.pending.push_back(make_shared<const string>("event: resync\ndata: {\"error\":\"resync_required\"}\n\n"));
+        sub.closeWhenFlushed = true;
+    }
+    for (unsigned int i = 0; i < replay.size(); i++) {
+        if (sub.collections == 0 || (sub.collections & collectionBit(replay[i].collection)) != 0) {
+            sub.pending.push_back(renderFrame(replay[i]));
+        }
+    }
+    // The replay may exceed the buffer once; live events only fit after it drains
+    for (unsigned int i = 0; i < sub.pending.size(); i++) {
+        sub.pendingBytes += sub.pending[i]->size();
+    }
+
+    if (resumable) {
+        sub.streaming = true;
+        subscriberCount++;
+    }
+    flushSubscriber(sub);
+}
+
+static void readSubscriber(int fd) {
+    unordered_map<int, Subscriber>::iterator it = subscribers.find(fd);
+    if (it == subscribers.end()) {
+        return; // Closed earlier in the same batch of events
+    }
+    Subscriber& sub = it->second;
+    char buffer[4096];
+    while (true) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received == 0) {
+            closeSubscriber(fd);
+            return;
+        }
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeSubscriber(fd);
+            }
+            return;
+        }
+        if (sub.streaming || sub.closeWhenFlushed) {
+            continue; // Nothing more is expected from a subscriber
+        }
+        sub.request.append(buffer, received);
+        if (sub.request.find("\r\n\r\n") != string::npos) {
+            startStreaming(sub);
+            if (subscribers.find(fd) == subscribers.end()) {
+                return;
+            }
+        } else if (sub.request.size() > MAX_REQUEST_BYTES) {
+            closeSubscriber(fd);
+            return;
+        }
+    }
+}
+
+static void acceptSubscribers() {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &KERNEL_SEND_BUFFER, sizeof(KERNEL_SEND_BUFFER));
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        subscribers[fd].fd = fd;
+    }
+}
+
+static void runLoop() {
+    struct epoll_event events[MAX_EVENTS];
+    chrono::steady_clock::time_point nextHeartbeat =
+        chrono::steady_clock::now() + chrono::seconds(changeStreamOptions.heartbeatSeconds);
+
+    while (streaming.load()) {
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                drainQueue();
+            } else if (fd == listenFd) {
+                acceptSubscribers();
+            } else {
+                if (events[i].events & EPOLLERR) {
+                    closeSubscriber(fd);
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                    readSubscriber(fd);
+                }
+                unordered_map<int, Subscriber>::iterator it = subscribers.find(fd);
+                if (it != subscribers.end() && (events[i].events & EPOLLOUT)) {
+                    flushSubscriber(it->second);
+                }
+            }
+        }
+
+        // Heartbeats keep proxies from timing the stream out and find dead peers
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (now >= nextHeartbeat) {
+            sendHeartbeats();
+            nextHeartbeat = now + chrono::seconds(changeStreamOptions.heartbeatSeconds);
+        }
+    }
+}
+
+bool startChangeStream() {
+    if (streaming.load()) {
+        return true;
+    }
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(changeStreamOptions.port);
+    if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 1024) < 0) {
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    socklen_t length = sizeof(addr);
+    getsockname(listenFd, (struct sockaddr*)&addr, &length);
+    boundPort = ntohs(addr.sin_port);
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+    ev.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+    streaming.store(true, memory_order_release);
+    loopThread = thread(runLoop);
+    return true;
+}
+
+void stopChangeStream() {
+    if (!streaming.exchange(false)) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+    (void)ignored;
+    loopThread.join();
+
+    vector<int> open;
+    for (unordered_map<int, Subscriber>::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+        open.push_back(it->first);
+    }
+    for (unsigned int i = 0; i < open.size(); i++) {
+        closeSubscriber(open[i]);
+    }
+    QueuedChange* node;
+    while ((node = popChange()) != nullptr) {
+        delete node;
+    }
+    close(epollFd);
+    close(wakeFd);
+    close(listenFd);
+    epollFd = wakeFd = listenFd = -1;
+    boundPort = 0;
+    wakePending.store(false);
+}
+
+int changeStreamPort() {
+    return boundPort;
+}
+
+ChangeStreamStats getChangeStreamStats() {
+    ChangeStreamStats stats;
+    stats.subscribers = subscriberCount.load();
+    stats.events = eventsQueued.load();
+    stats.slowDisconnects = slowDisconnects.load();
+    return stats;
+}
+
+response redirectToChangeStream(request req) {
+    if (changeStreamPort() == 0) {
+        return response(503, "Change stream is not running");
+    }
+    // Same host the client used, stream port instead of the API port
+    string host = req.get_header_value("Host");
+    if (host.empty()) {
+        host = "localhost";
+    } else if (host[0] == '[') {
+        host = host.substr(0, host.find(']') + 1);
+    } else {
+        host = host.substr(0, host.find(':'));
+    }
+    size_t query = req.raw_url.find('?');
+    string location = "http://" + host + ":" + to_string(changeStreamPort()) + "/api/stream" +
+                      (query == string::npos ? "" : req.raw_url.substr(query));
+
+    response res(307);
+    res.set_header("Location", location);
+    return res;
+}
@@ -0,0 +1,47 @@
+#ifndef CHANGESTREAM_H
+#define CHANGESTREAM_H
+
+#include <string>
+#include <crow.h>
+#include "ChangeLog.h"
+
+using namespace std;
+using namespace crow;
+
+// Server-sent events of every committed change, served by one epoll thread on
+// its own port. Crow answers a request with one finished response, so
+// GET /api/stream on the API port redirects there.
+struct ChangeStreamOptions {
+    int port = 18526;                // 0 picks a free port (tests)
+    size_t bufferBytes = 256 * 1024; // Per subscriber; past this the subscriber is dropped
+    int heartbeatSeconds = 15;
+};
+
+extern ChangeStreamOptions changeStreamOptions;
+
+struct ChangeStreamStats {
+    size_t subscribers;
+    unsigned long long events;          // Events queued to subscribers
+    unsigned long long slowDisconnects; // Subscribers dropped for a full buffer
+};
+
+// Consumes --stream-port=N, --stream-buffer-kb=N and --stream-heartbeat-s=N
+bool parseChangeStreamFlag(const string& arg);
+
+// Binds the port and starts the event loop; false if the port cannot be bound
+bool startChangeStream();
+void stopChangeStream();
+
+// Port actually bound, 0 when the stream is not running
+int changeStreamPort();
+
+ChangeStreamStats getChangeStreamStats();
+
+// Registered as a change listener: pushes the change onto the lock-free queue
+// the event loop drains. Never blocks the writer holding the data lock.
+void publishChange(const Change& change);
+
+// GET /api/stream?collections=books,reviews → 307 to the stream port
+response redirectToChangeStream(request req);
+
+#endif
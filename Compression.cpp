@@ -0,0 +1,219 @@
+#include "Compression.h"
+#include "SingleFlight.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Book.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <zlib.h>
+
+CompressionOptions compressionOptions;
+
+// Immutable once cached. Only the encoded bytes are kept; the version in the
+// key says which data they were computed from, so a hit never needs the body.
+struct CompressedEntry {
+    unsigned long long version;
+    size_t rawBytes;
+    string encoded;
+    string contentType;
+    string changeSeq; // Fixed for a data version; per-request headers are set again on each hit
+};
+
+static mutex cacheMutex;
+static map<string, shared_ptr<const CompressedEntry> > cache;
+static size_t cachedBytes = 0;
+
+bool parseCompressionFlag(const string& arg) {
+    size_t eq = arg.find('=');
+    if (eq == string::npos) {
+        return false;
+    }
+    string key = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+
+    try {
+        if (key == "--compression-level") {
+            compressionOptions.level = min(9, max(0, stoi(value)));
+        } else if (key == "--compress-min-bytes") {
+            compressionOptions.minBytes = stoul(value);
+        } else if (key == "--compress-cache-mb") {
+            compressionOptions.cacheBytes = stoul(value) << 20;
+        } else {
+            return false;
+        }
+    } catch (const exception&) {
+        return false;
+    }
+    return true;
+}
+
+ContentEncoding negotiateEncoding(const string& acceptEncoding) {
+    double gzipQ = 0;
+    double deflateQ = 0;
+    double anyQ = -1;
+
+    size_t pos = 0;
+    while (pos < acceptEncoding.size()) {
+        size_t comma = acceptEncoding.find(',', pos);
+        if (comma == string::npos) {
+            comma = acceptEncoding.size();
+        }
+        string token = toLower(acceptEncoding.substr(pos, comma - pos));
+        pos = comma + 1;
+
+        double q = 1;
+        size_t semicolon = token.find(';');
+        if (semicolon != string::npos) {
+            size_t qPos = token.find("q=", semicolon);
+            if (qPos != string::npos) {
+                q = atof(token.c_str() + qPos + 2);
+            }
+            token = token.substr(0, semicolon);
+        }
+        size_t start = token.find_first_not_of(' ');
+        size_t end = token.find_last_not_of(' ');
+        token = start == string::npos ? "" : token.substr(start, end - start + 1);
+
+        if (token == "gzip" || token == "x-gzip") {
+            gzipQ = q;
+        } else if (token == "deflate") {
+            deflateQ = q;
+        } else if (token == "*") {
+            anyQ = q;
+        }
+    }
+
+    // A wildcard only speaks for codings the header did not name
+    if (anyQ >= 0) {
+        if (acceptEncoding.find("gzip") == string::npos) {
+            gzipQ = anyQ;
+        }
+        if (acceptEncoding.find("deflate") == string::npos) {
+            deflateQ = anyQ;
+        }
+    }
+
+    if (gzipQ > 0 && gzipQ >= deflateQ) {
+        return GZIP;
+    }
+    return deflateQ > 0 ? DEFLATE : IDENTITY;
+}
+
+const char* encodingName(ContentEncoding encoding) {
+    return encoding == GZIP ? "gzip" : encoding == DEFLATE ? "deflate" : "identity";
+}
+
+string compressBody(const string& body, ContentEncoding encoding, int level) {
+    TraceSpan span("compress");
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int windowBits = encoding == GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw runtime_error("deflateInit2 failed");
+    }
+
+    string out;
+    out.resize(deflateBound(&stream, body.size()));
+    stream.next_in = (Bytef*)body.data();
+    stream.avail_in = body.size();
+    stream.next_out = (Bytef*)&out[0];
+    stream.avail_out = out.size();
+
+    int status = deflate(&stream, Z_FINISH);
+    size_t produced = stream.total_out;
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        throw runtime_error("deflate failed");
+    }
+    out.resize(produced);
+    return out;
+}
+
+static string cacheKey(int route, const request& req, unsigned long long version, ContentEncoding encoding) {
+    return to_string(route) + "@" + to_string(version) + "?" + normalizedQuery(req) + "#" + encodingName(encoding);
+}
+
+static void insertCompressed(const string& key, shared_ptr<const CompressedEntry> entry) {
+    lock_guard<mutex> lock(cacheMutex);
+    shared_ptr<const CompressedEntry>& slot = cache[key];
+    if (slot) {
+        cachedBytes -= slot->encoded.size();
+    }
+    slot = entry;
+    cachedBytes += entry->encoded.size();
+
+    // Over budget: entries from older data versions go first, then anything else
+    unsigned long long current = dataVersion.load();
+    for (auto it = cache.begin(); it != cache.end() && cachedBytes > compressionOptions.cacheBytes;) {
+        if (it->second->version < current && it->first != key) {
+            cachedBytes -= it->second->encoded.size();
+            it = cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = cache.begin(); it != cache.end() && cachedBytes > compressionOptions.cacheBytes;) {
+        cachedBytes -= it->second->encoded.size();
+        it = cache.erase(it);
+    }
+}
+
+bool readCompressed(int route, const request& req, response& res) {
+    if (compressionOptions.level == 0) {
+        return false;
+    }
+    ContentEncoding encoding = negotiateEncoding(req.get_header_value("Accept-Encoding"));
+    if (encoding == IDENTITY) {
+        return false;
+    }
+
+    string key = cacheKey(route, req, dataVersion.load(), encoding);
+    shared_ptr<const CompressedEntry> entry;
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        map<string, shared_ptr<const CompressedEntry> >::iterator it = cache.find(key);
+        if (it == cache.end()) {
+            return false;
+        }
+        entry = it->second;
+    }
+
+    res = response(entry->encoded);
+    if (!entry->contentType.empty()) {
+        res.set_header("Content-Type", entry->contentType);
+    }
+    res.set_header("Content-Encoding", encodingName(encoding));
+    res.set_header("Vary", "Accept-Encoding");
+    res.set_header("X-Change-Seq", entry->changeSeq);
+    recordCompression(true, entry->rawBytes, entry->encoded.size());
+    return true;
+}
+
+void compressResponse(int route, const request& req, unsigned long long version, response& res) {
+    if (compressionOptions.level == 0 || res.code != 200 || res.body.size() < compressionOptions.minBytes) {
+        return;
+    }
+    res.set_header("Vary", "Accept-Encoding");
+    ContentEncoding encoding = negotiateEncoding(req.get_header_value("Accept-Encoding"));
+    if (encoding == IDENTITY) {
+        return;
+    }
+
+    size_t rawBytes = res.body.size();
+    res.body = compressBody(res.body, encoding, compressionOptions.level);
+    res.set_header("Content-Encoding", encodingName(encoding));
+    recordCompression(false, rawBytes, res.body.size());
+
+    if (res.body.size() <= compressionOptions.cacheBytes) {
+        shared_ptr<CompressedEntry> entry = make_shared<CompressedEntry>();
+        entry->version = version;
+        entry->rawBytes = rawBytes;
+        entry->encoded = res.body;
+        entry->contentType = res.get_header_value("Content-Type");
+        entry->changeSeq = res.get_header_value("X-Change-Seq");
+        insertCompressed(cacheKey(route, req, version, encoding), entry);
+    }
+}
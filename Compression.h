@@ -0,0 +1,40 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+enum ContentEncoding { IDENTITY, GZIP, DEFLATE };
+
+struct CompressionOptions {
+    int level = 6;                     // zlib level 1-9; 0 turns compression off
+    size_t minBytes = 1024;            // Smaller bodies are sent as-is
+    size_t cacheBytes = 64 << 20;      // Budget for cached compressed list responses
+};
+
+extern CompressionOptions compressionOptions;
+
+// Consumes --compression-level=N, --compress-min-bytes=N or --compress-cache-mb=N
+bool parseCompressionFlag(const string& arg);
+
+// Best encoding allowed by an Accept-Encoding header; gzip wins ties
+ContentEncoding negotiateEncoding(const string& acceptEncoding);
+const char* encodingName(ContentEncoding encoding);
+
+// gzip or zlib-wrapped deflate (what HTTP calls "deflate")
+string compressBody(const string& body, ContentEncoding encoding, int level);
+
+// Answers a list GET from the compressed cache, before the handler runs, when
+// the same route, query and encoding were compressed at the current data version.
+// Sets the body, content headers and X-Change-Seq only; the caller adds the rest
+bool readCompressed(int route, const request& req, response& res);
+
+// Compresses a list GET response in place when the client accepts it and the body
+// is over the threshold, and caches the encoded bytes under version: the data
+// version the body was computed at
+void compressResponse(int route, const request& req, unsigned long long version, response& res);
+
+#endif
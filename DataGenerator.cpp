@@ -0,0 +1,183 @@
+#include "DataGenerator.h"
+
+#include <random>
+#include <cmath>
+
+static const char* GENRES[] = {
+    "Fiction", "Classic", "Mystery", "Fantasy", "Science Fiction", "Romance", "Thriller", "Historical Fiction",
+    "Dystopian", "Horror", "Biography", "Poetry", "Adventure", "Young Adult", "Non-Fiction", "Humor"
+};
+// Relative popularity of each genre above, heavy at the head like real catalogs
+static const double GENRE_WEIGHTS[] = {
+    18, 12, 11, 10, 9, 9, 8, 6, 4, 3, 3, 2, 2, 1.5, 1, 0.5
+};
+static const int GENRE_COUNT = sizeof(GENRES) / sizeof(GENRES[0]);
+
+static const char* FIRST_NAMES[] = {
+    "Alice", "Bob", "Carmen", "Dmitri", "Elena", "Farah", "George", "Hana", "Ibrahim", "Julia", "Kenji", "Lucia",
+    "Mateo", "Nadia", "Oscar", "Priya", "Quentin", "Rosa", "Samir", "Tara", "Umar", "Vera", "Wei", "Yusuf", "Zoe"
+};
+static const char* LAST_NAMES[] = {
+    "Yu", "Smith", "Garcia", "Ivanova", "Okafor", "Nguyen", "Kowalski", "Haddad", "Tanaka", "Silva", "Mensah",
+    "Larsen", "Moreau", "Patel", "Rossi", "Schmidt", "Kim", "Novak", "Fischer", "Costa"
+};
+static const char* TITLE_ADJECTIVES[] = {
+    "Silent", "Crimson", "Hidden", "Last", "Broken", "Golden", "Forgotten", "Distant", "Burning", "Hollow",
+    "Secret", "Winter", "Endless", "Quiet", "Wild", "Northern", "Glass", "Iron", "Paper", "Midnight"
+};
+static const char* TITLE_NOUNS[] = {
+    "Garden", "River", "Empire", "Letters", "Harbor", "Orchard", "Mirror", "Kingdom", "Station", "Archive",
+    "Lighthouse", "Forest", "Promise", "Voyage", "Crown", "Machine", "Island", "Witness", "Map", "Tide"
+};
+static const char* COMMENT_PHRASES[] = {
+    "The pacing drags in the middle but the ending makes up for it.",
+    "Wonderful characters and a setting I could not stop thinking about.",
+    "A thrilling read from start to finish!",
+    "The prose is beautiful, if a little slow.",
+    "I guessed the twist early, which spoiled the tension.",
+    "Perfect for a long weekend.",
+    "The dialogue felt stiff and the plot meandered.",
+    "An instant favourite; I have already recommended it to friends.",
+    "Clever structure and a satisfying mystery.",
+    "Too long by a hundred pages.",
+    "The world-building is rich and the magic system is original.",
+    "Not my usual genre, but I was pleasantly surprised.",
+    "Heartbreaking and hopeful at the same time.",
+    "The audiobook narration elevated it.",
+    "Solid but forgettable."
+};
+// Share of reviews giving 1..5 stars; real review sites skew positive
+static const double RATING_WEIGHTS[] = {5, 8, 17, 35, 35};
+
+template <typename T, size_t N>
+static const T& pick(const T (&values)[N], mt19937_64& rng) {
+    return values[uniform_int_distribution<size_t>(0, N - 1)(rng)];
+}
+
+// Skews toward low indices so a small head of books draws most reviews
+static int skewedIndex(int count, mt19937_64& rng) {
+    double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+    int index = (int)(count * pow(u, 2.5));
+    return index < count ? index : count - 1;
+}
+
+string makeIsbn13(long long serial) {
+    string digits = "978";
+    ostringstream ss;
+    ss << setfill('0') << setw(9) << serial % 1000000000LL;
+    digits += ss.str();
+
+    int sum = 0;
+    for (int i = 0; i < 12; i++) {
+        sum += (digits[i] - '0') * (i % 2 == 0 ? 1 : 3);
+    }
+    digits += (char)('0' + (10 - sum % 10) % 10);
+    return digits;
+}
+
+string formatEntityId(long long number, long long total) {
+    int width = 3;
+    for (long long limit = 1000; limit <= total; limit *= 10) {
+        width++;
+    }
+    ostringstream ss;
+    ss << setfill('0') << setw(width) << number;
+    return ss.str();
+}
+
+Dataset generateDataset(const DatasetSpec& spec) {
+    Dataset dataset;
+    mt19937_64 rng(spec.seed);
+    discrete_distribution<int> genreDist(GENRE_WEIGHTS, GENRE_WEIGHTS + GENRE_COUNT);
+    discrete_distribution<int> ratingDist(RATING_WEIGHTS, RATING_WEIGHTS + 5);
+
+    // Books: authors write several books each, mostly within one genre
+    int authorCount = spec.books / 6 > 0 ? spec.books / 6 : 1;
+    vector<string> authors;
+    vector<int> authorGenres;
+    for (int i = 0; i < authorCount; i++) {
+        authors.push_back(string(pick(FIRST_NAMES, rng)) + " " + pick(LAST_NAMES, rng) + " " + to_string(i + 1));
+        authorGenres.push_back(genreDist(rng));
+    }
+
+    vector<Book*> bookList;
+    vector<vector<Book*> > booksByGenre(GENRE_COUNT);
+    for (int i = 0; i < spec.books; i++) {
+        string id = formatEntityId(i + 1, spec.books);
+        int author = uniform_int_distribution<int>(0, authorCount - 1)(rng);
+        int genre = uniform_int_distribution<int>(0, 3)(rng) == 0 ? genreDist(rng) : authorGenres[author];
+        string title = string("The ") + pick(TITLE_ADJECTIVES, rng) + " " + pick(TITLE_NOUNS, rng);
+        if (i >= 400) {
+            title += " " + to_string(i / 400 + 1);
+        }
+
+        Book& book = dataset.books[id];
+        book = Book(id, title, authors[author], GENRES[genre], makeIsbn13(i + 1));
+        bookList.push_back(&book);
+        booksByGenre[genre].push_back(&book);
+    }
+
+    // Users: one to three distinct preferred genres
+    vector<User*> userList;
+    for (int i = 0; i < spec.users; i++) {
+        string id = formatEntityId(i + 1, spec.users);
+        string first = pick(FIRST_NAMES, rng);
+        string last = pick(LAST_NAMES, rng);
+        string email = toLower(first) + "." + toLower(last) + "." + to_string(i + 1) + "@example.com";
+
+        vector<string> preferences;
+        int preferenceCount = uniform_int_distribution<int>(1, 3)(rng);
+        while ((int)preferences.size() < preferenceCount) {
+            string genre = GENRES[genreDist(rng)];
+            if (find(preferences.begin(), preferences.end(), genre) == preferences.end()) {
+                preferences.push_back(genre);
+            }
+        }
+
+        User& user = dataset.users[id];
+        user = User(id, first + " " + last, email, preferences);
+        userList.push_back(&user);
+    }
+
+    // Reviews: any user, popularity-skewed book, positive-skewed rating
+    for (int i = 0; i < spec.reviews && !userList.empty() && !bookList.empty(); i++) {
+        string id = formatEntityId(i + 1, spec.reviews);
+        User& user = *userList[uniform_int_distribution<int>(0, (int)userList.size() - 1)(rng)];
+        Book& book = *bookList[skewedIndex((int)bookList.size(), rng)];
+
+        string comment = pick(COMMENT_PHRASES, rng);
+        int extra = uniform_int_distribution<int>(0, 2)(rng);
+        for (int j = 0; j < extra; j++) {
+            comment += string(" ") + pick(COMMENT_PHRASES, rng);
+        }
+
+        dataset.reviews[id] = Review(id, user, book, ratingDist(rng) + 1, comment);
+    }
+
+    // Recommendations: books in one of the user's preferred genres
+    int recCount = 0;
+    for (unsigned int i = 0; i < userList.size(); i++) {
+        User& user = *userList[i];
+        vector<string> preferences = user.getPreferences();
+        int given = 0;
+        for (unsigned int p = 0; p < preferences.size() && given < spec.maxRecommendationsPerUser; p++) {
+            int genre = (int)(find(GENRES, GENRES + GENRE_COUNT, preferences[p]) - GENRES);
+            vector<Book*>& candidates = booksByGenre[genre];
+            for (unsigned int b = 0; b < candidates.size() && given < spec.maxRecommendationsPerUser; b++) {
+                ostringstream ss;
+                ss << setfill('0') << setw(3) << ++recCount;
+                dataset.recommendations[ss.str()] = Recommendation(ss.str(), user, *candidates[b]);
+                given++;
+            }
+        }
+    }
+
+    return dataset;
+}
+
+void writeDataset(Dataset& dataset, string dir) {
+    saveBookToFile(dataset.books, dir + "/books.json");
+    saveUserToFile(dataset.users, dir + "/users.json");
+    saveReviewToFile(dataset.reviews, dir + "/reviews.json");
+    saveRecommendationToFile(dataset.recommendations, dir + "/recommendations.json");
+}
@@ -0,0 +1,42 @@
+#ifndef DATAGENERATOR_H
+#define DATAGENERATOR_H
+
+#include <string>
+#include <map>
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "Recommendation.h"
+
+using namespace std;
+
+struct DatasetSpec {
+    unsigned long long seed = 42;
+    int users = 10000;
+    int books = 5000;
+    int reviews = 50000;
+    // Recommendations follow the genre-match rule, capped per user so the
+    // set stays proportional to the user count at large scales
+    int maxRecommendationsPerUser = 10;
+};
+
+struct Dataset {
+    map<string, User> users;
+    map<string, Book> books;
+    map<string, Review> reviews;
+    map<string, Recommendation> recommendations;
+};
+
+// Deterministic for a given spec: the same seed always yields the same records
+Dataset generateDataset(const DatasetSpec& spec);
+
+// Writes books.json, users.json, reviews.json and recommendations.json into dir
+void writeDataset(Dataset& dataset, string dir);
+
+// Zero-padded numeric ID, at least three digits wide like the shipped data
+string formatEntityId(long long number, long long total);
+
+// Valid, distinct ISBN-13 per serial; book i of a dataset has serial i
+string makeIsbn13(long long serial);
+
+#endif
@@ -0,0 +1,496 @@
+#include "Facets.h"
+#include "Bitmap.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "ChangeLog.h"
+#include "Trace.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <unordered_map>
+
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+
+static const uint32_t NONE = UINT32_MAX;
+// Bitmap words (see Bitmap::scanCost) worth one matched row when counting:
+// a row is a cache miss into the slot table plus its share of a sort
+static const size_t ROW_COST = 128;
+
+static const char* BOOK_FACETS[] = {"genre", "author"};
+static const char* REVIEW_FACETS[] = {"genre", "author", "user", "rating"};
+
+struct Facet {
+    string name;
+    unordered_map<string, uint32_t> valueIds;
+    unordered_map<string, vector<uint32_t> > spellings; // Lowercased value to the value ids spelling it
+    vector<string> values;    // Kept once seen, even after the last slot leaves; a rebuild drops them
+    vector<Bitmap> slots;     // By value id
+    vector<uint32_t> valueOf; // By slot; NONE for free slots and empty values
+    size_t scanCost = 0;      // Of every bitmap together
+};
+
+struct FacetIndex {
+    vector<Facet> facets;
+    unordered_map<string, uint32_t> slotOf; // Entity id to slot
+    vector<uint32_t> freeSlots;
+};
+
+static bool ready = false;
+static bool listening = false;
+static FacetIndex bookFacets;
+static FacetIndex reviewFacets;
+static vector<ReviewStore::Position> reviewAt; // By slot, for ratedReviews
+
+static void resetIndex(FacetIndex& index, const char** names, size_t count, size_t expected) {
+    index.facets.assign(count, Facet());
+    for (size_t f = 0; f < count; f++) {
+        index.facets[f].name = names[f];
+        index.facets[f].valueOf.reserve(expected);
+    }
+    index.slotOf.clear();
+    index.slotOf.reserve(expected);
+    index.freeSlots.clear();
+}
+
+static void bookValues(Book& book, vector<string>& values) {
+    values.clear();
+    values.push_back(book.getGenre());
+    values.push_back(book.getAuthor());
+}
+
+// What filterKey=genre/author/user matches for reviews: the copies the review carries
+static void reviewValues(Review& review, vector<string>& values) {
+    Book book = review.getBook();
+    values.clear();
+    values.push_back(book.getGenre());
+    values.push_back(book.getAuthor());
+    values.push_back(review.getUser().getName());
+    values.push_back(to_string(review.getRating()));
+}
+
+static uint32_t internValue(Facet& facet, const string& value) {
+    if (value.empty()) {
+        return NONE;
+    }
+    unordered_map<string, uint32_t>::iterator known = facet.valueIds.find(value);
+    if (known != facet.valueIds.end()) {
+        return known->second;
+    }
+    uint32_t valueId = facet.values.size();
+    facet.valueIds[value] = valueId;
+    facet.spellings[toLower(value)].push_back(valueId);
+    facet.values.push_back(value);
+    facet.slots.push_back(Bitmap());
+    return valueId;
+}
+
+static void setValue(Facet& facet, uint32_t slot, const string& value) {
+    uint32_t valueId = internValue(facet, value);
+    uint32_t previous = facet.valueOf[slot];
+    if (previous == valueId) {
+        return;
+    }
+    if (previous != NONE) {
+        Bitmap& bitmap = facet.slots[previous];
+        facet.scanCost -= bitmap.scanCost();
+        bitmap.remove(slot);
+        facet.scanCost += bitmap.scanCost();
+    }
+    if (valueId != NONE) {
+        Bitmap& bitmap = facet.slots[valueId];
+        facet.scanCost -= bitmap.scanCost();
+        bitmap.add(slot);
+        facet.scanCost += bitmap.scanCost();
+    }
+    facet.valueOf[slot] = valueId;
+}
+
+static uint32_t place(FacetIndex& index, const string& id, const vector<string>& values) {
+    uint32_t slot;
+    unordered_map<string, uint32_t>::iterator known = index.slotOf.find(id);
+    if (known != index.slotOf.end()) {
+        slot = known->second;
+    } else if (!index.freeSlots.empty()) {
+        // Reusing freed slots keeps the numbering, and so the bitmaps, dense
+        slot = index.freeSlots.back();
+        index.freeSlots.pop_back();
+        index.slotOf[id] = slot;
+    } else {
+        slot = index.facets[0].valueOf.size();
+        for (unsigned int f = 0; f < index.facets.size(); f++) {
+            index.facets[f].valueOf.push_back(NONE);
+        }
+        index.slotOf[id] = slot;
+    }
+    for (unsigned int f = 0; f < index.facets.size(); f++) {
+        setValue(index.facets[f], slot, values[f]);
+    }
+    return slot;
+}
+
+static uint32_t unplace(FacetIndex& index, const string& id) {
+    unordered_map<string, uint32_t>::iterator known = index.slotOf.find(id);
+    if (known == index.slotOf.end()) {
+        return NONE;
+    }
+    uint32_t slot = known->second;
+    for (unsigned int f = 0; f < index.facets.size(); f++) {
+        setValue(index.facets[f], known->second, "");
+    }
+    index.freeSlots.push_back(slot);
+    index.slotOf.erase(known);
+    return slot;
+}
+
+void refreshFacets(const string& collection, const string& id, bool deleted) {
+    if (!ready) {
+        return;
+    }
+    vector<string> values;
+    if (collection == "books") {
+        map<string, Book>::iterator it = deleted ? bookMap.end() : bookMap.find(id);
+        if (it == bookMap.end()) {
+            unplace(bookFacets, id);
+        } else {
+            bookValues(it->second, values);
+            place(bookFacets, id, values);
+        }
+    } else if (collection == "reviews") {
+        ReviewStore::iterator it = deleted ? reviewMap.end() : reviewMap.find(id);
+        if (it == reviewMap.end()) {
+            uint32_t slot = unplace(reviewFacets, id);
+            if (slot != NONE) {
+                reviewAt[slot] = ReviewStore::Position();
+            }
+        } else {
+            reviewValues(it->second, values);
+            uint32_t slot = place(reviewFacets, id, values);
+            reviewAt.resize(max(reviewAt.size(), (size_t)slot + 1));
+            reviewAt[slot] = it.position();
+        }
+    }
+}
+
+static void followChange(const Change& change) {
+    // Writers update the map before they record the change
+    refreshFacets(change.collection, change.id, change.deleted);
+}
+
+// Numbers the slot like place, leaving the bitmaps to packBitmaps
+static void appendSlot(FacetIndex& index, const string& id, const vector<string>& values) {
+    index.slotOf[id] = index.facets[0].valueOf.size();
+    for (unsigned int f = 0; f < index.facets.size(); f++) {
+        index.facets[f].valueOf.push_back(internValue(index.facets[f], values[f]));
+    }
+}
+
+// Every value's bitmap from the slot table at once: slots are grouped by
+// value in one counting pass, so each group is packed with no per-slot insert
+static void packBitmaps(Facet& facet) {
+    vector<uint32_t> offsets(facet.values.size() + 1, 0);
+    for (size_t slot = 0; slot < facet.valueOf.size(); slot++) {
+        if (facet.valueOf[slot] != NONE) {
+            offsets[facet.valueOf[slot] + 1]++;
+        }
+    }
+    for (size_t v = 0; v < facet.values.size(); v++) {
+        offsets[v + 1] += offsets[v];
+    }
+    vector<uint32_t> grouped(offsets.back());
+    vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t slot = 0; slot < facet.valueOf.size(); slot++) {
+        if (facet.valueOf[slot] != NONE) {
+            grouped[next[facet.valueOf[slot]]++] = slot;
+        }
+    }
+    facet.scanCost = 0;
+    for (size_t v = 0; v < facet.values.size(); v++) {
+        facet.slots[v] = Bitmap::fromSorted(grouped.data() + offsets[v], offsets[v + 1] - offsets[v]);
+        facet.scanCost += facet.slots[v].scanCost();
+    }
+}
+
+void rebuildFacets() {
+    TraceSpan span("rebuildFacets");
+    resetIndex(bookFacets, BOOK_FACETS, sizeof(BOOK_FACETS) / sizeof(BOOK_FACETS[0]), bookMap.size());
+    resetIndex(reviewFacets, REVIEW_FACETS, sizeof(REVIEW_FACETS) / sizeof(REVIEW_FACETS[0]), reviewMap.size());
+    vector<string> values;
+    for (map<string, Book>::iterator it = bookMap.begin(); it != bookMap.end(); ++it) {
+        bookValues(it->second, values);
+        appendSlot(bookFacets, it->first, values);
+    }
+    reviewAt.clear();
+    reviewAt.reserve(reviewMap.size());
+    for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end(); ++it) {
+        reviewValues(it->second, values);
+        appendSlot(reviewFacets, it->first, values);
+        reviewAt.push_back(it.position());
+    }
+    FacetIndex* indexes[] = {&bookFacets, &reviewFacets};
+    for (unsigned int i = 0; i < 2; i++) {
+        for (unsigned int f = 0; f < indexes[i]->facets.size(); f++) {
+            packBitmaps(indexes[i]->facets[f]);
+        }
+    }
+    ready = true;
+    if (!listening) {
+        addChangeListener(followChange);
+        listening = true;
+    }
+}
+
+bool facetsReady() {
+    return ready;
+}
+
+// The slots a plain filterKey=genre, author or user list matched (the filters
+// compare without case), read from the bitmaps instead of looked up by id
+static bool filterSlots(const FacetIndex& index, const request& req, vector<uint32_t>& matched) {
+    const char* key = req.url_params.get("filterKey");
+    const char* value = req.url_params.get("filterValue");
+    if (req.url_params.get("search") || req.url_params.get("sort") || req.url_params.get("minRating") ||
+        req.url_params.get("maxRating") || !key || !value || !*value ||
+        (string(key) != "genre" && string(key) != "author" && string(key) != "user")) {
+        return false;
+    }
+    for (unsigned int f = 0; f < index.facets.size(); f++) {
+        const Facet& facet = index.facets[f];
+        if (facet.name != key) {
+            continue;
+        }
+        unordered_map<string, vector<uint32_t> >::const_iterator spelled = facet.spellings.find(toLower(value));
+        if (spelled == facet.spellings.end()) {
+            return true;
+        }
+        vector<uint32_t> slots;
+        for (unsigned int i = 0; i < spelled->second.size(); i++) {
+            facet.slots[spelled->second[i]].values(slots);
+            matched.insert(matched.end(), slots.begin(), slots.end());
+        }
+        if (spelled->second.size() > 1) {
+            sort(matched.begin(), matched.end());
+        }
+        return true;
+    }
+    return false;
+}
+
+// Nonzero counts by value id of one facet. Bitmaps are intersected when that
+// reads fewer words than looking up each matched slot would cost.
+static void countFacet(const Facet& facet, const vector<uint32_t>* matched, const Bitmap* selection,
+                       vector<pair<uint32_t, size_t> >& counts) {
+    counts.clear();
+    if (!matched) {
+        for (uint32_t v = 0; v < facet.slots.size(); v++) {
+            if (facet.slots[v].cardinality() > 0) {
+                counts.push_back(make_pair(v, facet.slots[v].cardinality()));
+            }
+        }
+        return;
+    }
+    if (matched->size() * ROW_COST < facet.scanCost) {
+        vector<uint32_t> seen;
+        seen.reserve(matched->size());
+        for (unsigned int i = 0; i < matched->size(); i++) {
+            uint32_t value = facet.valueOf[(*matched)[i]];
+            if (value != NONE) {
+                seen.push_back(value);
+            }
+        }
+        sort(seen.begin(), seen.end());
+        for (size_t i = 0; i < seen.size();) {
+            size_t run = i + 1;
+            while (run < seen.size() && seen[run] == seen[i]) {
+                run++;
+            }
+            counts.push_back(make_pair(seen[i], run - i));
+            i = run;
+        }
+        return;
+    }
+    for (uint32_t v = 0; v < facet.slots.size(); v++) {
+        if (facet.slots[v].cardinality() == 0) {
+            continue;
+        }
+        size_t count = selection->andCardinality(facet.slots[v]);
+        if (count > 0) {
+            counts.push_back(make_pair(v, count));
+        }
+    }
+}
+
+response facetedList(const string& collection, const request& req, const string& items, const vector<string>* ids) {
+    FacetIndex* index = collection == "books" ? &bookFacets : collection == "reviews" ? &reviewFacets : nullptr;
+    const char* facetsParam = req.url_params.get("facets");
+    const char* limitParam = req.url_params.get("facetLimit");
+    if (!index || !facetsParam) {
+        return response(400, "facets is required");
+    }
+    size_t limit = DEFAULT_FACET_VALUES;
+    if (limitParam) {
+        int parsed = atoi(limitParam);
+        if (parsed < 1 || parsed > (int)MAX_FACET_VALUES) {
+            return response(400, "facetLimit must be between 1 and " + to_string(MAX_FACET_VALUES));
+        }
+        limit = parsed;
+    }
+    if (!ready) {
+        return response(503, "Facet index is not built");
+    }
+
+    // Requested facets in order, each once
+    vector<const Facet*> requested;
+    string names = facetsParam;
+    for (size_t start = 0; start <= names.size();) {
+        size_t comma = names.find(',', start);
+        if (comma == string::npos) {
+            comma = names.size();
+        }
+        string name = names.substr(start, comma - start);
+        start = comma + 1;
+        if (name.empty()) {
+            continue;
+        }
+        const Facet* facet = nullptr;
+        for (unsigned int f = 0; f < index->facets.size(); f++) {
+            if (index->facets[f].name == name) {
+                facet = &index->facets[f];
+            }
+        }
+        if (!facet) {
+            return response(400, "Unknown facet " + name + " for " + collection);
+        }
+        if (find(requested.begin(), requested.end(), facet) == requested.end()) {
+            requested.push_back(facet);
+        }
+    }
+
+    TraceSpan span("facet counts");
+    vector<uint32_t> matched;
+    if (ids && !filterSlots(*index, req, matched)) {
+        matched.reserve(ids->size());
+        for (unsigned int i = 0; i < ids->size(); i++) {
+            unordered_map<string, uint32_t>::iterator known = index->slotOf.find((*ids)[i]);
+            if (known != index->slotOf.end()) {
+                matched.push_back(known->second);
+            }
+        }
+        sort(matched.begin(), matched.end());
+    }
+    Bitmap selection;
+    bool selectionBuilt = false;
+
+    string json = "{\"items\":" + items + ",\"facets\":{";
+    vector<pair<uint32_t, size_t> > counts;
+    for (unsigned int r = 0; r < requested.size(); r++) {
+        const Facet& facet = *requested[r];
+        if (ids && !selectionBuilt && matched.size() * ROW_COST >= facet.scanCost) {
+            selection = Bitmap::fromSorted(matched.data(), matched.size());
+            selectionBuilt = true;
+        }
+        countFacet(facet, ids ? &matched : nullptr, &selection, counts);
+
+        // Most frequent first, then by value
+        auto before = [&](const pair<uint32_t, size_t>& a, const pair<uint32_t, size_t>& b) {
+            return a.second != b.second ? a.second > b.second : facet.values[a.first] < facet.values[b.first];
+        };
+        size_t shown = min(limit, counts.size());
+        partial_sort(counts.begin(), counts.begin() + shown, counts.end(), before);
+
+        if (r > 0) {
+            json += ',';
+        }
+        json += json::wvalue(facet.name).dump() + ":[";
+        for (size_t i = 0; i < shown; i++) {
+            if (i > 0) {
+                json += ',';
+            }
+            json += "{\"value\":" + json::wvalue(facet.values[counts[i].first]).dump() +
+                    ",\"count\":" + to_string(counts[i].second) + "}";
+        }
+        json += ']';
+    }
+    json += "}}";
+    return response(json);
+}
+
+bool ratedReviews(int minRating, int maxRating, const char* filterKey, const char* filterValue,
+                  vector<ReviewStore::Position>& reviews) {
+    if (!ready) {
+        return false;
+    }
+    const Facet* ratings = nullptr;
+    const Facet* filter = nullptr;
+    for (unsigned int f = 0; f < reviewFacets.facets.size(); f++) {
+        const Facet& facet = reviewFacets.facets[f];
+        if (facet.name == "rating") {
+            ratings = &facet;
+        } else if (filterKey && facet.name == filterKey) {
+            filter = &facet;
+        }
+    }
+    // Empty values are not indexed
+    if (filterKey && (!filter || !*filterValue)) {
+        return false;
+    }
+
+    TraceSpan span("ratedReviews");
+    vector<uint32_t> inRange;
+    for (uint32_t v = 0; v < ratings->values.size(); v++) {
+        int rating = atoi(ratings->values[v].c_str());
+        if (rating >= minRating && rating <= maxRating && ratings->slots[v].cardinality() > 0) {
+            inRange.push_back(v);
+        }
+    }
+    // A slot has one rating and one value per facet, so the pieces never overlap
+    vector<uint32_t> slots, part;
+    if (!filter) {
+        for (unsigned int r = 0; r < inRange.size(); r++) {
+            ratings->slots[inRange[r]].values(part);
+            slots.insert(slots.end(), part.begin(), part.end());
+        }
+    } else {
+        unordered_map<string, vector<uint32_t> >::const_iterator spelled = filter->spellings.find(toLower(filterValue));
+        for (unsigned int i = 0; spelled != filter->spellings.end() && i < spelled->second.size(); i++) {
+            for (unsigned int r = 0; r < inRange.size(); r++) {
+                filter->slots[spelled->second[i]].andValues(ratings->slots[inRange[r]], slots);
+            }
+        }
+    }
+
+    // In id order, like filterReviews. Slots are numbered in id order by a
+    // rebuild, so the string sort is only needed once writes have mixed them.
+    sort(slots.begin(), slots.end());
+    reviews.clear();
+    reviews.reserve(slots.size());
+    for (unsigned int i = 0; i < slots.size(); i++) {
+        reviews.push_back(reviewAt[slots[i]]);
+    }
+    auto byId = [](ReviewStore::Position a, ReviewStore::Position b) { return a->first < b->first; };
+    if (!is_sorted(reviews.begin(), reviews.end(), byId)) {
+        sort(reviews.begin(), reviews.end(), byId);
+    }
+    return true;
+}
+
+FacetStats getFacetStats() {
+    FacetStats stats = {0, 0, 0};
+    FacetIndex* indexes[] = {&bookFacets, &reviewFacets};
+    for (unsigned int i = 0; i < 2; i++) {
+        for (unsigned int f = 0; f < indexes[i]->facets.size(); f++) {
+            const Facet& facet = indexes[i]->facets[f];
+            for (unsigned int v = 0; v < facet.slots.size(); v++) {
+                if (facet.slots[v].cardinality() > 0) {
+                    stats.values++;
+                }
+                stats.containers += facet.slots[v].containerCount();
+                stats.bytes += facet.slots[v].bytes() + facet.values[v].capacity();
+            }
+            stats.bytes += facet.valueOf.capacity() * sizeof(uint32_t);
+        }
+    }
+    return stats;
+}
@@ -0,0 +1,50 @@
+#ifndef FACETS_H
+#define FACETS_H
+
+#include <string>
+#include <vector>
+#include <crow.h>
+#include "ReviewStore.h"
+
+using namespace std;
+using namespace crow;
+
+// Facet counts for GET /api/books and /api/reviews with facets=. Every book
+// and review has a slot number, and each facet value keeps a compressed bitmap
+// of the slots that carry it: books by genre and author, reviews by their
+// book's genre and author, by reviewer name and by rating. Follows the change
+// log; written under the exclusive data lock, read under the shared one.
+static const size_t DEFAULT_FACET_VALUES = 10;
+static const size_t MAX_FACET_VALUES = 1000;
+
+struct FacetStats {
+    size_t values;     // Distinct values over every facet
+    size_t containers; // Bitmap groups
+    size_t bytes;      // Bitmaps and slot tables
+};
+
+// Indexes bookMap and reviewMap from scratch and starts following the change
+// log. Call before the server threads start, or with the exclusive lock.
+void rebuildFacets();
+bool facetsReady();
+
+// Re-reads one book or review from the maps; for writers that bypass the
+// change log (replication). Exclusive lock held.
+void refreshFacets(const string& collection, const string& id, bool deleted);
+
+// {"items":<items>,"facets":{"genre":[{"value":"Fantasy","count":12},...],...}}
+// for a list handler whose request has facets=. Each facet lists its top
+// facetLimit values among the matched entities, most frequent first.
+// ids are what the list matched, or null when it is the whole collection.
+response facetedList(const string& collection, const request& req, const string& items, const vector<string>* ids);
+
+// GET /api/reviews?minRating=&maxRating=: the reviews rated within the bounds,
+// narrowed to a filterKey of genre, author or user when one is given, from
+// the rating bitmaps intersected with the filter value's, as store positions
+// in id order. False when the index cannot answer, and the caller scans instead.
+bool ratedReviews(int minRating, int maxRating, const char* filterKey, const char* filterValue,
+                  vector<ReviewStore::Position>& reviews);
+
+FacetStats getFacetStats();
+
+#endif
@@ -0,0 +1,59 @@
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "Recommendation.h"
+#include "Serialize.h"
+
+#include <cstdint>
+#include <cstdlib>
+
+// libFuzzer target for the JSON reader and writer (make fuzz). Each input is
+// read as every entity's request body and as a load file. Rejections must be
+// a 400 or 413 with a message; an accepted entity must write out text that
+// reads back to the same bytes.
+
+template <typename T>
+static string writeOut(T& entity) {
+    string out;
+    writeJsonFields(out, entity);
+    return out;
+}
+
+template <typename T>
+static void checkBody(const string& text) {
+    T entity;
+    unsigned seen;
+    response error;
+    if (!readJsonBody(text, entity, jsonRequiredFields<T>(), &seen, error)) {
+        if ((error.code != 400 && error.code != 413) || error.body.empty()) {
+            abort();
+        }
+        return;
+    }
+    string written = writeOut(entity);
+    T again;
+    if (!readJson(written, again) || writeOut(again) != written) {
+        abort();
+    }
+}
+
+template <typename T>
+static void checkFile(const uint8_t* data, size_t size) {
+    // Straight over the input bytes, so reading past the end is caught
+    JsonReader in((const char*)data, (const char*)data + size);
+    bool read = readJsonArray<T>(in, [](T& entity) { writeOut(entity); });
+    if (!read && in.error().empty()) {
+        abort();
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    string text((const char*)data, size);
+    checkBody<Book>(text);
+    checkBody<User>(text);
+    checkBody<Review>(text);
+    checkBody<Recommendation>(text);
+    checkFile<Book>(data, size);
+    checkFile<Review>(data, size);
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "HttpClient.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+HttpConnection::HttpConnection(string host, int port) : host(host), port(port), fd(-1) {}
+
+HttpConnection::~HttpConnection() {
+    close();
+}
+
+void HttpConnection::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    buffer.clear();
+}
+
+bool HttpConnection::connect() {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0) {
+        return false;
+    }
+
+    fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0 && ::connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+}
+
+bool HttpConnection::sendAll(const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+bool HttpConnection::fill() {
+    char chunk[16384];
+    ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+        return false;
+    }
+    buffer.append(chunk, n);
+    return true;
+}
+
+bool HttpConnection::readResponse(HttpResponse& out) {
+    size_t headerEnd;
+    while ((headerEnd = buffer.find("\r\n\r\n")) == string::npos) {
+        if (!fill()) {
+            return false;
+        }
+    }
+
+    out = HttpResponse();
+    string head = buffer.substr(0, headerEnd);
+    size_t lineEnd = head.find("\r\n");
+    string statusLine = head.substr(0, lineEnd);
+    size_t space = statusLine.find(' ');
+    if (space == string::npos) {
+        return false;
+    }
+    out.status = atoi(statusLine.c_str() + space + 1);
+
+    size_t pos = lineEnd == string::npos ? head.size() : lineEnd + 2;
+    while (pos < head.size()) {
+        size_t next = head.find("\r\n", pos);
+        if (next == string::npos) {
+            next = head.size();
+        }
+        string line = head.substr(pos, next - pos);
+        size_t colon = line.find(':');
+        if (colon != string::npos) {
+            string key = line.substr(0, colon);
+            for (unsigned int i = 0; i < key.size(); i++) {
+                key[i] = tolower(key[i]);
+            }
+            size_t valueStart = line.find_first_not_of(' ', colon + 1);
+            out.headers[key] = valueStart == string::npos ? "" : line.substr(valueStart);
+        }
+        pos = next + 2;
+    }
+    buffer.erase(0, headerEnd + 4);
+
+    if (out.headers.count("transfer-encoding") && out.headers["transfer-encoding"].find("chunked") != string::npos) {
+        while (true) {
+            size_t sizeEnd;
+            while ((sizeEnd = buffer.find("\r\n")) == string::npos) {
+                if (!fill()) {
+                    return false;
+                }
+            }
+            size_t chunkSize = strtoul(buffer.c_str(), nullptr, 16);
+            while (buffer.size() < sizeEnd + 2 + chunkSize + 2) {
+                if (!fill()) {
+                    return false;
+                }
+            }
+            out.body.append(buffer, sizeEnd + 2, chunkSize);
+            buffer.erase(0, sizeEnd + 2 + chunkSize + 2);
+            if (chunkSize == 0) {
+                return true;
+            }
+        }
+    }
+
+    size_t length = out.headers.count("content-length") ? strtoul(out.headers["content-length"].c_str(), nullptr, 10) : 0;
+    while (buffer.size() < length) {
+        if (!fill()) {
+            return false;
+        }
+    }
+    out.body = buffer.substr(0, length);
+    buffer.erase(0, length);
+
+    if (out.headers.count("connection") && out.headers["connection"] == "close") {
+        close();
+    }
+    return true;
+}
+
+string HttpConnection::format(const string& method, const string& target, const string& body,
+                              const vector<pair<string, string> >& headers) {
+    string message = method + " " + target + " HTTP/1.1\r\nHost: " + host + ":" + to_string(port) + "\r\n";
+    for (unsigned int i = 0; i < headers.size(); i++) {
+        message += headers[i].first + ": " + headers[i].second + "\r\n";
+    }
+    if (!body.empty() || method == "POST" || method == "PUT") {
+        message += "Content-Type: application/json\r\nContent-Length: " + to_string(body.size()) + "\r\n";
+    }
+    message += "\r\n" + body;
+    return message;
+}
+
+bool HttpConnection::send(const string& method, const string& target, const string& body,
+                          const vector<pair<string, string> >& headers) {
+    if (fd < 0 && !connect()) {
+        return false;
+    }
+    return sendAll(format(method, target, body, headers));
+}
+
+bool HttpConnection::receive(HttpResponse& out) {
+    return fd >= 0 && readResponse(out);
+}
+
+bool HttpConnection::request(const string& method, const string& target, const string& body, HttpResponse& out,
+                             const vector<pair<string, string> >& headers) {
+    string message = format(method, target, body, headers);
+
+    // A kept-alive connection may have been closed by the server while idle
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool fresh = fd < 0;
+        if (fresh && !connect()) {
+            return false;
+        }
+        if (sendAll(message) && readResponse(out)) {
+            return true;
+        }
+        close();
+        if (fresh) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool parseHostPort(const string& value, string& host, int& port) {
+    size_t colon = value.rfind(':');
+    if (colon == string::npos) {
+        return false;
+    }
+    host = value.substr(0, colon);
+    port = atoi(value.c_str() + colon + 1);
+    return !host.empty() && port > 0;
+}
@@ -0,0 +1,50 @@
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <string>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+struct HttpResponse {
+    int status = 0;
+    map<string, string> headers; // Keys are lower-cased
+    string body;
+};
+
+// Blocking HTTP/1.1 client over one keep-alive connection.
+// Reconnects once if the server closed the idle connection.
+class HttpConnection {
+public:
+    HttpConnection(string host, int port);
+    ~HttpConnection();
+
+    bool request(const string& method, const string& target, const string& body, HttpResponse& out,
+                 const vector<pair<string, string> >& headers = {});
+    void close();
+
+    // The two halves of request(), so one caller can have requests in flight on
+    // several connections at once. No retry: on failure, close() and fall back to request().
+    bool send(const string& method, const string& target, const string& body,
+              const vector<pair<string, string> >& headers = {});
+    bool receive(HttpResponse& out);
+
+private:
+    string format(const string& method, const string& target, const string& body,
+                  const vector<pair<string, string> >& headers);
+    bool connect();
+    bool sendAll(const string& data);
+    bool readResponse(HttpResponse& out);
+    bool fill();
+
+    string host;
+    int port;
+    int fd;
+    string buffer;
+};
+
+// Splits "host:port"; returns false when the port is missing or invalid
+bool parseHostPort(const string& value, string& host, int& port);
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <string>
+#include <chrono>
+#include <crow.h>
+#include "Metrics.h"
+#include "Trace.h"
+#include "AdmissionControl.h"
+#include "SingleFlight.h"
+#include "Compression.h"
+#include "ChangeLog.h"
+#include "Replication.h"
+#include "ListSnapshot.h"
+#include "Startup.h"
+#include "Recommendation.h"
+
+using namespace std;
+using namespace crow;
+
+// Route wrappers that time a handler, count its status code, open its trace root,
+// pass admission control (not for list snapshots) and take the data lock (shared for GET, exclusive otherwise).
+// On a read replica, writes are redirected to the primary instead. Until startup
+// loading is done, every route answers 503.
+// List GETs are coalesced with identical in-flight requests first, served from
+// the compressed cache or the published list snapshot when they can be instead
+// of under the lock, and compressed after the lock is released. Recommendation
+// freshness headers are set again on responses the handler did not build.
+inline auto instrument(string method, string path, response (*handler)(request)) {
+    int route = registerRoute(method, path);
+    configureAdmission(route, method, path);
+    const char* traceName = internTraceName(method + " " + path);
+    bool exclusive = method != "GET";
+    bool recommendations = path == "/api/recommendations";
+    return [route, path, traceName, exclusive, recommendations, handler](const request& req) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        TraceRoot trace(traceName);
+        if (exclusive && isReadOnlyReplica()) {
+            response res;
+            fillReadOnlyResponse(res, req.raw_url);
+            recordRequest(route, res.code, start);
+            return res;
+        }
+        if (isLoading()) {
+            response res;
+            fillLoadingResponse(res);
+            recordRequest(route, res.code, start);
+            return res;
+        }
+        auto run = [&]() {
+            response res;
+            // Compressed at this data version already: the handler need not run
+            if (!exclusive && readCompressed(route, req, res)) {
+                if (recommendations) {
+                    setRecommendationStatusHeaders(res);
+                }
+                return res;
+            }
+            unsigned long long version = 0;
+            // A published snapshot is served without the lock, so it is not admission limited
+            if (exclusive || !readListSnapshot(path, req, res, version)) {
+                AdmissionTicket ticket(route);
+                if (!ticket.admitted()) {
+                    fillShedResponse(res);
+                    return res;
+                }
+                DataLock lock(exclusive);
+                version = dataVersion.load();
+                res = handler(req);
+                if (!exclusive) {
+                    // Lets a client that re-downloads a list resume the change feed from here
+                    res.set_header("X-Change-Seq", to_string(latestChangeSeq()));
+                }
+            } else if (recommendations) {
+                setRecommendationStatusHeaders(res);
+            }
+            if (!exclusive) {
+                compressResponse(route, req, version, res);
+            }
+            return res;
+        };
+        response res = exclusive ? run() : coalesce(route, req, run);
+        recordRequest(route, res.code, start);
+        return res;
+    };
+}
+
+inline auto instrument(string method, string path, response (*handler)(string)) {
+    int route = registerRoute(method, path);
+    configureAdmission(route, method, path);
+    const char* traceName = internTraceName(method + " " + path);
+    bool exclusive = method != "GET";
+    return [route, path, traceName, exclusive, handler](string id) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        TraceRoot trace(traceName);
+        if (exclusive && isReadOnlyReplica()) {
+            response res;
+            fillReadOnlyResponse(res, path.substr(0, path.find("<id>")) + id);
+            recordRequest(route, res.code, start);
+            return res;
+        }
+        if (isLoading()) {
+            response res;
+            fillLoadingResponse(res);
+            recordRequest(route, res.code, start);
+            return res;
+        }
+        AdmissionTicket ticket(route);
+        if (!ticket.admitted()) {
+            response res;
+            fillShedResponse(res);
+            recordRequest(route, res.code, start);
+            return res;
+        }
+        DataLock lock(exclusive);
+        response res = handler(id);
+        recordRequest(route, res.code, start);
+        return res;
+    };
+}
+
+inline auto instrument(string method, string path, void (*handler)(request, response&, string)) {
+    int route = registerRoute(method, path);
+    configureAdmission(route, method, path);
+    const char* traceName = internTraceName(method + " " + path);
+    bool exclusive = method != "GET";
+    return [route, traceName, exclusive, handler](const request& req, response& res, string id) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        TraceRoot trace(traceName);
+        if (exclusive && isReadOnlyReplica()) {
+            fillReadOnlyResponse(res, req.raw_url);
+            recordRequest(route, res.code, start);
+            res.end();
+            return;
+        }
+        if (isLoading()) {
+            fillLoadingResponse(res);
+            recordRequest(route, res.code, start);
+            res.end();
+            return;
+        }
+        AdmissionTicket ticket(route);
+        if (!ticket.admitted()) {
+            fillShedResponse(res);
+            recordRequest(route, res.code, start);
+            res.end();
+            return;
+        }
+        DataLock lock(exclusive);
+        handler(req, res, id);
+        recordRequest(route, res.code, start);
+    };
+}
+
+#endif
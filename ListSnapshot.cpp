@@ -0,0 +1,415 @@
+#include "ListSnapshot.h"
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "Recommendation.h"
+#include "Trace.h"
+
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <map>
+#include <memory>
+
+extern map<string, User> userMap;
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+extern map<string, Recommendation> recommendationMap;
+extern atomic<unsigned long long> dataVersion;
+
+static const size_t CHUNK_ENTRIES = 256;     // Entries per chunk when one is (re)built
+static const size_t MAX_CHUNK_ENTRIES = 512; // A chunk grown past this is split
+static const int MAX_READERS = 256;          // Reader threads beyond this fall back to the lock
+
+enum Collection { BOOKS, USERS, REVIEWS, RECOMMENDATIONS, COLLECTION_COUNT };
+static const char* COLLECTION_NAMES[COLLECTION_COUNT] = {"books", "users", "reviews", "recommendations"};
+static const char* COLLECTION_PATHS[COLLECTION_COUNT] = {"/api/books", "/api/users", "/api/reviews", "/api/recommendations"};
+
+typedef vector<pair<string, shared_ptr<const string> > > Entries; // id, JSON fragment
+
+// A run of consecutive entries, sorted by id like the maps. Immutable once
+// published and shared by every version that did not touch it. The fragments
+// are the entities' own cached JSON, so a version adds no copy of it.
+struct Chunk {
+    Entries entries;
+    size_t bytes = 0; // Sum of fragment sizes
+};
+
+struct Version {
+    vector<const Chunk*> chunks;
+    size_t count = 0;
+    size_t bytes = 0;
+};
+
+// A superseded version and the chunks it alone referenced
+struct Retired {
+    unsigned long long epoch;
+    const Version* version;
+    vector<const Chunk*> chunks;
+};
+
+// Epoch of the scan a reader thread is in, 0 when idle
+struct alignas(64) ReaderSlot {
+    atomic<unsigned long long> epoch{0};
+    atomic<bool> taken{false};
+};
+
+static bool snapshotsEnabled = true;
+static atomic<bool> running(false);
+static bool listening = false;
+static atomic<const Version*> current[COLLECTION_COUNT];
+static atomic<unsigned long long> publishedSeq(0); // Change log position the current versions reflect
+static atomic<unsigned long long> publishedVersion(0); // Data version they reflect
+static vector<Change> staged[COLLECTION_COUNT]; // Guarded by the exclusive data lock
+
+static atomic<unsigned long long> globalEpoch(1);
+static ReaderSlot readers[MAX_READERS];
+static deque<Retired> retired; // Guarded by the exclusive data lock
+static atomic<size_t> retiredCount(0);
+static atomic<unsigned long long> published(0);
+static atomic<unsigned long long> snapshotReads(0);
+
+struct ReaderSlotHandle {
+    int index = -1;
+    ~ReaderSlotHandle() {
+        if (index >= 0) {
+            readers[index].taken.store(false, memory_order_release);
+        }
+    }
+};
+
+static ReaderSlot* claimReaderSlot() {
+    thread_local ReaderSlotHandle handle;
+    if (handle.index < 0) {
+        for (int i = 0; i < MAX_READERS; i++) {
+            bool expected = false;
+            if (!readers[i].taken.load(memory_order_relaxed) && readers[i].taken.compare_exchange_strong(expected, true)) {
+                handle.index = i;
+                break;
+            }
+        }
+        if (handle.index < 0) {
+            return nullptr;
+        }
+    }
+    return &readers[handle.index];
+}
+
+static int collectionIndex(const string& name) {
+    for (int c = 0; c < COLLECTION_COUNT; c++) {
+        if (name == COLLECTION_NAMES[c]) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static void stageChange(const Change& change) {
+    if (!running.load(memory_order_relaxed)) {
+        return;
+    }
+    int c = collectionIndex(change.collection);
+    if (c >= 0 && current[c].load(memory_order_relaxed)) {
+        staged[c].push_back(change);
+    }
+}
+
+// Cuts a sorted run into chunks of CHUNK_ENTRIES
+static void appendChunks(Entries& entries, vector<const Chunk*>& out) {
+    for (size_t first = 0; first < entries.size(); first += CHUNK_ENTRIES) {
+        size_t last = min(entries.size(), first + CHUNK_ENTRIES);
+        Chunk* chunk = new Chunk;
+        chunk->entries.reserve(last - first);
+        for (size_t i = first; i < last; i++) {
+            chunk->bytes += entries[i].second->size();
+            chunk->entries.push_back(move(entries[i]));
+        }
+        out.push_back(chunk);
+    }
+}
+
+template <typename M>
+static Version* versionOf(M& data) {
+    Entries entries;
+    entries.reserve(data.size());
+    for (typename M::iterator it = data.begin(); it != data.end(); ++it) {
+        entries.push_back(make_pair(it->first, it->second.getSharedJsonFragment()));
+    }
+    Version* version = new Version;
+    version->count = entries.size();
+    appendChunks(entries, version->chunks);
+    for (unsigned int i = 0; i < version->chunks.size(); i++) {
+        version->bytes += version->chunks[i]->bytes;
+    }
+    return version;
+}
+
+template <typename M>
+static shared_ptr<const string> sharedFragment(M& data, const Change& change) {
+    typename M::iterator it = data.find(change.id);
+    if (it == data.end()) {
+        return make_shared<const string>(change.fragment);
+    }
+    return it->second.getSharedJsonFragment();
+}
+
+// An upserted entity's fragment as the maps hold it after the commit
+static shared_ptr<const string> sharedFragment(int c, const Change& change) {
+    switch (c) {
+    case BOOKS:
+        return sharedFragment(bookMap, change);
+    case USERS:
+        return sharedFragment(userMap, change);
+    case REVIEWS:
+        return sharedFragment(reviewMap, change);
+    default:
+        return sharedFragment(recommendationMap, change);
+    }
+}
+
+// Merges one chunk with the changes that fall into its id range
+static void mergeChunk(int c, const Chunk* chunk, map<string, const Change*>::iterator first,
+                       map<string, const Change*>::iterator last, Entries& merged) {
+    static const Entries none;
+    const Entries& entries = chunk ? chunk->entries : none;
+    Entries::const_iterator entry = entries.begin();
+    while (entry != entries.end() || first != last) {
+        if (first == last || (entry != entries.end() && entry->first < first->first)) {
+            merged.push_back(*entry);
+            ++entry;
+            continue;
+        }
+        if (entry != entries.end() && entry->first == first->first) {
+            ++entry;
+        }
+        if (!first->second->deleted) {
+            merged.push_back(make_pair(first->first, sharedFragment(c, *first->second)));
+        }
+        ++first;
+    }
+}
+
+// New version of one collection sharing every chunk the staged changes missed
+static void publishCollection(int c, unsigned long long epoch) {
+    if (staged[c].empty()) {
+        return;
+    }
+    // Several changes to one id in a commit (a cascade) collapse to the last
+    map<string, const Change*> changes;
+    for (unsigned int i = 0; i < staged[c].size(); i++) {
+        changes[staged[c][i].id] = &staged[c][i];
+    }
+
+    const Version* old = current[c].load(memory_order_relaxed);
+    Version* next = new Version;
+    Retired superseded;
+    superseded.version = old;
+
+    map<string, const Change*>::iterator change = changes.begin();
+    size_t chunkCount = max((size_t)1, old->chunks.size());
+    for (size_t i = 0; i < chunkCount; i++) {
+        const Chunk* chunk = i < old->chunks.size() ? old->chunks[i] : nullptr;
+        // Changes before the next chunk's first id belong to this one
+        map<string, const Change*>::iterator end = i + 1 < old->chunks.size()
+            ? changes.lower_bound(old->chunks[i + 1]->entries.front().first)
+            : changes.end();
+        if (change == end) {
+            next->chunks.push_back(chunk);
+            continue;
+        }
+        Entries merged;
+        mergeChunk(c, chunk, change, end, merged);
+        change = end;
+        if (chunk) {
+            superseded.chunks.push_back(chunk);
+        }
+        if (merged.size() <= MAX_CHUNK_ENTRIES && !merged.empty()) {
+            Chunk* rebuilt = new Chunk;
+            for (unsigned int e = 0; e < merged.size(); e++) {
+                rebuilt->bytes += merged[e].second->size();
+            }
+            rebuilt->entries.swap(merged);
+            next->chunks.push_back(rebuilt);
+        } else {
+            appendChunks(merged, next->chunks);
+        }
+    }
+    for (unsigned int i = 0; i < next->chunks.size(); i++) {
+        next->count += next->chunks[i]->entries.size();
+        next->bytes += next->chunks[i]->bytes;
+    }
+    staged[c].clear();
+
+    current[c].store(next);
+    superseded.epoch = epoch;
+    retired.push_back(superseded);
+}
+
+// Frees versions retired before the oldest epoch a reader may still be in
+static void reclaim() {
+    unsigned long long oldest = globalEpoch.load();
+    for (int i = 0; i < MAX_READERS; i++) {
+        unsigned long long epoch = readers[i].epoch.load();
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    while (!retired.empty() && retired.front().epoch < oldest) {
+        Retired& entry = retired.front();
+        for (unsigned int i = 0; i < entry.chunks.size(); i++) {
+            delete entry.chunks[i];
+        }
+        delete entry.version;
+        retired.pop_front();
+    }
+    retiredCount.store(retired.size(), memory_order_relaxed);
+}
+
+static void freeVersion(const Version* version) {
+    if (!version) {
+        return;
+    }
+    for (unsigned int i = 0; i < version->chunks.size(); i++) {
+        delete version->chunks[i];
+    }
+    delete version;
+}
+
+bool parseListSnapshotFlag(const string& arg) {
+    if (arg == "--snapshot-lists=off") {
+        snapshotsEnabled = false;
+    } else if (arg == "--snapshot-lists=on") {
+        snapshotsEnabled = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void startListSnapshots() {
+    if (!snapshotsEnabled || running.load()) {
+        return;
+    }
+    if (!listening) {
+        addChangeListener(stageChange);
+        listening = true;
+    }
+    current[BOOKS].store(versionOf(bookMap));
+    current[USERS].store(versionOf(userMap));
+    // A copy of every paged review would undo the paging; their lists read the store
+    current[REVIEWS].store(reviewMap.paged() ? nullptr : versionOf(reviewMap));
+    current[RECOMMENDATIONS].store(versionOf(recommendationMap));
+    publishedSeq.store(latestChangeSeq());
+    publishedVersion.store(dataVersion.load());
+    running.store(true);
+}
+
+void stopListSnapshots() {
+    if (!running.load()) {
+        return;
+    }
+    running.store(false);
+    const Version* last[COLLECTION_COUNT];
+    for (int c = 0; c < COLLECTION_COUNT; c++) {
+        last[c] = current[c].exchange(nullptr);
+        staged[c].clear();
+    }
+    // Readers that announced before the exchange may still be copying
+    for (int i = 0; i < MAX_READERS; i++) {
+        while (readers[i].epoch.load() != 0) {
+            this_thread::yield();
+        }
+    }
+    for (int c = 0; c < COLLECTION_COUNT; c++) {
+        freeVersion(last[c]);
+    }
+    globalEpoch++;
+    reclaim();
+}
+
+void publishListSnapshots() {
+    if (!running.load(memory_order_relaxed)) {
+        return;
+    }
+    bool changed = false;
+    for (int c = 0; c < COLLECTION_COUNT; c++) {
+        changed = changed || !staged[c].empty();
+    }
+    if (!changed) {
+        // Nothing listed moved, so the current versions hold this data version too
+        publishedVersion.store(dataVersion.load());
+        return;
+    }
+    TraceSpan span("publish list snapshots");
+    // Readers that announce this epoch or an earlier one may hold the versions replaced now
+    unsigned long long epoch = globalEpoch.load();
+    for (int c = 0; c < COLLECTION_COUNT; c++) {
+        publishCollection(c, epoch);
+    }
+    publishedSeq.store(latestChangeSeq());
+    publishedVersion.store(dataVersion.load());
+    globalEpoch++;
+    published++;
+    reclaim();
+}
+
+bool readListSnapshot(const string& path, const request& req, response& res, unsigned long long& dataVersionRead) {
+    if (!running.load(memory_order_acquire)) {
+        return false;
+    }
+    int c = 0;
+    while (c < COLLECTION_COUNT && path != COLLECTION_PATHS[c]) {
+        c++;
+    }
+    if (c == COLLECTION_COUNT || req.url_params.get("search") || req.url_params.get("sort") || req.url_params.get("q") || req.url_params.get("facets") ||
+        req.url_params.get("minRating") || req.url_params.get("maxRating") ||
+        (req.url_params.get("filterKey") && req.url_params.get("filterValue"))) {
+        return false;
+    }
+    ReaderSlot* slot = claimReaderSlot();
+    if (!slot) {
+        return false;
+    }
+
+    // Announce before loading: a writer that retires this version after the
+    // announcement sees it and keeps the version alive until the slot clears
+    slot->epoch.store(globalEpoch.load());
+    // Read before the version, so it never claims more than the version holds
+    unsigned long long seq = publishedSeq.load();
+    dataVersionRead = publishedVersion.load();
+    const Version* version = current[c].load();
+    if (!version) {
+        slot->epoch.store(0, memory_order_release);
+        return false;
+    }
+    {
+        TraceSpan span("dump");
+        string json;
+        json.reserve(2 + version->count + version->bytes);
+        json += '[';
+        for (unsigned int i = 0; i < version->chunks.size(); i++) {
+            const Entries& entries = version->chunks[i]->entries;
+            for (unsigned int e = 0; e < entries.size(); e++) {
+                if (json.size() > 1) {
+                    json += ',';
+                }
+                json += *entries[e].second;
+            }
+        }
+        json += ']';
+        res = response(json);
+    }
+    res.set_header("X-Change-Seq", to_string(seq));
+    slot->epoch.store(0, memory_order_release);
+    snapshotReads.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+ListSnapshotStats getListSnapshotStats() {
+    ListSnapshotStats stats;
+    stats.published = published.load();
+    stats.retiredPending = retiredCount.load();
+    stats.snapshotReads = snapshotReads.load();
+    return stats;
+}
@@ -0,0 +1,46 @@
+#ifndef LISTSNAPSHOT_H
+#define LISTSNAPSHOT_H
+
+#include <string>
+#include <crow.h>
+#include "ChangeLog.h"
+
+using namespace std;
+using namespace crow;
+
+// Versioned copies of the four list collections for unfiltered list GETs.
+// Each commit publishes a new version under the exclusive lock, built
+// copy-on-write from the previous one: only chunks touched by the commit are
+// rebuilt. Readers pin a version without taking the data lock, so a long scan
+// never blocks a writer and always sees whole commits, cascades included.
+// Superseded versions are freed once no reader that could hold them remains.
+// Versions hold the serialized list, not entities: each entry references the
+// entity's cached JSON fragment, so only unfiltered list GETs are served from
+// them. Reviews are not snapshotted while the review store is paged.
+struct ListSnapshotStats {
+    unsigned long long published;     // Versions published since start
+    size_t retiredPending;            // Superseded versions still waiting for readers to leave
+    unsigned long long snapshotReads; // List GETs answered without the data lock
+};
+
+// Consumes --snapshot-lists=on|off (default on)
+bool parseListSnapshotFlag(const string& arg);
+
+// Builds the first version from the maps and starts following the change log.
+// Call before the server threads start, or with the data lock held.
+void startListSnapshots();
+void stopListSnapshots();
+
+// Applies the changes staged since the last call; writers call this with the
+// exclusive lock held, just before releasing it
+void publishListSnapshots();
+
+// Serves GET path from the current version. False when snapshots are off,
+// the path is not a list, or the query asks for search, ranking, sort, filter,
+// facets or a rating range; the caller then takes the data lock and runs the handler.
+// dataVersionRead is the data version the served body reflects, or an older one.
+bool readListSnapshot(const string& path, const request& req, response& res, unsigned long long& dataVersionRead);
+
+ListSnapshotStats getListSnapshotStats();
+
+#endif
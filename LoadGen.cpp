@@ -0,0 +1,431 @@
+#include "HttpClient.h"
+#include <crow.h>
+
+#include <random>
+#include <cmath>
+
+using namespace std;
+using namespace crow;
+
+// Canned mixes over the README's API. Format, one entry per line:
+//   <weight> <METHOD> <target> [json body]
+// Targets and bodies may use {user} {book} {review} {uniq} {word} {rating}.
+static const char* SCENARIOS[][2] = {
+    {"search-heavy",
+     "80 GET /api/books?search={word}\n"
+     "15 POST /api/reviews {\"id\":\"{uniq}\",\"user\":{\"id\":\"{user}\"},\"book\":{\"id\":\"{book}\"},\"rating\":{rating},\"comment\":\"Load test review about the {word} pacing\"}\n"
+     "5 PUT /api/users/{user} {\"name\":\"Load Tester {uniq}\",\"email\":\"{uniq}@example.com\",\"preferences\":[\"Fantasy\",\"Mystery\"]}\n"},
+    {"browse",
+     "40 GET /api/books/{book}\n"
+     "20 GET /api/users/{user}\n"
+     "20 GET /api/reviews/{review}\n"
+     "10 GET /api/books?filterKey=genre&filterValue=fantasy\n"
+     "5 GET /api/reviews?filterKey=genre&filterValue=mystery\n"
+     "5 GET /api/recommendations?filterKey=genre&filterValue=classic\n"},
+    {"reviews",
+     "50 GET /api/reviews/{review}\n"
+     "20 POST /api/reviews {\"id\":\"{uniq}\",\"user\":{\"id\":\"{user}\"},\"book\":{\"id\":\"{book}\"},\"rating\":{rating},\"comment\":\"Quick {word} take\"}\n"
+     "20 PUT /api/reviews/{review} {\"rating\":{rating},\"comment\":\"Changed my mind about the {word}\"}\n"
+     "5 GET /api/reviews?search={word}\n"
+     "5 GET /api/reviews?sort=rating\n"},
+    {"viral-search",
+     "90 GET /api/books?search=harbor\n"
+     "5 GET /api/reviews?search=pacing\n"
+     "5 GET /api/books/{book}\n"},
+    // ISBNs are unique and the body cannot name the target book's own, so updates clear it
+    {"catalog-writes",
+     "70 GET /api/books/{book}\n"
+     "20 PUT /api/books/{book} {\"title\":\"The {word} Revised\",\"author\":\"Load Author\",\"genre\":\"Fantasy\",\"isbn\":\"\"}\n"
+     "10 POST /api/users {\"id\":\"{uniq}\",\"name\":\"New Reader\",\"email\":\"{uniq}@example.com\",\"preferences\":[\"Classic\"]}\n"}
+};
+
+// Words that appear in generated titles and comments
+static const char* WORDS[] = {
+    "garden", "river", "empire", "harbor", "mirror", "kingdom", "archive", "forest", "voyage", "crown",
+    "silent", "crimson", "hidden", "golden", "midnight", "pacing", "characters", "twist", "ending", "prose"
+};
+
+// Log-linear histogram in the style of HdrHistogram: 64 linear sub-buckets
+// per power of two keeps every recorded value within ~1.6%.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts(SUB + 58 * HALF, 0), total(0), maxValue(0) {}
+
+    void record(unsigned long long value) {
+        counts[index(value)]++;
+        total++;
+        maxValue = max(maxValue, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (unsigned int i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        maxValue = max(maxValue, other.maxValue);
+    }
+
+    unsigned long long percentile(double p) const {
+        if (total == 0) {
+            return 0;
+        }
+        unsigned long long target = (unsigned long long)ceil(p / 100.0 * total);
+        unsigned long long seen = 0;
+        for (unsigned int i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= target && counts[i] > 0) {
+                return min(upperBound(i), maxValue);
+            }
+        }
+        return maxValue;
+    }
+
+    unsigned long long count() const { return total; }
+    unsigned long long maximum() const { return maxValue; }
+
+private:
+    static const int SUB_BITS = 7;
+    static const unsigned long long SUB = 1ULL << SUB_BITS;
+    static const unsigned long long HALF = SUB / 2;
+
+    static unsigned int index(unsigned long long value) {
+        if (value < SUB) {
+            return (unsigned int)value;
+        }
+        int shift = (63 - __builtin_clzll(value)) - (SUB_BITS - 1);
+        return (unsigned int)(SUB + (shift - 1) * HALF + ((value >> shift) - HALF));
+    }
+
+    static unsigned long long upperBound(unsigned int i) {
+        if (i < SUB) {
+            return i;
+        }
+        int shift = (int)((i - SUB) / HALF) + 1;
+        unsigned long long sub = (i - SUB) % HALF + HALF;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    vector<unsigned long long> counts;
+    unsigned long long total;
+    unsigned long long maxValue;
+};
+
+struct MixEntry {
+    double weight;
+    string method;
+    string target;
+    string body;
+    string name;
+};
+
+struct RouteStats {
+    LatencyHistogram latency;
+    unsigned long long errors = 0;
+    unsigned long long transportErrors = 0;
+};
+
+struct LoadOptions {
+    string host = "127.0.0.1";
+    int port = 18525;
+    int threads = 16;
+    double rate = 1000;
+    double duration = 30;
+    double warmup = 5;
+    int users = 10000;
+    int books = 5000;
+    int reviews = 50000;
+    unsigned long long seed = 1;
+    string scenario = "search-heavy";
+    string mixFile;
+    bool json = false;
+};
+
+static LoadOptions options;
+
+// Matches formatEntityId in DataGenerator so targets hit generated records
+static string entityId(long long number, long long total) {
+    int width = 3;
+    for (long long limit = 1000; limit <= total; limit *= 10) {
+        width++;
+    }
+    ostringstream ss;
+    ss << setfill('0') << setw(width) << number;
+    return ss.str();
+}
+
+static vector<MixEntry> parseMix(const string& text) {
+    vector<MixEntry> mix;
+    istringstream lines(text);
+    string line;
+    while (getline(lines, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        istringstream fields(line);
+        MixEntry entry;
+        fields >> entry.weight >> entry.method >> entry.target;
+        getline(fields, entry.body);
+        size_t start = entry.body.find_first_not_of(' ');
+        entry.body = start == string::npos ? "" : entry.body.substr(start);
+        if (entry.method.empty() || entry.target.empty() || entry.weight <= 0) {
+            cerr << "skipping malformed mix line: " << line << endl;
+            continue;
+        }
+        entry.name = entry.method + " " + entry.target;
+        mix.push_back(entry);
+    }
+    return mix;
+}
+
+static string expand(const string& text, mt19937_64& rng, int thread, unsigned long long& sequence) {
+    string out;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t open = text.find('{', pos);
+        if (open == string::npos) {
+            out += text.substr(pos);
+            break;
+        }
+        size_t close = text.find('}', open);
+        string key = close == string::npos ? "" : text.substr(open + 1, close - open - 1);
+        string value;
+        if (key == "user") value = entityId(uniform_int_distribution<int>(1, options.users)(rng), options.users);
+        else if (key == "book") value = entityId(uniform_int_distribution<int>(1, options.books)(rng), options.books);
+        else if (key == "review") value = entityId(uniform_int_distribution<int>(1, options.reviews)(rng), options.reviews);
+        else if (key == "uniq") value = "lg" + to_string(thread) + "-" + to_string(++sequence);
+        else if (key == "word") value = WORDS[uniform_int_distribution<int>(0, sizeof(WORDS) / sizeof(WORDS[0]) - 1)(rng)];
+        else if (key == "rating") value = to_string(uniform_int_distribution<int>(1, 5)(rng));
+        else {
+            // A literal JSON brace rather than a placeholder
+            out += text.substr(pos, open - pos + 1);
+            pos = open + 1;
+            continue;
+        }
+        out += text.substr(pos, open - pos) + value;
+        pos = close + 1;
+    }
+    return out;
+}
+
+// Open-loop worker: requests are scheduled on a Poisson arrival process and
+// latency is measured from the scheduled time, so a stalled server shows up
+// as queueing delay instead of silently lowering the offered load.
+static void runWorker(int thread, const vector<MixEntry>& mix, chrono::steady_clock::time_point start,
+                      vector<RouteStats>& stats) {
+    mt19937_64 rng(options.seed * 1000003 + thread);
+    exponential_distribution<double> interarrival(options.rate / options.threads);
+    vector<double> weights;
+    for (unsigned int i = 0; i < mix.size(); i++) {
+        weights.push_back(mix[i].weight);
+    }
+    discrete_distribution<int> pickEntry(weights.begin(), weights.end());
+
+    HttpConnection connection(options.host, options.port);
+    chrono::steady_clock::time_point warmEnd = start + chrono::microseconds((long long)(options.warmup * 1e6));
+    chrono::steady_clock::time_point end = warmEnd + chrono::microseconds((long long)(options.duration * 1e6));
+    chrono::steady_clock::time_point next = start;
+    unsigned long long sequence = 0;
+
+    while (true) {
+        next += chrono::nanoseconds((long long)(interarrival(rng) * 1e9));
+        if (next >= end) {
+            break;
+        }
+        this_thread::sleep_until(next);
+
+        int i = pickEntry(rng);
+        string target = expand(mix[i].target, rng, thread, sequence);
+        string body = expand(mix[i].body, rng, thread, sequence);
+
+        HttpResponse response;
+        bool ok = connection.request(mix[i].method, target, body, response);
+        unsigned long long micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - next).count();
+
+        if (next < warmEnd) {
+            continue;
+        }
+        stats[i].latency.record(micros);
+        if (!ok) {
+            stats[i].transportErrors++;
+        } else if (response.status >= 400) {
+            stats[i].errors++;
+        }
+    }
+}
+
+struct ServerCounters {
+    double cpuSeconds = -1;
+    double coalesced = 0;
+};
+
+// Sums every series of a metric in Prometheus text, labelled or not
+static double sumMetric(const string& text, const string& name) {
+    double total = 0;
+    size_t pos = 0;
+    while ((pos = text.find("\n" + name, pos)) != string::npos) {
+        pos += name.size() + 1;
+        if (text[pos] != ' ' && text[pos] != '{') {
+            continue;
+        }
+        size_t space = text.find(' ', text[pos] == '{' ? text.find('}', pos) : pos);
+        total += atof(text.c_str() + space + 1);
+    }
+    return total;
+}
+
+// Reads CPU time and coalesced request counts from the server's /metrics
+static ServerCounters scrapeServer() {
+    ServerCounters counters;
+    HttpConnection connection(options.host, options.port);
+    HttpResponse response;
+    if (!connection.request("GET", "/metrics", "", response) || response.status != 200 ||
+        response.body.find("\nprocess_cpu_seconds_total ") == string::npos) {
+        return counters;
+    }
+    counters.cpuSeconds = sumMetric(response.body, "process_cpu_seconds_total");
+    counters.coalesced = sumMetric(response.body, "bookreview_http_coalesced_total");
+    return counters;
+}
+
+static void parseOptions(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if (key == "--target") {
+            if (!parseHostPort(value, options.host, options.port)) {
+                cerr << "--target expects host:port" << endl;
+                exit(2);
+            }
+        }
+        else if (key == "--threads") options.threads = stoi(value);
+        else if (key == "--rate") options.rate = stod(value);
+        else if (key == "--duration") options.duration = stod(value);
+        else if (key == "--warmup") options.warmup = stod(value);
+        else if (key == "--users") options.users = stoi(value);
+        else if (key == "--books") options.books = stoi(value);
+        else if (key == "--reviews") options.reviews = stoi(value);
+        else if (key == "--seed") options.seed = stoull(value);
+        else if (key == "--scenario") options.scenario = value;
+        else if (key == "--mix") options.mixFile = value;
+        else if (key == "--json") options.json = true;
+        else {
+            cerr << "usage: loadgen [--target=host:port] [--threads=N] [--rate=REQ_PER_SEC] [--duration=SEC] [--warmup=SEC]\n"
+                 << "               [--scenario=NAME | --mix=FILE] [--users=N] [--books=N] [--reviews=N] [--seed=N] [--json]\n"
+                 << "scenarios:";
+            for (unsigned int s = 0; s < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); s++) {
+                cerr << " " << SCENARIOS[s][0];
+            }
+            cerr << endl;
+            exit(arg == "--help" ? 0 : 2);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    parseOptions(argc, argv);
+
+    string mixText;
+    if (!options.mixFile.empty()) {
+        ifstream file(options.mixFile);
+        if (!file.is_open()) {
+            cerr << "cannot open mix file " << options.mixFile << endl;
+            return 2;
+        }
+        ostringstream ss;
+        ss << file.rdbuf();
+        mixText = ss.str();
+    } else {
+        for (unsigned int s = 0; s < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); s++) {
+            if (options.scenario == SCENARIOS[s][0]) {
+                mixText = SCENARIOS[s][1];
+            }
+        }
+    }
+    vector<MixEntry> mix = parseMix(mixText);
+    if (mix.empty()) {
+        cerr << "empty request mix (unknown scenario or bad mix file)" << endl;
+        return 2;
+    }
+
+    ServerCounters before = scrapeServer();
+    vector<vector<RouteStats> > threadStats(options.threads, vector<RouteStats>(mix.size()));
+    vector<thread> workers;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int t = 0; t < options.threads; t++) {
+        workers.push_back(thread(runWorker, t, ref(mix), start, ref(threadStats[t])));
+    }
+    for (unsigned int t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    ServerCounters after = scrapeServer();
+    double cpuBefore = before.cpuSeconds;
+    double cpuAfter = after.cpuSeconds;
+
+    vector<RouteStats> totals(mix.size());
+    RouteStats overall;
+    for (int t = 0; t < options.threads; t++) {
+        for (unsigned int i = 0; i < mix.size(); i++) {
+            totals[i].latency.merge(threadStats[t][i].latency);
+            totals[i].errors += threadStats[t][i].errors;
+            totals[i].transportErrors += threadStats[t][i].transportErrors;
+        }
+    }
+    for (unsigned int i = 0; i < mix.size(); i++) {
+        overall.latency.merge(totals[i].latency);
+        overall.errors += totals[i].errors;
+        overall.transportErrors += totals[i].transportErrors;
+    }
+
+    json::wvalue report;
+    report["target"] = options.host + ":" + to_string(options.port);
+    report["offered_rate"] = options.rate;
+    report["achieved_rate"] = overall.latency.count() / options.duration;
+    report["duration_sec"] = options.duration;
+    if (cpuBefore >= 0 && cpuAfter >= 0 && overall.latency.count() > 0) {
+        report["server_cpu_seconds"] = cpuAfter - cpuBefore;
+        report["server_cpu_us_per_request"] = (cpuAfter - cpuBefore) * 1e6 / overall.latency.count();
+        report["server_coalesced_requests"] = after.coalesced - before.coalesced;
+    }
+    for (unsigned int i = 0; i <= mix.size(); i++) {
+        RouteStats& stats = i < mix.size() ? totals[i] : overall;
+        json::wvalue& j = i < mix.size() ? report["routes"][i] : report["overall"];
+        unsigned long long count = stats.latency.count();
+        j["name"] = i < mix.size() ? mix[i].name : string("overall");
+        j["requests"] = (uint64_t)count;
+        j["error_rate"] = count ? (double)(stats.errors + stats.transportErrors) / count : 0.0;
+        j["transport_errors"] = (uint64_t)stats.transportErrors;
+        j["p50_us"] = (uint64_t)stats.latency.percentile(50);
+        j["p90_us"] = (uint64_t)stats.latency.percentile(90);
+        j["p99_us"] = (uint64_t)stats.latency.percentile(99);
+        j["p999_us"] = (uint64_t)stats.latency.percentile(99.9);
+        j["max_us"] = (uint64_t)stats.latency.maximum();
+    }
+
+    if (options.json) {
+        cout << report.dump() << endl;
+        return 0;
+    }
+
+    printf("%-70s %9s %7s %9s %9s %9s %9s %9s\n", "route", "requests", "err%", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (unsigned int i = 0; i <= mix.size(); i++) {
+        RouteStats& stats = i < mix.size() ? totals[i] : overall;
+        string name = i < mix.size() ? mix[i].name : "overall";
+        if (name.size() > 70) {
+            name = name.substr(0, 67) + "...";
+        }
+        unsigned long long count = stats.latency.count();
+        printf("%-70s %9llu %6.2f%% %9llu %9llu %9llu %9llu %9llu\n", name.c_str(), count,
+               count ? 100.0 * (stats.errors + stats.transportErrors) / count : 0.0,
+               stats.latency.percentile(50), stats.latency.percentile(90), stats.latency.percentile(99),
+               stats.latency.percentile(99.9), stats.latency.maximum());
+    }
+    printf("offered %.0f req/s, achieved %.0f req/s\n", options.rate, overall.latency.count() / options.duration);
+    if (cpuBefore >= 0 && cpuAfter >= 0 && overall.latency.count() > 0) {
+        printf("server cpu %.2f s (%.1f us/request), %.0f requests coalesced\n", cpuAfter - cpuBefore,
+               (cpuAfter - cpuBefore) * 1e6 / overall.latency.count(), after.coalesced - before.coalesced);
+    }
+    return 0;
+}
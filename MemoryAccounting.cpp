@@ -0,0 +1,373 @@
+#include "MemoryAccounting.h"
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "Recommendation.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Startup.h"
+#include "BookSuggest.h"
+#include "Facets.h"
+
+#include <atomic>
+#include <fstream>
+#include <new>
+#include <cstdlib>
+#include <malloc.h>
+#include <unistd.h>
+
+extern map<string, User> userMap;
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+extern map<string, Recommendation> recommendationMap;
+
+const char* MEMORY_CLASS_NAMES[MEMORY_CLASS_COUNT] = {"nodes", "keys", "strings", "slack", "vectors", "json"};
+
+// Entries walked per hold of the shared data lock
+static const size_t WALK_CHUNK = 4096;
+
+// A string this long or shorter lives inside its owner
+static const size_t INLINE_CHARS = string().capacity();
+
+// A map node's colour and parent/left/right links, ahead of its value
+static const size_t TREE_LINKS = 4 * sizeof(void*);
+
+// make_shared's control block ahead of the object: vtable pointer and two counts
+static const size_t SHARED_CONTROL = sizeof(void*) + 2 * sizeof(int);
+
+unsigned long long MemoryUsage::total() const {
+    unsigned long long sum = 0;
+    for (int c = 0; c < MEMORY_CLASS_COUNT; c++) {
+        sum += bytes[c];
+    }
+    return sum;
+}
+
+void MemoryUsage::add(const MemoryUsage& other) {
+    for (int c = 0; c < MEMORY_CLASS_COUNT; c++) {
+        bytes[c] += other.bytes[c];
+    }
+}
+
+// -- Allocation counting --
+
+// glibc puts an 8-byte size header ahead of what malloc_usable_size reports
+static size_t blockChunk(void* block) {
+    return malloc_usable_size(block) + sizeof(size_t);
+}
+
+// The first threads each count on a shard of their own, with plain loads and
+// stores; later ones share the last shard with atomic adds. A block freed on
+// another thread than the one that allocated it leaves one shard up and the
+// other down.
+struct alignas(64) AllocationShard {
+    atomic<unsigned long long> allocations;
+    atomic<unsigned long long> frees;
+    atomic<long long> bytes;
+};
+
+static const int ALLOCATION_SHARDS = 64;
+static AllocationShard allocationShards[ALLOCATION_SHARDS];
+static atomic<int> nextAllocationShard(0);
+static thread_local int allocationShard = -1;
+
+template <typename T, typename V>
+static void addToShard(atomic<T>& counter, V amount, bool shared) {
+    if (shared) {
+        counter.fetch_add(amount, memory_order_relaxed);
+    } else {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+}
+
+static void countBlock(bool allocated, void* block) {
+    if (allocationShard < 0) {
+        allocationShard = min(nextAllocationShard.fetch_add(1, memory_order_relaxed), ALLOCATION_SHARDS - 1);
+    }
+    AllocationShard& shard = allocationShards[allocationShard];
+    bool shared = allocationShard == ALLOCATION_SHARDS - 1;
+    long long chunk = blockChunk(block);
+    addToShard(allocated ? shard.allocations : shard.frees, 1, shared);
+    addToShard(shard.bytes, allocated ? chunk : -chunk, shared);
+}
+
+static void* allocate(size_t size) {
+    for (;;) {
+        void* block = malloc(size ? size : 1);
+        if (block) {
+            countBlock(true, block);
+            return block;
+        }
+        new_handler handler = get_new_handler();
+        if (!handler) {
+            throw bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void* allocateOrNull(size_t size) noexcept {
+    try {
+        return allocate(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+static void release(void* block) noexcept {
+    if (block) {
+        countBlock(false, block);
+        free(block);
+    }
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept { return allocateOrNull(size); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return allocateOrNull(size); }
+void operator delete(void* block) noexcept { release(block); }
+void operator delete[](void* block) noexcept { release(block); }
+void operator delete(void* block, size_t) noexcept { release(block); }
+void operator delete[](void* block, size_t) noexcept { release(block); }
+void operator delete(void* block, const nothrow_t&) noexcept { release(block); }
+void operator delete[](void* block, const nothrow_t&) noexcept { release(block); }
+
+AllocatorStats getAllocatorStats() {
+    AllocatorStats stats = {0, 0, 0, 0, 0, 0, 0};
+    long long bytes = 0;
+    for (int i = 0; i < ALLOCATION_SHARDS; i++) {
+        stats.allocations += allocationShards[i].allocations.load(memory_order_relaxed);
+        stats.frees += allocationShards[i].frees.load(memory_order_relaxed);
+        bytes += allocationShards[i].bytes.load(memory_order_relaxed);
+    }
+    stats.liveBlocks = stats.allocations - stats.frees;
+    stats.liveBytes = bytes > 0 ? bytes : 0;
+
+    struct mallinfo2 info = mallinfo2();
+    stats.heapBytes = info.arena + info.hblkhd;
+    stats.freeBytes = info.fordblks;
+
+    ifstream statm("/proc/self/statm");
+    size_t pages, resident;
+    if (statm >> pages >> resident) {
+        stats.rssBytes = resident * sysconf(_SC_PAGESIZE);
+    }
+    return stats;
+}
+
+// -- Estimates --
+
+// The chunk glibc's malloc hands out for n bytes on a 64-bit build
+static size_t chunkBytes(size_t n) {
+    size_t chunk = (n + sizeof(size_t) + 15) & ~(size_t)15;
+    return chunk < 32 ? 32 : chunk;
+}
+
+static void measureString(MemoryUsage& usage, MemoryClass kind, const string& value) {
+    if (value.capacity() > INLINE_CHARS) {
+        size_t unused = value.capacity() - value.size();
+        usage.bytes[kind] += chunkBytes(value.capacity() + 1) - unused;
+        usage.bytes[MEMORY_SLACK] += unused;
+    }
+}
+
+static const char* memoryTypeName(const User&) { return "User"; }
+static const char* memoryTypeName(const Book&) { return "Book"; }
+static const char* memoryTypeName(const Review&) { return "Review"; }
+static const char* memoryTypeName(const Recommendation&) { return "Recommendation"; }
+
+template <typename T>
+static void measureEntity(CollectionMemory& out, const T& entity);
+
+static void measureField(CollectionMemory&, MemoryUsage& usage, const string& value) {
+    measureString(usage, MEMORY_STRINGS, value);
+}
+
+static void measureField(CollectionMemory&, MemoryUsage&, int) {}
+
+static void measureField(CollectionMemory&, MemoryUsage& usage, const vector<string>& values) {
+    if (values.capacity() > 0) {
+        usage.bytes[MEMORY_VECTORS] += chunkBytes(values.capacity() * sizeof(string));
+    }
+    for (vector<string>::const_iterator it = values.begin(); it != values.end(); ++it) {
+        measureString(usage, MEMORY_STRINGS, *it);
+    }
+}
+
+// An embedded user or book goes to its own type
+template <typename T>
+static auto measureField(CollectionMemory& out, MemoryUsage&, const T& entity)
+    -> decltype(T::jsonFields(), void()) {
+    measureEntity(out, entity);
+}
+
+template <typename T, size_t... I>
+static void measureFields(CollectionMemory& out, MemoryUsage& usage, const T& entity, index_sequence<I...>) {
+    constexpr auto fields = T::jsonFields();
+    (measureField(out, usage, entity.*get<I>(fields).member), ...);
+}
+
+template <typename T>
+static void measureEntity(CollectionMemory& out, const T& entity) {
+    MemoryUsage& usage = out.byType[memoryTypeName(entity)];
+    measureFields(out, usage, entity, JsonFieldIndexes<T>());
+    // Copies of an entity, and the list snapshots, share one fragment; each
+    // holder is charged its part of the control block, string and text
+    shared_ptr<const string> json = entity.getJsonCache();
+    if (json) {
+        size_t bytes = chunkBytes(SHARED_CONTROL + sizeof(string));
+        if (json->capacity() > INLINE_CHARS) {
+            bytes += chunkBytes(json->capacity() + 1);
+        }
+        usage.bytes[MEMORY_JSON] += bytes / (json.use_count() - 1);
+    }
+}
+
+template <typename T>
+static void measureEntry(CollectionMemory& out, map<string, T>&, typename map<string, T>::iterator it) {
+    MemoryUsage& usage = out.byType[memoryTypeName(it->second)];
+    usage.bytes[MEMORY_NODES] += chunkBytes(TREE_LINKS + sizeof(typename map<string, T>::value_type));
+    measureString(usage, MEMORY_KEYS, it->first);
+    measureEntity(out, it->second);
+}
+
+// A paged store's reviews count only while they are cached
+static void measureEntry(CollectionMemory& out, ReviewStore& store, ReviewStore::iterator it) {
+    MemoryUsage& usage = out.byType["Review"];
+    usage.bytes[MEMORY_NODES] += chunkBytes(TREE_LINKS + ReviewStore::entryBytes());
+    measureString(usage, MEMORY_KEYS, it.key());
+    shared_ptr<const ReviewStore::value_type> record = store.resident(it);
+    if (record) {
+        usage.bytes[MEMORY_NODES] += chunkBytes(SHARED_CONTROL + sizeof(ReviewStore::value_type));
+        measureString(usage, MEMORY_KEYS, record->first);
+        measureEntity(out, record->second);
+    }
+}
+
+static const string& entryKey(const ReviewStore::iterator& it) {
+    return it.key();
+}
+
+template <typename I>
+static const string& entryKey(const I& it) {
+    return it->first;
+}
+
+// Each chunk resumes at the first key not walked yet, wherever writers
+// between the chunks have moved it
+template <typename M>
+static CollectionMemory measureCollection(M& m, int sample) {
+    CollectionMemory out;
+    string next;
+    bool started = false;
+    for (;;) {
+        DataLock lock(false);
+        typename M::iterator it = started ? m.lower_bound(next) : m.begin();
+        started = true;
+        for (size_t n = 0; it != m.end() && n < WALK_CHUNK; ++it, ++n) {
+            if (out.entities++ % sample == 0) {
+                measureEntry(out, m, it);
+                out.measured++;
+            }
+        }
+        if (it == m.end()) {
+            break;
+        }
+        next = entryKey(it);
+    }
+
+    if (out.measured > 0 && out.measured < out.entities) {
+        for (map<string, MemoryUsage>::iterator type = out.byType.begin(); type != out.byType.end(); ++type) {
+            for (int c = 0; c < MEMORY_CLASS_COUNT; c++) {
+                type->second.bytes[c] = type->second.bytes[c] * out.entities / out.measured;
+            }
+        }
+    }
+    return out;
+}
+
+map<string, CollectionMemory> measureCollections(int sample) {
+    if (sample < 1) {
+        sample = 1;
+    }
+    map<string, CollectionMemory> collections;
+    collections["books"] = measureCollection(bookMap, sample);
+    collections["users"] = measureCollection(userMap, sample);
+    collections["reviews"] = measureCollection(reviewMap, sample);
+    collections["recommendations"] = measureCollection(recommendationMap, sample);
+    return collections;
+}
+
+// -- Endpoint --
+
+static void writeUsage(json::wvalue& out, const MemoryUsage& usage) {
+    out["bytes"] = (uint64_t)usage.total();
+    for (int c = 0; c < MEMORY_CLASS_COUNT; c++) {
+        out[MEMORY_CLASS_NAMES[c]] = (uint64_t)usage.bytes[c];
+    }
+}
+
+response readMemoryUsage(request req) {
+    if (isLoading()) {
+        response res;
+        fillLoadingResponse(res);
+        return res;
+    }
+    int sample = 1;
+    char* sampleParam = req.url_params.get("sample");
+    if (sampleParam) {
+        sample = atoi(sampleParam);
+        if (sample < 1) {
+            return response(400, "sample must be a positive integer");
+        }
+    }
+
+    TraceRoot trace("readMemoryUsage");
+    map<string, CollectionMemory> collections = measureCollections(sample);
+    json::wvalue out;
+    out["sample"] = sample;
+
+    MemoryUsage total;
+    map<string, MemoryUsage> byType;
+    for (map<string, CollectionMemory>::iterator it = collections.begin(); it != collections.end(); ++it) {
+        json::wvalue& collection = out["collections"][it->first];
+        MemoryUsage sum;
+        for (map<string, MemoryUsage>::iterator type = it->second.byType.begin(); type != it->second.byType.end(); ++type) {
+            writeUsage(collection["types"][type->first], type->second);
+            sum.add(type->second);
+            byType[type->first].add(type->second);
+        }
+        writeUsage(collection, sum);
+        collection["entities"] = (uint64_t)it->second.entities;
+        collection["measured"] = (uint64_t)it->second.measured;
+        total.add(sum);
+    }
+    for (map<string, MemoryUsage>::iterator type = byType.begin(); type != byType.end(); ++type) {
+        writeUsage(out["types"][type->first], type->second);
+    }
+    writeUsage(out["classes"], total);
+
+    size_t suggestBytes, facetBytes;
+    {
+        DataLock lock(false);
+        suggestBytes = getBookSuggestStats().bytes;
+        facetBytes = getFacetStats().bytes;
+    }
+    out["indexes"]["bookSuggest"] = (uint64_t)suggestBytes;
+    out["indexes"]["facets"] = (uint64_t)facetBytes;
+    unsigned long long estimated = total.total() + suggestBytes + facetBytes;
+    out["estimatedBytes"] = (uint64_t)estimated;
+
+    AllocatorStats allocator = getAllocatorStats();
+    out["allocator"]["allocations"] = (uint64_t)allocator.allocations;
+    out["allocator"]["frees"] = (uint64_t)allocator.frees;
+    out["allocator"]["liveBlocks"] = (uint64_t)allocator.liveBlocks;
+    out["allocator"]["liveBytes"] = (uint64_t)allocator.liveBytes;
+    out["allocator"]["heapBytes"] = (uint64_t)allocator.heapBytes;
+    out["allocator"]["freeBytes"] = (uint64_t)allocator.freeBytes;
+    out["rssBytes"] = (uint64_t)allocator.rssBytes;
+    // Indexes without a size of their own, buffers, caches and request state
+    out["unaccountedBytes"] = (int64_t)allocator.liveBytes - (int64_t)estimated;
+    return response(out);
+}
@@ -0,0 +1,66 @@
+#ifndef MEMORYACCOUNTING_H
+#define MEMORYACCOUNTING_H
+
+#include <string>
+#include <map>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Estimated heap held by the entity maps, walked entity by entity and field
+// by field. Every allocation is counted as the malloc chunk it takes, header
+// and rounding included, so estimates compare with the allocator's totals.
+// A review's embedded user and book are counted as User and Book.
+enum MemoryClass {
+    MEMORY_NODES,   // Map nodes and shared review records
+    MEMORY_KEYS,    // Ids held by the maps as keys
+    MEMORY_STRINGS, // String fields, the ids inside entities included
+    MEMORY_SLACK,   // Capacity of those strings past their contents
+    MEMORY_VECTORS, // Element arrays of vector fields
+    MEMORY_JSON,    // Cached JSON fragments
+    MEMORY_CLASS_COUNT
+};
+
+extern const char* MEMORY_CLASS_NAMES[MEMORY_CLASS_COUNT];
+
+struct MemoryUsage {
+    unsigned long long bytes[MEMORY_CLASS_COUNT] = {};
+
+    unsigned long long total() const;
+    void add(const MemoryUsage& other);
+};
+
+struct CollectionMemory {
+    size_t entities = 0;
+    size_t measured = 0;             // Entities walked; the rest are scaled from them
+    map<string, MemoryUsage> byType; // Entity type -> its share
+};
+
+// Walks bookMap, userMap, reviewMap and recommendationMap, keyed by their
+// file names. Takes the shared data lock for a few thousand entries at a
+// time, so writers get in between; an entity written meanwhile is counted as
+// the walk finds it. sample > 1 measures every sample-th entity and scales.
+// A paged review store counts only the reviews it has in memory.
+map<string, CollectionMemory> measureCollections(int sample);
+
+// Counted by the replacement global operator new and delete. Aligned new
+// goes straight to the C++ runtime and is not counted.
+struct AllocatorStats {
+    unsigned long long allocations; // Since start
+    unsigned long long frees;
+    unsigned long long liveBlocks;
+    unsigned long long liveBytes;   // Chunks of the blocks not freed yet
+    size_t heapBytes;               // What malloc holds from the system, mmapped blocks included
+    size_t freeBytes;               // Of that, free chunks waiting for reuse
+    size_t rssBytes;
+};
+
+AllocatorStats getAllocatorStats();
+
+// GET /api/admin/memory[?sample=N]: estimates per collection, entity type and
+// field class, the indexes' sizes, the allocator's totals and the part of
+// its live bytes the estimates do not cover. Takes the data lock itself.
+response readMemoryUsage(request req);
+
+#endif
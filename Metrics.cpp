@@ -0,0 +1,449 @@
+#include "Metrics.h"
+#include "Trace.h"
+#include "AdmissionControl.h"
+#include "ChangeStream.h"
+#include "Replication.h"
+#include "ListSnapshot.h"
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "Recommendation.h"
+#include "ReviewSearch.h"
+#include "BookSuggest.h"
+#include "Facets.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <sys/resource.h>
+
+extern map<string, User> userMap;
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+extern map<string, Recommendation> recommendationMap;
+
+static const int MAX_ROUTES = 64;
+
+// Bucket i holds samples <= 2^i microseconds; the last bucket is +Inf
+static const int LATENCY_BUCKETS = 24;
+
+// Status codes get their own counter slot; anything else lands in "other"
+static const int STATUS_CODES[] = {
+    200, 201, 204, 301, 302, 304, 307, 400, 401, 403, 404, 405, 409, 410, 413, 422, 429, 500, 502, 503, 504
+};
+static const int STATUS_SLOTS = sizeof(STATUS_CODES) / sizeof(STATUS_CODES[0]) + 1;
+
+static const char* PERSISTENCE_OP_NAMES[PERSISTENCE_OP_COUNT][2] = {
+    {"load", "books"}, {"load", "users"}, {"load", "reviews"}, {"load", "recommendations"},
+    {"save", "books"}, {"save", "users"}, {"save", "reviews"}, {"save", "recommendations"}
+};
+
+typedef atomic<unsigned long long> Counter;
+
+struct Histogram {
+    Counter buckets[LATENCY_BUCKETS];
+    Counter count;
+    Counter sumMicros;
+};
+
+// One shard per thread. Only the owning thread writes to it, so increments
+// are plain relaxed load/store pairs rather than locked read-modify-writes.
+struct MetricsShard {
+    Counter requests[MAX_ROUTES][STATUS_SLOTS];
+    Histogram latency[MAX_ROUTES];
+    Histogram rebuilds;
+    Histogram persistence[PERSISTENCE_OP_COUNT];
+    Histogram lockWait[2]; // Indexed by exclusive
+    Counter shed[MAX_ROUTES][SHED_REASON_COUNT];
+    Counter coalesced[MAX_ROUTES];
+};
+
+static Counter compressionHits;
+static Counter compressionMisses;
+static Counter compressionRawBytes;
+static Counter compressionSentBytes;
+
+static const char* SHED_REASON_NAMES[SHED_REASON_COUNT] = {"queue_full", "timeout"};
+
+static vector<pair<string, string> > routes;
+static mutex shardsMutex;
+static vector<MetricsShard*> shards;
+
+static void bump(Counter& counter, unsigned long long amount) {
+    counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Shards are never freed: Crow's worker threads live as long as the process
+static MetricsShard& localShard() {
+    thread_local MetricsShard* shard = nullptr;
+    if (!shard) {
+        shard = new MetricsShard();
+        lock_guard<mutex> lock(shardsMutex);
+        shards.push_back(shard);
+    }
+    return *shard;
+}
+
+static int statusSlot(int status) {
+    for (int i = 0; i < STATUS_SLOTS - 1; i++) {
+        if (STATUS_CODES[i] == status) {
+            return i;
+        }
+    }
+    return STATUS_SLOTS - 1;
+}
+
+static int latencyBucket(unsigned long long micros) {
+    if (micros <= 1) {
+        return 0;
+    }
+    int bucket = 64 - __builtin_clzll(micros - 1);
+    return bucket < LATENCY_BUCKETS - 1 ? bucket : LATENCY_BUCKETS - 1;
+}
+
+static unsigned long long elapsedMicros(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
+static void observe(Histogram& histogram, unsigned long long micros) {
+    bump(histogram.buckets[latencyBucket(micros)], 1);
+    bump(histogram.count, 1);
+    bump(histogram.sumMicros, micros);
+}
+
+int registerRoute(string method, string path) {
+    if ((int)routes.size() >= MAX_ROUTES) {
+        throw runtime_error("Too many instrumented routes");
+    }
+    routes.push_back(make_pair(method, path));
+    return (int)routes.size() - 1;
+}
+
+void recordRequest(int route, int status, chrono::steady_clock::time_point start) {
+    MetricsShard& shard = localShard();
+    bump(shard.requests[route][statusSlot(status)], 1);
+    observe(shard.latency[route], elapsedMicros(start));
+}
+
+void recordRecommendationRebuild(chrono::steady_clock::time_point start) {
+    observe(localShard().rebuilds, elapsedMicros(start));
+}
+
+void recordPersistence(PersistenceOp op, chrono::steady_clock::time_point start) {
+    observe(localShard().persistence[op], elapsedMicros(start));
+}
+
+void recordLockWait(bool exclusive, chrono::steady_clock::time_point start) {
+    observe(localShard().lockWait[exclusive ? 1 : 0], elapsedMicros(start));
+}
+
+void recordShed(int route, ShedReason reason) {
+    bump(localShard().shed[route][reason], 1);
+}
+
+void recordCoalesced(int route) {
+    bump(localShard().coalesced[route], 1);
+}
+
+// Rare next to request counts, so shared counters are fine
+void recordCompression(bool cacheHit, size_t rawBytes, size_t sentBytes) {
+    (cacheHit ? compressionHits : compressionMisses).fetch_add(1, memory_order_relaxed);
+    compressionRawBytes.fetch_add(rawBytes, memory_order_relaxed);
+    compressionSentBytes.fetch_add(sentBytes, memory_order_relaxed);
+}
+
+DataLock::DataLock(bool exclusive) : exclusive(exclusive) {
+    TraceSpan span("lock wait");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (exclusive) {
+        dataMutex.lock();
+    } else {
+        dataMutex.lock_shared();
+    }
+    recordLockWait(exclusive, start);
+}
+
+DataLock::~DataLock() {
+    if (exclusive) {
+        dataVersion++;
+        publishListSnapshots();
+        dataMutex.unlock();
+    } else {
+        dataMutex.unlock_shared();
+    }
+}
+
+// -- Exposition --
+
+struct HistogramTotals {
+    unsigned long long buckets[LATENCY_BUCKETS] = {};
+    unsigned long long count = 0;
+    unsigned long long sumMicros = 0;
+
+    void add(Histogram& histogram) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            buckets[i] += histogram.buckets[i].load(memory_order_relaxed);
+        }
+        count += histogram.count.load(memory_order_relaxed);
+        sumMicros += histogram.sumMicros.load(memory_order_relaxed);
+    }
+};
+
+static string seconds(unsigned long long micros) {
+    ostringstream ss;
+    ss << setprecision(9) << micros / 1e6;
+    return ss.str();
+}
+
+static void writeHistogram(ostringstream& out, const string& name, const string& labels, HistogramTotals& totals) {
+    string prefix = labels.empty() ? "" : labels + ",";
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        cumulative += totals.buckets[i];
+        out << name << "_bucket{" << prefix << "le=\"" << seconds(1ULL << i) << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{" << prefix << "le=\"+Inf\"} " << totals.count << "\n";
+    string suffix = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << suffix << " " << seconds(totals.sumMicros) << "\n";
+    out << name << "_count" << suffix << " " << totals.count << "\n";
+}
+
+string renderMetricsText() {
+    vector<MetricsShard*> snapshot;
+    {
+        lock_guard<mutex> lock(shardsMutex);
+        snapshot = shards;
+    }
+
+    ostringstream out;
+
+    out << "# HELP bookreview_http_requests_total Requests handled, by route and status code.\n";
+    out << "# TYPE bookreview_http_requests_total counter\n";
+    for (int r = 0; r < (int)routes.size(); r++) {
+        for (int s = 0; s < STATUS_SLOTS; s++) {
+            unsigned long long total = 0;
+            for (unsigned int i = 0; i < snapshot.size(); i++) {
+                total += snapshot[i]->requests[r][s].load(memory_order_relaxed);
+            }
+            if (total == 0) {
+                continue;
+            }
+            string code = s < STATUS_SLOTS - 1 ? to_string(STATUS_CODES[s]) : "other";
+            out << "bookreview_http_requests_total{method=\"" << routes[r].first << "\",route=\"" << routes[r].second
+                << "\",code=\"" << code << "\"} " << total << "\n";
+        }
+    }
+
+    out << "# HELP bookreview_http_request_duration_seconds Handler latency by route.\n";
+    out << "# TYPE bookreview_http_request_duration_seconds histogram\n";
+    for (int r = 0; r < (int)routes.size(); r++) {
+        HistogramTotals totals;
+        for (unsigned int i = 0; i < snapshot.size(); i++) {
+            totals.add(snapshot[i]->latency[r]);
+        }
+        string labels = "method=\"" + routes[r].first + "\",route=\"" + routes[r].second + "\"";
+        writeHistogram(out, "bookreview_http_request_duration_seconds", labels, totals);
+    }
+
+    out << "# HELP bookreview_http_shed_total Requests rejected with 503 by admission control.\n";
+    out << "# TYPE bookreview_http_shed_total counter\n";
+    for (int r = 0; r < (int)routes.size(); r++) {
+        for (int reason = 0; reason < SHED_REASON_COUNT; reason++) {
+            unsigned long long total = 0;
+            for (unsigned int i = 0; i < snapshot.size(); i++) {
+                total += snapshot[i]->shed[r][reason].load(memory_order_relaxed);
+            }
+            if (total == 0) {
+                continue;
+            }
+            out << "bookreview_http_shed_total{method=\"" << routes[r].first << "\",route=\"" << routes[r].second
+                << "\",reason=\"" << SHED_REASON_NAMES[reason] << "\"} " << total << "\n";
+        }
+    }
+
+    out << "# HELP bookreview_http_coalesced_total GETs answered with another in-flight request's result.\n";
+    out << "# TYPE bookreview_http_coalesced_total counter\n";
+    for (int r = 0; r < (int)routes.size(); r++) {
+        unsigned long long total = 0;
+        for (unsigned int i = 0; i < snapshot.size(); i++) {
+            total += snapshot[i]->coalesced[r].load(memory_order_relaxed);
+        }
+        if (total > 0) {
+            out << "bookreview_http_coalesced_total{method=\"" << routes[r].first << "\",route=\"" << routes[r].second
+                << "\"} " << total << "\n";
+        }
+    }
+
+    out << "# HELP bookreview_compression_cache_total Compressed responses served from cache or freshly compressed.\n";
+    out << "# TYPE bookreview_compression_cache_total counter\n";
+    out << "bookreview_compression_cache_total{result=\"hit\"} " << compressionHits.load() << "\n";
+    out << "bookreview_compression_cache_total{result=\"miss\"} " << compressionMisses.load() << "\n";
+    out << "# HELP bookreview_compression_bytes_total Body bytes of compressed responses before and after encoding.\n";
+    out << "# TYPE bookreview_compression_bytes_total counter\n";
+    out << "bookreview_compression_bytes_total{stage=\"raw\"} " << compressionRawBytes.load() << "\n";
+    out << "bookreview_compression_bytes_total{stage=\"sent\"} " << compressionSentBytes.load() << "\n";
+
+    out << "# HELP bookreview_admission_limit Current concurrency limit of each limited route.\n";
+    out << "# TYPE bookreview_admission_limit gauge\n";
+    for (int r = 0; r < (int)routes.size(); r++) {
+        double limit = getAdmissionLimit(r);
+        if (limit >= 0) {
+            out << "bookreview_admission_limit{method=\"" << routes[r].first << "\",route=\"" << routes[r].second
+                << "\"} " << limit << "\n";
+        }
+    }
+
+    out << "# HELP bookreview_data_lock_wait_seconds Time handlers waited for the data lock.\n";
+    out << "# TYPE bookreview_data_lock_wait_seconds histogram\n";
+    for (int exclusive = 0; exclusive < 2; exclusive++) {
+        HistogramTotals totals;
+        for (unsigned int i = 0; i < snapshot.size(); i++) {
+            totals.add(snapshot[i]->lockWait[exclusive]);
+        }
+        writeHistogram(out, "bookreview_data_lock_wait_seconds", exclusive ? "mode=\"exclusive\"" : "mode=\"shared\"", totals);
+    }
+
+    // The entity and index gauges need the data lock. A scrape must not wait for
+    // the startup load or a long write, so it leaves them out while a writer holds it.
+    {
+        shared_lock<shared_mutex> lock(dataMutex, try_to_lock);
+        if (lock.owns_lock()) {
+            out << "# HELP bookreview_entities Entities currently held, by collection.\n";
+            out << "# TYPE bookreview_entities gauge\n";
+            out << "bookreview_entities{collection=\"books\"} " << bookMap.size() << "\n";
+            out << "bookreview_entities{collection=\"users\"} " << userMap.size() << "\n";
+            out << "bookreview_entities{collection=\"reviews\"} " << reviewMap.size() << "\n";
+            out << "bookreview_entities{collection=\"recommendations\"} " << recommendationMap.size() << "\n";
+
+            ReviewIndexStats index = getReviewIndexStats();
+            out << "# HELP bookreview_review_index_terms Distinct tokens in the review search index.\n";
+            out << "# TYPE bookreview_review_index_terms gauge\n";
+            out << "bookreview_review_index_terms " << index.terms << "\n";
+            out << "# HELP bookreview_review_index_postings Postings in the review search index, including ones awaiting compaction.\n";
+            out << "# TYPE bookreview_review_index_postings gauge\n";
+            out << "bookreview_review_index_postings " << index.postings << "\n";
+            out << "# HELP bookreview_review_index_documents Documents in the review search index, including replaced ones awaiting compaction.\n";
+            out << "# TYPE bookreview_review_index_documents gauge\n";
+            out << "bookreview_review_index_documents " << index.documentSlots << "\n";
+
+            BookSuggestStats suggest = getBookSuggestStats();
+            out << "# HELP bookreview_book_suggest_entries Distinct titles and authors offered as completions.\n";
+            out << "# TYPE bookreview_book_suggest_entries gauge\n";
+            out << "bookreview_book_suggest_entries " << suggest.suggestions << "\n";
+            out << "# HELP bookreview_book_suggest_bytes Approximate memory held by the completion trie.\n";
+            out << "# TYPE bookreview_book_suggest_bytes gauge\n";
+            out << "bookreview_book_suggest_bytes " << suggest.bytes << "\n";
+
+            FacetStats facets = getFacetStats();
+            out << "# HELP bookreview_facet_values Distinct facet values with at least one book or review.\n";
+            out << "# TYPE bookreview_facet_values gauge\n";
+            out << "bookreview_facet_values " << facets.values << "\n";
+            out << "# HELP bookreview_facet_bytes Approximate memory held by the facet bitmaps.\n";
+            out << "# TYPE bookreview_facet_bytes gauge\n";
+            out << "bookreview_facet_bytes " << facets.bytes << "\n";
+
+            if (reviewMap.paged()) {
+                ReviewStoreStats store = reviewMap.stats();
+                out << "# HELP bookreview_review_store_cached_reviews Reviews held decoded in the review store's cache.\n";
+                out << "# TYPE bookreview_review_store_cached_reviews gauge\n";
+                out << "bookreview_review_store_cached_reviews " << store.cachedReviews << "\n";
+                out << "# HELP bookreview_review_store_cached_bytes Estimated memory held by the review store's cache.\n";
+                out << "# TYPE bookreview_review_store_cached_bytes gauge\n";
+                out << "bookreview_review_store_cached_bytes " << store.cachedBytes << "\n";
+                out << "# HELP bookreview_review_store_reads_total Review reads by whether the review was cached.\n";
+                out << "# TYPE bookreview_review_store_reads_total counter\n";
+                out << "bookreview_review_store_reads_total{result=\"hit\"} " << store.hits << "\n";
+                out << "bookreview_review_store_reads_total{result=\"miss\"} " << store.misses << "\n";
+                out << "# HELP bookreview_review_store_appends_total Records appended to the review store's segments.\n";
+                out << "# TYPE bookreview_review_store_appends_total counter\n";
+                out << "bookreview_review_store_appends_total " << store.appends << "\n";
+                out << "# HELP bookreview_review_store_disk_bytes Segment bytes on disk, and of those the live records.\n";
+                out << "# TYPE bookreview_review_store_disk_bytes gauge\n";
+                out << "bookreview_review_store_disk_bytes{kind=\"total\"} " << store.diskBytes << "\n";
+                out << "bookreview_review_store_disk_bytes{kind=\"live\"} " << store.liveBytes << "\n";
+                out << "# HELP bookreview_review_store_compactions_total Segments rewritten by compaction.\n";
+                out << "# TYPE bookreview_review_store_compactions_total counter\n";
+                out << "bookreview_review_store_compactions_total " << store.compactions << "\n";
+            }
+        }
+    }
+
+    RecommendationStatus status = getRecommendationStatus();
+    out << "# HELP bookreview_recommendation_generation Number of times the recommendation set has been replaced.\n";
+    out << "# TYPE bookreview_recommendation_generation counter\n";
+    out << "bookreview_recommendation_generation " << status.generation << "\n";
+    out << "# HELP bookreview_recommendation_pending_tasks Recompute tasks enqueued but not yet applied.\n";
+    out << "# TYPE bookreview_recommendation_pending_tasks gauge\n";
+    out << "bookreview_recommendation_pending_tasks " << status.pendingTasks << "\n";
+    out << "# HELP bookreview_recommendation_staleness_seconds Age of the oldest unapplied recompute task.\n";
+    out << "# TYPE bookreview_recommendation_staleness_seconds gauge\n";
+    out << "bookreview_recommendation_staleness_seconds " << seconds(status.stalenessMillis * 1000) << "\n";
+
+    ChangeStreamStats stream = getChangeStreamStats();
+    out << "# HELP bookreview_stream_subscribers Connected /api/stream subscribers.\n";
+    out << "# TYPE bookreview_stream_subscribers gauge\n";
+    out << "bookreview_stream_subscribers " << stream.subscribers << "\n";
+    out << "# HELP bookreview_stream_events_total Change events queued to stream subscribers.\n";
+    out << "# TYPE bookreview_stream_events_total counter\n";
+    out << "bookreview_stream_events_total " << stream.events << "\n";
+    out << "# HELP bookreview_stream_slow_disconnects_total Stream subscribers dropped for falling a full buffer behind.\n";
+    out << "# TYPE bookreview_stream_slow_disconnects_total counter\n";
+    out << "bookreview_stream_slow_disconnects_total " << stream.slowDisconnects << "\n";
+
+    ListSnapshotStats snapshots = getListSnapshotStats();
+    out << "# HELP bookreview_list_snapshot_reads_total List GETs served from a snapshot without the data lock.\n";
+    out << "# TYPE bookreview_list_snapshot_reads_total counter\n";
+    out << "bookreview_list_snapshot_reads_total " << snapshots.snapshotReads << "\n";
+    out << "# HELP bookreview_list_snapshot_versions_retired Superseded list snapshots waiting for readers to finish.\n";
+    out << "# TYPE bookreview_list_snapshot_versions_retired gauge\n";
+    out << "bookreview_list_snapshot_versions_retired " << snapshots.retiredPending << "\n";
+
+    if (isReadOnlyReplica()) {
+        ReplicationStatus replica = getReplicationStatus();
+        out << "# HELP bookreview_replication_connected 1 while the replica is tailing the primary's change stream.\n";
+        out << "# TYPE bookreview_replication_connected gauge\n";
+        out << "bookreview_replication_connected " << (replica.connected ? 1 : 0) << "\n";
+        out << "# HELP bookreview_replication_lag_changes Primary changes not applied yet.\n";
+        out << "# TYPE bookreview_replication_lag_changes gauge\n";
+        out << "bookreview_replication_lag_changes " << replica.primarySeq - replica.appliedSeq << "\n";
+        out << "# HELP bookreview_replication_lag_seconds Age of the oldest primary change not applied yet.\n";
+        out << "# TYPE bookreview_replication_lag_seconds gauge\n";
+        out << "bookreview_replication_lag_seconds " << seconds(replica.lagMillis * 1000) << "\n";
+    }
+
+    HistogramTotals rebuilds;
+    for (unsigned int i = 0; i < snapshot.size(); i++) {
+        rebuilds.add(snapshot[i]->rebuilds);
+    }
+    out << "# HELP bookreview_recommendation_rebuild_seconds Recommendation rebuild and reindex durations.\n";
+    out << "# TYPE bookreview_recommendation_rebuild_seconds histogram\n";
+    writeHistogram(out, "bookreview_recommendation_rebuild_seconds", "", rebuilds);
+
+    out << "# HELP bookreview_persistence_seconds JSON file load/save durations.\n";
+    out << "# TYPE bookreview_persistence_seconds histogram\n";
+    for (int op = 0; op < PERSISTENCE_OP_COUNT; op++) {
+        HistogramTotals totals;
+        for (unsigned int i = 0; i < snapshot.size(); i++) {
+            totals.add(snapshot[i]->persistence[op]);
+        }
+        string labels = string("operation=\"") + PERSISTENCE_OP_NAMES[op][0] + "\",collection=\"" + PERSISTENCE_OP_NAMES[op][1] + "\"";
+        writeHistogram(out, "bookreview_persistence_seconds", labels, totals);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    unsigned long long cpuMicros = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+                                   usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    out << "# HELP process_cpu_seconds_total Total user and system CPU time spent in seconds.\n";
+    out << "# TYPE process_cpu_seconds_total counter\n";
+    out << "process_cpu_seconds_total " << seconds(cpuMicros) << "\n";
+
+    return out.str();
+}
+
+response readMetrics() {
+    response res(renderMetricsText());
+    res.set_header("Content-Type", "text/plain; version=0.0.4");
+    return res;
+}
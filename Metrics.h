@@ -0,0 +1,57 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <chrono>
+#include <shared_mutex>
+#include <atomic>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Persistence operations timed by the load/save functions
+enum PersistenceOp {
+    LOAD_BOOKS, LOAD_USERS, LOAD_REVIEWS, LOAD_RECOMMENDATIONS,
+    SAVE_BOOKS, SAVE_USERS, SAVE_REVIEWS, SAVE_RECOMMENDATIONS,
+    PERSISTENCE_OP_COUNT
+};
+
+// Why a request was turned away by admission control
+enum ShedReason { SHED_QUEUE_FULL, SHED_TIMEOUT, SHED_REASON_COUNT };
+
+// Guards the entity maps. GET routes hold it shared, writes and the
+// recommendation worker hold it exclusively.
+extern shared_mutex dataMutex;
+
+// Bumped under the exclusive lock by every write, before the lock is released
+extern atomic<unsigned long long> dataVersion;
+
+// Holds dataMutex for one handler call and records how long it waited for it
+class DataLock {
+public:
+    DataLock(bool exclusive);
+    ~DataLock();
+
+private:
+    bool exclusive;
+};
+
+// Routes must be registered before the server threads start
+int registerRoute(string method, string path);
+
+// Recording only touches the calling thread's shard; shards are summed at scrape time
+void recordRequest(int route, int status, chrono::steady_clock::time_point start);
+void recordRecommendationRebuild(chrono::steady_clock::time_point start);
+void recordPersistence(PersistenceOp op, chrono::steady_clock::time_point start);
+void recordLockWait(bool exclusive, chrono::steady_clock::time_point start);
+void recordShed(int route, ShedReason reason);
+void recordCoalesced(int route);
+void recordCompression(bool cacheHit, size_t rawBytes, size_t sentBytes);
+
+// Prometheus text exposition of everything recorded so far. Never waits for
+// the data lock: the entity and index gauges are left out while a writer holds it.
+string renderMetricsText();
+response readMetrics();
+
+#endif
@@ -1,28 +1,87 @@
 #include "Recommendation.h"
 #include "User.h"
 #include "Book.h"
+#include "Metrics.h"
+#include "ListSnapshot.h"
+#include "Startup.h"
+#include "Trace.h"
+#include "ChangeLog.h"
+#include "Sharding.h"
+
+#include <set>
+#include <thread>
+#include <condition_variable>
 
 extern map<string, Recommendation> recommendationMap;
 extern map<string, User> userMap;
 extern map<string, Book> bookMap;
 
-json::wvalue convertRecommendationToJson(Recommendation rec) {
-    json::wvalue j;
-    j["id"] = rec.getId();
-    j["user"] = convertUserToJson(rec.getUser());
-    j["book"] = convertBookToJson(rec.getBook());
-    return j;
+static atomic<unsigned long long> recommendationGeneration(0);
+
+const string& Recommendation::getJsonFragment() {
+    if (__atomic_load_n(&cachedVersion, __ATOMIC_ACQUIRE) != version + 1) {
+        // Embedded fragments first, so at most one stripe is held at a time
+        user.getJsonFragment();
+        book.getJsonFragment();
+
+        lock_guard<mutex> lock(fragmentLock(this));
+        if (cachedVersion != version + 1) {
+            string json;
+            writeJsonFields(json, *this);
+            cachedJson = make_shared<const string>(move(json));
+            __atomic_store_n(&cachedVersion, version + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return *cachedJson;
+}
+
+shared_ptr<const string> Recommendation::getSharedJsonFragment() {
+    getJsonFragment();
+    return cachedJson;
+}
+
+// Renumbers recs 001, 002, ... (s<i>-001, ... on shard i) and publishes them as the new recommendation set.
+// Ids whose content moved are logged as upserts, ids past the new end as deletes. For a shard taking its
+// partition at startup; the worker keeps ids stable instead.
+void reindexRecommendations(vector<Recommendation>& recs) {
+    TraceSpan reindexSpan("reindex");
+    map<string, Recommendation> reindexedMap;
+    for (int i = 0; i < (int)recs.size(); i++) {
+        stringstream ss;
+        ss << setfill('0') << setw(3) << (i + 1);
+        string recId = recommendationIdPrefix() + ss.str();
+        recs[i].setId(recId);
+        reindexedMap[recId] = recs[i];
+    }
+
+    // Readers only hold the lock shared; hand them fragments that are already built
+    for (auto it = reindexedMap.begin(); it != reindexedMap.end(); ++it) {
+        map<string, Recommendation>::iterator previous = recommendationMap.find(it->first);
+        const string& fragment = it->second.getJsonFragment();
+        if (previous == recommendationMap.end() || previous->second.getJsonFragment() != fragment) {
+            recordUpsert("recommendations", it->first, fragment);
+        }
+    }
+    for (auto it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
+        if (reindexedMap.find(it->first) == reindexedMap.end()) {
+            recordDelete("recommendations", it->first);
+        }
+    }
+
+    recommendationMap = reindexedMap;
+    recommendationGeneration++;
 }
 
 // -- Search, Filter, Sort --
 
 response searchRecommendations(string searchStr) {
-    vector<Recommendation> found;
+    TraceSpan span("searchRecommendations");
+    vector<const string*> found;
     string lowered = toLower(searchStr);
 
     map<string, Recommendation>::iterator it;
     for (it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        Recommendation r = it->second;
+        Recommendation& r = it->second;
         Book b = r.getBook();
         User u = r.getUser();
         if (
@@ -30,79 +89,76 @@ response searchRecommendations(string searchStr) {
             toLower(b.getAuthor()).find(lowered) != string::npos ||
             toLower(u.getName()).find(lowered) != string::npos
         ) {
-            found.push_back(r);
+            found.push_back(&r.getJsonFragment());
         }
     }
 
-    json::wvalue json;
-    for (unsigned int i = 0; i < found.size(); i++) {
-        json[i] = convertRecommendationToJson(found[i]);
-    }
-
-    return response(json.dump());
+    return response(joinJsonFragments(found));
 }
 
 response filterRecommendations(string key, string value) {
-    vector<Recommendation> filtered;
+    TraceSpan span("filterRecommendations");
+    vector<const string*> filtered;
     string lowered = toLower(value);
 
     map<string, Recommendation>::iterator it;
     for (it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        Recommendation r = it->second;
+        Recommendation& r = it->second;
         Book b = r.getBook();
         User u = r.getUser();
         if ((key == "genre" && toLower(b.getGenre()) == lowered) ||
             (key == "author" && toLower(b.getAuthor()) == lowered) ||
             (key == "user" && toLower(u.getName()) == lowered)) {
-            filtered.push_back(r);
+            filtered.push_back(&r.getJsonFragment());
         }
     }
 
-    json::wvalue json;
-    for (unsigned int i = 0; i < filtered.size(); i++) {
-        json[i] = convertRecommendationToJson(filtered[i]);
-    }
-
-    return response(json.dump());
+    return response(joinJsonFragments(filtered));
 }
 
 response sortRecommendations(string sortKey) {
-    vector<pair<string, Recommendation> > items;
+    TraceSpan span("sortRecommendations");
+    vector<Recommendation*> items;
 
     map<string, Recommendation>::iterator it;
     for (it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        items.push_back(make_pair(it->first, it->second));
+        items.push_back(&it->second);
     }
 
+    // Ties keep map (id) order
     if (sortKey == "title") {
-        sort(items.begin(), items.end(), [](pair<string, Recommendation>& a, pair<string, Recommendation>& b) {
-            return a.second.getBook().getTitle() < b.second.getBook().getTitle();
+        stable_sort(items.begin(), items.end(), [](Recommendation* a, Recommendation* b) {
+            return a->getBook().getTitle() < b->getBook().getTitle();
         });
     } else if (sortKey == "user") {
-        sort(items.begin(), items.end(), [](pair<string, Recommendation>& a, pair<string, Recommendation>& b) {
-            return a.second.getUser().getName() < b.second.getUser().getName();
+        stable_sort(items.begin(), items.end(), [](Recommendation* a, Recommendation* b) {
+            return a->getUser().getName() < b->getUser().getName();
         });
     }
 
-    json::wvalue json;
+    vector<const string*> fragments;
     for (unsigned int i = 0; i < items.size(); i++) {
-        json[i] = convertRecommendationToJson(items[i].second);
+        fragments.push_back(&items[i]->getJsonFragment());
     }
 
-    return response(json.dump());
+    return response(joinJsonFragments(fragments));
 }
 
 // -- CRUD --
 
 response createRecommendation(request req) {
-    json::rvalue body = json::load(req.body);
-    if (!body) {
-        return response(400, "Invalid JSON");
+    TraceSpan parseSpan("readJson");
+    Recommendation body;
+    response invalid;
+    bool parsed = readJsonBody(req.body, body, jsonRequiredFields<Recommendation>(), nullptr, invalid);
+    parseSpan.end();
+    if (!parsed) {
+        return invalid;
     }
 
-    string id = body["id"].s();
-    string userId = body["user"]["id"].s();
-    string bookId = body["book"]["id"].s();
+    string id = body.getId();
+    string userId = body.getUser().getId();
+    string bookId = body.getBook().getId();
 
     if (userMap.find(userId) == userMap.end()) {
         return response(404, "User not found");
@@ -113,18 +169,24 @@ response createRecommendation(request req) {
 
     Recommendation rec(id, userMap[userId], bookMap[bookId]);
     recommendationMap[id] = rec;
+    recordUpsert("recommendations", id, recommendationMap[id].getJsonFragment());
 
-    return response(201, convertRecommendationToJson(rec).dump());
+    return response(201, recommendationMap[id].getJsonFragment());
 }
 
 response readRecommendation(string id) {
     map<string, Recommendation>::iterator it = recommendationMap.find(id);
     if (it != recommendationMap.end()) {
-        return response(convertRecommendationToJson(it->second).dump());
+        return response(it->second.getJsonFragment());
     }
     return response(404, "Recommendation not found");
 }
 
+static response withRecommendationStatus(response res) {
+    setRecommendationStatusHeaders(res);
+    return res;
+}
+
 response readAllRecommendations(request req) {
     char* searchParam = req.url_params.get("search");
     char* sortParam = req.url_params.get("sort");
@@ -132,23 +194,22 @@ response readAllRecommendations(request req) {
     char* filterValue = req.url_params.get("filterValue");
 
     if (searchParam) {
-        return searchRecommendations(string(searchParam));
+        return withRecommendationStatus(searchRecommendations(string(searchParam)));
     }
     if (sortParam) {
-        return sortRecommendations(string(sortParam));
+        return withRecommendationStatus(sortRecommendations(string(sortParam)));
     }
     if (filterKey && filterValue) {
-        return filterRecommendations(string(filterKey), string(filterValue));
+        return withRecommendationStatus(filterRecommendations(string(filterKey), string(filterValue)));
     }
 
-    json::wvalue json;
-    int index = 0;
+    vector<const string*> fragments;
     map<string, Recommendation>::iterator it;
     for (it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        json[index++] = convertRecommendationToJson(it->second);
+        fragments.push_back(&it->second.getJsonFragment());
     }
 
-    return response(json.dump());
+    return withRecommendationStatus(response(joinJsonFragments(fragments)));
 }
 
 void updateRecommendation(request req, response& res, string id) {
@@ -159,32 +220,37 @@ void updateRecommendation(request req, response& res, string id) {
         return;
     }
 
-    json::rvalue body = json::load(req.body);
-    if (!body) {
-        res.code = 400;
-        res.end("Invalid JSON");
+    TraceSpan parseSpan("readJson");
+    Recommendation body;
+    unsigned seen;
+    bool parsed = readJsonBody(req.body, body, 0, &seen, res);
+    parseSpan.end();
+    if (!parsed) {
+        res.end();
         return;
     }
 
     Recommendation& rec = it->second;
 
-    if (body.has("user")) {
-        string userId = body["user"]["id"].s();
+    if (seen & jsonFieldBit<Recommendation>("user")) {
+        string userId = body.getUser().getId();
         if (userMap.find(userId) != userMap.end()) {
             rec.setUser(userMap[userId]);
         }
     }
 
-    if (body.has("book")) {
-        string bookId = body["book"]["id"].s();
+    if (seen & jsonFieldBit<Recommendation>("book")) {
+        string bookId = body.getBook().getId();
         if (bookMap.find(bookId) != bookMap.end()) {
             rec.setBook(bookMap[bookId]);
         }
     }
 
+    recordUpsert("recommendations", id, rec.getJsonFragment());
+
     res.code = 200;
     res.set_header("Content-Type", "application/json");
-    res.write(convertRecommendationToJson(rec).dump());
+    res.write(rec.getJsonFragment());
     res.end();
 }
 
@@ -192,63 +258,273 @@ response deleteRecommendation(string id) {
     map<string, Recommendation>::iterator it = recommendationMap.find(id);
     if (it != recommendationMap.end()) {
         recommendationMap.erase(it);
+        recordDelete("recommendations", id);
         return response(204);
     }
     return response(404, "Recommendation not found");
 }
 
 void saveRecommendationToFile(map<string, Recommendation> data, string filename) {
+    TraceRoot trace("saveRecommendationToFile");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
     ofstream file(filename);
     if (file.is_open()) {
-        json::wvalue json;
-        int index = 0;
+        vector<const string*> fragments;
         map<string, Recommendation>::iterator it;
         for (it = data.begin(); it != data.end(); ++it) {
-            json[index++] = convertRecommendationToJson(it->second);
+            fragments.push_back(&it->second.getJsonFragment());
         }
-        file << json.dump();
+        string json = joinJsonFragments(fragments);
+
+        TraceSpan writeSpan("write file");
+        file << json;
         file.close();
     }
+    recordPersistence(SAVE_RECOMMENDATIONS, start);
+}
+
+bool parseRecommendationJson(const json::rvalue& item, Recommendation& recommendation) {
+    return readJson(item, recommendation);
 }
 
 map<string, Recommendation> loadRecommendationFromFile(string filename) {
-    map<string, Recommendation> data;
-    ifstream file(filename);
+    TraceRoot trace("loadRecommendationFromFile");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    // Cut into runs parsed side by side; a file that does not parse loads nothing
+    map<string, Recommendation> data = loadMapFile<Recommendation>(filename, loadThreadCount());
+    recordPersistence(LOAD_RECOMMENDATIONS, start);
+    return data;
+}
 
-    if (file.is_open()) {
-        ostringstream ss;
-        ss << file.rdbuf();
-        file.close();
 
-        json::rvalue json = json::load(ss.str());
+// -- Background recomputation --
+
+// Writes that land within this window of each other share one rebuild
+static const chrono::milliseconds BATCH_WINDOW(5);
+
+static mutex queueMutex;
+static condition_variable queueChanged;
+static set<string> pendingUsers;
+static set<string> pendingBooks;
+static unsigned long long enqueuedTasks = 0;
+static unsigned long long appliedTasks = 0;
+static chrono::steady_clock::time_point oldestUnapplied; // Includes the batch being applied
+static chrono::steady_clock::time_point oldestQueued;    // Only what is still in the pending sets
+
+static thread worker;
+static bool workerRunning = false;
+static bool stopRequested = false;
 
-        for (json::rvalue& item : json) {
-            string id = item["id"].s();
+static bool prefersGenre(User& user, const string& genre) {
+    vector<string> preferences = user.getPreferences();
+    for (int i = 0; i < (int)preferences.size(); i++) {
+        if (preferences[i] == genre) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The number in a recommendation id this process gave out, or 0
+static unsigned long long recommendationNumber(const string& id) {
+    string prefix = recommendationIdPrefix();
+    if (id.compare(0, prefix.size(), prefix) != 0 || id.size() == prefix.size() ||
+        id.find_first_not_of("0123456789", prefix.size()) != string::npos) {
+        return 0;
+    }
+    return strtoull(id.c_str() + prefix.size(), nullptr, 10);
+}
 
-            // Deserialize User
-            string userId = item["user"]["id"].s();
-            string name = item["user"]["name"].s();
-            string email = item["user"]["email"].s();
-            vector<string> preferences;
-            for (json::rvalue& pref : item["user"]["preferences"]) {
-                preferences.push_back(pref.s());
+// Works out which recommendations the queued users and books (created,
+// changed or deleted) should have now against the current maps. Ones that
+// still apply keep their id and are rewritten only if an embedded user or book
+// changed; ones that no longer apply are deleted; new pairs get ids past the
+// highest in use. Only those are logged. Caller holds the data lock exclusively.
+static void applyRecommendationBatch(const set<string>& users, const set<string>& books) {
+    TraceSpan rebuildSpan("recommendation rebuild");
+    set<pair<string, string> > wanted; // (user id, book id)
+
+    // Queued users get every book in their preferred genres
+    for (auto u = users.begin(); u != users.end(); ++u) {
+        map<string, User>::iterator user = userMap.find(*u);
+        if (user == userMap.end()) {
+            continue;
+        }
+        for (auto it = bookMap.begin(); it != bookMap.end(); ++it) {
+            if (prefersGenre(user->second, it->second.getGenre())) {
+                wanted.insert(make_pair(user->first, it->first));
             }
-            User user(userId, name, email, preferences);
+        }
+    }
 
-            // Deserialize Book
-            string bookId = item["book"]["id"].s();
-            string title = item["book"]["title"].s();
-            string author = item["book"]["author"].s();
-            string genre = item["book"]["genre"].s();
-            string isbn = item["book"]["isbn"].s();
-            Book book(bookId, title, author, genre, isbn);
+    // Queued books go to every other user who prefers their genre
+    for (auto b = books.begin(); b != books.end(); ++b) {
+        map<string, Book>::iterator book = bookMap.find(*b);
+        if (book == bookMap.end()) {
+            continue;
+        }
+        string genre = book->second.getGenre();
+        for (auto it = userMap.begin(); it != userMap.end(); ++it) {
+            if (!users.count(it->first) && prefersGenre(it->second, genre)) {
+                wanted.insert(make_pair(it->first, book->first));
+            }
+        }
+    }
 
-            // Construct Recommendation
-            Recommendation recommendation(id, user, book);
-            data[recommendation.getId()] = recommendation;
+    unsigned long long lastNumber = 0;
+    for (auto it = recommendationMap.begin(); it != recommendationMap.end();) {
+        lastNumber = max(lastNumber, recommendationNumber(it->first));
+        Recommendation& rec = it->second;
+        string userId = rec.getUser().getId();
+        string bookId = rec.getBook().getId();
+        if (!users.count(userId) && !books.count(bookId)) {
+            ++it;
+            continue;
+        }
+        // A pair already taken by an earlier entry is a duplicate and goes too
+        if (!wanted.erase(make_pair(userId, bookId))) {
+            recordDelete("recommendations", it->first);
+            it = recommendationMap.erase(it);
+            continue;
         }
+        string before = rec.getJsonFragment();
+        rec.setUser(userMap[userId]);
+        rec.setBook(bookMap[bookId]);
+        if (rec.getJsonFragment() != before) {
+            recordUpsert("recommendations", it->first, rec.getJsonFragment());
+        }
+        ++it;
     }
 
-    return data;
+    for (auto it = wanted.begin(); it != wanted.end(); ++it) {
+        stringstream ss;
+        ss << setfill('0') << setw(3) << ++lastNumber;
+        string recId = recommendationIdPrefix() + ss.str();
+        Recommendation& rec = recommendationMap[recId];
+        rec = Recommendation(recId, userMap[it->first], bookMap[it->second]);
+        recordUpsert("recommendations", recId, rec.getJsonFragment());
+    }
+    recommendationGeneration++;
+}
+
+static void enqueue(set<string>& pending, const string& id) {
+    lock_guard<mutex> lock(queueMutex);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (pendingUsers.empty() && pendingBooks.empty()) {
+        oldestQueued = now;
+    }
+    if (enqueuedTasks == appliedTasks) {
+        oldestUnapplied = now;
+    }
+    pending.insert(id);
+    enqueuedTasks++;
+    queueChanged.notify_all();
+}
+
+void enqueueRecommendationsForUser(string userId) {
+    enqueue(pendingUsers, userId);
+}
+
+void enqueueRecommendationsForBook(string bookId) {
+    enqueue(pendingBooks, bookId);
 }
 
+// Applies everything queued so far as one batch
+static void drainPending() {
+    set<string> users;
+    set<string> books;
+    unsigned long long target;
+    {
+        lock_guard<mutex> lock(queueMutex);
+        users.swap(pendingUsers);
+        books.swap(pendingBooks);
+        target = enqueuedTasks;
+    }
+
+    if (!users.empty() || !books.empty()) {
+        TraceRoot trace("recommendation batch");
+        unique_lock<shared_mutex> dataLock(dataMutex);
+        chrono::steady_clock::time_point rebuildStart = chrono::steady_clock::now();
+        applyRecommendationBatch(users, books);
+        dataVersion++;
+        publishListSnapshots();
+        recordRecommendationRebuild(rebuildStart);
+    }
+
+    lock_guard<mutex> lock(queueMutex);
+    if (target > appliedTasks) {
+        appliedTasks = target;
+    }
+    oldestUnapplied = oldestQueued;
+    queueChanged.notify_all();
+}
+
+static void runWorker() {
+    unique_lock<mutex> lock(queueMutex);
+    while (true) {
+        queueChanged.wait(lock, [] { return stopRequested || !pendingUsers.empty() || !pendingBooks.empty(); });
+        if (pendingUsers.empty() && pendingBooks.empty()) {
+            break;
+        }
+        queueChanged.wait_for(lock, BATCH_WINDOW, [] { return stopRequested; });
+
+        lock.unlock();
+        drainPending();
+        lock.lock();
+    }
+}
+
+void startRecommendationWorker() {
+    lock_guard<mutex> lock(queueMutex);
+    if (workerRunning) {
+        return;
+    }
+    stopRequested = false;
+    workerRunning = true;
+    worker = thread(runWorker);
+}
+
+void stopRecommendationWorker() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (!workerRunning) {
+            return;
+        }
+        stopRequested = true;
+        queueChanged.notify_all();
+    }
+    worker.join();
+
+    lock_guard<mutex> lock(queueMutex);
+    workerRunning = false;
+}
+
+void flushRecommendations() {
+    unique_lock<mutex> lock(queueMutex);
+    if (!workerRunning) {
+        lock.unlock();
+        drainPending();
+        return;
+    }
+    unsigned long long target = enqueuedTasks;
+    queueChanged.wait(lock, [target] { return appliedTasks >= target; });
+}
+
+void setRecommendationStatusHeaders(response& res) {
+    RecommendationStatus status = getRecommendationStatus();
+    res.set_header("X-Recommendation-Generation", to_string(status.generation));
+    res.set_header("X-Recommendation-Pending", to_string(status.pendingTasks));
+    res.set_header("X-Recommendation-Staleness-Ms", to_string(status.stalenessMillis));
+}
+
+RecommendationStatus getRecommendationStatus() {
+    lock_guard<mutex> lock(queueMutex);
+    RecommendationStatus status;
+    status.generation = recommendationGeneration.load();
+    status.pendingTasks = enqueuedTasks - appliedTasks;
+    status.stalenessMillis = 0;
+    if (status.pendingTasks > 0) {
+        status.stalenessMillis = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - oldestUnapplied).count();
+    }
+    return status;
+}
@@ -4,6 +4,7 @@
 #include "UserBookInteraction.h"
 #include <crow.h>
 #include <map>
+#include <vector>
 
 using namespace std;
 using namespace crow;
@@ -13,10 +14,43 @@ public:
     Recommendation() : UserBookInteraction() {}
     Recommendation(string id, User user, Book book)
         : UserBookInteraction(id, user, book) {}
+
+    const string& getJsonFragment();
+    shared_ptr<const string> getSharedJsonFragment();
+
+    static constexpr auto jsonFields() {
+        return make_tuple(jsonField("id", &Recommendation::interaction_ID, JSON_REQUIRED),
+                          jsonField("user", &Recommendation::user, JSON_REQUIRED),
+                          jsonField("book", &Recommendation::book, JSON_REQUIRED));
+    }
 };
 
 // Helpers
-json::wvalue convertRecommendationToJson(Recommendation rec);
+void reindexRecommendations(vector<Recommendation>& recs);
+
+// Background recomputation. Writers enqueue the user or book they created,
+// changed or deleted and return; the worker coalesces duplicates and updates
+// the affected recommendations in place under the exclusive data lock. The
+// others keep their ids and are not logged again.
+struct RecommendationStatus {
+    unsigned long long generation;      // Bumped every time the recommendation set is replaced
+    unsigned long long pendingTasks;    // Enqueued but not yet applied
+    unsigned long long stalenessMillis; // Age of the oldest unapplied task, 0 when caught up
+};
+
+void enqueueRecommendationsForUser(string userId);
+void enqueueRecommendationsForBook(string bookId);
+void startRecommendationWorker();
+void stopRecommendationWorker(); // Applies whatever is still queued before returning
+RecommendationStatus getRecommendationStatus();
+
+// Tells clients which generation they are reading and how far it may lag the
+// latest writes: X-Recommendation-Generation, -Pending and -Staleness-Ms
+void setRecommendationStatusHeaders(response& res);
+
+// Returns once every task enqueued before the call has been applied. Drains
+// inline when no worker is running. Must not be called with the data lock held.
+void flushRecommendations();
 
 // CRUD Handlers
 response createRecommendation(request req);
@@ -27,5 +61,6 @@ response deleteRecommendation(string id);
 
 void saveRecommendationToFile(map<string, Recommendation> data, string filename);
 map<string, Recommendation> loadRecommendationFromFile(string filename);
+bool parseRecommendationJson(const json::rvalue& item, Recommendation& recommendation);
 
 #endif
@@ -0,0 +1,507 @@
+#include "Replication.h"
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "Recommendation.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "ChangeLog.h"
+#include "ChangeStream.h"
+#include "HttpClient.h"
+#include "ReviewSearch.h"
+#include "BookSuggest.h"
+#include "Facets.h"
+
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+extern map<string, User> userMap;
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+extern map<string, Recommendation> recommendationMap;
+
+ReplicationOptions replicationOptions;
+
+static const int RETRY_MILLIS = 1000;
+static const int LAG_POLL_MILLIS = 1000;
+
+static atomic<bool> replicating(false);
+static thread replicaThread;
+static atomic<bool> connected(false);
+static atomic<unsigned long long> appliedSeq(0);
+static atomic<unsigned long long> primarySeq(0);
+static atomic<long long> lagMillis(0);
+static atomic<unsigned long long> snapshots(0);
+
+static unsigned long long nowMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool parseReplicationFlag(const string& arg) {
+    const string flag = "--replica-of=";
+    if (arg.compare(0, flag.size(), flag) != 0) {
+        return false;
+    }
+    string host;
+    int port;
+    if (!parseHostPort(arg.substr(flag.size()), host, port)) {
+        return false;
+    }
+    replicationOptions.primaryHost = host;
+    replicationOptions.primaryPort = port;
+    return true;
+}
+
+bool isReadOnlyReplica() {
+    return !replicationOptions.primaryHost.empty();
+}
+
+void fillReadOnlyResponse(response& res, const string& target) {
+    string primary = "http://" + replicationOptions.primaryHost + ":" + to_string(replicationOptions.primaryPort);
+    json::wvalue error;
+    error["error"] = "read_only_replica";
+    error["primary"] = primary;
+    res.code = 307;
+    res.set_header("Location", primary + target);
+    res.set_header("Content-Type", "application/json");
+    res.body = error.dump();
+}
+
+template <typename T>
+static bool readCollection(JsonReader& in, map<string, T>& out) {
+    return readJsonArray<T>(in, [&](T& entity) {
+        entity.getJsonFragment();
+        string id = entity.getId();
+        out[id] = move(entity);
+    });
+}
+
+bool applyReplicationSnapshot(const string& body, unsigned long long& seq, int& streamPort) {
+    map<string, Book> books;
+    map<string, User> users;
+    map<string, Review> reviews;
+    map<string, Recommendation> recommendations;
+
+    // One pass over the body, building the collections as they are read
+    JsonReader in(body);
+    string key;
+    long long number;
+    bool haveSeq = false, havePort = false;
+    if (!in.beginObject()) {
+        return false;
+    }
+    while (in.nextMember(key)) {
+        bool read;
+        if (key == "seq") {
+            read = haveSeq = in.readInt(number);
+            seq = number;
+        } else if (key == "streamPort") {
+            read = havePort = in.readInt(number);
+            streamPort = (int)number;
+        } else if (key == "books") {
+            read = readCollection(in, books);
+        } else if (key == "users") {
+            read = readCollection(in, users);
+        } else if (key == "reviews") {
+            read = readCollection(in, reviews);
+        } else if (key == "recommendations") {
+            read = readCollection(in, recommendations);
+        } else {
+            read = in.skipValue();
+        }
+        if (!read) {
+            return false;
+        }
+    }
+    if (!in.finish() || !haveSeq || !havePort) {
+        return false;
+    }
+
+    DataLock lock(true);
+    bookMap.swap(books);
+    userMap.swap(users);
+    reviewMap = move(reviews);
+    recommendationMap.swap(recommendations);
+    rebuildIsbnIndex();
+    rebuildEmailIndex();
+    rebuildReviewIndex();
+    rebuildBookSuggestions();
+    rebuildFacets();
+    return true;
+}
+
+bool applyReplicatedChange(const json::rvalue& change) {
+    try {
+        string collection = change["collection"].s();
+        string id = change["id"].s();
+        bool deleted = string(change["op"].s()) == "delete";
+
+        // Parsed before anything is unindexed, so a bad entry changes nothing
+        if (collection == "books") {
+            Book book;
+            if (!deleted && !parseBookJson(change["data"], book)) {
+                return false;
+            }
+            map<string, Book>::iterator previous = bookMap.find(id);
+            if (previous != bookMap.end()) {
+                unindexBookIsbn(previous->second);
+            }
+            if (deleted) {
+                bookMap.erase(id);
+            } else {
+                book.getJsonFragment();
+                bookMap[id] = book;
+                indexBookIsbn(book);
+            }
+        } else if (collection == "users") {
+            User user;
+            if (!deleted && !parseUserJson(change["data"], user)) {
+                return false;
+            }
+            map<string, User>::iterator previous = userMap.find(id);
+            if (previous != userMap.end()) {
+                unindexUserEmail(previous->second);
+            }
+            if (deleted) {
+                userMap.erase(id);
+            } else {
+                user.getJsonFragment();
+                userMap[id] = user;
+                indexUserEmail(user);
+            }
+        } else if (collection == "reviews") {
+            if (deleted) {
+                reviewMap.erase(id);
+                unindexReview(id);
+            } else {
+                Review review;
+                if (!parseReviewJson(change["data"], review)) {
+                    return false;
+                }
+                review.getJsonFragment();
+                reviewMap.insert_or_assign(id, review);
+                indexReview(review);
+            }
+        } else if (collection == "recommendations") {
+            if (deleted) {
+                recommendationMap.erase(id);
+            } else {
+                Recommendation recommendation;
+                if (!parseRecommendationJson(change["data"], recommendation)) {
+                    return false;
+                }
+                recommendation.getJsonFragment();
+                recommendationMap[id] = recommendation;
+            }
+        } else {
+            return false;
+        }
+        refreshBookSuggestions(collection, id, deleted);
+        refreshFacets(collection, id, deleted);
+        appliedSeq = change["seq"].u();
+    } catch (const exception&) {
+        return false;
+    }
+    return true;
+}
+
+// -- Replica thread --
+
+static int connectTo(const string& host, int port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0) {
+        return -1;
+    }
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+static void sleepWhileReplicating(int millis) {
+    for (int waited = 0; waited < millis && replicating.load(); waited += 50) {
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+}
+
+static bool bootstrap(HttpConnection& primary, int& streamPort) {
+    HttpResponse res;
+    if (!primary.request("GET", "/api/replication/snapshot", "", res) || res.status != 200) {
+        return false;
+    }
+    unsigned long long seq;
+    if (!applyReplicationSnapshot(res.body, seq, streamPort)) {
+        return false;
+    }
+    appliedSeq = seq;
+    snapshots++;
+    return true;
+}
+
+// The oldest change after appliedSeq on the primary tells both how far behind
+// and since when
+static void pollLag(HttpConnection& primary) {
+    HttpResponse res;
+    if (!primary.request("GET", "/api/changes?limit=1&since=" + to_string(appliedSeq.load()), "", res) || res.status != 200) {
+        return;
+    }
+    json::rvalue feed = json::load(res.body);
+    if (!feed) {
+        return;
+    }
+    primarySeq = max(primarySeq.load(), (unsigned long long)feed["latest"].u());
+    if (feed["changes"].size() == 0) {
+        lagMillis = 0;
+    } else {
+        unsigned long long committed = feed["changes"][(size_t)0]["ts"].u();
+        unsigned long long now = nowMillis();
+        lagMillis = now > committed ? (long long)(now - committed) : 0;
+    }
+}
+
+bool applyReplicatedEvents(string& buffer) {
+    vector<string> payloads;
+    bool resync = false;
+    size_t end;
+    while ((end = buffer.find("\n\n")) != string::npos) {
+        string frame = buffer.substr(0, end);
+        buffer.erase(0, end + 2);
+        if (frame.compare(0, 13, "event: resync") == 0) {
+            resync = true;
+            break;
+        }
+        size_t data = frame.find("data: ");
+        if (data != string::npos && (data == 0 || frame[data - 1] == '\n')) {
+            payloads.push_back(frame.substr(data + 6, frame.find('\n', data) - data - 6));
+        }
+    }
+    bool applied = true;
+    if (!payloads.empty()) {
+        TraceRoot trace("replication apply");
+        DataLock lock(true);
+        for (unsigned int i = 0; applied && i < payloads.size(); i++) {
+            json::rvalue change = json::load(payloads[i]);
+            applied = change && applyReplicatedChange(change);
+        }
+    }
+    if (appliedSeq.load() > primarySeq.load()) {
+        primarySeq = appliedSeq.load();
+    }
+    return applied && !resync;
+}
+
+// Reads the stream until it drops, the primary asks for a resync or replication stops
+static void tail(HttpConnection& primary, int streamPort, bool& needSnapshot) {
+    int fd = connectTo(replicationOptions.primaryHost, streamPort);
+    if (fd < 0) {
+        return;
+    }
+    string request = "GET /api/stream?since=" + to_string(appliedSeq.load()) + " HTTP/1.1\r\nHost: " +
+                     replicationOptions.primaryHost + "\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    string buffer;
+    bool headersDone = false;
+    chrono::steady_clock::time_point nextPoll = chrono::steady_clock::now();
+    while (replicating.load()) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, 200);
+        if (ready > 0) {
+            char chunk[65536];
+            ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
+                break;
+            }
+            buffer.append(chunk, received);
+            if (!headersDone) {
+                size_t blank = buffer.find("\r\n\r\n");
+                if (blank == string::npos) {
+                    continue;
+                }
+                if (buffer.compare(0, 12, "HTTP/1.1 200") != 0) {
+                    break;
+                }
+                buffer.erase(0, blank + 4);
+                headersDone = true;
+                connected = true;
+            }
+            if (!applyReplicatedEvents(buffer)) {
+                needSnapshot = true;
+                break;
+            }
+        }
+        if (chrono::steady_clock::now() >= nextPoll) {
+            pollLag(primary);
+            nextPoll = chrono::steady_clock::now() + chrono::milliseconds(LAG_POLL_MILLIS);
+        }
+    }
+    connected = false;
+    close(fd);
+}
+
+static void runReplica() {
+    HttpConnection primary(replicationOptions.primaryHost, replicationOptions.primaryPort);
+    bool needSnapshot = true;
+    int streamPort = 0;
+    while (replicating.load()) {
+        if (needSnapshot) {
+            if (!bootstrap(primary, streamPort)) {
+                fprintf(stderr, "replica: cannot load a snapshot from %s:%d, retrying\n",
+                        replicationOptions.primaryHost.c_str(), replicationOptions.primaryPort);
+                primary.close();
+                sleepWhileReplicating(RETRY_MILLIS);
+                continue;
+            }
+            needSnapshot = false;
+        }
+        if (streamPort == 0) {
+            fprintf(stderr, "replica: the primary is not serving a change stream\n");
+            needSnapshot = true;
+            sleepWhileReplicating(RETRY_MILLIS);
+            continue;
+        }
+        // Resumes from appliedSeq; a resync event or a change that does not apply sends us back to a snapshot
+        tail(primary, streamPort, needSnapshot);
+        if (replicating.load() && !needSnapshot) {
+            sleepWhileReplicating(RETRY_MILLIS);
+        }
+    }
+}
+
+void startReplication() {
+    if (!isReadOnlyReplica() || replicating.exchange(true)) {
+        return;
+    }
+    replicaThread = thread(runReplica);
+}
+
+void stopReplication() {
+    if (!replicating.exchange(false)) {
+        return;
+    }
+    replicaThread.join();
+}
+
+ReplicationStatus getReplicationStatus() {
+    ReplicationStatus status;
+    status.connected = connected.load();
+    status.appliedSeq = appliedSeq.load();
+    status.primarySeq = primarySeq.load();
+    status.lagMillis = status.primarySeq > status.appliedSeq ? lagMillis.load() : 0;
+    status.snapshots = snapshots.load();
+    return status;
+}
+
+// -- Primary-side and shared endpoints --
+
+template <typename T>
+static string joinCollection(map<string, T>& m) {
+    vector<const string*> fragments;
+    typename map<string, T>::iterator it;
+    for (it = m.begin(); it != m.end(); ++it) {
+        fragments.push_back(&it->second.getJsonFragment());
+    }
+    return joinJsonFragments(fragments);
+}
+
+// Read from the store as text, so a paged one is not pulled through its cache
+static string joinCollection(ReviewStore& m) {
+    string json = "[", fragment;
+    for (ReviewStore::iterator it = m.begin(); it != m.end(); ++it) {
+        if (json.size() > 1) {
+            json += ',';
+        }
+        m.readSerialized(it, fragment);
+        json += fragment;
+    }
+    json += ']';
+    return json;
+}
+
+response readReplicationSnapshot(request) {
+    TraceSpan span("readReplicationSnapshot");
+    json::wvalue header;
+    header["seq"] = (uint64_t)latestChangeSeq();
+    header["streamPort"] = changeStreamPort();
+
+    string body = header.dump();
+    body.pop_back();
+    body += ",\"books\":" + joinCollection(bookMap);
+    body += ",\"users\":" + joinCollection(userMap);
+    body += ",\"reviews\":" + joinCollection(reviewMap);
+    body += ",\"recommendations\":" + joinCollection(recommendationMap) + "}";
+
+    response res(body);
+    res.set_header("Content-Type", "application/json");
+    return res;
+}
+
+// FNV-1a over id and fragment of every entity in key order
+template <typename M>
+static void digestCollection(M& m, json::wvalue& out, uint64_t& combined) {
+    uint64_t hash = 14695981039346656037ULL;
+    typename M::iterator it;
+    for (it = m.begin(); it != m.end(); ++it) {
+        const string& fragment = it->second.getJsonFragment();
+        string record = it->first + '\0' + fragment + '\n';
+        for (unsigned int i = 0; i < record.size(); i++) {
+            hash = (hash ^ (unsigned char)record[i]) * 1099511628211ULL;
+        }
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    out["count"] = (uint64_t)m.size();
+    out["hash"] = string(hex);
+    combined = (combined ^ hash) * 1099511628211ULL;
+}
+
+response readStateDigest(request) {
+    TraceSpan span("readStateDigest");
+    json::wvalue digest;
+    uint64_t combined = 14695981039346656037ULL;
+    digestCollection(bookMap, digest["collections"]["books"], combined);
+    digestCollection(userMap, digest["collections"]["users"], combined);
+    digestCollection(reviewMap, digest["collections"]["reviews"], combined);
+    digestCollection(recommendationMap, digest["collections"]["recommendations"], combined);
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)combined);
+    digest["digest"] = string(hex);
+    digest["seq"] = (uint64_t)(isReadOnlyReplica() ? appliedSeq.load() : latestChangeSeq());
+    return response(digest);
+}
+
+response readReplicationStatus(request) {
+    json::wvalue status;
+    if (!isReadOnlyReplica()) {
+        status["role"] = "primary";
+        status["seq"] = (uint64_t)latestChangeSeq();
+        status["streamPort"] = changeStreamPort();
+        return response(status);
+    }
+    ReplicationStatus replica = getReplicationStatus();
+    status["role"] = "replica";
+    status["primary"] = replicationOptions.primaryHost + ":" + to_string(replicationOptions.primaryPort);
+    status["connected"] = replica.connected;
+    status["appliedSeq"] = (uint64_t)replica.appliedSeq;
+    status["primarySeq"] = (uint64_t)replica.primarySeq;
+    status["lagChanges"] = (uint64_t)(replica.primarySeq - replica.appliedSeq);
+    status["lagMillis"] = (int64_t)replica.lagMillis;
+    status["snapshots"] = (uint64_t)replica.snapshots;
+    return response(status);
+}
@@ -0,0 +1,63 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <string>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Read replica mode: bootstrap from the primary's snapshot, then tail its
+// change stream and apply each change to the local maps. A replica serves
+// GETs and answers every write with a 307 to the primary.
+struct ReplicationOptions {
+    string primaryHost; // Empty on a primary
+    int primaryPort = 0;
+};
+
+extern ReplicationOptions replicationOptions;
+
+struct ReplicationStatus {
+    bool connected;                 // Tailing the primary's stream right now
+    unsigned long long appliedSeq;  // Primary sequence the local maps reflect
+    unsigned long long primarySeq;  // Newest primary sequence seen
+    long long lagMillis;            // Age of the oldest change not applied yet, 0 when caught up
+    unsigned long long snapshots;   // Bootstraps, including re-syncs after falling off the log
+};
+
+// Consumes --replica-of=host:port (the primary's API port)
+bool parseReplicationFlag(const string& arg);
+
+bool isReadOnlyReplica();
+
+// 307 to the same target on the primary, with a JSON hint for clients that do not follow it
+void fillReadOnlyResponse(response& res, const string& target);
+
+// Replica thread: snapshot, stream, reconnect
+void startReplication();
+void stopReplication();
+
+ReplicationStatus getReplicationStatus();
+
+// Replaces the local maps with a snapshot body; false if it does not parse.
+// Takes the data lock itself.
+bool applyReplicationSnapshot(const string& body, unsigned long long& seq, int& streamPort);
+
+// Applies one change-feed entry; caller holds the exclusive data lock
+bool applyReplicatedChange(const json::rvalue& change);
+
+// Applies every complete stream event in buffer under one exclusive lock and
+// removes it. False when the primary asked for a resync or an event does not
+// load or apply: the replica would diverge past it, so it bootstraps again.
+bool applyReplicatedEvents(string& buffer);
+
+// GET /api/replication/snapshot: every collection plus the sequence it reflects
+response readReplicationSnapshot(request req);
+
+// GET /api/replication/digest: per-collection counts and hashes; equal digests mean equal state
+response readStateDigest(request req);
+
+// GET /api/replication/status: role, applied and primary sequence, lag
+response readReplicationStatus(request req);
+
+#endif
@@ -12,26 +12,37 @@
 using namespace std;
 using namespace crow;
 
+class ReviewStore;
+
 class Review : public UserBookInteraction {
 public:
-    Review() : UserBookInteraction() {}
+    Review() : UserBookInteraction(), rating(0) {}
     Review(string id, User user, Book book, int rating, string comment)
         : UserBookInteraction(id, user, book), rating(rating), comment(comment) {}
 
     int getRating() { return rating; }
     string getComment() { return comment; }
 
-    void setRating(int value) { rating = value; }
-    void setComment(string value) { comment = value; }
+    void setRating(int value) { rating = value; version++; }
+    void setComment(string value) { comment = value; version++; }
+
+    const string& getJsonFragment();
+    shared_ptr<const string> getSharedJsonFragment();
+
+    // The embedded user and book are written as their own fragments
+    static constexpr auto jsonFields() {
+        return make_tuple(jsonField("id", &Review::interaction_ID, JSON_REQUIRED),
+                          jsonField("rating", &Review::rating, JSON_REQUIRED),
+                          jsonField("comment", &Review::comment),
+                          jsonField("user", &Review::user, JSON_REQUIRED),
+                          jsonField("book", &Review::book, JSON_REQUIRED));
+    }
 
 private:
     int rating;
     string comment;
 };
 
-// Helpers
-json::wvalue convertReviewToJson(Review& review);
-
 // CRUD Handlers
 response createReview(request req);
 response readReview(string id);
@@ -40,6 +51,8 @@ void updateReview(request req, response& res, string id);
 response deleteReview(string id);
 
 void saveReviewToFile(map<string, Review> data, string filename);
+void saveReviewToFile(ReviewStore& data, string filename);
 map<string, Review> loadReviewFromFile(string filename);
+bool parseReviewJson(const json::rvalue& item, Review& review);
 
 #endif
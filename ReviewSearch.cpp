@@ -0,0 +1,388 @@
+#include "ReviewSearch.h"
+#include "ChangeLog.h"
+#include "Trace.h"
+#include "ReviewStore.h"
+
+#include <cmath>
+#include <cctype>
+#include <cstdint>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+
+extern ReviewStore reviewMap;
+
+// BM25 parameters as commonly tuned for short documents
+static const double K1 = 1.2;
+static const double B = 0.75;
+static const size_t MAX_TOKEN_LENGTH = 32;
+static const size_t COMPACT_MIN_POSTINGS = 64; // Shorter lists are only compacted once empty
+static const size_t COMPACT_MIN_DOCUMENTS = 1024; // Replaced documents are renumbered away past this many
+static const uint32_t NO_DOCUMENT = UINT32_MAX;
+
+struct Posting {
+    uint32_t doc;
+    uint32_t tf;
+};
+
+struct Term {
+    vector<Posting> postings; // Ascending doc; may still hold replaced documents
+    uint32_t live = 0;        // Postings of current documents: the document frequency
+    // Feed the WAND upper bound. Only loosen between compactions, so the bound stays safe.
+    uint32_t maxTf = 0;
+    uint32_t minLength = UINT32_MAX;
+};
+
+// A review's text at one point in time. An updated review is indexed as a new
+// document, which keeps every posting list append-only and sorted. Replaced
+// documents are dropped once they outnumber the live ones.
+struct Document {
+    string id;
+    uint32_t length = 0;
+    bool live = false;
+    vector<uint32_t> terms; // Term ids, to find the postings again on removal
+};
+
+static bool ready = false;
+static bool listening = false;
+static unordered_map<string, uint32_t> termIds;
+static vector<Term> terms;
+static vector<Document> documents;
+static unordered_map<string, uint32_t> documentOf; // Review id to its live document
+static size_t liveDocuments = 0;
+static unsigned long long liveLength = 0;
+static size_t postingCount = 0;
+
+vector<string> tokenizeText(const string& text) {
+    vector<string> tokens;
+    string token;
+    for (size_t i = 0; i <= text.size(); i++) {
+        unsigned char c = i < text.size() ? text[i] : ' ';
+        // Bytes of multi-byte UTF-8 characters stay inside the word
+        if (isalnum(c) || c >= 0x80) {
+            if (token.size() < MAX_TOKEN_LENGTH) {
+                token += (char)tolower(c);
+            }
+        } else if (!token.empty()) {
+            tokens.push_back(token);
+            token.clear();
+        }
+    }
+    return tokens;
+}
+
+static string indexedText(Review& review) {
+    return review.getComment() + " " + review.getBook().getTitle();
+}
+
+static void addDocument(const string& id, const string& text) {
+    vector<string> tokens = tokenizeText(text);
+    sort(tokens.begin(), tokens.end());
+
+    uint32_t doc = documents.size();
+    documents.push_back(Document());
+    Document& document = documents.back();
+    document.id = id;
+    document.length = tokens.size();
+    document.live = true;
+
+    for (size_t i = 0; i < tokens.size();) {
+        size_t run = i + 1;
+        while (run < tokens.size() && tokens[run] == tokens[i]) {
+            run++;
+        }
+        unordered_map<string, uint32_t>::iterator known = termIds.find(tokens[i]);
+        uint32_t termId;
+        if (known == termIds.end()) {
+            termId = terms.size();
+            termIds[tokens[i]] = termId;
+            terms.push_back(Term());
+        } else {
+            termId = known->second;
+        }
+
+        Term& term = terms[termId];
+        Posting posting = {doc, (uint32_t)(run - i)};
+        term.postings.push_back(posting);
+        term.live++;
+        term.maxTf = max(term.maxTf, posting.tf);
+        term.minLength = min(term.minLength, document.length);
+        document.terms.push_back(termId);
+        postingCount++;
+        i = run;
+    }
+
+    documentOf[id] = doc;
+    liveDocuments++;
+    liveLength += document.length;
+}
+
+// Drops postings of replaced documents and re-tightens the bound inputs
+static void compactTerm(Term& term) {
+    size_t before = term.postings.size();
+    vector<Posting> kept;
+    kept.reserve(term.live);
+    term.maxTf = 0;
+    term.minLength = UINT32_MAX;
+    for (unsigned int i = 0; i < term.postings.size(); i++) {
+        const Document& document = documents[term.postings[i].doc];
+        if (document.live) {
+            kept.push_back(term.postings[i]);
+            term.maxTf = max(term.maxTf, term.postings[i].tf);
+            term.minLength = min(term.minLength, document.length);
+        }
+    }
+    term.postings.swap(kept);
+    postingCount -= before - term.postings.size();
+}
+
+static void removeDocument(const string& id) {
+    unordered_map<string, uint32_t>::iterator found = documentOf.find(id);
+    if (found == documentOf.end()) {
+        return;
+    }
+    Document& document = documents[found->second];
+    document.live = false;
+    liveDocuments--;
+    liveLength -= document.length;
+    documentOf.erase(found);
+
+    // A list is rewritten once most of it is dead, so removal stays amortized O(1) per posting
+    for (unsigned int i = 0; i < document.terms.size(); i++) {
+        Term& term = terms[document.terms[i]];
+        term.live--;
+        if (term.live == 0 || (term.postings.size() >= COMPACT_MIN_POSTINGS && term.live * 2 < term.postings.size())) {
+            compactTerm(term);
+        }
+    }
+    vector<uint32_t>().swap(document.terms);
+    string().swap(document.id);
+}
+
+// Renumbers the live documents in their current order, so every posting list
+// stays sorted, and drops the replaced documents and the terms only they used.
+// O(postings), run once replaced documents outnumber live ones.
+static void compactDocuments() {
+    TraceSpan span("compactReviewIndex");
+    vector<uint32_t> documentIds(documents.size(), NO_DOCUMENT);
+    vector<Document> keptDocuments;
+    keptDocuments.reserve(liveDocuments);
+    for (uint32_t doc = 0; doc < documents.size(); doc++) {
+        if (documents[doc].live) {
+            documentIds[doc] = keptDocuments.size();
+            documentOf[documents[doc].id] = keptDocuments.size();
+            keptDocuments.push_back(move(documents[doc]));
+        }
+    }
+    documents.swap(keptDocuments);
+
+    vector<uint32_t> termIdsNow(terms.size(), NO_DOCUMENT);
+    vector<Term> keptTerms;
+    for (unordered_map<string, uint32_t>::iterator it = termIds.begin(); it != termIds.end();) {
+        if (terms[it->second].live == 0) {
+            it = termIds.erase(it);
+            continue;
+        }
+        termIdsNow[it->second] = keptTerms.size();
+        keptTerms.push_back(move(terms[it->second]));
+        it->second = keptTerms.size() - 1;
+        ++it;
+    }
+    terms.swap(keptTerms);
+
+    postingCount = 0;
+    for (unsigned int t = 0; t < terms.size(); t++) {
+        Term& term = terms[t];
+        vector<Posting> kept;
+        kept.reserve(term.live);
+        term.maxTf = 0;
+        term.minLength = UINT32_MAX;
+        for (unsigned int i = 0; i < term.postings.size(); i++) {
+            uint32_t doc = documentIds[term.postings[i].doc];
+            if (doc != NO_DOCUMENT) {
+                Posting posting = {doc, term.postings[i].tf};
+                kept.push_back(posting);
+                term.maxTf = max(term.maxTf, posting.tf);
+                term.minLength = min(term.minLength, documents[doc].length);
+            }
+        }
+        term.postings.swap(kept);
+        postingCount += term.postings.size();
+    }
+    for (unsigned int doc = 0; doc < documents.size(); doc++) {
+        for (unsigned int i = 0; i < documents[doc].terms.size(); i++) {
+            documents[doc].terms[i] = termIdsNow[documents[doc].terms[i]];
+        }
+    }
+}
+
+static void followChange(const Change& change) {
+    if (!ready || change.collection != "reviews") {
+        return;
+    }
+    if (change.deleted) {
+        unindexReview(change.id);
+        return;
+    }
+    // Writers update the map before they record the change
+    ReviewStore::iterator it = reviewMap.find(change.id);
+    if (it != reviewMap.end()) {
+        indexReview(it->second);
+    }
+}
+
+void rebuildReviewIndex() {
+    TraceSpan span("rebuildReviewIndex");
+    termIds.clear();
+    terms.clear();
+    documents.clear();
+    documentOf.clear();
+    liveDocuments = 0;
+    liveLength = 0;
+    postingCount = 0;
+
+    documents.reserve(reviewMap.size());
+    documentOf.reserve(reviewMap.size());
+    for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end(); ++it) {
+        addDocument(it->first, indexedText(it->second));
+    }
+    ready = true;
+    if (!listening) {
+        addChangeListener(followChange);
+        listening = true;
+    }
+}
+
+bool reviewIndexReady() {
+    return ready;
+}
+
+static void compactIfMostlyReplaced() {
+    if (documents.size() >= COMPACT_MIN_DOCUMENTS && liveDocuments * 2 < documents.size()) {
+        compactDocuments();
+    }
+}
+
+void indexReview(Review& review) {
+    removeDocument(review.getId());
+    addDocument(review.getId(), indexedText(review));
+    compactIfMostlyReplaced();
+}
+
+void unindexReview(const string& id) {
+    removeDocument(id);
+    compactIfMostlyReplaced();
+}
+
+struct Cursor {
+    const Term* term;
+    size_t pos;
+    double idf;
+    double bound; // No document can get more than this from the term
+
+    uint32_t doc() const {
+        return pos < term->postings.size() ? term->postings[pos].doc : NO_DOCUMENT;
+    }
+};
+
+static double termScore(double idf, uint32_t tf, uint32_t length, double averageLength) {
+    return idf * tf * (K1 + 1) / (tf + K1 * (1 - B + B * length / averageLength));
+}
+
+vector<ScoredReview> rankReviews(const string& query, size_t k) {
+    TraceSpan span("rankReviews");
+    vector<ScoredReview> ranked;
+    if (liveDocuments == 0 || k == 0) {
+        return ranked;
+    }
+    double averageLength = max(1.0, (double)liveLength / liveDocuments);
+
+    vector<string> tokens = tokenizeText(query);
+    sort(tokens.begin(), tokens.end());
+    tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
+    vector<Cursor> cursors;
+    for (unsigned int i = 0; i < tokens.size(); i++) {
+        unordered_map<string, uint32_t>::iterator known = termIds.find(tokens[i]);
+        if (known == termIds.end() || terms[known->second].live == 0) {
+            continue;
+        }
+        const Term& term = terms[known->second];
+        Cursor cursor;
+        cursor.term = &term;
+        cursor.pos = 0;
+        cursor.idf = log(1 + (liveDocuments - term.live + 0.5) / (term.live + 0.5));
+        cursor.bound = termScore(cursor.idf, term.maxTf, term.minLength, averageLength);
+        cursors.push_back(cursor);
+    }
+
+    // The best k so far with the weakest on top; equal scores prefer the older document
+    auto better = [](const pair<double, uint32_t>& a, const pair<double, uint32_t>& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    };
+    priority_queue<pair<double, uint32_t>, vector<pair<double, uint32_t> >, decltype(better)> best(better);
+    double threshold = 0;
+
+    while (true) {
+        sort(cursors.begin(), cursors.end(), [](const Cursor& a, const Cursor& b) { return a.doc() < b.doc(); });
+
+        // Pivot: the first document where the cursors up to it could together beat the k-th best
+        double reach = 0;
+        size_t pivot = 0;
+        while (pivot < cursors.size() && cursors[pivot].doc() != NO_DOCUMENT) {
+            reach += cursors[pivot].bound;
+            if (reach > threshold) {
+                break;
+            }
+            pivot++;
+        }
+        if (pivot == cursors.size() || cursors[pivot].doc() == NO_DOCUMENT) {
+            break;
+        }
+        uint32_t pivotDoc = cursors[pivot].doc();
+
+        if (cursors[0].doc() == pivotDoc) {
+            const Document& document = documents[pivotDoc];
+            double score = 0;
+            for (unsigned int i = 0; i < cursors.size() && cursors[i].doc() == pivotDoc; i++) {
+                if (document.live) {
+                    score += termScore(cursors[i].idf, cursors[i].term->postings[cursors[i].pos].tf, document.length, averageLength);
+                }
+                cursors[i].pos++;
+            }
+            if (document.live && (best.size() < k || score > threshold)) {
+                best.push(make_pair(score, pivotDoc));
+                if (best.size() > k) {
+                    best.pop();
+                }
+                if (best.size() == k) {
+                    threshold = best.top().first;
+                }
+            }
+        } else {
+            // Nothing before the pivot can make the top k: skip those cursors ahead
+            Posting target = {pivotDoc, 0};
+            for (size_t i = 0; i < pivot; i++) {
+                const vector<Posting>& postings = cursors[i].term->postings;
+                cursors[i].pos = lower_bound(postings.begin() + cursors[i].pos, postings.end(), target,
+                                             [](const Posting& a, const Posting& b) { return a.doc < b.doc; }) - postings.begin();
+            }
+        }
+    }
+
+    while (!best.empty()) {
+        ScoredReview result = {documents[best.top().second].id, best.top().first};
+        ranked.push_back(result);
+        best.pop();
+    }
+    reverse(ranked.begin(), ranked.end());
+    return ranked;
+}
+
+ReviewIndexStats getReviewIndexStats() {
+    ReviewIndexStats stats;
+    stats.documents = liveDocuments;
+    stats.documentSlots = documents.size();
+    stats.terms = termIds.size();
+    stats.postings = postingCount;
+    return stats;
+}
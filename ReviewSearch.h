@@ -0,0 +1,44 @@
+#ifndef REVIEWSEARCH_H
+#define REVIEWSEARCH_H
+
+#include <string>
+#include <vector>
+#include "Review.h"
+
+using namespace std;
+
+// Inverted index over each review's comment and book title, ranked with BM25
+// for GET /api/reviews?q=. Follows every review change in the change log, so
+// cascades from user and book writes keep it current too. Written under the
+// exclusive data lock, queried under the shared one.
+struct ScoredReview {
+    string id;
+    double score;
+};
+
+struct ReviewIndexStats {
+    size_t documents;     // Reviews indexed
+    size_t documentSlots; // Including replaced documents not compacted away yet
+    size_t terms;         // Distinct tokens
+    size_t postings;      // Including postings of replaced reviews not compacted away yet
+};
+
+// Lowercased runs of letters and digits
+vector<string> tokenizeText(const string& text);
+
+// Indexes every review in reviewMap from scratch and starts following the
+// change log. Call before the server threads start, or with the exclusive lock.
+void rebuildReviewIndex();
+bool reviewIndexReady();
+
+// For writers that bypass the change log (replication); exclusive lock held
+void indexReview(Review& review);
+void unindexReview(const string& id);
+
+// Best k reviews for the query, highest score first. Skips documents whose
+// score cannot reach the current k-th best (WAND).
+vector<ScoredReview> rankReviews(const string& query, size_t k);
+
+ReviewIndexStats getReviewIndexStats();
+
+#endif
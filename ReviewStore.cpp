@@ -0,0 +1,677 @@
+#include "ReviewStore.h"
+#include "Serialize.h"
+
+#include <vector>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+ReviewStoreOptions reviewStoreOptions;
+
+// A record is the id's length and the JSON's length, 4 bytes each and
+// little-endian, then the id, then the JSON
+static const size_t RECORD_HEADER = 8;
+// Charged per cached review besides twice its JSON: the pair, its Review and the slot's share
+static const size_t REVIEW_OVERHEAD = sizeof(ReviewStore::value_type) + 64;
+// The JSON size assumed for a review not yet written, until some have been
+static const size_t DEFAULT_REVIEW_BYTES = 512;
+// Compaction reads a segment this much at a time and moves each read's records under one lock
+static const size_t COMPACT_READ_BYTES = 64 * 1024;
+
+struct ReviewStore::Segment {
+    string path;
+    int fd;
+    uint64_t size = 0; // Bytes appended
+    uint64_t live = 0; // Of those, records some review still points at
+
+    Segment(const string& path, int fd) : path(path), fd(fd) {}
+    ~Segment() { ::close(fd); }
+};
+
+// Reviews pinned on this thread; a ReviewPins trims it back when it ends
+static thread_local vector<shared_ptr<ReviewStore::value_type> > pins;
+
+bool parseReviewStoreFlag(const string& arg) {
+    size_t eq = arg.find('=');
+    if (eq == string::npos) {
+        return false;
+    }
+    string key = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+
+    try {
+        if (key == "--review-store" && !value.empty()) {
+            reviewStoreOptions.dir = value;
+        } else if (key == "--review-cache-mb") {
+            reviewStoreOptions.cacheBytes = stoul(value) << 20;
+        } else {
+            return false;
+        }
+    } catch (const exception&) {
+        return false;
+    }
+    return true;
+}
+
+static void putLength(string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out += (char)(value >> (8 * i));
+    }
+}
+
+static uint32_t getLength(const char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)(unsigned char)in[i] << (8 * i);
+    }
+    return value;
+}
+
+// FNV-1a, to tell whether a cached review still matches what was written
+static uint64_t hashJson(const char* text, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The user and book ids a review's JSON embeds, skipping everything else
+static void readReferences(const char* text, size_t length, string& userId, string& bookId) {
+    JsonReader in(text, text + length);
+    string key;
+    if (!in.beginObject()) {
+        return;
+    }
+    while (in.nextMember(key)) {
+        string* id = key == "user" ? &userId : key == "book" ? &bookId : nullptr;
+        if (!id) {
+            in.skipValue();
+            continue;
+        }
+        string member;
+        if (!in.beginObject()) {
+            return;
+        }
+        while (in.nextMember(member)) {
+            if (member == "id") {
+                in.readString(*id);
+            } else {
+                in.skipValue();
+            }
+        }
+    }
+}
+
+static shared_ptr<ReviewStore::value_type> decode(const string& id, const char* text, size_t length) {
+    shared_ptr<ReviewStore::value_type> record = make_shared<ReviewStore::value_type>(id, Review());
+    JsonReader in(text, text + length);
+    if (!readJson(in, record->second) || !in.finish()) {
+        throw runtime_error("review store: the record for review " + id + " does not parse");
+    }
+    return record;
+}
+
+// -- Iteration --
+
+ReviewStore::value_type& ReviewStore::iterator::operator*() const {
+    if (!store->isPaged) {
+        return *at->second.record;
+    }
+    if (!held) {
+        lock_guard<mutex> guard(store->lock);
+        held = store->load(at);
+    }
+    return *held;
+}
+
+ReviewStore::ReviewStore()
+    : isPaged(false), newest(nullptr), oldest(nullptr), cachedReviews(0), cachedBytes(0), active(0), nextSegment(1),
+      writtenBytes(0), writtenRecords(0), hits(0), misses(0), appends(0), compactions(0), stopping(false) {}
+
+ReviewStore::~ReviewStore() {
+    stopCompactor();
+    // Reading the reviews back in would only slow the exit
+    lock_guard<mutex> guard(lock);
+    dropSegments();
+}
+
+// -- Opening and closing --
+
+bool ReviewStore::open(const ReviewStoreOptions& settings) {
+    close();
+    if (mkdir(settings.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+    // Left by an earlier run; the reviews are loaded afresh each start
+    if (DIR* dir = opendir(settings.dir.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name.compare(0, 8, "reviews-") == 0 && name.size() > 12 && name.compare(name.size() - 4, 4, ".seg") == 0) {
+                ::unlink((settings.dir + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    lock_guard<mutex> guard(lock);
+    options = settings;
+    if (!startSegment()) {
+        return false;
+    }
+    isPaged = true;
+    // Reviews already held become cached ones, written out as they leave
+    for (Position it = slots.begin(); it != slots.end(); ++it) {
+        cache(it->second, it->second.record->second.getJsonFragment().size());
+    }
+    evict(nullptr);
+    stopping = false;
+    compactor = thread(&ReviewStore::compactLoop, this);
+    return true;
+}
+
+void ReviewStore::close() {
+    if (!isPaged) {
+        return;
+    }
+    stopCompactor();
+    lock_guard<mutex> guard(lock);
+    for (Position it = slots.begin(); it != slots.end(); ++it) {
+        Slot& slot = it->second;
+        if (!slot.record) {
+            string text;
+            readRecord(it->first, slot, text);
+            slot.record = decode(it->first, text.data(), text.size());
+        }
+        slot.newer = slot.older = nullptr;
+        slot.length = 0;
+        slot.cost = 0;
+    }
+    newest = oldest = nullptr;
+    cachedReviews = 0;
+    cachedBytes = 0;
+    dropSegments();
+    isPaged = false;
+}
+
+void ReviewStore::stopCompactor() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    compactWake.notify_all();
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+}
+
+// -- Map operations --
+
+pair<ReviewStore::iterator, bool> ReviewStore::insert_or_assign(const string& id, Review review) {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+    }
+    Position position = slots.lower_bound(id);
+    bool inserted = position == slots.end() || position->first != id;
+    if (inserted) {
+        position = slots.emplace_hint(position, id, Slot());
+    }
+    Slot& slot = position->second;
+    // Assigned in place, so pins and iterators on the review see the new one
+    if (slot.record) {
+        slot.record->second = move(review);
+        if (isPaged) {
+            touch(slot);
+        }
+    } else {
+        slot.record = make_shared<value_type>(id, move(review));
+        if (isPaged) {
+            cache(slot, 0);
+            evict(&slot);
+        }
+    }
+    iterator it(this, position);
+    if (isPaged) {
+        it.held = slot.record;
+    }
+    return make_pair(it, inserted);
+}
+
+ReviewStore::iterator ReviewStore::emplace_hint(iterator hint, string&& id, Review&& review) {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+    }
+    size_t before = slots.size();
+    Position position = slots.emplace_hint(hint.at, move(id), Slot());
+    Slot& slot = position->second;
+    if (slots.size() > before) {
+        slot.record = make_shared<value_type>(position->first, move(review));
+        if (isPaged) {
+            cache(slot, 0);
+            evict(&slot);
+        }
+    }
+    return iterator(this, position);
+}
+
+ReviewStore::iterator ReviewStore::erase(iterator it) {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+        Slot& slot = it.at->second;
+        forget(it.at->first, slot);
+        if (slot.record) {
+            uncache(slot);
+        }
+    }
+    return iterator(this, slots.erase(it.at));
+}
+
+size_t ReviewStore::erase(const string& id) {
+    iterator it = find(id);
+    if (it == end()) {
+        return 0;
+    }
+    erase(it);
+    return 1;
+}
+
+void ReviewStore::clear() {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+        newest = oldest = nullptr;
+        cachedReviews = 0;
+        cachedBytes = 0;
+        slots.clear();
+        dropSegments();
+        startSegment();
+        return;
+    }
+    slots.clear();
+}
+
+ReviewStore& ReviewStore::operator=(map<string, Review> data) {
+    clear();
+    for (map<string, Review>::iterator it = data.begin(); it != data.end(); it = data.erase(it)) {
+        if (isPaged) {
+            const string& json = it->second.getJsonFragment();
+            insertSerialized(it->first, json.data(), json.size());
+        } else {
+            Position position = slots.emplace_hint(slots.end(), it->first, Slot());
+            position->second.record = make_shared<value_type>(it->first, move(it->second));
+        }
+    }
+    return *this;
+}
+
+void ReviewStore::insertSerialized(const string& id, const char* text, size_t length) {
+    if (!isPaged) {
+        slots[id].record = decode(id, text, length);
+        return;
+    }
+    lock_guard<mutex> guard(lock);
+    Position position = slots.lower_bound(id);
+    if (position == slots.end() || position->first != id) {
+        position = slots.emplace_hint(position, id, Slot());
+    }
+    Slot& slot = position->second;
+    if (slot.record) {
+        uncache(slot);
+    }
+    if (!append(id, text, length, hashJson(text, length), slot)) {
+        throw runtime_error("review store: cannot write to " + options.dir);
+    }
+    slot.userId.clear();
+    slot.bookId.clear();
+    readReferences(text, length, slot.userId, slot.bookId);
+}
+
+void ReviewStore::readSerialized(const iterator& it, string& out) {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+    }
+    const Slot& slot = it.at->second;
+    if (slot.record) {
+        out = slot.record->second.getJsonFragment();
+    } else {
+        readRecord(it.at->first, slot, out);
+    }
+}
+
+void ReviewStore::appendSerialized(Position position, string& out) {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+    }
+    const Slot& slot = position->second;
+    if (slot.record) {
+        out += slot.record->second.getJsonFragment();
+    } else {
+        string text;
+        readRecord(position->first, slot, text);
+        out += text;
+    }
+}
+
+bool ReviewStore::refersToUser(const iterator& it, const string& userId) {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+    }
+    const Slot& slot = it.at->second;
+    return slot.record ? slot.record->second.getUserId() == userId : slot.userId == userId;
+}
+
+bool ReviewStore::refersToBook(const iterator& it, const string& bookId) {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (isPaged) {
+        guard.lock();
+    }
+    const Slot& slot = it.at->second;
+    return slot.record ? slot.record->second.getBookId() == bookId : slot.bookId == bookId;
+}
+
+Review* ReviewStore::pin(const iterator& it) {
+    value_type& entry = *it;
+    if (isPaged) {
+        pins.push_back(it.held);
+    }
+    return &entry.second;
+}
+
+shared_ptr<const ReviewStore::value_type> ReviewStore::resident(const iterator& it) {
+    if (!isPaged) {
+        return it.at->second.record;
+    }
+    lock_guard<mutex> guard(lock);
+    return it.at->second.record;
+}
+
+ReviewPins::ReviewPins() : mark(pins.size()) {}
+
+ReviewPins::~ReviewPins() {
+    pins.resize(mark);
+}
+
+ReviewStoreStats ReviewStore::stats() {
+    lock_guard<mutex> guard(lock);
+    ReviewStoreStats stats = {cachedReviews, cachedBytes, hits, misses, appends, segments.size(), 0, 0, compactions};
+    for (map<uint32_t, shared_ptr<Segment> >::iterator it = segments.begin(); it != segments.end(); ++it) {
+        stats.diskBytes += it->second->size;
+        stats.liveBytes += it->second->live;
+    }
+    return stats;
+}
+
+// -- The cache; the lock is held from here down --
+
+shared_ptr<ReviewStore::value_type> ReviewStore::load(Position position) {
+    Slot& slot = position->second;
+    if (slot.record) {
+        hits++;
+        touch(slot);
+        // Over budget only once pins that held it there are gone
+        if (cachedBytes > options.cacheBytes) {
+            evict(&slot);
+        }
+        return slot.record;
+    }
+    misses++;
+    string text;
+    readRecord(position->first, slot, text);
+    slot.record = decode(position->first, text.data(), text.size());
+    cache(slot, slot.length);
+    evict(&slot);
+    return slot.record;
+}
+
+void ReviewStore::readRecord(const string& id, const Slot& slot, string& out) {
+    map<uint32_t, shared_ptr<Segment> >::iterator segment = segments.find(slot.segment);
+    size_t size = RECORD_HEADER + id.size() + slot.length;
+    string record(size, '\0');
+    if (slot.length == 0 || segment == segments.end() ||
+        pread(segment->second->fd, &record[0], size, slot.offset) != (ssize_t)size || getLength(&record[0]) != id.size() ||
+        getLength(&record[4]) != slot.length || record.compare(RECORD_HEADER, id.size(), id) != 0) {
+        throw runtime_error("review store: cannot read review " + id);
+    }
+    out.assign(record, RECORD_HEADER + id.size(), slot.length);
+}
+
+void ReviewStore::linkNewest(Slot& slot) {
+    slot.older = newest;
+    slot.newer = nullptr;
+    (newest ? newest->newer : oldest) = &slot;
+    newest = &slot;
+}
+
+void ReviewStore::unlinkSlot(Slot& slot) {
+    (slot.newer ? slot.newer->older : newest) = slot.older;
+    (slot.older ? slot.older->newer : oldest) = slot.newer;
+    slot.newer = slot.older = nullptr;
+}
+
+void ReviewStore::cache(Slot& slot, size_t jsonBytes) {
+    if (jsonBytes == 0) {
+        jsonBytes = writtenRecords > 0 ? writtenBytes / writtenRecords : DEFAULT_REVIEW_BYTES;
+    }
+    slot.cost = REVIEW_OVERHEAD + 2 * jsonBytes;
+    linkNewest(slot);
+    cachedReviews++;
+    cachedBytes += slot.cost;
+}
+
+void ReviewStore::uncache(Slot& slot) {
+    unlinkSlot(slot);
+    cachedReviews--;
+    cachedBytes -= slot.cost;
+    slot.cost = 0;
+    slot.record.reset();
+}
+
+void ReviewStore::touch(Slot& slot) {
+    if (newest != &slot) {
+        unlinkSlot(slot);
+        linkNewest(slot);
+    }
+}
+
+// Drops least recently used reviews until the cache is within budget. keep
+// and pinned reviews (held by an iterator or a ReviewPins) stay; a pinned one
+// moves to the front, so later passes do not walk over it again.
+void ReviewStore::evict(Slot* keep) {
+    Slot* slot = oldest;
+    for (size_t left = cachedReviews; left > 0 && slot && cachedBytes > options.cacheBytes; left--) {
+        Slot* next = slot->newer;
+        if (slot != keep) {
+            if (slot->record.use_count() > 1 || !writeBack(*slot)) {
+                touch(*slot);
+            } else {
+                uncache(*slot);
+            }
+        }
+        slot = next;
+    }
+}
+
+// Appends the review if it differs from its last written record. Changes made
+// through a reference or iterator are caught here, so nothing has to mark them.
+bool ReviewStore::writeBack(Slot& slot) {
+    const string& json = slot.record->second.getJsonFragment();
+    uint64_t hash = hashJson(json.data(), json.size());
+    if (slot.length == json.size() && slot.hash == hash) {
+        return true;
+    }
+    if (!append(slot.record->first, json.data(), json.size(), hash, slot)) {
+        return false;
+    }
+    slot.userId = slot.record->second.getUserId();
+    slot.bookId = slot.record->second.getBookId();
+    return true;
+}
+
+bool ReviewStore::append(const string& id, const char* text, size_t length, uint64_t hash, Slot& slot) {
+    map<uint32_t, shared_ptr<Segment> >::iterator found = segments.find(active);
+    if (found == segments.end()) {
+        return false;
+    }
+    Segment& segment = *found->second;
+    string record;
+    record.reserve(RECORD_HEADER + id.size() + length);
+    putLength(record, id.size());
+    putLength(record, length);
+    record += id;
+    record.append(text, length);
+    if (pwrite(segment.fd, record.data(), record.size(), segment.size) != (ssize_t)record.size()) {
+        return false;
+    }
+    forget(id, slot);
+    slot.segment = active;
+    slot.offset = segment.size;
+    slot.length = length;
+    slot.hash = hash;
+    segment.size += record.size();
+    segment.live += record.size();
+    writtenBytes += length;
+    writtenRecords++;
+    appends++;
+    if (segment.size >= options.segmentBytes && startSegment()) {
+        compactWake.notify_one();
+    }
+    return true;
+}
+
+// The review's last record no longer counts as live
+void ReviewStore::forget(const string& id, Slot& slot) {
+    if (slot.length == 0) {
+        return;
+    }
+    map<uint32_t, shared_ptr<Segment> >::iterator segment = segments.find(slot.segment);
+    if (segment != segments.end()) {
+        segment->second->live -= RECORD_HEADER + id.size() + slot.length;
+    }
+    slot.length = 0;
+}
+
+bool ReviewStore::startSegment() {
+    char name[32];
+    snprintf(name, sizeof(name), "/reviews-%06u.seg", nextSegment);
+    string path = options.dir + name;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    active = nextSegment++;
+    segments[active] = make_shared<Segment>(path, fd);
+    return true;
+}
+
+void ReviewStore::dropSegments() {
+    for (map<uint32_t, shared_ptr<Segment> >::iterator it = segments.begin(); it != segments.end(); ++it) {
+        ::unlink(it->second->path.c_str());
+    }
+    segments.clear();
+}
+
+// -- Compaction --
+
+int ReviewStore::compact() {
+    lock_guard<mutex> one(compacting);
+    int rewritten = 0;
+    while (true) {
+        uint32_t id = 0;
+        shared_ptr<Segment> victim;
+        {
+            lock_guard<mutex> guard(lock);
+            for (map<uint32_t, shared_ptr<Segment> >::iterator it = segments.begin(); it != segments.end(); ++it) {
+                if (it->first != active && it->second->live * 100 < it->second->size * options.compactLivePercent) {
+                    id = it->first;
+                    victim = it->second;
+                    break;
+                }
+            }
+        }
+        if (!victim || !rewriteSegment(id, victim)) {
+            return rewritten;
+        }
+        rewritten++;
+    }
+}
+
+// Appends the segment's live records to the active one and deletes it. The
+// file is read outside the lock, and a record is only moved if its review
+// still points at it; a sealed segment is never appended to.
+bool ReviewStore::rewriteSegment(uint32_t id, shared_ptr<Segment> segment) {
+    uint64_t size = segment->size;
+    uint64_t offset = 0; // Of the first record not yet looked at
+    size_t want = COMPACT_READ_BYTES;
+    string chunk;
+    while (offset < size) {
+        chunk.resize((size_t)min<uint64_t>(want, size - offset));
+        if (pread(segment->fd, &chunk[0], chunk.size(), offset) != (ssize_t)chunk.size()) {
+            return false;
+        }
+        size_t at = 0;
+        size_t needed = 0; // Of a record that did not fit
+        {
+            lock_guard<mutex> guard(lock);
+            while (at + RECORD_HEADER <= chunk.size()) {
+                uint32_t idLength = getLength(&chunk[at]);
+                uint32_t length = getLength(&chunk[at + 4]);
+                size_t total = RECORD_HEADER + idLength + length;
+                if (at + total > chunk.size()) {
+                    needed = total;
+                    break;
+                }
+                string key(chunk, at + RECORD_HEADER, idLength);
+                Position found = slots.find(key);
+                if (found != slots.end() && found->second.length != 0 && found->second.segment == id &&
+                    found->second.offset == offset + at) {
+                    Slot& slot = found->second;
+                    if (!append(key, &chunk[at + RECORD_HEADER + idLength], length, slot.hash, slot)) {
+                        return false;
+                    }
+                }
+                at += total;
+            }
+        }
+        if (at == 0) {
+            // One record larger than a read, or a torn one at the end
+            if (needed == 0 || offset + needed > size) {
+                return false;
+            }
+            want = needed;
+            continue;
+        }
+        want = COMPACT_READ_BYTES;
+        offset += at;
+    }
+
+    lock_guard<mutex> guard(lock);
+    if (segments.erase(id) > 0) {
+        ::unlink(segment->path.c_str());
+    }
+    compactions++;
+    return true;
+}
+
+void ReviewStore::compactLoop() {
+    unique_lock<mutex> guard(lock);
+    while (!stopping) {
+        compactWake.wait_for(guard, chrono::seconds(1));
+        if (stopping) {
+            break;
+        }
+        guard.unlock();
+        compact();
+        guard.lock();
+    }
+}
@@ -0,0 +1,224 @@
+#ifndef REVIEWSTORE_H
+#define REVIEWSTORE_H
+
+#include "Review.h"
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <iterator>
+#include <cstdint>
+
+using namespace std;
+
+// Where reviewMap keeps its reviews. By default every review is held in
+// memory, as in a plain map. Opened on a directory, the store pages them
+// out: each review is a record holding its JSON fragment in append-only
+// segment files, the index keeps only id -> record, and an LRU cache holds up
+// to cacheBytes of recently used reviews decoded. A review changed in memory
+// is appended again when it leaves the cache, and a background thread
+// rewrites sealed segments that are mostly superseded records. The segments
+// are scratch space for one run; reviews.json stays the saved copy.
+//
+// The interface is the part of map<string, Review> the handlers use. An
+// iterator keeps the review it points at in memory while it is on it; a
+// Review* that must outlive its iterator is taken with pin() under a
+// ReviewPins. There is no operator[]: a bare Review& could be paged out
+// under its holder. Code that walks many reviews keeps Positions and reads
+// each review's JSON with appendSerialized, so only one is held at a time.
+struct ReviewStoreOptions {
+    string dir;                          // Empty keeps every review in memory
+    size_t cacheBytes = 256 << 20;       // Decoded reviews, at twice their JSON size each
+    size_t segmentBytes = 64 << 20;      // A segment this large is sealed and a new one started
+    int compactLivePercent = 50;         // Sealed segments with fewer live bytes are rewritten
+};
+
+extern ReviewStoreOptions reviewStoreOptions;
+
+// Consumes --review-store=DIR and --review-cache-mb=N
+bool parseReviewStoreFlag(const string& arg);
+
+struct ReviewStoreStats {
+    size_t cachedReviews;
+    size_t cachedBytes;
+    unsigned long long hits;        // Reviews found decoded in the cache
+    unsigned long long misses;      // Reviews read back from a segment
+    unsigned long long appends;     // Records written, compaction included
+    size_t segments;
+    unsigned long long diskBytes;   // Segment bytes on disk
+    unsigned long long liveBytes;   // Of those, records still current
+    unsigned long long compactions; // Segments rewritten
+};
+
+class ReviewStore {
+public:
+    typedef pair<const string, Review> value_type;
+
+private:
+    struct Slot {
+        shared_ptr<value_type> record; // Null while the review is only on disk
+        Slot* newer = nullptr;         // LRU neighbours while cached
+        Slot* older = nullptr;
+        uint64_t offset = 0;           // Of the record in its segment
+        uint64_t hash = 0;             // Of the JSON written there
+        uint32_t segment = 0;
+        uint32_t length = 0;           // Of that JSON; 0 before the review is first written
+        uint32_t cost = 0;             // Charged to the cache while record is held
+        string userId;                 // Of the review as last written, so fan-outs
+        string bookId;                 // can pass over it without reading it in
+    };
+    struct Segment;
+    typedef map<string, Slot> Slots;
+
+public:
+    typedef Slots::iterator Position; // An entry's place; stays put until the entry is erased
+
+    class iterator {
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef ReviewStore::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator() : store(nullptr) {}
+        value_type& operator*() const;
+        value_type* operator->() const { return &**this; }
+        iterator& operator++() {
+            ++at;
+            held.reset();
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator before = *this;
+            ++*this;
+            return before;
+        }
+        bool operator==(const iterator& other) const { return at == other.at; }
+        bool operator!=(const iterator& other) const { return at != other.at; }
+
+        const string& key() const { return at->first; } // Without reading the review
+        Position position() const { return at; }
+
+    private:
+        friend class ReviewStore;
+        iterator(ReviewStore* store, Position at) : store(store), at(at) {}
+
+        ReviewStore* store;
+        Position at;
+        mutable shared_ptr<value_type> held; // Paged stores only
+    };
+
+    ReviewStore();
+    ~ReviewStore();
+    ReviewStore(const ReviewStore&) = delete;
+    ReviewStore& operator=(const ReviewStore&) = delete;
+
+    // Pages the reviews out under options.dir, removing segments a previous
+    // run left there. False if the directory cannot be written.
+    bool open(const ReviewStoreOptions& options);
+    // Reads every review back into memory and removes the segments
+    void close();
+    bool paged() const { return isPaged; }
+
+    iterator begin() { return iterator(this, slots.begin()); }
+    iterator end() { return iterator(this, slots.end()); }
+    iterator find(const string& id) { return iterator(this, slots.find(id)); }
+    iterator lower_bound(const string& id) { return iterator(this, slots.lower_bound(id)); }
+    iterator at(Position position) { return iterator(this, position); }
+    size_t count(const string& id) const { return slots.count(id); }
+    size_t size() const { return slots.size(); }
+    bool empty() const { return slots.empty(); }
+
+    // Like map::insert_or_assign; the iterator keeps the review in memory
+    pair<iterator, bool> insert_or_assign(const string& id, Review review);
+    iterator emplace_hint(iterator hint, string&& id, Review&& review);
+    iterator erase(iterator it);
+    size_t erase(const string& id);
+    void clear();
+    ReviewStore& operator=(map<string, Review> data);
+
+    // Adds or replaces a review from its JSON text. A paged store writes the
+    // text out as it is, so loading never holds the reviews in memory.
+    void insertSerialized(const string& id, const char* text, size_t length);
+    // The review's JSON, without reading it into the cache
+    void readSerialized(const iterator& it, string& out);
+    void appendSerialized(Position position, string& out);
+
+    // Whether the review embeds that user or book. A review on disk answers
+    // from the ids it was written with, so it is not read in.
+    bool refersToUser(const iterator& it, const string& userId);
+    bool refersToBook(const iterator& it, const string& bookId);
+
+    // The review, kept in memory until the innermost ReviewPins on this
+    // thread goes out of scope
+    Review* pin(const iterator& it);
+
+    // For memory accounting: the review if it is in memory, without reading
+    // it in, and what an index entry takes besides its key
+    shared_ptr<const value_type> resident(const iterator& it);
+    static size_t entryBytes() { return sizeof(Slots::value_type); }
+
+    // Rewrites the segments compaction is due for now instead of waiting for
+    // the background thread; returns how many
+    int compact();
+
+    ReviewStoreStats stats();
+
+private:
+    Slots slots;
+    bool isPaged;
+    ReviewStoreOptions options;
+
+    // Everything below, and the slots' fields, are guarded by lock while
+    // paged. Insertions and erasures also take it, so the compactor can look
+    // entries up while handlers hold only the shared data lock.
+    mutex lock;
+    Slot* newest;
+    Slot* oldest;
+    size_t cachedReviews;
+    size_t cachedBytes;
+    map<uint32_t, shared_ptr<Segment> > segments;
+    uint32_t active;      // The segment appended to
+    uint32_t nextSegment; // Never reused, so a stale offset cannot match a new segment
+    unsigned long long writtenBytes, writtenRecords; // For the cost of reviews not yet written
+    unsigned long long hits, misses, appends, compactions;
+
+    mutex compacting; // One compaction at a time
+    thread compactor;
+    condition_variable compactWake;
+    bool stopping;
+
+    shared_ptr<value_type> load(Position position);
+    void readRecord(const string& id, const Slot& slot, string& out);
+    void linkNewest(Slot& slot);
+    void unlinkSlot(Slot& slot);
+    void cache(Slot& slot, size_t jsonBytes);
+    void uncache(Slot& slot);
+    void touch(Slot& slot);
+    void evict(Slot* keep);
+    bool writeBack(Slot& slot);
+    bool append(const string& id, const char* text, size_t length, uint64_t hash, Slot& slot);
+    void forget(const string& id, Slot& slot);
+    bool startSegment();
+    void dropSegments();
+    bool rewriteSegment(uint32_t id, shared_ptr<Segment> segment);
+    void compactLoop();
+    void stopCompactor();
+};
+
+// Pins taken on this thread while it is in scope stay valid until it ends
+class ReviewPins {
+public:
+    ReviewPins();
+    ~ReviewPins();
+    ReviewPins(const ReviewPins&) = delete;
+    ReviewPins& operator=(const ReviewPins&) = delete;
+
+private:
+    size_t mark;
+};
+
+#endif
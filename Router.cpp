@@ -0,0 +1,334 @@
+// Router in front of N bookReviewAPI shard processes (started with --shard=i/N).
+// Users, reviews and recommendations live on the shard that owns the user id;
+// every shard holds the whole catalog, so book writes go to all of them.
+//
+//   ./router --port=18700 --shards=127.0.0.1:18701,127.0.0.1:18702
+
+#include "ShardRouter.h"
+#include "Sharding.h"
+#include "HttpClient.h"
+
+#include <crow.h>
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+using namespace crow;
+
+static vector<ShardEndpoint> shards;
+static atomic<unsigned> nextReader(0);
+
+// Review ids say nothing about their user, so the router remembers where each
+// one was created or last found and scatters only on a miss
+static const size_t MAX_REMEMBERED_REVIEWS = 4000000;
+static mutex reviewShardsMutex;
+static unordered_map<string, int> reviewShards;
+
+static const char* methodName(HTTPMethod method) {
+    switch (method) {
+        case HTTPMethod::POST: return "POST";
+        case HTTPMethod::PUT: return "PUT";
+        case HTTPMethod::DELETE: return "DELETE";
+        default: return "GET";
+    }
+}
+
+// One keep-alive connection per shard per router thread
+static HttpConnection& connectionTo(int shard) {
+    thread_local vector<unique_ptr<HttpConnection> > pool;
+    if (pool.empty()) {
+        for (unsigned int i = 0; i < shards.size(); i++) {
+            pool.emplace_back(new HttpConnection(shards[i].host, shards[i].port));
+        }
+    }
+    return *pool[shard];
+}
+
+static response toResponse(const HttpResponse& upstream) {
+    response res(upstream.status, upstream.body);
+    map<string, string>::const_iterator type = upstream.headers.find("content-type");
+    if (type != upstream.headers.end()) {
+        res.set_header("Content-Type", type->second);
+    }
+    return res;
+}
+
+static response unavailable(int shard) {
+    return response(502, "Shard " + to_string(shard) + " is unavailable");
+}
+
+static response forward(int shard, const request& req) {
+    HttpResponse upstream;
+    if (!connectionTo(shard).request(methodName(req.method), req.raw_url, req.body, upstream)) {
+        return unavailable(shard);
+    }
+    return toResponse(upstream);
+}
+
+// Sends the request to every shard before reading any reply, so a scatter
+// costs about one shard round trip instead of N
+static vector<bool> scatter(const request& req, vector<HttpResponse>& replies) {
+    string method = methodName(req.method);
+    vector<bool> ok(shards.size());
+    replies.assign(shards.size(), HttpResponse());
+    for (unsigned int s = 0; s < shards.size(); s++) {
+        ok[s] = connectionTo(s).send(method, req.raw_url, req.body);
+    }
+    for (unsigned int s = 0; s < shards.size(); s++) {
+        if (!ok[s] || !connectionTo(s).receive(replies[s])) {
+            // Stale keep-alive connection: retry this shard on its own
+            connectionTo(s).close();
+            ok[s] = connectionTo(s).request(method, req.raw_url, req.body, replies[s]);
+        }
+    }
+    return ok;
+}
+
+// Catalog writes: every shard must agree, or the client hears which did not
+static response broadcast(const request& req) {
+    vector<HttpResponse> replies;
+    vector<bool> ok = scatter(req, replies);
+    bool agreed = true;
+    for (unsigned int s = 0; s < shards.size(); s++) {
+        agreed = agreed && ok[s] && replies[s].status == replies[0].status;
+    }
+    if (agreed) {
+        return toResponse(replies[0]);
+    }
+    json::wvalue error;
+    error["error"] = "shards_disagree";
+    for (unsigned int s = 0; s < shards.size(); s++) {
+        error["statuses"][s] = ok[s] ? replies[s].status : 0;
+    }
+    return response(502, error.dump());
+}
+
+static response gather(const request& req, const string& collection) {
+    vector<HttpResponse> replies;
+    vector<bool> ok = scatter(req, replies);
+    vector<string> bodies;
+    for (unsigned int s = 0; s < shards.size(); s++) {
+        if (!ok[s]) {
+            return unavailable(s);
+        }
+        if (replies[s].status != 200) {
+            return toResponse(replies[s]);
+        }
+        bodies.push_back(replies[s].body);
+    }
+    string merged;
+    if (!mergeShardLists(collection, req.url_params, bodies, merged)) {
+        return response(502, "Shards returned lists that could not be merged");
+    }
+    response res(merged);
+    res.set_header("Content-Type", "application/json");
+    return res;
+}
+
+// Point operation whose owner is unknown: only the owner answers with something other than 404
+static response scatterFind(const request& req, int& found) {
+    vector<HttpResponse> replies;
+    vector<bool> ok = scatter(req, replies);
+    found = -1;
+    for (unsigned int s = 0; s < shards.size(); s++) {
+        if (!ok[s]) {
+            return unavailable(s);
+        }
+        if (replies[s].status != 404 && found < 0) {
+            found = s;
+        }
+    }
+    return toResponse(replies[found < 0 ? 0 : found]);
+}
+
+static string encodePathSegment(const string& value) {
+    static const char* HEX = "0123456789ABCDEF";
+    string encoded;
+    for (size_t i = 0; i < value.size(); i++) {
+        unsigned char c = value[i];
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' || c == '@' || c == '+') {
+            encoded += c;
+        } else {
+            encoded += '%';
+            encoded += HEX[c >> 4];
+            encoded += HEX[c & 15];
+        }
+    }
+    return encoded;
+}
+
+// Each shard keeps its own users' emails unique; across shards the router asks
+// all of them first. Two writes racing on different shards can both get through.
+static bool emailTakenElsewhere(const string& email, const string& id) {
+    if (email.empty()) {
+        return false;
+    }
+    request probe;
+    probe.method = HTTPMethod::GET;
+    probe.raw_url = "/api/users/by-email/" + encodePathSegment(email);
+    vector<HttpResponse> replies;
+    vector<bool> ok = scatter(probe, replies);
+    for (unsigned int s = 0; s < shards.size(); s++) {
+        if (!ok[s] || replies[s].status != 200) {
+            continue;
+        }
+        json::rvalue owner = json::load(replies[s].body);
+        if (owner && owner.has("id") && string(owner["id"].s()) != id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void rememberReview(const string& id, int shard) {
+    lock_guard<mutex> lock(reviewShardsMutex);
+    if (shard < 0) {
+        reviewShards.erase(id);
+        return;
+    }
+    if (reviewShards.size() >= MAX_REMEMBERED_REVIEWS) {
+        reviewShards.clear();
+    }
+    reviewShards[id] = shard;
+}
+
+// -- Routes --
+
+static response routeBooks(const request& req) {
+    if (req.method == HTTPMethod::GET) {
+        return forward(nextReader++ % shards.size(), req);
+    }
+    return broadcast(req);
+}
+
+static response routeSuggestions(const request& req) {
+    return gather(req, "suggestions");
+}
+
+static response routeBook(const request& req, string) {
+    return routeBooks(req);
+}
+
+static response routeUsers(const request& req) {
+    if (req.method == HTTPMethod::GET) {
+        return gather(req, "users");
+    }
+    json::rvalue body = json::load(req.body);
+    if (!body || !body.has("id")) {
+        return response(400, "Invalid JSON");
+    }
+    if (body.has("email") && emailTakenElsewhere(body["email"].s(), body["id"].s())) {
+        return response(409, "Email already belongs to another user");
+    }
+    return forward(shardForUser(body["id"].s(), shards.size()), req);
+}
+
+static response routeUser(const request& req, string id) {
+    if (req.method == HTTPMethod::PUT) {
+        json::rvalue body = json::load(req.body);
+        if (body && body.has("email") && emailTakenElsewhere(body["email"].s(), id)) {
+            return response(409, "Email already belongs to another user");
+        }
+    }
+    return forward(shardForUser(id, shards.size()), req);
+}
+
+static response routeUserByEmail(const request& req, string) {
+    int shard = -1;
+    return scatterFind(req, shard);
+}
+
+static response routeReviews(const request& req) {
+    if (req.method == HTTPMethod::GET) {
+        return gather(req, "reviews");
+    }
+    json::rvalue body = json::load(req.body);
+    if (!body || !body.has("id") || !body.has("user") || !body["user"].has("id")) {
+        return response(400, "Invalid JSON");
+    }
+    int shard = shardForUser(body["user"]["id"].s(), shards.size());
+    response res = forward(shard, req);
+    if (res.code == 201 || res.code == 200) {
+        rememberReview(body["id"].s(), shard);
+    }
+    return res;
+}
+
+static response routeReview(const request& req, string id) {
+    int shard = -1;
+    {
+        lock_guard<mutex> lock(reviewShardsMutex);
+        unordered_map<string, int>::iterator known = reviewShards.find(id);
+        if (known != reviewShards.end()) {
+            shard = known->second;
+        }
+    }
+
+    response res;
+    if (shard >= 0) {
+        res = forward(shard, req);
+    }
+    if (shard < 0 || res.code == 404) {
+        res = scatterFind(req, shard);
+    }
+    bool gone = req.method == HTTPMethod::DELETE && res.code < 300;
+    rememberReview(id, gone ? -1 : shard);
+    return res;
+}
+
+static response routeRecommendations(const request& req) {
+    return gather(req, "recommendations");
+}
+
+static response routeRecommendation(const request& req, string id) {
+    int shard = recommendationShard(id, shards.size());
+    if (shard >= 0) {
+        return forward(shard, req);
+    }
+    return scatterFind(req, shard);
+}
+
+int main(int argc, char* argv[]) {
+    int port = 18700;
+    int threads = max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 9, "--shards=") == 0 && parseShardList(arg.substr(9), shards)) {
+            continue;
+        }
+        if (arg.compare(0, 7, "--port=") == 0) {
+            port = atoi(arg.c_str() + 7);
+        } else if (arg.compare(0, 10, "--threads=") == 0) {
+            threads = max(1, atoi(arg.c_str() + 10));
+        } else {
+            cerr << "unknown or malformed option: " << arg << "\n"
+                 << "usage: router --shards=HOST:PORT,HOST:PORT,... [--port=N] [--threads=N]\n";
+            return 1;
+        }
+    }
+    if (shards.empty()) {
+        cerr << "usage: router --shards=HOST:PORT,HOST:PORT,... [--port=N] [--threads=N]\n";
+        return 1;
+    }
+
+    SimpleApp app;
+
+    CROW_ROUTE(app, "/api/books").methods(HTTPMethod::GET, HTTPMethod::POST)(routeBooks);
+    CROW_ROUTE(app, "/api/books/suggest").methods(HTTPMethod::GET)(routeSuggestions);
+    CROW_ROUTE(app, "/api/books/isbn/<string>").methods(HTTPMethod::GET)(routeBook);
+    CROW_ROUTE(app, "/api/books/<string>").methods(HTTPMethod::GET, HTTPMethod::PUT, HTTPMethod::DELETE)(routeBook);
+    CROW_ROUTE(app, "/api/users").methods(HTTPMethod::GET, HTTPMethod::POST)(routeUsers);
+    CROW_ROUTE(app, "/api/users/by-email/<string>").methods(HTTPMethod::GET)(routeUserByEmail);
+    CROW_ROUTE(app, "/api/users/<string>").methods(HTTPMethod::GET, HTTPMethod::PUT, HTTPMethod::DELETE)(routeUser);
+    CROW_ROUTE(app, "/api/reviews").methods(HTTPMethod::GET, HTTPMethod::POST)(routeReviews);
+    CROW_ROUTE(app, "/api/reviews/<string>").methods(HTTPMethod::GET, HTTPMethod::PUT, HTTPMethod::DELETE)(routeReview);
+    CROW_ROUTE(app, "/api/recommendations").methods(HTTPMethod::GET)(routeRecommendations);
+    CROW_ROUTE(app, "/api/recommendations/<string>").methods(HTTPMethod::GET)(routeRecommendation);
+
+    app.port(port).concurrency(threads).run();
+    return 0;
+}
@@ -0,0 +1,492 @@
+#include "Serialize.h"
+
+#include <cstdlib>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <algorithm>
+
+void writeJson(string& out, const string& value) {
+    static const char HEX[] = "0123456789abcdef";
+    out += '"';
+    size_t plain = 0; // Start of the run not yet copied
+    for (size_t i = 0; i < value.size(); i++) {
+        unsigned char c = value[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(value, plain, i - plain);
+        plain = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += HEX[c >> 4];
+                out += HEX[c & 15];
+        }
+    }
+    out.append(value, plain, string::npos);
+    out += '"';
+}
+
+void writeJson(string& out, int value) {
+    char digits[16];
+    out.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+void writeJson(string& out, const vector<string>& values) {
+    out += '[';
+    for (unsigned int i = 0; i < values.size(); i++) {
+        if (i > 0) {
+            out += ',';
+        }
+        writeJson(out, values[i]);
+    }
+    out += ']';
+}
+
+// -- JsonReader --
+
+void JsonReader::skipSpace() {
+    while (at < end && (*at == ' ' || *at == '\n' || *at == '\r' || *at == '\t')) {
+        at++;
+    }
+}
+
+bool JsonReader::fail(const char* why) {
+    if (!failed) {
+        failed = true;
+        failedAt = at;
+        reason = why;
+    }
+    return false;
+}
+
+bool JsonReader::mismatch(const char* type) {
+    if (at == end) {
+        return fail("unexpected end of input");
+    }
+    if (!failed) {
+        failed = true;
+        failedAt = at;
+        expected = type;
+    }
+    return false;
+}
+
+bool JsonReader::expect(char c, const char* why) {
+    skipSpace();
+    if (failed || at == end || *at != c) {
+        return fail(at == end ? "unexpected end of input" : why);
+    }
+    at++;
+    return true;
+}
+
+bool JsonReader::enter(char c, const char* type) {
+    skipSpace();
+    if (failed || at == end || *at != c) {
+        return mismatch(type);
+    }
+    if (depth == MAX_DEPTH) {
+        return fail("nesting is too deep");
+    }
+    at++;
+    depth++;
+    open = true;
+    return true;
+}
+
+// True at the closing bracket c, which is consumed. Otherwise consumes the
+// comma every member or element but the first needs. A failed read counts
+// as closed, so loops over members end.
+bool JsonReader::closes(char c) {
+    skipSpace();
+    if (failed || at == end) {
+        fail("unexpected end of input");
+        return true;
+    }
+    if (*at == c) {
+        at++;
+        depth--;
+        open = false;
+        return true;
+    }
+    if (!open && !expect(',', c == '}' ? "expected ',' or '}'" : "expected ',' or ']'")) {
+        return true;
+    }
+    open = false;
+    return false;
+}
+
+bool JsonReader::beginObject() {
+    return enter('{', "an object");
+}
+
+bool JsonReader::nextMember(string& key) {
+    if (closes('}') || failed) {
+        return false;
+    }
+    skipSpace();
+    if (at < end && *at != '"') {
+        return fail("expected a member name");
+    }
+    return readString(key) && expect(':', "expected ':'");
+}
+
+bool JsonReader::beginArray() {
+    return enter('[', "an array");
+}
+
+bool JsonReader::nextElement() {
+    return !closes(']') && !failed;
+}
+
+bool JsonReader::nextRunElement() {
+    skipSpace();
+    if (failed || at == end) {
+        return false;
+    }
+    if (*at == ']') {
+        at++;
+        return false;
+    }
+    if (*at != '[' && *at != ',') {
+        return fail("expected ',' or ']'");
+    }
+    bool first = *at++ == '[';
+    skipSpace();
+    if (first && at < end && *at == ']') {
+        at++;
+        return false;
+    }
+    return true;
+}
+
+void JsonReader::inMember(const string& name) {
+    if (!failed || reason) {
+        return; // Syntax errors are reported by offset alone
+    }
+    if (field.empty() || field[0] == '[') {
+        field = name + field;
+    } else {
+        field = name + "." + field;
+    }
+}
+
+string JsonReader::error() const {
+    if (!failed) {
+        return "";
+    }
+    string offset = " at offset " + to_string(failedAt - begin);
+    if (reason) {
+        return reason + offset;
+    }
+    if (field.empty()) {
+        return string("expected ") + expected + offset;
+    }
+    return field + " must be " + expected;
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static void appendUtf8(string& out, unsigned code) {
+    if (code < 0x80) {
+        out += (char)code;
+    } else if (code < 0x800) {
+        out += (char)(0xc0 | (code >> 6));
+        out += (char)(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        out += (char)(0xe0 | (code >> 12));
+        out += (char)(0x80 | ((code >> 6) & 0x3f));
+        out += (char)(0x80 | (code & 0x3f));
+    } else {
+        out += (char)(0xf0 | (code >> 18));
+        out += (char)(0x80 | ((code >> 12) & 0x3f));
+        out += (char)(0x80 | ((code >> 6) & 0x3f));
+        out += (char)(0x80 | (code & 0x3f));
+    }
+}
+
+bool JsonReader::readString(string& out) {
+    skipSpace();
+    if (failed || at == end || *at != '"') {
+        return mismatch("a string");
+    }
+    at++;
+    out.clear();
+    while (true) {
+        // Copy up to the next quote or escape in one go
+        const char* run = at;
+        while (at < end && *at != '"' && *at != '\\') {
+            at++;
+        }
+        out.append(run, at - run);
+        if (at == end) {
+            return fail("unterminated string");
+        }
+        if (*at++ == '"') {
+            return true;
+        }
+        if (at == end) {
+            return fail("unterminated string");
+        }
+        char c = *at++;
+        switch (c) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned code = 0;
+                for (int i = 0; i < 4; i++) {
+                    int digit = at < end ? hexDigit(*at) : -1;
+                    if (digit < 0) {
+                        return fail("bad \\u escape");
+                    }
+                    at++;
+                    code = code * 16 + digit;
+                }
+                // A high surrogate followed by its low half is one code point
+                if (code >= 0xd800 && code < 0xdc00 && end - at >= 6 && at[0] == '\\' && at[1] == 'u') {
+                    unsigned low = 0;
+                    for (int i = 2; i < 6 && hexDigit(at[i]) >= 0; i++) {
+                        low = low * 16 + hexDigit(at[i]);
+                    }
+                    if (low >= 0xdc00 && low < 0xe000) {
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        at += 6;
+                    }
+                }
+                appendUtf8(out, code);
+                break;
+            }
+            default:
+                at--;
+                return fail("bad escape");
+        }
+    }
+}
+
+bool JsonReader::readInt(long long& out, long long min, long long max) {
+    skipSpace();
+    if (failed) {
+        return false;
+    }
+    const char* start = at;
+    const char* digits = at < end && *at == '-' ? at + 1 : at;
+    const char* stop = digits;
+    while (stop < end && *stop >= '0' && *stop <= '9') {
+        stop++;
+    }
+    if (stop == digits || (stop < end && (*stop == '.' || *stop == 'e' || *stop == 'E'))) {
+        return mismatch("an integer");
+    }
+    if (from_chars(start, stop, out).ec != errc() || out < min || out > max) {
+        return mismatch(max == INT_MAX ? "a 32-bit integer" : "an integer in range");
+    }
+    at = stop;
+    return true;
+}
+
+bool JsonReader::skipValue() {
+    skipSpace();
+    if (failed || at == end) {
+        return fail("unexpected end of input");
+    }
+    char c = *at;
+    if (c == '"') {
+        for (at++; at < end && *at != '"'; at++) {
+            if (*at == '\\' && at + 1 < end) {
+                at++;
+            }
+        }
+        return at < end ? (at++, true) : fail("unterminated string");
+    }
+    if (c == '{' || c == '[') {
+        // Brackets are only counted, not matched; the depth still bounds them
+        int nested = 0;
+        for (; at < end; at++) {
+            if (*at == '"') {
+                if (!skipValue()) {
+                    return false;
+                }
+                at--;
+            } else if (*at == '{' || *at == '[') {
+                if (depth + ++nested > MAX_DEPTH) {
+                    return fail("nesting is too deep");
+                }
+            } else if ((*at == '}' || *at == ']') && --nested == 0) {
+                at++;
+                return true;
+            }
+        }
+        return fail("unexpected end of input");
+    }
+    const char* start = at;
+    while (at < end && (isalnum((unsigned char)*at) || *at == '-' || *at == '+' || *at == '.')) {
+        at++;
+    }
+    return at > start || fail("unexpected character");
+}
+
+bool JsonReader::finish() {
+    skipSpace();
+    return !failed && (at == end || fail("unexpected content after the value"));
+}
+
+bool splitJsonArray(const char* begin, const char* end, size_t parts, vector<JsonRun>& runs) {
+    runs.clear();
+    const char* at = begin;
+    while (at < end && isspace((unsigned char)*at)) {
+        at++;
+    }
+    if (at == end || *at != '[') {
+        return false;
+    }
+    size_t target = (end - at) / max(parts, (size_t)1) + 1;
+    const char* runStart = at;
+    int depth = 0;
+    for (at++; at < end; at++) {
+        char c = *at;
+        if (c == '"') {
+            // To the closing quote: one not preceded by an odd run of backslashes
+            while (true) {
+                const char* quote = (const char*)memchr(at + 1, '"', end - at - 1);
+                if (!quote) {
+                    return false;
+                }
+                const char* slash = quote;
+                while (slash[-1] == '\\') {
+                    slash--;
+                }
+                at = quote;
+                if ((quote - slash) % 2 == 0) {
+                    break;
+                }
+            }
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (depth > 0) {
+                depth--;
+                continue;
+            }
+            if (c == '}') {
+                return false;
+            }
+            runs.push_back(JsonRun{runStart, at + 1});
+            for (at++; at < end; at++) {
+                if (!isspace((unsigned char)*at)) {
+                    return false;
+                }
+            }
+            return true;
+        } else if (c == ',' && depth == 0 && (size_t)(at - runStart) >= target) {
+            runs.push_back(JsonRun{runStart, at});
+            runStart = at;
+        }
+    }
+    return false;
+}
+
+bool readJson(JsonReader& in, string& value) {
+    return in.readString(value);
+}
+
+bool readJson(JsonReader& in, int& value) {
+    long long number;
+    if (!in.readInt(number, INT_MIN, INT_MAX)) {
+        return false;
+    }
+    value = (int)number;
+    return true;
+}
+
+bool readJson(JsonReader& in, vector<string>& values) {
+    values.clear();
+    if (!in.beginArray()) {
+        return false;
+    }
+    while (in.nextElement()) {
+        values.push_back(string());
+        if (!in.readString(values.back())) {
+            in.inMember("[" + to_string(values.size() - 1) + "]");
+            return false;
+        }
+    }
+    return in.ok();
+}
+
+// -- Request bodies --
+
+bool isMissingJson(const string& value, string&) {
+    return value.empty();
+}
+
+bool isMissingJson(int, string&) {
+    return false;
+}
+
+bool isMissingJson(const vector<string>&, string&) {
+    return false;
+}
+
+bool rejectJsonBody(response& error, int code, const string& message) {
+    error.code = code;
+    error.body = message;
+    return false;
+}
+
+// -- Parsed values --
+
+bool readJson(const json::rvalue& in, string& value) {
+    if (in.t() != json::type::String) {
+        return false;
+    }
+    value = in.s();
+    return true;
+}
+
+bool readJson(const json::rvalue& in, int& value) {
+    if (in.t() != json::type::Number) {
+        return false;
+    }
+    value = (int)in.i();
+    return true;
+}
+
+bool readJson(const json::rvalue& in, vector<string>& values) {
+    if (in.t() != json::type::List) {
+        return false;
+    }
+    values.clear();
+    for (const json::rvalue& item : in) {
+        values.push_back(string());
+        if (!readJson(item, values.back())) {
+            return false;
+        }
+    }
+    return true;
+}
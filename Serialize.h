@@ -0,0 +1,342 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <string>
+#include <vector>
+#include <tuple>
+#include <utility>
+#include <climits>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Compile-time field lists for the entities. Each class declares
+//
+//     static constexpr auto jsonFields() {
+//         return make_tuple(jsonField("id", &Book::id, JSON_REQUIRED), ...);
+//     }
+//
+// in the order its JSON fragment lists them, and the templates below expand
+// that tuple into a writer that appends straight to a string and a reader
+// that fills the members in one pass over the text, with no json::wvalue or
+// rvalue in between. Members are strings, ints, string vectors or another
+// entity; an embedded entity is written as its cached fragment. The list is
+// also the request schema: creates must carry the JSON_REQUIRED members.
+enum JsonPresence { JSON_OPTIONAL, JSON_REQUIRED };
+
+template <typename T, typename M>
+struct JsonField {
+    const char* name;
+    M T::*member;
+    JsonPresence presence;
+};
+
+template <typename T, typename M>
+constexpr JsonField<T, M> jsonField(const char* name, M T::*member, JsonPresence presence = JSON_OPTIONAL) {
+    return JsonField<T, M>{name, member, presence};
+}
+
+constexpr bool sameJsonName(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+template <typename T>
+using JsonFieldIndexes = make_index_sequence<tuple_size<decltype(T::jsonFields())>::value>;
+
+template <typename T, size_t... I>
+constexpr unsigned jsonFieldBit(const char* name, index_sequence<I...>) {
+    unsigned bit = 0;
+    ((bit |= sameJsonName(get<I>(T::jsonFields()).name, name) ? 1u << I : 0u), ...);
+    return bit;
+}
+
+// The bit readJson sets in seen when the text has this member
+template <typename T>
+constexpr unsigned jsonFieldBit(const char* name) {
+    return jsonFieldBit<T>(name, JsonFieldIndexes<T>());
+}
+
+template <typename T, size_t... I>
+constexpr unsigned jsonRequiredFields(index_sequence<I...>) {
+    return ((get<I>(T::jsonFields()).presence == JSON_REQUIRED ? 1u << I : 0u) | ... | 0u);
+}
+
+// The bits of the JSON_REQUIRED members
+template <typename T>
+constexpr unsigned jsonRequiredFields() {
+    return jsonRequiredFields<T>(JsonFieldIndexes<T>());
+}
+
+// -- Writing --
+
+void writeJson(string& out, const string& value); // Quoted and escaped as json::wvalue::dump does
+void writeJson(string& out, int value);
+void writeJson(string& out, const vector<string>& values);
+
+template <typename T>
+auto writeJson(string& out, T& entity) -> decltype(entity.getJsonFragment(), void()) {
+    out += entity.getJsonFragment();
+}
+
+template <typename T, size_t... I>
+void writeJsonFields(string& out, T& entity, index_sequence<I...>) {
+    constexpr auto fields = T::jsonFields();
+    out += '{';
+    ((out += I == 0 ? "\"" : ",\"", out += get<I>(fields).name, out += "\":",
+      writeJson(out, entity.*get<I>(fields).member)), ...);
+    out += '}';
+}
+
+// Appends entity as a JSON object
+template <typename T>
+void writeJsonFields(string& out, T& entity) {
+    writeJsonFields(out, entity, JsonFieldIndexes<T>());
+}
+
+// -- Reading text --
+
+// Pull parser over one JSON text. Every call returns false once the text
+// has gone wrong, and the reader stays failed; error() then says why.
+class JsonReader {
+public:
+    static const int MAX_DEPTH = 32; // Objects and arrays, counting skipped ones
+
+    JsonReader(const char* begin, const char* end)
+        : begin(begin), at(begin), end(end), failedAt(nullptr), reason(nullptr), expected(nullptr), depth(0),
+          open(false), failed(false) {}
+    explicit JsonReader(const string& text) : JsonReader(text.data(), text.data() + text.size()) {}
+    explicit JsonReader(string&&) = delete; // Would read a destroyed temporary
+
+    bool beginObject();
+    bool nextMember(string& key); // False at the closing brace
+    bool beginArray();
+    bool nextElement();           // False at the closing bracket
+    bool nextRunElement();        // Same, over a run cut by splitJsonArray
+    bool readString(string& out);
+    // Integers only; a fraction, exponent or value outside [min, max] is a type error
+    bool readInt(long long& out, long long min = LLONG_MIN, long long max = LLONG_MAX);
+    bool skipValue();
+    bool finish();                // Only whitespace left
+    bool ok() const { return !failed; }
+    const char* position() const { return at; }
+
+    // Names the member or element whose value just failed to read, so a type
+    // error deep inside reads "user.preferences[1] must be a string"
+    void inMember(const string& name);
+    string error() const;
+
+private:
+    const char* begin;
+    const char* at;
+    const char* end;
+    const char* failedAt;
+    const char* reason;   // Syntax error, or null for a value of the wrong type
+    const char* expected; // The type that value should have had
+    string field;         // Path to that value
+    int depth;
+    bool open; // Just past a bracket, so the next member or element needs no comma
+    bool failed;
+
+    void skipSpace();
+    bool fail(const char* why);
+    bool mismatch(const char* type);
+    bool expect(char c, const char* why);
+    bool enter(char c, const char* type);
+    bool closes(char c);
+};
+
+bool readJson(JsonReader& in, string& value);
+bool readJson(JsonReader& in, int& value);
+bool readJson(JsonReader& in, vector<string>& values);
+
+template <typename T>
+auto readJson(JsonReader& in, T& entity, unsigned* seen = nullptr) -> decltype(T::jsonFields(), bool());
+
+// Entities may fix up what they read, e.g. Book canonicalizing its ISBN
+template <typename T>
+auto finishJsonRead(T& entity, int) -> decltype(entity.finishJsonRead(), void()) {
+    entity.finishJsonRead();
+}
+
+template <typename T>
+void finishJsonRead(T&, long) {}
+
+template <typename T, size_t... I>
+bool readJsonMember(JsonReader& in, T& entity, const string& key, unsigned& seen, index_sequence<I...>) {
+    constexpr auto fields = T::jsonFields();
+    bool matched = false;
+    bool read = true;
+    ((matched || key != get<I>(fields).name ||
+      (matched = true, read = readJson(in, entity.*get<I>(fields).member), seen |= 1u << I)), ...);
+    if (!matched) {
+        return in.skipValue();
+    }
+    if (!read) {
+        in.inMember(key);
+    }
+    return read;
+}
+
+// Unknown members are skipped and absent ones keep their value
+template <typename T>
+auto readJson(JsonReader& in, T& entity, unsigned* seen) -> decltype(T::jsonFields(), bool()) {
+    unsigned present = 0;
+    string key;
+    if (!in.beginObject()) {
+        return false;
+    }
+    while (in.nextMember(key)) {
+        if (!readJsonMember(in, entity, key, present, JsonFieldIndexes<T>())) {
+            return false;
+        }
+    }
+    finishJsonRead(entity, 0);
+    if (seen) {
+        *seen = present;
+    }
+    return in.ok();
+}
+
+// One entity from a whole request body or file
+template <typename T>
+bool readJson(const string& text, T& entity, unsigned* seen = nullptr) {
+    JsonReader in(text);
+    return readJson(in, entity, seen) && in.finish();
+}
+
+// -- Request bodies --
+
+static const size_t MAX_JSON_BODY = 64 * 1024;
+
+bool isMissingJson(const string& value, string& path);
+bool isMissingJson(int value, string& path);
+bool isMissingJson(const vector<string>& values, string& path);
+
+// An embedded entity counts as given once it has an id
+template <typename T>
+auto isMissingJson(T& entity, string& path) -> decltype(entity.getId(), bool()) {
+    if (!entity.getId().empty()) {
+        return false;
+    }
+    path += ".id";
+    return true;
+}
+
+template <typename T, size_t... I>
+bool findMissingJson(T& entity, unsigned required, unsigned seen, string& path, index_sequence<I...>) {
+    constexpr auto fields = T::jsonFields();
+    bool missing = false;
+    ((missing = missing || ((required >> I & 1) && (path = get<I>(fields).name, !(seen >> I & 1) ||
+                                                    isMissingJson(entity.*get<I>(fields).member, path)))), ...);
+    return missing;
+}
+
+bool rejectJsonBody(response& error, int code, const string& message);
+
+// Reads a request body against T's schema: at most MAX_JSON_BODY bytes, one
+// object whose known members have their declared types, and every member in
+// required present and non-empty. Otherwise error is the 413 or 400 to send.
+template <typename T>
+bool readJsonBody(const string& body, T& entity, unsigned required, unsigned* seen, response& error) {
+    if (body.size() > MAX_JSON_BODY) {
+        return rejectJsonBody(error, 413, "Request body is larger than " + to_string(MAX_JSON_BODY) + " bytes");
+    }
+    JsonReader in(body);
+    unsigned present = 0;
+    if (!readJson(in, entity, &present) || !in.finish()) {
+        return rejectJsonBody(error, 400, "Invalid JSON: " + in.error());
+    }
+    string path;
+    if (findMissingJson(entity, required, present, path, JsonFieldIndexes<T>())) {
+        return rejectJsonBody(error, 400, path + " is required");
+    }
+    if (seen) {
+        *seen = present;
+    }
+    return true;
+}
+
+// Each element of an array of entities, handed to onItem as soon as it is read
+template <typename T, typename F>
+bool readJsonArray(JsonReader& in, F onItem) {
+    if (!in.beginArray()) {
+        return false;
+    }
+    while (in.nextElement()) {
+        T entity;
+        if (!readJson(in, entity)) {
+            return false;
+        }
+        onItem(entity);
+    }
+    return in.ok();
+}
+
+// A stretch of a JSON array's text holding whole elements: the first run
+// starts at the '[', later ones at the ',' before their first element, and
+// the last one ends with the ']'
+struct JsonRun {
+    const char* begin;
+    const char* end;
+};
+
+// Cuts the array in text into runs of roughly equal size, at most parts of
+// them, so each can be read on its own thread. Only counts brackets and
+// skips strings; the reads find any other error. False if text is not an
+// array, or has something after it.
+bool splitJsonArray(const char* begin, const char* end, size_t parts, vector<JsonRun>& runs);
+
+// Each element of one run, handed to onItem with its own text as soon as it is read
+template <typename T, typename F>
+bool readJsonRunElements(const JsonRun& run, F onItem) {
+    JsonReader in(run.begin, run.end);
+    while (in.nextRunElement()) {
+        const char* start = in.position();
+        T entity;
+        if (!readJson(in, entity)) {
+            return false;
+        }
+        onItem(entity, JsonRun{start, in.position()});
+    }
+    return in.finish();
+}
+
+// Each element of one run, handed to onItem as soon as it is read
+template <typename T, typename F>
+bool readJsonRun(const JsonRun& run, F onItem) {
+    return readJsonRunElements<T>(run, [&](T& entity, const JsonRun&) { onItem(entity); });
+}
+
+// -- Reading a parsed value --
+
+// For callers that already hold a json::rvalue (the replication change feed)
+bool readJson(const json::rvalue& in, string& value);
+bool readJson(const json::rvalue& in, int& value);
+bool readJson(const json::rvalue& in, vector<string>& values);
+
+template <typename T>
+auto readJson(const json::rvalue& in, T& entity) -> decltype(T::jsonFields(), bool());
+
+template <typename T, size_t... I>
+bool readJsonMembers(const json::rvalue& in, T& entity, index_sequence<I...>) {
+    constexpr auto fields = T::jsonFields();
+    bool read = true;
+    ((read = read && (!in.has(get<I>(fields).name) || readJson(in[get<I>(fields).name], entity.*get<I>(fields).member))), ...);
+    return read;
+}
+
+template <typename T>
+auto readJson(const json::rvalue& in, T& entity) -> decltype(T::jsonFields(), bool()) {
+    if (in.t() != json::type::Object || !readJsonMembers(in, entity, JsonFieldIndexes<T>())) {
+        return false;
+    }
+    finishJsonRead(entity, 0);
+    return true;
+}
+
+#endif
@@ -0,0 +1,295 @@
+#include "ShardRouter.h"
+#include "HttpClient.h"
+
+#include <map>
+#include <queue>
+#include <cstdlib>
+#include <algorithm>
+
+struct SortKey {
+    string text;
+    double number;
+    string id; // Ties keep id order, as the maps one process sorts from do
+};
+
+bool parseShardList(const string& value, vector<ShardEndpoint>& shards) {
+    shards.clear();
+    size_t start = 0;
+    while (start < value.size()) {
+        size_t comma = value.find(',', start);
+        if (comma == string::npos) {
+            comma = value.size();
+        }
+        ShardEndpoint shard;
+        if (!parseHostPort(value.substr(start, comma - start), shard.host, shard.port)) {
+            return false;
+        }
+        shards.push_back(shard);
+        start = comma + 1;
+    }
+    return !shards.empty();
+}
+
+bool splitJsonArray(const string& body, vector<string>& elements) {
+    elements.clear();
+    size_t i = body.find_first_not_of(" \t\r\n");
+    if (i == string::npos || body[i] != '[') {
+        return false;
+    }
+    int depth = 0;
+    bool inString = false;
+    size_t elementStart = i + 1;
+    for (; i < body.size(); i++) {
+        char c = body[i];
+        if (inString) {
+            if (c == '\\') {
+                i++;
+            } else if (c == '"') {
+                inString = false;
+            }
+            continue;
+        }
+        if (c == '"') {
+            inString = true;
+        } else if (c == '[' || c == '{') {
+            depth++;
+        } else if (c == ']' || c == '}') {
+            depth--;
+            if (depth == 0) {
+                size_t first = body.find_first_not_of(" \t\r\n", elementStart);
+                if (first < i) {
+                    elements.push_back(body.substr(first, body.find_last_not_of(" \t\r\n", i - 1) - first + 1));
+                }
+                return true;
+            }
+        } else if (c == ',' && depth == 1) {
+            size_t first = body.find_first_not_of(" \t\r\n", elementStart);
+            elements.push_back(body.substr(first, body.find_last_not_of(" \t\r\n", i - 1) - first + 1));
+            elementStart = i + 1;
+        }
+    }
+    return false;
+}
+
+// The field each handler sorts on; reviews by rating are the one numeric, descending order
+static SortKey sortKeyOf(const json::rvalue& item, const string& collection, const string& sortKey) {
+    SortKey key = {"", 0, item["id"].s()};
+    if (collection == "users" && (sortKey == "name" || sortKey == "email")) {
+        key.text = item[sortKey].s();
+    } else if (collection == "reviews" && (sortKey == "rating" || sortKey == "score")) {
+        key.number = item[sortKey].d();
+    } else if ((collection == "reviews" || collection == "recommendations") && sortKey == "title") {
+        key.text = item["book"]["title"].s();
+    } else if ((collection == "reviews" || collection == "recommendations") && sortKey == "user") {
+        key.text = item["user"]["name"].s();
+    } else if (collection == "books" && (sortKey == "title" || sortKey == "author" || sortKey == "genre" || sortKey == "isbn")) {
+        key.text = item[sortKey].s();
+    } else {
+        key.text = item["id"].s();
+    }
+    return key;
+}
+
+// Every shard holds the whole catalog but only its users' reviews: the same
+// completion comes back from each, and its review counts add up
+static bool mergeSuggestions(const query_string& params, const vector<string>& bodies, string& merged) {
+    map<pair<string, string>, json::wvalue> combined; // type, text
+    map<pair<string, string>, unsigned> reviews;
+    try {
+        for (unsigned int s = 0; s < bodies.size(); s++) {
+            json::rvalue list = json::load(bodies[s]);
+            if (!list) {
+                return false;
+            }
+            for (json::rvalue& item : list) {
+                pair<string, string> key(item["type"].s(), item["text"].s());
+                if (combined.find(key) == combined.end()) {
+                    combined[key] = json::wvalue(item);
+                }
+                reviews[key] += item["reviews"].u();
+            }
+        }
+    } catch (const exception&) {
+        return false;
+    }
+
+    vector<pair<string, string> > order;
+    for (map<pair<string, string>, unsigned>::iterator it = reviews.begin(); it != reviews.end(); ++it) {
+        order.push_back(it->first);
+    }
+    // The order one process uses: most reviewed, then text, titles before authors
+    sort(order.begin(), order.end(), [&](const pair<string, string>& a, const pair<string, string>& b) {
+        if (reviews[a] != reviews[b]) {
+            return reviews[a] > reviews[b];
+        }
+        return a.second != b.second ? a.second < b.second : a.first > b.first;
+    });
+    size_t limit = params.get("k") ? (size_t)max(0, atoi(params.get("k"))) : 10;
+    vector<json::wvalue> items;
+    for (unsigned int i = 0; i < order.size() && i < limit; i++) {
+        json::wvalue item = combined[order[i]];
+        item["reviews"] = reviews[order[i]];
+        items.push_back(item);
+    }
+    merged = json::wvalue(items).dump();
+    return true;
+}
+
+static bool mergeLists(const string& collection, const query_string& params, const vector<string>& bodies,
+                       string& merged) {
+    // q= wins over everything, search= over sort=, and filters keep map (id) order.
+    // Ranked results are cut back to the k best across all shards.
+    bool ranked = collection == "reviews" && params.get("q") != nullptr;
+    string sortKey = ranked ? "score"
+                     : params.get("search") == nullptr && params.get("sort") != nullptr ? params.get("sort") : "";
+    bool descending = collection == "reviews" && (sortKey == "rating" || sortKey == "score");
+    size_t limit = !ranked ? (size_t)-1 : params.get("k") ? (size_t)max(0, atoi(params.get("k"))) : 10;
+
+    vector<vector<string> > elements(bodies.size());
+    vector<vector<SortKey> > keys(bodies.size());
+    size_t total = 2;
+    for (unsigned int s = 0; s < bodies.size(); s++) {
+        json::rvalue list = json::load(bodies[s]);
+        if (!list || !splitJsonArray(bodies[s], elements[s]) || list.size() != elements[s].size()) {
+            return false;
+        }
+        try {
+            for (json::rvalue& item : list) {
+                keys[s].push_back(sortKeyOf(item, collection, sortKey));
+            }
+        } catch (const exception&) {
+            return false;
+        }
+        total += bodies[s].size();
+    }
+
+    // k-way merge; equal keys go by id, so the order does not depend on the shard count
+    auto after = [&](const pair<int, size_t>& a, const pair<int, size_t>& b) {
+        const SortKey& x = keys[a.first][a.second];
+        const SortKey& y = keys[b.first][b.second];
+        if (descending ? x.number != y.number : x.text != y.text) {
+            return descending ? x.number < y.number : x.text > y.text;
+        }
+        return x.id > y.id;
+    };
+    priority_queue<pair<int, size_t>, vector<pair<int, size_t> >, decltype(after)> heads(after);
+    for (unsigned int s = 0; s < bodies.size(); s++) {
+        if (!elements[s].empty()) {
+            heads.push(make_pair((int)s, (size_t)0));
+        }
+    }
+
+    merged.clear();
+    merged.reserve(total);
+    merged += '[';
+    bool first = true;
+    for (size_t taken = 0; !heads.empty() && taken < limit; taken++) {
+        pair<int, size_t> head = heads.top();
+        heads.pop();
+        if (!first) {
+            merged += ',';
+        }
+        merged += elements[head.first][head.second];
+        first = false;
+        if (head.second + 1 < elements[head.first].size()) {
+            heads.push(make_pair(head.first, head.second + 1));
+        }
+    }
+    merged += ']';
+    return true;
+}
+
+// With facets= each shard answers {"items":[...],"facets":{...}}: the items
+// merge like a plain list and each value's counts add up across shards
+static bool mergeFacetedLists(const string& collection, const query_string& params, const vector<string>& bodies,
+                              string& merged) {
+    vector<string> itemBodies;
+    vector<string> names;
+    map<string, map<string, unsigned long long> > counts; // Facet, value
+    string requested = params.get("facets");
+    for (size_t start = 0; start <= requested.size();) {
+        size_t comma = requested.find(',', start);
+        if (comma == string::npos) {
+            comma = requested.size();
+        }
+        string name = requested.substr(start, comma - start);
+        if (!name.empty() && find(names.begin(), names.end(), name) == names.end()) {
+            names.push_back(name);
+        }
+        start = comma + 1;
+    }
+    try {
+        for (unsigned int s = 0; s < bodies.size(); s++) {
+            json::rvalue body = json::load(bodies[s]);
+            size_t items = bodies[s].find("\"items\"");
+            size_t open = items == string::npos ? string::npos : bodies[s].find('[', items);
+            if (!body || open == string::npos) {
+                return false;
+            }
+            vector<string> elements;
+            if (!splitJsonArray(bodies[s].substr(open), elements)) {
+                return false;
+            }
+            string list = "[";
+            for (unsigned int e = 0; e < elements.size(); e++) {
+                list += (e > 0 ? "," : "") + elements[e];
+            }
+            itemBodies.push_back(list + "]");
+            for (unsigned int n = 0; n < names.size(); n++) {
+                for (json::rvalue& entry : body["facets"][names[n]]) {
+                    counts[names[n]][entry["value"].s()] += entry["count"].u();
+                }
+            }
+        }
+    } catch (const exception&) {
+        return false;
+    }
+
+    string items;
+    if (!mergeLists(collection, params, itemBodies, items)) {
+        return false;
+    }
+    size_t limit = params.get("facetLimit") ? (size_t)max(1, atoi(params.get("facetLimit"))) : 10;
+    merged = "{\"items\":" + items + ",\"facets\":{";
+    for (unsigned int n = 0; n < names.size(); n++) {
+        vector<pair<string, unsigned long long> > values(counts[names[n]].begin(), counts[names[n]].end());
+        // Most frequent first, then by value, as one process orders them
+        stable_sort(values.begin(), values.end(), [](const pair<string, unsigned long long>& a,
+                                                     const pair<string, unsigned long long>& b) {
+            return a.second > b.second;
+        });
+        merged += (n > 0 ? "," : "") + json::wvalue(names[n]).dump() + ":[";
+        for (size_t v = 0; v < values.size() && v < limit; v++) {
+            merged += (v > 0 ? "," : "") + string("{\"value\":") + json::wvalue(values[v].first).dump() +
+                      ",\"count\":" + to_string(values[v].second) + "}";
+        }
+        merged += ']';
+    }
+    merged += "}}";
+    return true;
+}
+
+bool mergeShardLists(const string& collection, const query_string& params, const vector<string>& bodies,
+                     string& merged) {
+    if (collection == "suggestions") {
+        return mergeSuggestions(params, bodies, merged);
+    }
+    if (params.get("facets")) {
+        return mergeFacetedLists(collection, params, bodies, merged);
+    }
+    return mergeLists(collection, params, bodies, merged);
+}
+
+int recommendationShard(const string& id, int count) {
+    size_t dash = id.find('-');
+    if (id.size() < 3 || id[0] != 's' || dash == string::npos || dash == 1) {
+        return -1;
+    }
+    for (size_t i = 1; i < dash; i++) {
+        if (!isdigit((unsigned char)id[i])) {
+            return -1;
+        }
+    }
+    int shard = atoi(id.c_str() + 1);
+    return shard < count ? shard : -1;
+}
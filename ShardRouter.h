@@ -0,0 +1,33 @@
+#ifndef SHARDROUTER_H
+#define SHARDROUTER_H
+
+#include <string>
+#include <vector>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Scatter/gather helpers for the router in front of the shard processes
+struct ShardEndpoint {
+    string host;
+    int port;
+};
+
+// "127.0.0.1:18701,127.0.0.1:18702"; shard i is the i-th entry
+bool parseShardList(const string& value, vector<ShardEndpoint>& shards);
+
+// Top-level elements of a JSON array as raw text, so merged lists are not re-serialized
+bool splitJsonArray(const string& body, vector<string>& elements);
+
+// Combines one list response per shard into the order a single process would
+// return: merge-sorted on sort=, by score for q=, by id for plain lists, search= and filters.
+// "suggestions" (GET /api/books/suggest) adds up each completion's reviews across shards.
+// With facets= the items merge the same way and each facet value's counts add up.
+bool mergeShardLists(const string& collection, const query_string& params, const vector<string>& bodies,
+                     string& merged);
+
+// Shard named by an "s<i>-" recommendation id, -1 for ids without one
+int recommendationShard(const string& id, int count);
+
+#endif
@@ -0,0 +1,81 @@
+#include "Sharding.h"
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "Recommendation.h"
+
+#include <cstdlib>
+
+extern map<string, User> userMap;
+extern ReviewStore reviewMap;
+extern map<string, Recommendation> recommendationMap;
+
+ShardOptions shardOptions;
+
+bool parseShardFlag(const string& arg) {
+    const string flag = "--shard=";
+    if (arg.compare(0, flag.size(), flag) != 0) {
+        return false;
+    }
+    string value = arg.substr(flag.size());
+    size_t slash = value.find('/');
+    if (slash == string::npos) {
+        return false;
+    }
+    int index = atoi(value.substr(0, slash).c_str());
+    int count = atoi(value.substr(slash + 1).c_str());
+    if (count < 1 || index < 0 || index >= count) {
+        return false;
+    }
+    shardOptions.index = index;
+    shardOptions.count = count;
+    return true;
+}
+
+bool isSharded() {
+    return shardOptions.count > 1;
+}
+
+bool ownsUser(const string& userId) {
+    return !isSharded() || shardForUser(userId, shardOptions.count) == shardOptions.index;
+}
+
+string shardFileName(const string& filename) {
+    if (!isSharded()) {
+        return filename;
+    }
+    size_t dot = filename.rfind('.');
+    string suffix = ".shard-" + to_string(shardOptions.index) + "-of-" + to_string(shardOptions.count);
+    return dot == string::npos ? filename + suffix : filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+string recommendationIdPrefix() {
+    return isSharded() ? "s" + to_string(shardOptions.index) + "-" : "";
+}
+
+void keepOwnedPartition() {
+    for (map<string, User>::iterator it = userMap.begin(); it != userMap.end();) {
+        if (ownsUser(it->first)) {
+            ++it;
+        } else {
+            it = userMap.erase(it);
+        }
+    }
+    for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end();) {
+        if (ownsUser(it->second.getUser().getId())) {
+            ++it;
+        } else {
+            it = reviewMap.erase(it);
+        }
+    }
+
+    // Renumbered with this shard's prefix so ids stay unique behind the router
+    vector<Recommendation> owned;
+    for (map<string, Recommendation>::iterator it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
+        if (ownsUser(it->second.getUser().getId())) {
+            owned.push_back(it->second);
+        }
+    }
+    reindexRecommendations(owned);
+}
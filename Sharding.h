@@ -0,0 +1,44 @@
+#ifndef SHARDING_H
+#define SHARDING_H
+
+#include <string>
+
+using namespace std;
+
+// Users, their reviews and their recommendations are partitioned across shard
+// processes by user id; every shard holds the whole book catalog.
+struct ShardOptions {
+    int index = 0;
+    int count = 1;
+};
+
+extern ShardOptions shardOptions;
+
+// Consumes --shard=i/N (0 <= i < N)
+bool parseShardFlag(const string& arg);
+
+bool isSharded();
+
+// FNV-1a of the user id; the router and every shard must agree on it
+inline int shardForUser(const string& userId, int count) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned int i = 0; i < userId.size(); i++) {
+        hash = (hash ^ (unsigned char)userId[i]) * 1099511628211ULL;
+    }
+    return (int)(hash % (unsigned long long)count);
+}
+
+bool ownsUser(const string& userId);
+
+// "reviews.json" → "reviews.shard-2-of-4.json"; unchanged when not sharded
+string shardFileName(const string& filename);
+
+// Prefix for recommendation ids so they stay unique across shards ("s2-"), empty when not sharded
+string recommendationIdPrefix();
+
+// Drops users, reviews and recommendations owned by other shards from the global
+// maps and renumbers the remaining recommendations with this shard's prefix.
+// For a shard that started from the unpartitioned files.
+void keepOwnedPartition();
+
+#endif
@@ -0,0 +1,117 @@
+#include "SingleFlight.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Compression.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+static bool coalescingEnabled = true;
+
+struct Flight {
+    bool done = false;
+    int code = 0;
+    string body;
+    ci_map headers;
+};
+
+static mutex flightsMutex;
+static condition_variable flightLanded;
+static map<string, shared_ptr<Flight> > flights;
+
+string normalizedQuery(const request& req) {
+    vector<string> params;
+    size_t mark = req.raw_url.find('?');
+    if (mark != string::npos) {
+        string rest = req.raw_url.substr(mark + 1);
+        size_t pos = 0;
+        while (pos <= rest.size()) {
+            size_t amp = rest.find('&', pos);
+            if (amp == string::npos) {
+                amp = rest.size();
+            }
+            if (amp > pos) {
+                params.push_back(rest.substr(pos, amp - pos));
+            }
+            pos = amp + 1;
+        }
+        sort(params.begin(), params.end());
+    }
+
+    string query;
+    for (unsigned int i = 0; i < params.size(); i++) {
+        query += (i > 0 ? "&" : "") + params[i];
+    }
+    return query;
+}
+
+string coalescingKey(int route, const request& req) {
+    ContentEncoding encoding = negotiateEncoding(req.get_header_value("Accept-Encoding"));
+    return to_string(route) + "@" + to_string(dataVersion.load()) + "?" + normalizedQuery(req) + "#" + encodingName(encoding);
+}
+
+response coalesce(int route, const request& req, const function<response()>& compute) {
+    if (!coalescingEnabled) {
+        return compute();
+    }
+
+    string key = coalescingKey(route, req);
+    shared_ptr<Flight> flight;
+    bool leader = false;
+    {
+        lock_guard<mutex> lock(flightsMutex);
+        shared_ptr<Flight>& slot = flights[key];
+        if (!slot) {
+            slot = make_shared<Flight>();
+            leader = true;
+        }
+        flight = slot;
+    }
+
+    if (!leader) {
+        TraceSpan span("coalesced wait");
+        unique_lock<mutex> lock(flightsMutex);
+        flightLanded.wait(lock, [&flight] { return flight->done; });
+        lock.unlock();
+        recordCoalesced(route);
+
+        response res(flight->code, flight->body);
+        res.headers = flight->headers;
+        return res;
+    }
+
+    response res;
+    try {
+        res = compute();
+    } catch (...) {
+        lock_guard<mutex> lock(flightsMutex);
+        flight->code = 500;
+        flight->done = true;
+        flights.erase(key);
+        flightLanded.notify_all();
+        throw;
+    }
+
+    lock_guard<mutex> lock(flightsMutex);
+    flight->code = res.code;
+    flight->body = res.body;
+    flight->headers = res.headers;
+    flight->done = true;
+    flights.erase(key);
+    flightLanded.notify_all();
+    return res;
+}
+
+bool parseCoalescingFlag(const string& arg) {
+    if (arg == "--coalesce=off") {
+        coalescingEnabled = false;
+    } else if (arg == "--coalesce=on") {
+        coalescingEnabled = true;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <string>
+#include <functional>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Collapses identical concurrent GETs into one handler call. The key includes
+// the data version seen on arrival, so a caller only ever joins a computation
+// that started after every write it could have observed.
+response coalesce(int route, const request& req, const function<response()>& compute);
+
+// Query string with its parameters sorted, so ?a=1&b=2 and ?b=2&a=1 match
+string normalizedQuery(const request& req);
+
+// Route, data version, normalized query and negotiated content encoding
+string coalescingKey(int route, const request& req);
+
+// --coalesce=off disables coalescing (for A/B runs with the load generator)
+bool parseCoalescingFlag(const string& arg);
+
+#endif
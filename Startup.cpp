@@ -0,0 +1,186 @@
+#include "Startup.h"
+#include "User.h"
+#include "Book.h"
+#include "Review.h"
+#include "ReviewStore.h"
+#include "Recommendation.h"
+#include "Metrics.h"
+#include "Replication.h"
+#include "AdmissionControl.h"
+
+#include <thread>
+#include <atomic>
+#include <future>
+#include <shared_mutex>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern map<string, User> userMap;
+extern map<string, Book> bookMap;
+extern ReviewStore reviewMap;
+extern map<string, Recommendation> recommendationMap;
+
+StartupOptions startupOptions;
+
+static thread loader;
+static atomic<bool> loading(false);
+
+bool parseStartupFlag(const string& arg) {
+    if (arg.compare(0, 15, "--load-threads=") != 0) {
+        return false;
+    }
+    try {
+        startupOptions.loadThreads = stoi(arg.substr(15));
+    } catch (const exception&) {
+        return false;
+    }
+    return startupOptions.loadThreads >= 0;
+}
+
+int loadThreadCount() {
+    if (startupOptions.loadThreads > 0) {
+        return startupOptions.loadThreads;
+    }
+    return (int)max(1u, thread::hardware_concurrency());
+}
+
+void runParallel(const vector<function<void()>>& tasks, int threads) {
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < tasks.size(); i = next++) {
+            tasks[i]();
+        }
+    };
+    vector<thread> pool;
+    for (size_t i = 1; i < min((size_t)max(threads, 1), tasks.size()); i++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (unsigned int i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+}
+
+const char* mapFile(const string& filename, size_t& size) {
+    size = 0;
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    void* text = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        text = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (text == MAP_FAILED) {
+        return nullptr;
+    }
+    size = info.st_size;
+    return (const char*)text;
+}
+
+void unmapFile(const char* text, size_t size) {
+    if (text) {
+        munmap((void*)text, size);
+    }
+}
+
+void loadDataFiles(const string& books, const string& users, const string& reviews, const string& recommendations,
+                   int threads) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    MapFileLoad<Book> bookLoad(books);
+    MapFileLoad<User> userLoad(users);
+    MapFileLoad<Review> reviewLoad(reviews);
+    MapFileLoad<Recommendation> recommendationLoad(recommendations);
+
+    // Reading and cutting each file is one task; the runs of all four then share the pool
+    size_t parts = (size_t)threads * 4;
+    runParallel({[&]() { bookLoad.read(); bookLoad.split(parts); },
+                 [&]() { userLoad.read(); userLoad.split(parts); },
+                 [&]() { reviewLoad.read(); reviewLoad.split(parts); },
+                 [&]() { recommendationLoad.read(); recommendationLoad.split(parts); }},
+                threads);
+
+    // Largest first, so a long run does not start last
+    // A paged review store takes the reviews' text, so they are never all decoded at once
+    bool pagedReviews = reviewMap.paged();
+    vector<function<void()>> runs;
+    for (size_t i = 0; i < reviewLoad.runCount(); i++) {
+        if (pagedReviews) {
+            runs.push_back([&reviewLoad, i]() { reviewLoad.parseText(i); });
+        } else {
+            runs.push_back([&reviewLoad, i]() { reviewLoad.parse(i); });
+        }
+    }
+    for (size_t i = 0; i < bookLoad.runCount(); i++) {
+        runs.push_back([&bookLoad, i]() { bookLoad.parse(i); });
+    }
+    for (size_t i = 0; i < recommendationLoad.runCount(); i++) {
+        runs.push_back([&recommendationLoad, i]() { recommendationLoad.parse(i); });
+    }
+    for (size_t i = 0; i < userLoad.runCount(); i++) {
+        runs.push_back([&userLoad, i]() { userLoad.parse(i); });
+    }
+    runParallel(runs, threads);
+
+    runParallel({[&]() { bookLoad.merge(bookMap); },
+                 [&]() { userLoad.merge(userMap); },
+                 [&]() { pagedReviews ? reviewLoad.mergeText(reviewMap) : reviewLoad.merge(reviewMap); },
+                 [&]() { recommendationLoad.merge(recommendationMap); }},
+                threads);
+
+    // Recorded here rather than on the pool's threads, each of which would keep a metrics shard
+    recordPersistence(LOAD_BOOKS, start);
+    recordPersistence(LOAD_USERS, start);
+    recordPersistence(LOAD_REVIEWS, start);
+    recordPersistence(LOAD_RECOMMENDATIONS, start);
+}
+
+void startLoading(function<void()> load) {
+    loading = true;
+    promise<void> locked;
+    future<void> lockedFuture = locked.get_future();
+    loader = thread([load, &locked]() {
+        unique_lock<shared_mutex> lock(dataMutex);
+        locked.set_value();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        load();
+        dataVersion++;
+        cerr << "loaded " << bookMap.size() << " books, " << userMap.size() << " users, " << reviewMap.size()
+             << " reviews and " << recommendationMap.size() << " recommendations with " << loadThreadCount()
+             << " threads in " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count()
+             << " ms" << endl;
+        loading = false;
+    });
+    lockedFuture.wait();
+}
+
+void waitForLoading() {
+    if (loader.joinable()) {
+        loader.join();
+    }
+}
+
+bool isLoading() {
+    return loading.load();
+}
+
+response readReadiness() {
+    if (isLoading()) {
+        return response(503, "loading");
+    }
+    if (isReadOnlyReplica() && getReplicationStatus().snapshots == 0) {
+        return response(503, "waiting for the primary's snapshot");
+    }
+    return response(200, "ready");
+}
+
+void fillLoadingResponse(response& res) {
+    res.code = 503;
+    res.set_header("Retry-After", to_string(admissionOptions.retryAfterSeconds));
+    res.body = "Service Unavailable: loading data";
+}
@@ -0,0 +1,180 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include "Serialize.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <fstream>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// Startup loading: the four collection files are read at once, each is cut
+// into runs of whole elements that a pool of threads parses, and the runs
+// are merged into the maps in id order. The indexes are then built side by
+// side. Meanwhile the server is up, /ready answers 503, and API routes
+// answer 503 with Retry-After instead of waiting on the data lock.
+struct StartupOptions {
+    int loadThreads = 0; // 0 means one per core
+};
+
+extern StartupOptions startupOptions;
+
+// Consumes --load-threads=N
+bool parseStartupFlag(const string& arg);
+
+int loadThreadCount();
+
+// Runs every task on up to threads threads, the caller's included, and
+// returns once all have finished
+void runParallel(const vector<function<void()>>& tasks, int threads);
+
+// The file mapped read-only, so its pages can be dropped and read again
+// under memory pressure; null with size 0 if it is missing or empty
+const char* mapFile(const string& filename, size_t& size);
+void unmapFile(const char* text, size_t size);
+
+// One collection file, mapped whole and parsed in runs
+template <typename T>
+class MapFileLoad {
+public:
+    explicit MapFileLoad(const string& filename) : filename(filename), text(nullptr), size(0), ok(true) {}
+    ~MapFileLoad() { unmapFile(text, size); }
+    MapFileLoad(const MapFileLoad&) = delete;
+    MapFileLoad& operator=(const MapFileLoad&) = delete;
+
+    // A missing file loads as empty
+    void read() { text = mapFile(filename, size); }
+
+    // Runs of at least MIN_RUN_BYTES, at most parts of them
+    void split(size_t parts) {
+        if (size == 0) {
+            return;
+        }
+        parts = min(parts, size / MIN_RUN_BYTES + 1);
+        ok = splitJsonArray(text, text + size, parts, runs);
+        items.resize(runs.size());
+        texts.resize(runs.size());
+        parsed.assign(runs.size(), 0);
+    }
+
+    size_t runCount() const { return runs.size(); }
+
+    // Runs may be parsed at the same time on different threads
+    void parse(size_t run) {
+        vector<pair<string, T>>& out = items[run];
+        parsed[run] = readJsonRun<T>(runs[run], [&](T& entity) {
+            entity.getJsonFragment(); // Built here so concurrent readers find it ready
+            string id = entity.getId();
+            out.emplace_back(move(id), move(entity));
+        });
+    }
+
+    // Like parse, but keeps only each element's id and where its text is, for mergeText
+    void parseText(size_t run) {
+        vector<pair<string, JsonRun>>& out = texts[run];
+        parsed[run] = readJsonRunElements<T>(runs[run], [&](T& entity, const JsonRun& element) {
+            out.emplace_back(entity.getId(), element);
+        });
+    }
+
+    // Saved files are in id order, so nearly every element goes in at the
+    // end without a search. A repeated id keeps its last copy. If any run
+    // failed to parse, out is left empty.
+    template <typename M>
+    void merge(M& out) {
+        out.clear();
+        checkRuns();
+        const string* last = nullptr; // Largest id so far
+        for (size_t i = 0; ok && i < items.size(); i++) {
+            for (typename vector<pair<string, T>>::iterator it = items[i].begin(); it != items[i].end(); ++it) {
+                if (!last || *last < it->first) {
+                    last = &out.emplace_hint(out.end(), move(it->first), move(it->second))->first;
+                } else {
+                    out.insert_or_assign(it->first, move(it->second));
+                }
+            }
+        }
+        items.clear();
+        release();
+    }
+
+    // The same for a paged ReviewStore after parseText: each element's text
+    // is written to the store as it is, without holding the entities
+    template <typename S>
+    void mergeText(S& out) {
+        out.clear();
+        checkRuns();
+        for (size_t i = 0; ok && i < texts.size(); i++) {
+            for (vector<pair<string, JsonRun>>::iterator it = texts[i].begin(); it != texts[i].end(); ++it) {
+                out.insertSerialized(it->first, it->second.begin, it->second.end - it->second.begin);
+            }
+        }
+        texts.clear();
+        release();
+    }
+
+private:
+    static constexpr size_t MIN_RUN_BYTES = 64 * 1024;
+
+    string filename;
+    const char* text;
+    size_t size;
+    vector<JsonRun> runs;
+    vector<vector<pair<string, T>>> items;       // Per run, in file order
+    vector<vector<pair<string, JsonRun>>> texts; // Per run, for parseText
+    vector<char> parsed;                         // Per run
+    bool ok;
+
+    void checkRuns() {
+        for (size_t i = 0; i < runs.size(); i++) {
+            ok = ok && parsed[i];
+        }
+    }
+
+    void release() {
+        runs.clear();
+        unmapFile(text, size);
+        text = nullptr;
+        size = 0;
+    }
+};
+
+// One file on its own, parsed on threads threads
+template <typename T>
+map<string, T> loadMapFile(const string& filename, int threads) {
+    MapFileLoad<T> load(filename);
+    load.read();
+    load.split((size_t)threads * 4);
+    vector<function<void()>> tasks;
+    for (size_t i = 0; i < load.runCount(); i++) {
+        tasks.push_back([&load, i]() { load.parse(i); });
+    }
+    runParallel(tasks, threads);
+    map<string, T> data;
+    load.merge(data);
+    return data;
+}
+
+// Fills bookMap, userMap, reviewMap and recommendationMap from the four
+// files at once, sharing threads threads between them
+void loadDataFiles(const string& books, const string& users, const string& reviews, const string& recommendations,
+                   int threads);
+
+// Runs load on a background thread that holds the exclusive data lock
+// throughout; returns once that thread has the lock
+void startLoading(function<void()> load);
+void waitForLoading();
+bool isLoading();
+
+// GET /ready: 200 once loading is done (and, on a replica, once the first
+// snapshot is applied), 503 before
+response readReadiness();
+
+// 503 with Retry-After for API routes hit while loading; the caller ends or returns it
+void fillLoadingResponse(response& res);
+
+#endif
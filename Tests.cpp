@@ -4,17 +4,48 @@
 #include "User.h"
 #include "Book.h"
 #include "Review.h"
+#include "ReviewStore.h"
 #include "Recommendation.h"
+#include "Instrument.h"
+#include "Trace.h"
+#include "AdmissionControl.h"
+#include "SingleFlight.h"
+#include "Compression.h"
+#include "ChangeLog.h"
+#include "ChangeStream.h"
+#include "Replication.h"
+#include "Sharding.h"
+#include "ShardRouter.h"
+#include "ListSnapshot.h"
+#include "ReviewSearch.h"
+#include "BookSuggest.h"
+#include "Facets.h"
+#include "Bitmap.h"
+#include "Startup.h"
+#include "MemoryAccounting.h"
 #include "crow.h"
 
 #include <fstream>
+#include <thread>
+#include <future>
+#include <zlib.h>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <set>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
 
 using namespace std;
 
 // External maps
 extern map<string, User> userMap;
 extern map<string, Book> bookMap;
-extern map<string, Review> reviewMap;
+extern ReviewStore reviewMap;
 extern map<string, Recommendation> recommendationMap;
 
 // save/load function declarations
@@ -150,6 +181,68 @@ TEST_CASE("User save/load from file") {
     CHECK(loaded.getPreferences() == vector<string>{"Fantasy", "Mystery"});
 }
 
+TEST_CASE("Users - Unique email index") {
+    SUBCASE("Writes keep emails unique and lookups ignore case") {
+        userMap.clear();
+        reviewMap.clear();
+        recommendationMap.clear();
+        rebuildEmailIndex();
+
+        request post;
+        post.body = "{\"id\":\"u80\",\"name\":\"Ada\",\"email\":\"Ada@Example.com\",\"preferences\":[]}";
+        REQUIRE(createUser(post).code == 201);
+        CHECK(string(json::load(readUserByEmail("ada@example.COM").body)["id"].s()) == "u80");
+        CHECK(readUserByEmail("bob@example.com").code == 404);
+
+        request filter;
+        filter.url_params = query_string("/api/users?filterKey=email&filterValue=ADA%40example.com");
+        CHECK(json::load(readAllUsers(filter).body).size() == 1);
+
+        post.body = "{\"id\":\"u81\",\"name\":\"Copy\",\"email\":\"ada@example.com\",\"preferences\":[]}";
+        CHECK(createUser(post).code == 409);
+        CHECK(userMap.count("u81") == 0);
+        post.body = "{\"id\":\"u81\",\"name\":\"Bob\",\"email\":\"bob@example.com\",\"preferences\":[]}";
+        REQUIRE(createUser(post).code == 201);
+
+        // Re-saving a user with their own email is fine; taking another's is not
+        request update;
+        update.body = "{\"name\":\"Ada L.\",\"email\":\"ADA@example.com\",\"preferences\":[]}";
+        response updated;
+        updateUser(update, updated, "u80");
+        CHECK(updated.code == 200);
+        update.body = "{\"name\":\"Bob\",\"email\":\"ada@example.com\",\"preferences\":[]}";
+        response clashed;
+        updateUser(update, clashed, "u81");
+        CHECK(clashed.code == 409);
+        CHECK(userMap["u81"].getEmail() == "bob@example.com");
+
+        // A changed or deleted user releases their email
+        update.body = "{\"name\":\"Ada L.\",\"email\":\"ada@lovelace.org\",\"preferences\":[]}";
+        response moved;
+        updateUser(update, moved, "u80");
+        CHECK(moved.code == 200);
+        CHECK(readUserByEmail("ada@example.com").code == 404);
+        deleteUser("u81");
+        CHECK(readUserByEmail("bob@example.com").code == 404);
+        post.body = "{\"id\":\"u82\",\"name\":\"Robert\",\"email\":\"BOB@example.com\",\"preferences\":[]}";
+        CHECK(createUser(post).code == 201);
+        CHECK(string(json::load(readUserByEmail("bob@example.com").body)["id"].s()) == "u82");
+        flushRecommendations();
+    }
+
+    SUBCASE("Rebuilding reports repeated emails") {
+        userMap.clear();
+        userMap["u83"] = User("u83", "A", "same@example.com", {});
+        userMap["u84"] = User("u84", "B", "Same@Example.com", {});
+        userMap["u85"] = User("u85", "C", "", {});
+        userMap["u86"] = User("u86", "D", "", {});
+        CHECK(rebuildEmailIndex() == 1);
+        CHECK(string(json::load(readUserByEmail("SAME@example.com").body)["id"].s()) == "u83");
+        userMap.clear();
+        rebuildEmailIndex();
+    }
+}
+
 TEST_CASE("Book class - Constructors") {
     SUBCASE("Default constructor initializes all fields to empty strings") {
         Book book;
@@ -279,6 +372,122 @@ TEST_CASE("Book save/load from file") {
     CHECK(loaded.getIsbn() == "9780441172719");
 }
 
+TEST_CASE("Books - ISBN normalization and unique index") {
+    SUBCASE("Accepted forms normalize to ISBN-13; the rest are rejected") {
+        const char* corpus[][2] = {
+            {"9780306406157", "9780306406157"},
+            {"978-0-306-40615-7", "9780306406157"},
+            {"978 0 306 40615 7", "9780306406157"},
+            {"0306406152", "9780306406157"},
+            {"0-306-40615-2", "9780306406157"},
+            {"080442957X", "9780804429573"},
+            {"0-8044-2957-x", "9780804429573"},
+            {"979-0-2600-0043-8", "9790260000438"},
+            {"978-0-306-40615-8", ""},  // Wrong ISBN-13 check digit
+            {"0-306-40615-3", ""},      // Wrong ISBN-10 check digit
+            {"9770306406158", ""},      // Valid checksum, not a book prefix
+            {"X306406152", ""},         // X only as the last ISBN-10 digit
+            {"978030640615X", ""},
+            {"97803064061570", ""},
+            {"030640615", ""},
+            {"ISBN 0306406152", ""},
+            {"0306406152/", ""},
+            {"", ""}
+        };
+        for (unsigned int i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+            string isbn = "unchanged";
+            bool valid = normalizeIsbn(corpus[i][0], isbn);
+            INFO(corpus[i][0]);
+            CHECK(valid == (corpus[i][1][0] != '\0'));
+            CHECK(isbn == (valid ? string(corpus[i][1]) : string("unchanged")));
+        }
+    }
+
+    SUBCASE("Writes keep ISBNs unique and lookups take any form") {
+        bookMap.clear();
+        reviewMap.clear();
+        rebuildIsbnIndex();
+
+        request post;
+        post.body = "{\"id\":\"b90\",\"title\":\"Computers\",\"author\":\"Rogers\",\"genre\":\"Science\",\"isbn\":\"0-306-40615-2\"}";
+        response created = createBook(post);
+        REQUIRE(created.code == 201);
+        CHECK(string(json::load(created.body)["isbn"].s()) == "9780306406157");
+
+        CHECK(readBookByIsbn("978-0-306-40615-7").code == 200);
+        CHECK(string(json::load(readBookByIsbn("0306406152").body)["id"].s()) == "b90");
+        CHECK(readBookByIsbn("9780804429573").code == 404);
+        CHECK(readBookByIsbn("0306406153").code == 400);
+
+        post.body = "{\"id\":\"b91\",\"title\":\"Copy\",\"author\":\"Rogers\",\"genre\":\"Science\",\"isbn\":\"9780306406157\"}";
+        CHECK(createBook(post).code == 409);
+        post.body = "{\"id\":\"b91\",\"title\":\"Typo\",\"author\":\"Rogers\",\"genre\":\"Science\",\"isbn\":\"9780306406158\"}";
+        CHECK(createBook(post).code == 400);
+        CHECK(bookMap.count("b91") == 0);
+        post.body = "{\"id\":\"b91\",\"title\":\"Other\",\"author\":\"Ames\",\"genre\":\"Science\",\"isbn\":\"080442957X\"}";
+        REQUIRE(createBook(post).code == 201);
+
+        // Re-saving a book with its own ISBN is fine; taking another's is not
+        request update;
+        update.body = "{\"title\":\"Computers, 2nd ed.\",\"author\":\"Rogers\",\"genre\":\"Science\",\"isbn\":\"978-0-306-40615-7\"}";
+        response updated;
+        updateBook(update, updated, "b90");
+        CHECK(updated.code == 200);
+        update.body = "{\"title\":\"Other\",\"author\":\"Ames\",\"genre\":\"Science\",\"isbn\":\"0306406152\"}";
+        response clashed;
+        updateBook(update, clashed, "b91");
+        CHECK(clashed.code == 409);
+        CHECK(bookMap["b91"].getIsbn() == "9780804429573");
+
+        // A changed or deleted book releases its ISBN
+        update.body = "{\"title\":\"Computers\",\"author\":\"Rogers\",\"genre\":\"Science\",\"isbn\":\"\"}";
+        response cleared;
+        updateBook(update, cleared, "b90");
+        CHECK(cleared.code == 200);
+        CHECK(readBookByIsbn("9780306406157").code == 404);
+        deleteBook("b91");
+        CHECK(readBookByIsbn("080442957X").code == 404);
+        post.body = "{\"id\":\"b92\",\"title\":\"Reissue\",\"author\":\"Ames\",\"genre\":\"Science\",\"isbn\":\"978-0-8044-2957-3\"}";
+        CHECK(createBook(post).code == 201);
+        CHECK(string(json::load(readBookByIsbn("080442957X").body)["id"].s()) == "b92");
+        flushRecommendations();
+    }
+
+    SUBCASE("Loading normalizes stored ISBNs and reports repeats") {
+        bookMap.clear();
+        bookMap["b93"] = Book("b93", "A", "X", "Science", "0-306-40615-2");
+        bookMap["b94"] = Book("b94", "B", "Y", "Science", "978-0-306-40615-7");
+        bookMap["b95"] = Book("b95", "C", "Z", "Science", "not an isbn");
+        saveBookToFile(bookMap, "test_isbn_books.json");
+        bookMap = loadBookFromFile("test_isbn_books.json");
+        CHECK(bookMap["b93"].getIsbn() == "9780306406157");
+        CHECK(bookMap["b94"].getIsbn() == "9780306406157");
+        CHECK(bookMap["b95"].getIsbn() == "not an isbn");
+        CHECK(rebuildIsbnIndex() == 1);
+        CHECK(string(json::load(readBookByIsbn("0306406152").body)["id"].s()) == "b93");
+
+        // Updates that leave the ISBN out do not trip over the stored one
+        request retitle;
+        retitle.body = "{\"title\":\"C, Revised\"}";
+        response retitled;
+        updateBook(retitle, retitled, "b95");
+        CHECK(retitled.code == 200);
+        CHECK(bookMap["b95"].getTitle() == "C, Revised");
+        CHECK(bookMap["b95"].getIsbn() == "not an isbn");
+        response repeated;
+        updateBook(retitle, repeated, "b94");
+        CHECK(repeated.code == 200);
+        retitle.body = "{\"isbn\":\"still not an isbn\"}";
+        response rejected;
+        updateBook(retitle, rejected, "b95");
+        CHECK(rejected.code == 400);
+
+        remove("test_isbn_books.json");
+        bookMap.clear();
+        rebuildIsbnIndex();
+    }
+}
+
 TEST_CASE("Review class - Constructors") {
     SUBCASE("Default constructor initializes fields to defaults") {
         Review review;
@@ -352,7 +561,7 @@ TEST_CASE("Review save/load from file") {
 
     // Create Review
     Review r("r1", user, book, 5, "Amazing book!");
-    reviewMap[r.getId()] = r;
+    reviewMap.insert_or_assign(r.getId(), r);
 
     // Save to file
     saveReviewToFile(reviewMap, "test_reviews.json");
@@ -363,7 +572,7 @@ TEST_CASE("Review save/load from file") {
 
     REQUIRE(reviewMap.count("r1") == 1);
 
-    Review loaded = reviewMap["r1"];
+    Review loaded = reviewMap.find("r1")->second;
     CHECK(loaded.getId() == "r1");
     CHECK(loaded.getUser().getId() == "u1");
     CHECK(loaded.getBook().getId() == "b1");
@@ -483,3 +692,2524 @@ TEST_CASE("Recommendation save/load from file") {
 }
 
 
+
+TEST_CASE("JSON fragments - Cached serialization") {
+    SUBCASE("Book fragment parses back and follows setters") {
+        Book book("b60", "Emma", "Jane Austen", "Romance", "9780141439587");
+        json::rvalue parsed = json::load(book.getJsonFragment());
+        REQUIRE(parsed);
+        CHECK(string(parsed["title"].s()) == "Emma");
+        CHECK(string(parsed["isbn"].s()) == "9780141439587");
+
+        unsigned long before = book.getVersion();
+        book.setTitle("Persuasion");
+        CHECK(book.getVersion() == before + 1);
+        CHECK(string(json::load(book.getJsonFragment())["title"].s()) == "Persuasion");
+    }
+
+    SUBCASE("User fragment includes preferences") {
+        User user("u60", "Ivy", "ivy@example.com", {"Romance", "Poetry"});
+        json::rvalue parsed = json::load(user.getJsonFragment());
+        REQUIRE(parsed);
+        CHECK(parsed["preferences"].size() == 2);
+
+        user.setPreferences({"Horror"});
+        parsed = json::load(user.getJsonFragment());
+        CHECK(parsed["preferences"].size() == 1);
+        CHECK(string(parsed["preferences"][(size_t)0].s()) == "Horror");
+    }
+
+    SUBCASE("Review fragment embeds user and book and is invalidated on update") {
+        User user("u61", "Jack", "jack@example.com", {"Mystery"});
+        Book book("b61", "Rebecca", "Daphne du Maurier", "Mystery", "9780380730407");
+        Review review("r61", user, book, 4, "Atmospheric");
+
+        json::rvalue parsed = json::load(review.getJsonFragment());
+        REQUIRE(parsed);
+        CHECK(string(parsed["id"].s()) == "r61");
+        CHECK(parsed["rating"].i() == 4);
+        CHECK(string(parsed["user"]["name"].s()) == "Jack");
+        CHECK(string(parsed["book"]["title"].s()) == "Rebecca");
+
+        review.setComment("Haunting");
+        book.setTitle("Rebecca (Anniversary Edition)");
+        review.setBook(book);
+        parsed = json::load(review.getJsonFragment());
+        CHECK(string(parsed["comment"].s()) == "Haunting");
+        CHECK(string(parsed["book"]["title"].s()) == "Rebecca (Anniversary Edition)");
+    }
+
+    SUBCASE("Recommendation fragment embeds user and book") {
+        User user("u62", "Kim", "kim@example.com", {"Poetry"});
+        Book book("b62", "Ariel", "Sylvia Plath", "Poetry", "9780060931728");
+        Recommendation rec("rec62", user, book);
+
+        json::rvalue parsed = json::load(rec.getJsonFragment());
+        REQUIRE(parsed);
+        CHECK(string(parsed["id"].s()) == "rec62");
+        CHECK(string(parsed["user"]["id"].s()) == "u62");
+        CHECK(string(parsed["book"]["id"].s()) == "b62");
+
+        rec.setId("rec63");
+        CHECK(string(json::load(rec.getJsonFragment())["id"].s()) == "rec63");
+    }
+
+    SUBCASE("Fragments join into a JSON array") {
+        string a = "{\"id\":\"1\"}";
+        string b = "{\"id\":\"2\"}";
+        CHECK(joinJsonFragments({}) == "[]");
+        CHECK(joinJsonFragments({&a, &b}) == "[{\"id\":\"1\"},{\"id\":\"2\"}]");
+    }
+}
+
+TEST_CASE("Serialize - Reflected writers and readers") {
+    static_assert(jsonFieldBit<Book>("id") == 1, "id is the first book field");
+    static_assert(jsonFieldBit<Book>("isbn") == 16, "isbn is the fifth book field");
+    static_assert(jsonFieldBit<Book>("missing") == 0, "unknown names have no bit");
+
+    SUBCASE("Every entity round-trips through its field list") {
+        User user("u64", "Lena", "lena@example.com", {"Poetry", "Horror"});
+        Book book("b64", "Ariel", "Sylvia Plath", "Poetry", "9780060931728");
+        Review review("r64", user, book, 5, "Unsparing");
+        Recommendation rec("rec64", user, book);
+
+        User userBack;
+        REQUIRE(readJson(user.getJsonFragment(), userBack));
+        CHECK(userBack.getJsonFragment() == user.getJsonFragment());
+        Book bookBack;
+        REQUIRE(readJson(book.getJsonFragment(), bookBack));
+        CHECK(bookBack.getJsonFragment() == book.getJsonFragment());
+        Review reviewBack;
+        REQUIRE(readJson(review.getJsonFragment(), reviewBack));
+        CHECK(reviewBack.getJsonFragment() == review.getJsonFragment());
+        CHECK(reviewBack.getUser().getPreferences().size() == 2);
+        Recommendation recBack;
+        REQUIRE(readJson(rec.getJsonFragment(), recBack));
+        CHECK(recBack.getJsonFragment() == rec.getJsonFragment());
+
+        // Same fields as the DOM reads them
+        json::rvalue parsed = json::load(review.getJsonFragment());
+        REQUIRE(parsed);
+        CHECK(parsed["rating"].i() == 5);
+        CHECK(string(parsed["book"]["isbn"].s()) == "9780060931728");
+        Review fromDom;
+        REQUIRE(parseReviewJson(parsed, fromDom));
+        CHECK(fromDom.getJsonFragment() == review.getJsonFragment());
+    }
+
+    SUBCASE("Strings escape and unescape like the DOM") {
+        string tricky = "quote \" slash \\ tab \t line \n bell \x07 caf\xc3\xa9";
+        string out;
+        writeJson(out, tricky);
+        CHECK(out == "\"quote \\\" slash \\\\ tab \\t line \\n bell \\u0007 caf\xc3\xa9\"");
+        CHECK(string(json::load("[" + out + "]")[(size_t)0].s()) == tricky);
+
+        string back;
+        JsonReader in(out);
+        REQUIRE(in.readString(back));
+        CHECK(back == tricky);
+
+        string text = "\"caf\\u00e9 \\ud83d\\ude00 \\/\"";
+        JsonReader escaped(text);
+        REQUIRE(escaped.readString(back));
+        CHECK(back == "caf\xc3\xa9 \xf0\x9f\x98\x80 /");
+    }
+
+    SUBCASE("Unknown members are skipped and absent ones reported") {
+        Book book;
+        unsigned seen = 0;
+        REQUIRE(readJson("{ \"extra\" : {\"a\":[1,\"]}\",{}]}, \"title\":\"Emma\", \"n\":-1.5e3, \"ok\":true }", book, &seen));
+        CHECK(book.getTitle() == "Emma");
+        CHECK(seen == jsonFieldBit<Book>("title"));
+
+        Review review;
+        REQUIRE(readJson("{\"id\":\"r65\",\"rating\":4,\"user\":{\"id\":\"u65\"}}", review, &seen));
+        CHECK(review.getRating() == 4);
+        CHECK(review.getUser().getId() == "u65");
+        CHECK(seen == (jsonFieldBit<Review>("id") | jsonFieldBit<Review>("rating") | jsonFieldBit<Review>("user")));
+    }
+
+    SUBCASE("Malformed text and wrong types are rejected") {
+        const char* bad[] = {
+            "", "[]", "{", "{\"title\"}", "{\"title\":\"Emma\",}", "{\"title\":\"Emma\"} x",
+            "{\"title\":3}", "{\"title\":\"bad \\q escape\"}", "{\"title\":\"\\u12\"}", "{\"title\":\"open",
+            "{\"title\":\"a\" \"author\":\"b\"}", "{\"extra\":[1,2}",
+        };
+        for (const char* text : bad) {
+            INFO(text);
+            Book book;
+            CHECK_FALSE(readJson(string(text), book));
+        }
+        Review review;
+        CHECK_FALSE(readJson(string("{\"rating\":\"5\"}"), review));
+        User user;
+        CHECK_FALSE(readJson(string("{\"preferences\":[\"a\",1]}"), user));
+        CHECK_FALSE(parseUserJson(json::load("{\"preferences\":\"Poetry\"}"), user));
+    }
+
+    SUBCASE("Arrays stream one entity at a time") {
+        vector<string> ids;
+        string text = " [ {\"id\":\"b1\"} , {\"id\":\"b2\",\"title\":\"x\"} ] ";
+        JsonReader in(text);
+        CHECK(readJsonArray<Book>(in, [&](Book& book) { ids.push_back(book.getId()); }));
+        CHECK(in.finish());
+        CHECK(ids == vector<string>{"b1", "b2"});
+
+        string none = "[]";
+        JsonReader empty(none);
+        CHECK(readJsonArray<Book>(empty, [&](Book&) { ids.clear(); }));
+        CHECK(ids.size() == 2);
+
+        string cut = "[{\"id\":\"b1\"},";
+        JsonReader truncated(cut);
+        CHECK_FALSE(readJsonArray<Book>(truncated, [](Book&) {}));
+    }
+
+    SUBCASE("Updates change only the members the body names") {
+        userMap.clear();
+        bookMap.clear();
+        reviewMap.clear();
+        rebuildIsbnIndex();
+        rebuildEmailIndex();
+
+        request post;
+        post.body = "{\"id\":\"b66\",\"title\":\"Emma\",\"author\":\"Austen\",\"genre\":\"Romance\",\"isbn\":\"9780141439587\"}";
+        REQUIRE(createBook(post).code == 201);
+        request update;
+        update.body = "{\"genre\":\"Classics\"}";
+        response updated;
+        updateBook(update, updated, "b66");
+        CHECK(updated.code == 200);
+        CHECK(bookMap["b66"].getTitle() == "Emma");
+        CHECK(bookMap["b66"].getGenre() == "Classics");
+        CHECK(bookMap["b66"].getIsbn() == "9780141439587");
+
+        post.body = "{\"id\":\"u66\",\"name\":\"Mia\",\"email\":\"mia@example.com\",\"preferences\":[\"Romance\"]}";
+        REQUIRE(createUser(post).code == 201);
+        update.body = "{\"preferences\":[]}";
+        response cleared;
+        updateUser(update, cleared, "u66");
+        CHECK(cleared.code == 200);
+        CHECK(userMap["u66"].getName() == "Mia");
+        CHECK(userMap["u66"].getEmail() == "mia@example.com");
+        CHECK(userMap["u66"].getPreferences().empty());
+
+        update.body = "{\"name\":";
+        response invalid;
+        updateUser(update, invalid, "u66");
+        CHECK(invalid.code == 400);
+        CHECK(userMap["u66"].getName() == "Mia");
+        flushRecommendations();
+    }
+}
+
+TEST_CASE("Serialize - Request bodies are checked against the schema") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    rebuildIsbnIndex();
+    rebuildEmailIndex();
+    userMap["u67"] = User("u67", "Noor", "noor@example.com", {"Poetry"});
+    bookMap["b67"] = Book("b67", "Ariel", "Plath", "Poetry", "");
+
+    auto createBookError = [](const string& body) {
+        request post;
+        post.body = body;
+        response res = createBook(post);
+        return to_string(res.code) + " " + res.body;
+    };
+    auto createReviewError = [](const string& body) {
+        request post;
+        post.body = body;
+        response res = createReview(post);
+        return to_string(res.code) + " " + res.body;
+    };
+
+    SUBCASE("Required members must be present and non-empty") {
+        static_assert(jsonRequiredFields<Book>() == 15, "id, title, author and genre");
+        CHECK(createBookError("{\"id\":\"b68\",\"title\":\"Emma\",\"genre\":\"Romance\"}") == "400 author is required");
+        CHECK(createBookError("{\"id\":\"\",\"title\":\"Emma\",\"author\":\"Austen\",\"genre\":\"Romance\"}") ==
+              "400 id is required");
+        CHECK(createBookError("{\"id\":\"b68\",\"title\":\"Emma\",\"author\":\"Austen\",\"genre\":\"Romance\"}").substr(0, 3) ==
+              "201");
+        CHECK(createReviewError("{\"id\":\"r68\",\"rating\":4,\"user\":{},\"book\":{\"id\":\"b67\"}}") ==
+              "400 user.id is required");
+        CHECK(createReviewError("{\"id\":\"r68\",\"user\":{\"id\":\"u67\"},\"book\":{\"id\":\"b67\"}}") ==
+              "400 rating is required");
+        CHECK(createReviewError("{\"id\":\"r68\",\"rating\":0,\"user\":{\"id\":\"u67\"},\"book\":{\"id\":\"b67\"}}") ==
+              "400 rating must be between 1 and 5");
+        CHECK(reviewMap.count("r68") == 0);
+    }
+
+    SUBCASE("Type errors name the member") {
+        CHECK(createReviewError("{\"id\":\"r69\",\"rating\":\"5\"}") == "400 Invalid JSON: rating must be an integer");
+        CHECK(createReviewError("{\"id\":\"r69\",\"rating\":4.5}") == "400 Invalid JSON: rating must be an integer");
+        CHECK(createReviewError("{\"id\":\"r69\",\"rating\":12345678901}") ==
+              "400 Invalid JSON: rating must be a 32-bit integer");
+        CHECK(createReviewError("{\"id\":\"r69\",\"user\":{\"id\":67}}") == "400 Invalid JSON: user.id must be a string");
+        CHECK(createReviewError("{\"id\":\"r69\",\"user\":{\"preferences\":[\"a\",null]}}") ==
+              "400 Invalid JSON: user.preferences[1] must be a string");
+        CHECK(createReviewError("{\"id\":\"r69\",\"book\":\"b67\"}") == "400 Invalid JSON: book must be an object");
+        CHECK(createBookError("[]") == "400 Invalid JSON: expected an object at offset 0");
+    }
+
+    SUBCASE("Syntax errors give the offset") {
+        CHECK(createBookError("{\"title\" \"Emma\"}") == "400 Invalid JSON: expected ':' at offset 9");
+        CHECK(createBookError("{\"title\":\"Emma\" \"genre\":\"x\"}") == "400 Invalid JSON: expected ',' or '}' at offset 16");
+        CHECK(createBookError("{\"title\":\"Em\\qma\"}") == "400 Invalid JSON: bad escape at offset 13");
+        CHECK(createBookError("{\"title\":\"Emma") == "400 Invalid JSON: unterminated string at offset 14");
+        CHECK(createBookError("{} x") == "400 Invalid JSON: unexpected content after the value at offset 3");
+        CHECK(createBookError("{,}") == "400 Invalid JSON: expected a member name at offset 1");
+        CHECK(createBookError("") == "400 Invalid JSON: unexpected end of input at offset 0");
+    }
+
+    SUBCASE("Body size and nesting are bounded") {
+        string big = "{\"id\":\"b70\",\"title\":\"" + string(MAX_JSON_BODY, 'x') + "\"}";
+        CHECK(createBookError(big).substr(0, 4) == "413 ");
+
+        string deep = "{\"extra\":" + string(JsonReader::MAX_DEPTH, '[') + string(JsonReader::MAX_DEPTH, ']') + "}";
+        CHECK(createBookError(deep) == "400 Invalid JSON: nesting is too deep at offset " + to_string(9 + JsonReader::MAX_DEPTH - 1));
+        deep = "{\"extra\":" + string(JsonReader::MAX_DEPTH - 1, '[') + string(JsonReader::MAX_DEPTH - 1, ']') +
+               ",\"id\":\"b70\",\"title\":\"T\",\"author\":\"A\",\"genre\":\"G\"}";
+        CHECK(createBookError(deep).substr(0, 3) == "201");
+    }
+
+    SUBCASE("A rejected update changes nothing") {
+        request update;
+        update.body = "{\"title\":\"Lady Lazarus\",\"genre\":7}";
+        response res;
+        updateBook(update, res, "b67");
+        CHECK(res.code == 400);
+        CHECK(res.body == "Invalid JSON: genre must be a string");
+        CHECK(bookMap["b67"].getTitle() == "Ariel");
+
+        reviewMap.insert_or_assign("r71", Review("r71", userMap["u67"], bookMap["b67"], 3, "Fine"));
+        update.body = "{\"comment\":\"Sharp\",\"rating\":6}";
+        response rerated;
+        updateReview(update, rerated, "r71");
+        CHECK(rerated.code == 400);
+        CHECK(reviewMap.find("r71")->second.getComment() == "Fine");
+    }
+    flushRecommendations();
+}
+
+TEST_CASE("Metrics - Prometheus exposition") {
+    int route = registerRoute("GET", "/api/test-metrics");
+    recordRequest(route, 200, chrono::steady_clock::now());
+    recordRequest(route, 200, chrono::steady_clock::now());
+    recordRequest(route, 404, chrono::steady_clock::now());
+
+    string text = renderMetricsText();
+    CHECK(text.find("bookreview_http_requests_total{method=\"GET\",route=\"/api/test-metrics\",code=\"200\"} 2") != string::npos);
+    CHECK(text.find("bookreview_http_requests_total{method=\"GET\",route=\"/api/test-metrics\",code=\"404\"} 1") != string::npos);
+    CHECK(text.find("bookreview_http_request_duration_seconds_count{method=\"GET\",route=\"/api/test-metrics\"} 3") != string::npos);
+    CHECK(text.find("bookreview_entities{collection=\"reviews\"}") != string::npos);
+    CHECK(text.find("bookreview_persistence_seconds_count{operation=\"save\",collection=\"users\"}") != string::npos);
+
+    SUBCASE("A scrape does not wait for a writer") {
+        unique_lock<shared_mutex> writer(dataMutex);
+        string text = async(launch::async, renderMetricsText).get();
+        CHECK(text.find("bookreview_http_requests_total{method=\"GET\",route=\"/api/test-metrics\",code=\"200\"} 2") != string::npos);
+        CHECK(text.find("bookreview_entities{") == string::npos);
+    }
+}
+
+TEST_CASE("Admission control - Per-route limits and shedding") {
+    admissionOptions.workerThreads = 8;
+    admissionOptions.reservedThreads = 2;
+    admissionOptions.routeLimits["GET /api/test-admission"] = {1, 0};
+
+    int limited = registerRoute("GET", "/api/test-admission");
+    configureAdmission(limited, "GET", "/api/test-admission");
+    int pointRead = registerRoute("GET", "/api/test-admission/<id>");
+    configureAdmission(pointRead, "GET", "/api/test-admission/<id>");
+
+    SUBCASE("Requests beyond the limit and queue are shed") {
+        AdmissionTicket first(limited);
+        CHECK(first.admitted());
+        {
+            AdmissionTicket second(limited);
+            CHECK_FALSE(second.admitted());
+        }
+        CHECK(renderMetricsText().find("bookreview_http_shed_total{method=\"GET\",route=\"/api/test-admission\",reason=\"queue_full\"} 1") != string::npos);
+    }
+
+    SUBCASE("A released slot admits the next request") {
+        {
+            AdmissionTicket first(limited);
+            CHECK(first.admitted());
+        }
+        AdmissionTicket next(limited);
+        CHECK(next.admitted());
+    }
+
+    SUBCASE("Point reads are in the priority class") {
+        AdmissionTicket first(limited);
+        AdmissionTicket a(pointRead);
+        AdmissionTicket b(pointRead);
+        CHECK(a.admitted());
+        CHECK(b.admitted());
+        CHECK(getAdmissionLimit(pointRead) == -1);
+        CHECK(getAdmissionLimit(limited) == 1);
+    }
+
+    SUBCASE("Defaults do not shed at normal concurrency") {
+        int list = registerRoute("GET", "/api/test-admission-defaults");
+        configureAdmission(list, "GET", "/api/test-admission-defaults");
+        int write = registerRoute("POST", "/api/test-admission-defaults");
+        configureAdmission(write, "POST", "/api/test-admission-defaults");
+        int feed = registerRoute("GET", "/api/changes");
+        configureAdmission(feed, "GET", "/api/changes");
+        CHECK(getAdmissionLimit(list) == 3);
+        CHECK(getAdmissionLimit(feed) == -1);
+
+        // Four clients listing and two writing, each request holding its slot for a millisecond
+        atomic<int> shed(0);
+        vector<thread> clients;
+        for (int c = 0; c < 6; c++) {
+            clients.push_back(thread([&, c]() {
+                for (int i = 0; i < 30; i++) {
+                    AdmissionTicket ticket(c < 4 ? list : write);
+                    if (!ticket.admitted()) {
+                        shed++;
+                    }
+                    this_thread::sleep_for(chrono::milliseconds(1));
+                }
+            }));
+        }
+        for (unsigned int c = 0; c < clients.size(); c++) {
+            clients[c].join();
+        }
+        CHECK(shed == 0);
+
+        // Even with two threads, more than one limited request runs at a time
+        admissionOptions.workerThreads = 2;
+        int small = registerRoute("GET", "/api/test-admission-small");
+        configureAdmission(small, "GET", "/api/test-admission-small");
+        {
+            AdmissionTicket first(small);
+            AdmissionTicket second(small);
+            CHECK(first.admitted());
+            CHECK(second.admitted());
+        }
+        admissionOptions.workerThreads = 8;
+    }
+
+    SUBCASE("Shed responses carry Retry-After") {
+        response res;
+        fillShedResponse(res);
+        CHECK(res.code == 503);
+        CHECK(res.get_header_value("Retry-After") == to_string(admissionOptions.retryAfterSeconds));
+    }
+
+    SUBCASE("Startup flags") {
+        CHECK(parseAdmissionFlag("--route-limit=PUT /api/books/<id>=3:5"));
+        CHECK(admissionOptions.routeLimits["PUT /api/books/<id>"].concurrency == 3);
+        CHECK(admissionOptions.routeLimits["PUT /api/books/<id>"].queueDepth == 5);
+        CHECK(parseAdmissionFlag("--adaptive-latency-ms=50"));
+        CHECK(admissionOptions.adaptiveLatencyMillis == 50);
+        CHECK_FALSE(parseAdmissionFlag("--route-limit=nonsense"));
+        CHECK_FALSE(parseAdmissionFlag("--port=1"));
+        admissionOptions.adaptiveLatencyMillis = 0;
+    }
+}
+
+TEST_CASE("Single-flight - Identical concurrent GETs share one computation") {
+    int route = registerRoute("GET", "/api/test-coalesce");
+    request req;
+    req.raw_url = "/api/test-coalesce?search=harbor&sort=title";
+
+    SUBCASE("Keys ignore parameter order but not data version") {
+        request reordered;
+        reordered.raw_url = "/api/test-coalesce?sort=title&search=harbor";
+        CHECK(coalescingKey(route, req) == coalescingKey(route, reordered));
+
+        string before = coalescingKey(route, req);
+        dataVersion++;
+        CHECK(coalescingKey(route, req) != before);
+    }
+
+    SUBCASE("Followers receive the leader's bytes") {
+        atomic<int> calls(0);
+        auto compute = [&calls]() {
+            calls++;
+            this_thread::sleep_for(chrono::milliseconds(200));
+            response res(200, "[{\"id\":\"001\"}]");
+            res.set_header("X-Test", "leader");
+            return res;
+        };
+
+        response leaderRes;
+        thread leader([&] { leaderRes = coalesce(route, req, compute); });
+        this_thread::sleep_for(chrono::milliseconds(50));
+        response followerRes = coalesce(route, req, compute);
+        leader.join();
+
+        CHECK(calls == 1);
+        CHECK(followerRes.body == leaderRes.body);
+        CHECK(followerRes.get_header_value("X-Test") == "leader");
+        CHECK(renderMetricsText().find("bookreview_http_coalesced_total{method=\"GET\",route=\"/api/test-coalesce\"} 1") != string::npos);
+    }
+
+    SUBCASE("Sequential requests each compute") {
+        int calls = 0;
+        auto compute = [&calls]() {
+            calls++;
+            return response(200, "[]");
+        };
+        coalesce(route, req, compute);
+        coalesce(route, req, compute);
+        CHECK(calls == 2);
+    }
+}
+
+static string inflateBody(const string& data) {
+    z_stream stream = {};
+    inflateInit2(&stream, 15 + 32); // Detects gzip or zlib wrapping
+    string out(64 * 1024, '\0');
+    stream.next_in = (Bytef*)data.data();
+    stream.avail_in = data.size();
+    stream.next_out = (Bytef*)&out[0];
+    stream.avail_out = out.size();
+    inflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    inflateEnd(&stream);
+    return out;
+}
+
+TEST_CASE("Compression - Negotiation, threshold and cache") {
+    string body = "[";
+    for (int i = 0; i < 200; i++) {
+        body += string(i ? "," : "") + "{\"id\":\"" + to_string(i) + "\",\"book\":{\"title\":\"The Silent Garden\"}}";
+    }
+    body += "]";
+
+    SUBCASE("Accept-Encoding negotiation") {
+        CHECK(negotiateEncoding("") == IDENTITY);
+        CHECK(negotiateEncoding("gzip, deflate, br") == GZIP);
+        CHECK(negotiateEncoding("deflate") == DEFLATE);
+        CHECK(negotiateEncoding("gzip;q=0.5, deflate;q=0.8") == DEFLATE);
+        CHECK(negotiateEncoding("gzip;q=0") == IDENTITY);
+        CHECK(negotiateEncoding("*") == GZIP);
+        CHECK(negotiateEncoding("br, identity") == IDENTITY);
+    }
+
+    SUBCASE("gzip and deflate round-trip") {
+        CHECK(inflateBody(compressBody(body, GZIP, 6)) == body);
+        CHECK(inflateBody(compressBody(body, DEFLATE, 1)) == body);
+        CHECK(compressBody(body, GZIP, 9).size() < body.size() / 4);
+    }
+
+    SUBCASE("Large list responses are compressed and cached") {
+        int route = registerRoute("GET", "/api/test-compression");
+        request req;
+        req.raw_url = "/api/test-compression?sort=title";
+        req.add_header("Accept-Encoding", "gzip");
+
+        response cold;
+        CHECK_FALSE(readCompressed(route, req, cold));
+        response first(200, body);
+        first.set_header("X-Change-Seq", "7");
+        first.set_header("X-Recommendation-Pending", "3");
+        compressResponse(route, req, dataVersion.load(), first);
+        CHECK(first.get_header_value("Content-Encoding") == "gzip");
+        CHECK(first.get_header_value("Vary") == "Accept-Encoding");
+        CHECK(inflateBody(first.body) == body);
+
+        // Same data version: answered without a body to compare
+        response second;
+        REQUIRE(readCompressed(route, req, second));
+        CHECK(second.body == first.body);
+        CHECK(second.get_header_value("Content-Encoding") == "gzip");
+        CHECK(second.get_header_value("X-Change-Seq") == "7");
+        // Request-time headers are not replayed from the moment of caching
+        CHECK(second.get_header_value("X-Recommendation-Pending") == "");
+        CHECK(renderMetricsText().find("bookreview_compression_cache_total{result=\"hit\"} 1") != string::npos);
+
+        // A write moves the version, so the cached bytes no longer answer
+        dataVersion++;
+        response stale;
+        CHECK_FALSE(readCompressed(route, req, stale));
+
+        request identity;
+        identity.raw_url = req.raw_url;
+        response plain;
+        CHECK_FALSE(readCompressed(route, identity, plain));
+
+        response small(200, "[]");
+        compressResponse(route, req, dataVersion.load(), small);
+        CHECK(small.body == "[]");
+        CHECK(small.get_header_value("Content-Encoding") == "");
+    }
+
+    SUBCASE("Compression level flag") {
+        CHECK(parseCompressionFlag("--compression-level=9"));
+        CHECK(compressionOptions.level == 9);
+        CHECK(parseCompressionFlag("--compression-level=6"));
+        CHECK_FALSE(parseCompressionFlag("--compression-level=fast"));
+    }
+}
+
+TEST_CASE("Change feed - Deltas since a sequence") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+
+    auto changesSince = [](unsigned long long since, string extra = "") {
+        request req;
+        req.url_params = query_string("/api/changes?since=" + to_string(since) + extra);
+        return readChanges(req);
+    };
+
+    SUBCASE("Writes, cascades and recommendation rebuilds are stamped in order") {
+        unsigned long long start = latestChangeSeq();
+
+        request userReq;
+        userReq.body = "{\"id\":\"u80\",\"name\":\"Mara\",\"email\":\"mara@example.com\",\"preferences\":[\"Classic\"]}";
+        createUser(userReq);
+        request bookReq;
+        bookReq.body = "{\"id\":\"b80\",\"title\":\"Middlemarch\",\"author\":\"George Eliot\",\"genre\":\"Classic\",\"isbn\":\"9780141439549\"}";
+        createBook(bookReq);
+        request reviewReq;
+        reviewReq.body = "{\"id\":\"r80\",\"user\":{\"id\":\"u80\"},\"book\":{\"id\":\"b80\"},\"rating\":5,\"comment\":\"Vast\"}";
+        createReview(reviewReq);
+        flushRecommendations();
+        deleteBook("b80");
+        flushRecommendations();
+
+        response res = changesSince(start);
+        REQUIRE(res.code == 200);
+        json::rvalue feed = json::load(res.body);
+        REQUIRE(feed);
+        CHECK(feed["latest"].u() == latestChangeSeq());
+        CHECK(feed["next"].u() == latestChangeSeq());
+        CHECK_FALSE(feed["more"].b());
+
+        vector<string> ops;
+        for (json::rvalue& change : feed["changes"]) {
+            ops.push_back(string(change["op"].s()) + " " + string(change["collection"].s()) + " " + string(change["id"].s()));
+        }
+        vector<string> expected = {
+            "upsert users u80", "upsert books b80", "upsert reviews r80", "upsert recommendations 001",
+            "delete books b80", "delete reviews r80", "delete recommendations 001"
+        };
+        CHECK(ops == expected);
+        CHECK(string(feed["changes"][(size_t)0]["data"]["name"].s()) == "Mara");
+
+        json::rvalue paged = json::load(changesSince(start, "&limit=2").body);
+        CHECK(paged["changes"].size() == 2);
+        CHECK(paged["more"].b());
+        CHECK(paged["next"].u() == start + 2);
+    }
+
+    SUBCASE("Compacted or future sequences require a resync") {
+        deleteReview("missing");
+        recordUpsert("books", "b81", "{}");
+        recordUpsert("books", "b82", "{}");
+        recordUpsert("books", "b83", "{}");
+        unsigned long long latest = latestChangeSeq();
+        setChangeLogCapacity(2);
+
+        response gone = changesSince(latest - 3);
+        CHECK(gone.code == 410);
+        CHECK(string(json::load(gone.body)["error"].s()) == "resync_required");
+        CHECK(changesSince(latest - 2).code == 200);
+        CHECK(changesSince(latest + 1).code == 410);
+        setChangeLogCapacity(100000);
+    }
+}
+
+// Opens a subscriber on the local stream port; receiveBuffer > 0 shrinks the socket's receive buffer
+static int connectToStream(const string& target, int receiveBuffer = 0) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (receiveBuffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(changeStreamPort());
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    string request = "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    send(fd, request.data(), request.size(), 0);
+    return fd;
+}
+
+// Reads until the stream contains text, up to a second; everything read is kept in buffer
+static bool readUntil(int fd, string& buffer, const string& text) {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(1);
+    while (buffer.find(text) == string::npos) {
+        int remaining = (int)chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) {
+            return false;
+        }
+        char chunk[4096];
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+            return false;
+        }
+        buffer.append(chunk, received);
+    }
+    return true;
+}
+
+TEST_CASE("Change stream - Server-sent events") {
+    static bool listening = false;
+    if (!listening) {
+        addChangeListener(publishChange);
+        listening = true;
+    }
+    changeStreamOptions.port = 0;
+    REQUIRE(startChangeStream());
+    REQUIRE(changeStreamPort() > 0);
+
+    SUBCASE("Delivers filtered changes with low latency") {
+        int fd = connectToStream("/api/stream?collections=books");
+        REQUIRE(fd >= 0);
+        string stream;
+        REQUIRE(readUntil(fd, stream, "retry: 1000\n\n"));
+        CHECK(stream.find("Content-Type: text/event-stream") != string::npos);
+        stream.clear();
+
+        vector<double> micros;
+        for (int i = 0; i < 200; i++) {
+            recordUpsert("users", "u90", "{}");
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            recordUpsert("books", "b90", "{\"id\":\"b90\"}");
+            string expected = "id: " + to_string(latestChangeSeq()) + "\n";
+            REQUIRE(readUntil(fd, stream, expected));
+            micros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+        }
+        CHECK(stream.find("\"collection\":\"users\"") == string::npos);
+        CHECK(stream.find("\"data\":{\"id\":\"b90\"}") != string::npos);
+
+        sort(micros.begin(), micros.end());
+        CHECK(micros[198] < 100000);
+        close(fd);
+    }
+
+    SUBCASE("Replays from Last-Event-ID and asks for a resync past the log") {
+        unsigned long long before = latestChangeSeq();
+        recordUpsert("reviews", "r90", "{}");
+        recordDelete("reviews", "r90");
+
+        int fd = connectToStream("/api/stream?since=" + to_string(before));
+        REQUIRE(fd >= 0);
+        string stream;
+        REQUIRE(readUntil(fd, stream, "id: " + to_string(before + 2) + "\n"));
+        CHECK(stream.find("id: " + to_string(before + 1) + "\n") != string::npos);
+        CHECK(stream.find("\"op\":\"delete\"") != string::npos);
+        close(fd);
+
+        int future = connectToStream("/api/stream?since=" + to_string(latestChangeSeq() + 5));
+        string resync;
+        CHECK(readUntil(future, resync, "event: resync"));
+        close(future);
+
+        // The event loop never waits for the data lock, even while loading holds it
+        unique_lock<shared_mutex> writer(dataMutex);
+        int blocked = connectToStream("/api/stream?since=" + to_string(before));
+        REQUIRE(blocked >= 0);
+        string replayed;
+        CHECK(readUntil(blocked, replayed, "id: " + to_string(before + 2) + "\n"));
+        close(blocked);
+    }
+
+    SUBCASE("A subscriber that stops reading is disconnected, writers never wait") {
+        size_t previousBuffer = changeStreamOptions.bufferBytes;
+        changeStreamOptions.bufferBytes = 16 * 1024;
+        unsigned long long dropped = getChangeStreamStats().slowDisconnects;
+
+        int fd = connectToStream("/api/stream", 4096);
+        REQUIRE(fd >= 0);
+        string stream;
+        REQUIRE(readUntil(fd, stream, "retry: 1000\n\n"));
+
+        string fragment = "{\"comment\":\"" + string(4000, 'x') + "\"}";
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < 400; i++) {
+            recordUpsert("reviews", "r91", fragment);
+        }
+        CHECK(chrono::steady_clock::now() - start < chrono::seconds(1));
+
+        chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(2);
+        while (getChangeStreamStats().slowDisconnects == dropped && chrono::steady_clock::now() < deadline) {
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        CHECK(getChangeStreamStats().slowDisconnects == dropped + 1);
+        CHECK(getChangeStreamStats().subscribers == 0);
+        close(fd);
+        changeStreamOptions.bufferBytes = previousBuffer;
+    }
+
+    SUBCASE("GET /api/stream redirects to the stream port") {
+        request req;
+        req.raw_url = "/api/stream?collections=books";
+        req.add_header("Host", "api.example.com:18525");
+        response res = redirectToChangeStream(req);
+        CHECK(res.code == 307);
+        CHECK(res.get_header_value("Location") ==
+              "http://api.example.com:" + to_string(changeStreamPort()) + "/api/stream?collections=books");
+    }
+
+    stopChangeStream();
+    CHECK(changeStreamPort() == 0);
+}
+
+TEST_CASE("Replication - Snapshot plus replayed changes reproduce the primary") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+
+    auto stateDigest = []() {
+        request req;
+        return string(json::load(readStateDigest(req).body)["digest"].s());
+    };
+
+    SUBCASE("Replica state converges on the primary's") {
+        request userReq;
+        userReq.body = "{\"id\":\"u95\",\"name\":\"Ines\",\"email\":\"ines@example.com\",\"preferences\":[\"Poetry\"]}";
+        createUser(userReq);
+        request bookReq;
+        bookReq.body = "{\"id\":\"b95\",\"title\":\"Odes\",\"author\":\"Keats\",\"genre\":\"Poetry\",\"isbn\":\"9780140424478\"}";
+        createBook(bookReq);
+        request reviewReq;
+        reviewReq.body = "{\"id\":\"r95\",\"user\":{\"id\":\"u95\"},\"book\":{\"id\":\"b95\"},\"rating\":4,\"comment\":\"Luminous\"}";
+        createReview(reviewReq);
+        flushRecommendations();
+
+        request req;
+        response snapshot = readReplicationSnapshot(req);
+        unsigned long long snapshotSeq = latestChangeSeq();
+        string snapshotDigest = stateDigest();
+
+        // The primary moves on after the snapshot
+        request secondBook;
+        secondBook.body = "{\"id\":\"b96\",\"title\":\"Ariel\",\"author\":\"Plath\",\"genre\":\"Poetry\",\"isbn\":\"9780060931728\"}";
+        createBook(secondBook);
+        request rename;
+        rename.body = "{\"name\":\"Ines R.\",\"email\":\"ines@example.com\",\"preferences\":[\"Poetry\"]}";
+        response renamed;
+        updateUser(rename, renamed, "u95");
+        deleteReview("r95");
+        flushRecommendations();
+        string primaryDigest = stateDigest();
+        CHECK(primaryDigest != snapshotDigest);
+
+        request feedReq;
+        feedReq.url_params = query_string("/api/changes?since=" + to_string(snapshotSeq));
+        json::rvalue feed = json::load(readChanges(feedReq).body);
+
+        // Replica side: bootstrap from the snapshot, then apply the tail
+        unsigned long long seq;
+        int streamPort;
+        REQUIRE(applyReplicationSnapshot(snapshot.body, seq, streamPort));
+        CHECK(seq == snapshotSeq);
+        CHECK(stateDigest() == snapshotDigest);
+        CHECK(bookMap.count("b96") == 0);
+
+        for (json::rvalue& change : feed["changes"]) {
+            CHECK(applyReplicatedChange(change));
+        }
+        CHECK(getReplicationStatus().appliedSeq == latestChangeSeq());
+        CHECK(stateDigest() == primaryDigest);
+        CHECK(userMap["u95"].getName() == "Ines R.");
+        CHECK(reviewMap.count("r95") == 0);
+
+        CHECK_FALSE(applyReplicationSnapshot("not json", seq, streamPort));
+    }
+
+    SUBCASE("A stream event that does not apply sends the replica back to a snapshot") {
+        request bookReq;
+        bookReq.body = "{\"id\":\"b95\",\"title\":\"Odes\",\"author\":\"Keats\",\"genre\":\"Poetry\",\"isbn\":\"9780140424478\"}";
+        createBook(bookReq);
+        vector<Change> created;
+        REQUIRE(copyChangesSince(latestChangeSeq() - 1, created));
+        string frame = "id: " + to_string(created[0].seq) + "\ndata: " + renderChange(created[0]) + "\n\n";
+        bookMap.clear();
+        unsigned long long applied = getReplicationStatus().appliedSeq;
+
+        string malformed = "id: 1\ndata: {\"seq\":1,\"collection\n\n" + frame;
+        CHECK_FALSE(applyReplicatedEvents(malformed));
+        CHECK(bookMap.count("b95") == 0);
+        CHECK(getReplicationStatus().appliedSeq == applied);
+
+        string unknown = "data: {\"seq\":1,\"collection\":\"shelves\",\"id\":\"s1\",\"op\":\"delete\"}\n\n" + frame;
+        CHECK_FALSE(applyReplicatedEvents(unknown));
+        CHECK(bookMap.count("b95") == 0);
+
+        CHECK(applyReplicatedEvents(frame));
+        CHECK(frame.empty());
+        CHECK(bookMap.count("b95") == 1);
+    }
+
+    SUBCASE("A replica redirects writes to the primary") {
+        replicationOptions.primaryHost = "10.0.0.5";
+        replicationOptions.primaryPort = 18525;
+        REQUIRE(isReadOnlyReplica());
+
+        request post;
+        post.raw_url = "/api/books";
+        post.body = "{\"id\":\"b97\",\"title\":\"Harmonium\",\"author\":\"Stevens\",\"genre\":\"Poetry\",\"isbn\":\"9780679726234\"}";
+        response created = instrument("POST", "/api/books", createBook)(post);
+        CHECK(created.code == 307);
+        CHECK(created.get_header_value("Location") == "http://10.0.0.5:18525/api/books");
+        CHECK(string(json::load(created.body)["error"].s()) == "read_only_replica");
+        CHECK(bookMap.count("b97") == 0);
+
+        response deleted = instrument("DELETE", "/api/books/<id>", deleteBook)("b95");
+        CHECK(deleted.code == 307);
+        CHECK(deleted.get_header_value("Location") == "http://10.0.0.5:18525/api/books/b95");
+
+        request get;
+        CHECK(instrument("GET", "/api/books", readAllBooks)(get).code == 200);
+
+        replicationOptions.primaryHost = "";
+        CHECK(parseReplicationFlag("--replica-of=127.0.0.1:18625"));
+        CHECK(replicationOptions.primaryPort == 18625);
+        CHECK_FALSE(parseReplicationFlag("--replica-of=127.0.0.1"));
+        replicationOptions.primaryHost = "";
+    }
+}
+
+TEST_CASE("Sharding - Partitioning by user and scatter/gather merging") {
+    SUBCASE("A shard keeps only its users' data and prefixes its recommendation ids") {
+        userMap.clear();
+        bookMap.clear();
+        reviewMap.clear();
+        recommendationMap.clear();
+        flushRecommendations();
+
+        Book book("b60", "Dune", "Herbert", "SciFi", "9780441013593");
+        bookMap["b60"] = book;
+        for (int i = 0; i < 20; i++) {
+            string id = "su" + to_string(i);
+            User user(id, "Reader " + to_string(i), id + "@example.com", {"SciFi"});
+            userMap[id] = user;
+            reviewMap.insert_or_assign("sr" + to_string(i), Review("sr" + to_string(i), user, book, 4, "Spice"));
+            recommendationMap["r" + to_string(i)] = Recommendation("r" + to_string(i), user, book);
+        }
+
+        REQUIRE(parseShardFlag("--shard=1/3"));
+        CHECK(shardFileName("reviews.json") == "reviews.shard-1-of-3.json");
+        keepOwnedPartition();
+
+        CHECK(bookMap.size() == 1);
+        CHECK_FALSE(userMap.empty());
+        CHECK(userMap.size() < 20);
+        for (auto& entry : userMap) {
+            CHECK(shardForUser(entry.first, 3) == 1);
+        }
+        CHECK(reviewMap.size() == userMap.size());
+        CHECK(recommendationMap.size() == userMap.size());
+        CHECK(recommendationMap.begin()->first == "s1-001");
+        CHECK(recommendationShard("s1-001", 3) == 1);
+        CHECK(recommendationShard("001", 3) == -1);
+        CHECK(recommendationShard("s7-001", 3) == -1);
+
+        shardOptions = ShardOptions();
+        CHECK(shardFileName("reviews.json") == "reviews.json");
+        CHECK_FALSE(parseShardFlag("--shard=3/3"));
+        userMap.clear();
+        bookMap.clear();
+        reviewMap.clear();
+        recommendationMap.clear();
+    }
+
+    SUBCASE("Raw array elements survive nesting and escaped quotes") {
+        vector<string> elements;
+        REQUIRE(splitJsonArray(" [{\"id\":\"a\",\"tags\":[1,2]}, {\"id\":\"b\\\"]\"} ,3]", elements));
+        REQUIRE(elements.size() == 3);
+        CHECK(elements[0] == "{\"id\":\"a\",\"tags\":[1,2]}");
+        CHECK(elements[1] == "{\"id\":\"b\\\"]\"}");
+        CHECK(elements[2] == "3");
+        CHECK(splitJsonArray("[]", elements));
+        CHECK(elements.empty());
+        CHECK_FALSE(splitJsonArray("{\"id\":1}", elements));
+    }
+
+    SUBCASE("Sorted shard results merge into one sorted list") {
+        auto review = [](string id, int rating, string title) {
+            return "{\"id\":\"" + id + "\",\"rating\":" + to_string(rating) + ",\"book\":{\"title\":\"" + title +
+                   "\"},\"user\":{\"name\":\"n" + id + "\"}}";
+        };
+        vector<string> bodies = {
+            "[" + review("r1", 5, "Beloved") + "," + review("r4", 3, "Emma") + "," + review("r6", 1, "Ulysses") + "]",
+            "[" + review("r2", 4, "Carrie") + "," + review("r3", 2, "Annie") + "]",
+            "[]"
+        };
+
+        string merged;
+        REQUIRE(mergeShardLists("reviews", query_string("/api/reviews?sort=rating"), bodies, merged));
+        json::rvalue byRating = json::load(merged);
+        REQUIRE(byRating.size() == 5);
+        vector<int> ratings;
+        for (json::rvalue& item : byRating) {
+            ratings.push_back((int)item["rating"].i());
+        }
+        CHECK(ratings == vector<int>({5, 4, 3, 2, 1}));
+
+        // Each shard's plain list is in id order, and so is the merge
+        REQUIRE(mergeShardLists("reviews", query_string("/api/reviews?search=e"), bodies, merged));
+        json::rvalue byId = json::load(merged);
+        vector<string> ids;
+        for (json::rvalue& item : byId) {
+            ids.push_back(item["id"].s());
+        }
+        CHECK(ids == vector<string>({"r1", "r2", "r3", "r4", "r6"}));
+
+        // Equal keys come out in id order whatever shard holds them, as from one process
+        vector<string> ties = {
+            "[" + review("r5", 4, "Emma") + "," + review("r8", 4, "Emma") + "]",
+            "[" + review("r2", 4, "Emma") + "," + review("r7", 4, "Emma") + "]"
+        };
+        vector<string> single = {"[" + review("r2", 4, "Emma") + "," + review("r5", 4, "Emma") + "," +
+                                 review("r7", 4, "Emma") + "," + review("r8", 4, "Emma") + "]"};
+        string unsharded;
+        for (string sort : {"rating", "title"}) {
+            query_string params("/api/reviews?sort=" + sort);
+            REQUIRE(mergeShardLists("reviews", params, ties, merged));
+            REQUIRE(mergeShardLists("reviews", params, single, unsharded));
+            CHECK(merged == unsharded);
+        }
+
+        CHECK_FALSE(mergeShardLists("reviews", query_string("/api/reviews"), {"[", "[]"}, merged));
+    }
+
+    SUBCASE("Shard lists parse") {
+        vector<ShardEndpoint> shards;
+        REQUIRE(parseShardList("127.0.0.1:18701,localhost:18702", shards));
+        REQUIRE(shards.size() == 2);
+        CHECK(shards[1].host == "localhost");
+        CHECK(shards[1].port == 18702);
+        CHECK_FALSE(parseShardList("127.0.0.1", shards));
+    }
+}
+
+TEST_CASE("List snapshots - Lock-free list reads see whole commits") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+
+    Book book("b70", "Middlemarch", "Eliot", "Classic", "9780141439549");
+    bookMap["b70"] = book;
+    User reader("u70", "Dorothea", "dorothea@example.com", {"Classic"});
+    userMap["u70"] = reader;
+    reviewMap.insert_or_assign("r70", Review("r70", reader, book, 5, "Patient"));
+    startListSnapshots();
+
+    auto snapshotBody = [](const string& path) {
+        request req;
+        response res;
+        unsigned long long version;
+        REQUIRE(readListSnapshot(path, req, res, version));
+        return res.body;
+    };
+
+    SUBCASE("Snapshot lists match the handlers after writes") {
+        request newUser;
+        newUser.body = "{\"id\":\"u71\",\"name\":\"Will\",\"email\":\"will@example.com\",\"preferences\":[\"Classic\"]}";
+        CHECK(instrument("POST", "/api/users", createUser)(newUser).code == 201);
+        auto postReview = instrument("POST", "/api/reviews", createReview);
+        for (int i = 0; i < 600; i++) {
+            request post;
+            post.body = "{\"id\":\"r71-" + to_string(1000 + i) + "\",\"user\":{\"id\":\"u71\"},\"book\":{\"id\":\"b70\"},\"rating\":3,\"comment\":\"Note " +
+                        to_string(i) + "\"}";
+            postReview(post);
+        }
+        request rename;
+        rename.body = "{\"name\":\"Ladislaw\",\"email\":\"will@example.com\",\"preferences\":[\"Classic\"]}";
+        response renamed;
+        instrument("PUT", "/api/users/<id>", updateUser)(rename, renamed, "u71");
+        instrument("DELETE", "/api/reviews/<id>", deleteReview)("r71-1300");
+        flushRecommendations();
+
+        request all;
+        CHECK(snapshotBody("/api/books") == readAllBooks(all).body);
+        CHECK(snapshotBody("/api/users") == readAllUsers(all).body);
+        CHECK(snapshotBody("/api/reviews") == readAllReviews(all).body);
+        CHECK(snapshotBody("/api/recommendations") == readAllRecommendations(all).body);
+        // The snapshot references the user's cached fragment instead of a copy
+        CHECK(userMap["u71"].getJsonCache().use_count() > 2);
+        CHECK(json::load(snapshotBody("/api/reviews")).size() == 600);
+
+        // Served through the route wrapper too, change sequence included
+        response routed = instrument("GET", "/api/reviews", readAllReviews)(all);
+        CHECK(routed.body == readAllReviews(all).body);
+        CHECK(routed.get_header_value("X-Change-Seq") == to_string(latestChangeSeq()));
+        // The recommendations served from a snapshot still say how fresh they are
+        unsigned long long generation = getRecommendationStatus().generation;
+        response recommendations = instrument("GET", "/api/recommendations", readAllRecommendations)(all);
+        CHECK(recommendations.body == snapshotBody("/api/recommendations"));
+        CHECK(recommendations.get_header_value("X-Recommendation-Generation") == to_string(generation));
+        CHECK(recommendations.get_header_value("X-Recommendation-Pending") == "0");
+        CHECK(recommendations.get_header_value("X-Recommendation-Staleness-Ms") == "0");
+
+        request sorted;
+        sorted.url_params = query_string("/api/reviews?sort=rating");
+        response res;
+        unsigned long long version;
+        CHECK_FALSE(readListSnapshot("/api/reviews", sorted, res, version));
+        CHECK_FALSE(readListSnapshot("/api/changes", all, res, version));
+        CHECK(getListSnapshotStats().published > 0);
+    }
+
+    SUBCASE("Readers do not wait for a writer holding the lock") {
+        dataMutex.lock();
+        bool served = false;
+        thread scan([&]() {
+            request req;
+            response res;
+            unsigned long long version;
+            served = readListSnapshot("/api/reviews", req, res, version);
+        });
+        scan.join();
+        dataMutex.unlock();
+        CHECK(served);
+    }
+
+    SUBCASE("A concurrent scan never sees half of a deleteUser cascade") {
+        atomic<bool> done(false);
+        atomic<int> scans(0);
+        atomic<int> torn(0);
+        thread scanner([&]() {
+            while (!done.load()) {
+                request req;
+                response res;
+                unsigned long long version;
+                if (!readListSnapshot("/api/reviews", req, res, version)) {
+                    continue;
+                }
+                int marked = 0;
+                for (size_t at = res.body.find("Cascade marker"); at != string::npos; at = res.body.find("Cascade marker", at + 1)) {
+                    marked++;
+                }
+                if (marked != 0 && marked != 50) {
+                    torn++;
+                }
+                scans++;
+            }
+        });
+
+        auto removeUser = instrument("DELETE", "/api/users/<id>", deleteUser);
+        for (int round = 0; round < 20; round++) {
+            {
+                // Fifty reviews appear in one commit ...
+                DataLock lock(true);
+                request user;
+                user.body = "{\"id\":\"u72\",\"name\":\"Casaubon\",\"email\":\"casaubon@example.com\",\"preferences\":[\"Classic\"]}";
+                createUser(user);
+                for (int i = 0; i < 50; i++) {
+                    request post;
+                    post.body = "{\"id\":\"r72-" + to_string(i) + "\",\"user\":{\"id\":\"u72\"},\"book\":{\"id\":\"b70\"},\"rating\":2,\"comment\":\"Cascade marker\"}";
+                    createReview(post);
+                }
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+            // ... and vanish in another
+            CHECK(removeUser("u72").code == 204);
+        }
+        done = true;
+        scanner.join();
+        CHECK(torn.load() == 0);
+        CHECK(scans.load() > 0);
+        CHECK(snapshotBody("/api/reviews").find("Cascade marker") == string::npos);
+    }
+
+    stopListSnapshots();
+    request req;
+    response res;
+    unsigned long long version;
+    CHECK_FALSE(readListSnapshot("/api/reviews", req, res, version));
+}
+
+TEST_CASE("Review search - BM25 ranking with WAND") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+
+    Book pacingBook("b75", "Pacing Lessons", "Ward", "Craft", "9780000000751");
+    Book quietBook("b76", "Quiet Harbor", "Lund", "Fiction", "9780000000768");
+    bookMap["b75"] = pacingBook;
+    bookMap["b76"] = quietBook;
+    User critic("u75", "Critic", "critic@example.com", {"Fiction"});
+    userMap["u75"] = critic;
+
+    SUBCASE("Top k equals exhaustive BM25 scoring") {
+        const char* words[] = {"pacing", "plot", "slow", "twist", "characters", "prose", "ending", "world", "magic", "dialogue",
+                               "tension", "mystery", "voice", "setting", "romance", "humor"};
+        mt19937 rng(75);
+        for (int i = 0; i < 400; i++) {
+            string comment;
+            int length = 3 + rng() % 20;
+            for (int w = 0; w < length; w++) {
+                // Skewed toward the first words so common and rare terms both occur
+                comment += string(w ? " " : "") + words[min(rng() % 16, rng() % 16)];
+            }
+            string id = "r75-" + to_string(1000 + i);
+            reviewMap.insert_or_assign(id, Review(id, critic, i % 3 ? quietBook : pacingBook, 3, comment));
+        }
+        rebuildReviewIndex();
+        REQUIRE(reviewIndexReady());
+
+        auto exhaustive = [](const string& query, size_t k) {
+            vector<string> terms = tokenizeText(query);
+            sort(terms.begin(), terms.end());
+            terms.erase(unique(terms.begin(), terms.end()), terms.end());
+            map<string, vector<string> > docs;
+            double totalLength = 0;
+            map<string, int> df;
+            for (auto& entry : reviewMap) {
+                docs[entry.first] = tokenizeText(entry.second.getComment() + " " + entry.second.getBook().getTitle());
+                totalLength += docs[entry.first].size();
+                set<string> seen(docs[entry.first].begin(), docs[entry.first].end());
+                for (const string& term : seen) {
+                    df[term]++;
+                }
+            }
+            double n = docs.size();
+            double average = totalLength / n;
+            vector<pair<double, string> > scored;
+            for (auto& doc : docs) {
+                double score = 0;
+                for (const string& term : terms) {
+                    double tf = count(doc.second.begin(), doc.second.end(), term);
+                    if (tf > 0) {
+                        double idf = log(1 + (n - df[term] + 0.5) / (df[term] + 0.5));
+                        score += idf * tf * 2.2 / (tf + 1.2 * (0.25 + 0.75 * doc.second.size() / average));
+                    }
+                }
+                if (score > 0) {
+                    scored.push_back(make_pair(-score, doc.first));
+                }
+            }
+            sort(scored.begin(), scored.end());
+            scored.resize(min(k, scored.size()));
+            return scored;
+        };
+
+        auto checkQuery = [&](const string& query, size_t k) {
+            vector<ScoredReview> ranked = rankReviews(query, k);
+            vector<pair<double, string> > expected = exhaustive(query, k);
+            REQUIRE(ranked.size() == expected.size());
+            for (unsigned int i = 0; i < ranked.size(); i++) {
+                CHECK(ranked[i].score == doctest::Approx(-expected[i].first));
+            }
+            // Same scores; ids only where the score is not tied with a neighbour
+            for (unsigned int i = 0; i + 1 < ranked.size(); i++) {
+                CHECK(ranked[i].score >= ranked[i + 1].score);
+            }
+            if (!ranked.empty() && (ranked.size() == 1 || ranked[0].score > ranked[1].score)) {
+                CHECK(ranked[0].id == expected[0].second);
+            }
+        };
+        checkQuery("pacing", 10);
+        checkQuery("humor romance", 5);
+        checkQuery("slow PLOT, twist!", 20);
+        checkQuery("harbor voice", 1);
+        checkQuery("magic dialogue tension mystery", 50);
+        CHECK(rankReviews("nonexistent", 10).empty());
+        CHECK(rankReviews("", 10).empty());
+
+        // Writes keep it current: a replaced comment moves, a deleted review leaves
+        request rewrite;
+        rewrite.body = "{\"comment\":\"humor humor humor humor humor humor\"}";
+        response rewritten;
+        updateReview(rewrite, rewritten, "r75-1007");
+        checkQuery("humor", 10);
+        CHECK(rankReviews("humor", 1)[0].id == "r75-1007");
+        deleteReview("r75-1007");
+        checkQuery("humor", 10);
+        for (const ScoredReview& hit : rankReviews("humor", 400)) {
+            CHECK(hit.id != "r75-1007");
+        }
+        CHECK(getReviewIndexStats().documents == reviewMap.size());
+
+        // Replaced documents are compacted away instead of piling up
+        ReviewStore::iterator updated = reviewMap.find("r75-1008");
+        REQUIRE(updated != reviewMap.end());
+        for (int i = 0; i < 5000; i++) {
+            updated->second.setComment(i % 2 ? "humor again" : "pacing word" + to_string(i));
+            indexReview(updated->second);
+        }
+        ReviewIndexStats stats = getReviewIndexStats();
+        CHECK(stats.documentSlots < 2 * stats.documents + 1024);
+        CHECK(stats.terms < 1500);
+        CHECK(rankReviews("again", 5)[0].id == "r75-1008");
+        checkQuery("humor", 10);
+        checkQuery("pacing", 10);
+    }
+
+    SUBCASE("Cascades and the q= route") {
+        reviewMap.clear();
+        rebuildReviewIndex();
+        request post;
+        post.body = "{\"id\":\"r76\",\"user\":{\"id\":\"u75\"},\"book\":{\"id\":\"b76\"},\"rating\":2,\"comment\":\"The pacing drags\"}";
+        createReview(post);
+        post.body = "{\"id\":\"r77\",\"user\":{\"id\":\"u75\"},\"book\":{\"id\":\"b75\"},\"rating\":5,\"comment\":\"Superb\"}";
+        createReview(post);
+
+        request ranked;
+        ranked.url_params = query_string("/api/reviews?q=pacing&k=5");
+        json::rvalue hits = json::load(readAllReviews(ranked).body);
+        REQUIRE(hits.size() == 2);
+        // One occurrence each; the shorter text ranks first
+        CHECK(string(hits[0]["id"].s()) == "r77");
+        CHECK(hits[0]["score"].d() >= hits[1]["score"].d());
+
+        // A book retitle reaches the reviews that embed it
+        request retitle;
+        retitle.body = "{\"title\":\"Superb Craft\",\"author\":\"Ward\",\"genre\":\"Craft\",\"isbn\":\"9780000000750\"}";
+        response retitled;
+        updateBook(retitle, retitled, "b75");
+        CHECK(rankReviews("pacing", 10).size() == 1);
+        CHECK(rankReviews("craft", 10).size() == 1);
+
+        deleteUser("u75");
+        CHECK(rankReviews("superb pacing", 10).empty());
+
+        request invalid;
+        invalid.url_params = query_string("/api/reviews?q=pacing&k=0");
+        CHECK(readAllReviews(invalid).code == 400);
+    }
+
+    SUBCASE("Ranked shard results merge by score and keep k") {
+        vector<string> bodies = {
+            "[{\"id\":\"r1\",\"score\":4.5},{\"id\":\"r3\",\"score\":1.5}]",
+            "[{\"id\":\"r2\",\"score\":3.25},{\"id\":\"r4\",\"score\":0.5}]"
+        };
+        string merged;
+        REQUIRE(mergeShardLists("reviews", query_string("/api/reviews?q=pacing&k=3"), bodies, merged));
+        vector<string> ids;
+        for (json::rvalue& item : json::load(merged)) {
+            ids.push_back(item["id"].s());
+        }
+        CHECK(ids == vector<string>({"r1", "r2", "r3"}));
+    }
+}
+
+TEST_CASE("Book suggest - Prefix completions ranked by reviews") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+
+    User reader("u80", "Reader", "reader@example.com", {"Fiction"});
+    userMap["u80"] = reader;
+
+    // Every title and author with a matching prefix, ranked the way the trie should
+    auto bruteForce = [](const string& prefix, size_t k) {
+        string folded = toLower(prefix);
+        map<string, unsigned> reviewsOf;
+        for (auto& entry : reviewMap) {
+            reviewsOf[entry.second.getBook().getId()]++;
+        }
+        map<pair<string, bool>, pair<unsigned, unsigned> > found;
+        for (auto& entry : bookMap) {
+            string fields[2] = {entry.second.getTitle(), entry.second.getAuthor()};
+            for (int f = 0; f < 2; f++) {
+                if (!fields[f].empty() && toLower(fields[f]).compare(0, folded.size(), folded) == 0) {
+                    pair<unsigned, unsigned>& totals = found[make_pair(fields[f], f == 1)];
+                    totals.first += reviewsOf[entry.first];
+                    totals.second++;
+                }
+            }
+        }
+        vector<BookSuggestion> ranked;
+        for (auto& entry : found) {
+            BookSuggestion suggestion = {entry.first.first, entry.first.second, entry.second.first, entry.second.second};
+            ranked.push_back(suggestion);
+        }
+        sort(ranked.begin(), ranked.end(), [](const BookSuggestion& a, const BookSuggestion& b) {
+            if (a.reviews != b.reviews) {
+                return a.reviews > b.reviews;
+            }
+            return a.text != b.text ? a.text < b.text : !a.author && b.author;
+        });
+        ranked.resize(min(k, ranked.size()));
+        return ranked;
+    };
+
+    auto checkPrefix = [&](const string& prefix, size_t k) {
+        vector<BookSuggestion> found = suggestBooks(prefix, k);
+        vector<BookSuggestion> expected = bruteForce(prefix, k);
+        REQUIRE(found.size() == expected.size());
+        for (unsigned int i = 0; i < found.size(); i++) {
+            CHECK(found[i].text == expected[i].text);
+            CHECK(found[i].author == expected[i].author);
+            CHECK(found[i].reviews == expected[i].reviews);
+            CHECK(found[i].books == expected[i].books);
+        }
+    };
+
+    SUBCASE("Completions equal a brute-force ranking through writes") {
+        const char* adjectives[] = {"Silent", "Silver", "Hidden", "Quiet", "Lost", "Last", "Burning", "Broken"};
+        const char* nouns[] = {"Garden", "Gate", "River", "Road", "Harbor", "House", "Sea", "Season", "Star", "Stone"};
+        const char* authors[] = {"Ada Lund", "Ada Lane", "Bo Ward", "Cy Silva", "Theo Hart", "The Collective", "Sam Stone"};
+        mt19937 rng(80);
+        auto randomTitle = [&]() {
+            // Few enough combinations that titles repeat across books
+            return string(rng() % 4 ? "The " : "") + adjectives[rng() % 8] + " " + nouns[rng() % 10] +
+                   (rng() % 3 ? "" : " " + to_string(rng() % 40));
+        };
+        for (int i = 0; i < 1500; i++) {
+            string id = "b80-" + to_string(1000 + i);
+            bookMap[id] = Book(id, randomTitle(), authors[rng() % 7], "Fiction", "");
+        }
+        int nextReview = 0;
+        for (auto& entry : bookMap) {
+            for (unsigned r = rng() % 6; r > 0; r--) {
+                string id = "r80-" + to_string(nextReview++);
+                reviewMap.insert_or_assign(id, Review(id, reader, entry.second, 4, "Fine"));
+            }
+        }
+        rebuildBookSuggestions();
+        REQUIRE(bookSuggestionsReady());
+
+        vector<string> prefixes = {"", "t", "T", "the", "THE S", "the si", "the silent garden", "ada l", "s", "silver", "x", "the collective"};
+        auto checkAll = [&]() {
+            for (const string& prefix : prefixes) {
+                checkPrefix(prefix, 10);
+            }
+            checkPrefix("the", 16);
+            checkPrefix("h", 1);
+            // Prefixes of real titles, ending anywhere along the trie's edges
+            for (int i = 0; i < 40; i++) {
+                auto it = bookMap.begin();
+                advance(it, rng() % bookMap.size());
+                string title = it->second.getTitle();
+                checkPrefix(title.substr(0, 1 + rng() % title.size()), 1 + rng() % 16);
+            }
+        };
+        checkAll();
+
+        for (int step = 0; step < 300; step++) {
+            auto it = bookMap.begin();
+            advance(it, rng() % bookMap.size());
+            string bookId = it->first;
+            int action = rng() % 10;
+            if (action < 5) {
+                request post;
+                post.body = "{\"id\":\"r80-" + to_string(nextReview++) + "\",\"user\":{\"id\":\"u80\"},\"book\":{\"id\":\"" + bookId +
+                            "\"},\"rating\":5,\"comment\":\"Again\"}";
+                createReview(post);
+            } else if (action < 7 && !reviewMap.empty()) {
+                auto review = reviewMap.begin();
+                advance(review, rng() % reviewMap.size());
+                deleteReview(review->first);
+            } else if (action < 8) {
+                request retitle;
+                retitle.body = "{\"title\":\"" + randomTitle() + "\",\"author\":\"" + authors[rng() % 7] + "\",\"genre\":\"Fiction\",\"isbn\":\"\"}";
+                response retitled;
+                updateBook(retitle, retitled, bookId);
+            } else if (action < 9) {
+                deleteBook(bookId);
+            } else {
+                request post;
+                post.body = "{\"id\":\"b80-" + to_string(5000 + step) + "\",\"title\":\"" + randomTitle() + "\",\"author\":\"" +
+                            authors[rng() % 7] + "\",\"genre\":\"Fiction\",\"isbn\":\"\"}";
+                createBook(post);
+            }
+            if (step % 50 == 49) {
+                checkAll();
+            }
+        }
+        flushRecommendations();
+
+        // Everything deleted leaves nothing behind
+        while (!bookMap.empty()) {
+            deleteBook(bookMap.begin()->first);
+        }
+        CHECK(suggestBooks("", 16).empty());
+        CHECK(getBookSuggestStats().suggestions == 0);
+        flushRecommendations();
+    }
+
+    SUBCASE("The suggest route and shard merge") {
+        bookMap.clear();
+        reviewMap.clear();
+        bookMap["b81"] = Book("b81", "Night Train", "Nina Holt", "Mystery", "");
+        bookMap["b82"] = Book("b82", "Nightfall", "Omar Reyes", "Fiction", "");
+        rebuildBookSuggestions();
+        request post;
+        post.body = "{\"id\":\"r81\",\"user\":{\"id\":\"u80\"},\"book\":{\"id\":\"b82\"},\"rating\":5,\"comment\":\"Great\"}";
+        createReview(post);
+
+        request suggest;
+        suggest.url_params = query_string("/api/books/suggest?prefix=NIGHT");
+        json::rvalue found = json::load(readBookSuggestions(suggest).body);
+        REQUIRE(found.size() == 2);
+        CHECK(string(found[0]["text"].s()) == "Nightfall");
+        CHECK(found[0]["reviews"].i() == 1);
+        CHECK(string(found[1]["type"].s()) == "title");
+
+        suggest.url_params = query_string("/api/books/suggest?prefix=ni&k=3");
+        found = json::load(readBookSuggestions(suggest).body);
+        REQUIRE(found.size() == 3);
+        CHECK(string(found[2]["text"].s()) == "Nina Holt");
+        CHECK(string(found[2]["type"].s()) == "author");
+
+        suggest.url_params = query_string("/api/books/suggest?prefix=zz");
+        CHECK(json::load(readBookSuggestions(suggest).body).size() == 0);
+        suggest.url_params = query_string("/api/books/suggest?k=3");
+        CHECK(readBookSuggestions(suggest).code == 400);
+        suggest.url_params = query_string("/api/books/suggest?prefix=n&k=17");
+        CHECK(readBookSuggestions(suggest).code == 400);
+
+        // Shards answer with their own review counts for the same catalog
+        vector<string> bodies = {
+            "[{\"text\":\"Nightfall\",\"type\":\"title\",\"reviews\":1,\"books\":1},{\"text\":\"Night Train\",\"type\":\"title\",\"reviews\":0,\"books\":1}]",
+            "[{\"text\":\"Night Train\",\"type\":\"title\",\"reviews\":3,\"books\":1},{\"text\":\"Nightfall\",\"type\":\"title\",\"reviews\":1,\"books\":1}]"
+        };
+        string merged;
+        REQUIRE(mergeShardLists("suggestions", query_string("/api/books/suggest?prefix=night&k=1"), bodies, merged));
+        json::rvalue best = json::load(merged);
+        REQUIRE(best.size() == 1);
+        CHECK(string(best[0]["text"].s()) == "Night Train");
+        CHECK(best[0]["reviews"].i() == 3);
+        deleteUser("u80");
+    }
+}
+
+TEST_CASE("Facets - Counts by value over compressed bitmaps") {
+    SUBCASE("Bitmaps agree with a set through adds and removes") {
+        mt19937 rng(90);
+        // Dense and sparse groups, so arrays turn into bitmaps and back
+        auto randomValue = [&]() {
+            int group = rng() % 4;
+            return group == 0 ? (uint32_t)(rng() % 9000) : group == 1 ? 65536u * 3 + rng() % 200000 : (uint32_t)rng();
+        };
+        Bitmap a, b;
+        set<uint32_t> setA, setB;
+        for (int step = 0; step < 60000; step++) {
+            uint32_t value = randomValue();
+            bool onA = rng() % 2;
+            Bitmap& bitmap = onA ? a : b;
+            set<uint32_t>& reference = onA ? setA : setB;
+            if (rng() % 3 == 0) {
+                CHECK(bitmap.remove(value) == (reference.erase(value) == 1));
+            } else {
+                CHECK(bitmap.add(value) == reference.insert(value).second);
+            }
+            if (step % 20000 == 19999) {
+                // Shed most of the dense group so its bitmap goes back to an array
+                for (uint32_t v = 0; v < 9000; v++) {
+                    if (v % 7) {
+                        a.remove(v);
+                        setA.erase(v);
+                    }
+                }
+                size_t common = 0;
+                for (uint32_t v : setA) {
+                    common += setB.count(v);
+                }
+                CHECK(a.cardinality() == setA.size());
+                CHECK(b.cardinality() == setB.size());
+                CHECK(a.andCardinality(b) == common);
+                CHECK(b.andCardinality(a) == common);
+                vector<uint32_t> values;
+                a.values(values);
+                CHECK(values == vector<uint32_t>(setA.begin(), setA.end()));
+                CHECK(Bitmap::fromSorted(values.data(), values.size()).andCardinality(b) == common);
+                vector<uint32_t> both, expected;
+                a.andValues(b, both);
+                set_intersection(setA.begin(), setA.end(), setB.begin(), setB.end(), back_inserter(expected));
+                CHECK(both == expected);
+            }
+        }
+        for (int i = 0; i < 1000; i++) {
+            uint32_t value = randomValue();
+            CHECK(a.contains(value) == (setA.count(value) == 1));
+        }
+        // Two full groups take the bitmap-bitmap popcount path
+        Bitmap evens, thirds;
+        for (uint32_t v = 0; v < 200000; v++) {
+            if (v % 2 == 0) {
+                evens.add(v);
+            }
+            if (v % 3 == 0) {
+                thirds.add(v);
+            }
+        }
+        CHECK(evens.andCardinality(thirds) == (200000 + 5) / 6);
+        vector<uint32_t> sixths;
+        evens.andValues(thirds, sixths);
+        REQUIRE(sixths.size() == (200000 + 5) / 6);
+        CHECK(sixths.back() == 199998);
+    }
+
+    SUBCASE("Counts equal a brute-force tally of the listed items through writes") {
+        userMap.clear();
+        bookMap.clear();
+        reviewMap.clear();
+        recommendationMap.clear();
+        flushRecommendations();
+        User reader("u90", "Reader", "reader90@example.com", {"Fiction"});
+        userMap["u90"] = reader;
+
+        const char* genres[] = {"Fiction", "Mystery", "Fantasy", "History"};
+        const char* authors[] = {"Ada Lund", "Bo Ward", "Cy Silva", "Dee Hart", "Eli Moss", "Fay Lin"};
+        mt19937 rng(91);
+        for (int i = 0; i < 400; i++) {
+            string id = "b90-" + to_string(1000 + i);
+            bookMap[id] = Book(id, "Title " + to_string(i), authors[rng() % 6], genres[rng() % 4], "");
+        }
+        int nextReview = 0;
+        for (auto& entry : bookMap) {
+            for (unsigned r = rng() % 5; r > 0; r--) {
+                string id = "r90-" + to_string(nextReview++);
+                reviewMap.insert_or_assign(id, Review(id, reader, entry.second, 1 + rng() % 5, rng() % 4 ? "Fine" : "Slow pacing"));
+            }
+        }
+        rebuildFacets();
+        REQUIRE(facetsReady());
+
+        // Each facet of a faceted list response against a tally of its own items
+        auto checkList = [&](bool books, const string& query, const vector<string>& facets) {
+            string url = string(books ? "/api/books?" : "/api/reviews?") + query;
+            request req;
+            req.url_params = query_string(url);
+            response res = books ? readAllBooks(req) : readAllReviews(req);
+            REQUIRE(res.code == 200);
+            json::rvalue body = json::load(res.body);
+            REQUIRE(body);
+            INFO(url);
+            for (const string& facet : facets) {
+                map<string, size_t> tally;
+                for (json::rvalue& item : body["items"]) {
+                    string value = facet == "rating" ? to_string(item["rating"].i())
+                                   : facet == "user" ? string(item["user"]["name"].s())
+                                   : books ? string(item[facet].s()) : string(item["book"][facet].s());
+                    if (!value.empty()) {
+                        tally[value]++;
+                    }
+                }
+                vector<pair<string, size_t> > expected(tally.begin(), tally.end());
+                stable_sort(expected.begin(), expected.end(), [](const pair<string, size_t>& a, const pair<string, size_t>& b) {
+                    return a.second > b.second;
+                });
+                expected.resize(min(expected.size(), DEFAULT_FACET_VALUES));
+                json::rvalue counts = body["facets"][facet];
+                REQUIRE(counts.size() == expected.size());
+                for (size_t i = 0; i < expected.size(); i++) {
+                    CHECK(string(counts[i]["value"].s()) == expected[i].first);
+                    CHECK(counts[i]["count"].u() == expected[i].second);
+                }
+            }
+        };
+        auto checkAll = [&]() {
+            checkList(true, "facets=genre,author", {"genre", "author"});
+            checkList(true, "facets=author&filterKey=genre&filterValue=mystery", {"author"});
+            checkList(true, "facets=genre&search=ada", {"genre"});
+            checkList(true, "facets=genre&sort=title", {"genre"});
+            checkList(false, "facets=genre,author,rating", {"genre", "author", "rating"});
+            checkList(false, "facets=rating,author&search=pacing", {"rating", "author"});
+            checkList(false, "facets=rating&filterKey=author&filterValue=bo%20ward", {"rating"});
+            checkList(false, "facets=genre,rating&filterKey=genre&filterValue=FANTASY", {"genre", "rating"});
+            checkList(false, "facets=author&search=title+12", {"author"});
+            checkList(false, "facets=user,rating&filterKey=genre&filterValue=mystery&minRating=3", {"user", "rating"});
+        };
+        checkAll();
+
+        for (int step = 0; step < 300; step++) {
+            auto it = bookMap.begin();
+            advance(it, rng() % bookMap.size());
+            string bookId = it->first;
+            int action = rng() % 10;
+            if (action < 4) {
+                request post;
+                post.body = "{\"id\":\"r90-" + to_string(nextReview++) + "\",\"user\":{\"id\":\"u90\"},\"book\":{\"id\":\"" + bookId +
+                            "\"},\"rating\":" + to_string(1 + rng() % 5) + ",\"comment\":\"Again\"}";
+                createReview(post);
+            } else if (action < 6 && !reviewMap.empty()) {
+                auto review = reviewMap.begin();
+                advance(review, rng() % reviewMap.size());
+                if (rng() % 2) {
+                    deleteReview(review->first);
+                } else {
+                    request rerate;
+                    rerate.body = "{\"rating\":" + to_string(1 + rng() % 5) + ",\"comment\":\"Changed my mind\"}";
+                    response rerated;
+                    updateReview(rerate, rerated, review->first);
+                }
+            } else if (action < 8) {
+                // Moves the book's reviews to the new genre and author as well
+                request update;
+                update.body = string("{\"title\":\"Retitled\",\"author\":\"") + authors[rng() % 6] + "\",\"genre\":\"" +
+                              genres[rng() % 4] + "\",\"isbn\":\"\"}";
+                response updated;
+                updateBook(update, updated, bookId);
+            } else if (action < 9) {
+                deleteBook(bookId);
+            } else {
+                request post;
+                post.body = "{\"id\":\"b90-" + to_string(5000 + step) + "\",\"title\":\"New\",\"author\":\"" + authors[rng() % 6] +
+                            "\",\"genre\":\"" + genres[rng() % 4] + "\",\"isbn\":\"\"}";
+                createBook(post);
+            }
+            if (step % 100 == 99) {
+                checkAll();
+            }
+        }
+        flushRecommendations();
+    }
+
+    SUBCASE("Parameters, limits and the shard merge") {
+        bookMap.clear();
+        reviewMap.clear();
+        bookMap["b91"] = Book("b91", "A", "Ann", "Fiction", "");
+        bookMap["b92"] = Book("b92", "B", "Ben", "Fiction", "");
+        bookMap["b93"] = Book("b93", "C", "Ann", "Poetry", "");
+        rebuildFacets();
+
+        request req;
+        req.url_params = query_string("/api/books?facets=genre&facetLimit=1");
+        json::rvalue body = json::load(readAllBooks(req).body);
+        CHECK(body["items"].size() == 3);
+        REQUIRE(body["facets"]["genre"].size() == 1);
+        CHECK(string(body["facets"]["genre"][0]["value"].s()) == "Fiction");
+        CHECK(body["facets"]["genre"][0]["count"].i() == 2);
+
+        req.url_params = query_string("/api/books?facets=rating");
+        CHECK(readAllBooks(req).code == 400);
+        req.url_params = query_string("/api/books?facets=genre&facetLimit=0");
+        CHECK(readAllBooks(req).code == 400);
+        req.url_params = query_string("/api/reviews?facets=genre&q=slow");
+        CHECK(readAllReviews(req).code == 400);
+        req.url_params = query_string("/api/books?facets=genre");
+        response unfiltered;
+        unsigned long long version;
+        CHECK(!readListSnapshot("/api/books", req, unfiltered, version));
+
+        // Shards hold different users' reviews: items merge by id, counts add up
+        vector<string> bodies = {
+            "{\"items\":[{\"id\":\"r1\",\"rating\":5},{\"id\":\"r3\",\"rating\":4}],\"facets\":{\"rating\":[{\"value\":\"4\",\"count\":1},{\"value\":\"5\",\"count\":1}]}}",
+            "{\"items\":[{\"id\":\"r2\",\"rating\":4}],\"facets\":{\"rating\":[{\"value\":\"4\",\"count\":1}]}}"
+        };
+        string merged;
+        REQUIRE(mergeShardLists("reviews", query_string("/api/reviews?facets=rating"), bodies, merged));
+        json::rvalue combined = json::load(merged);
+        REQUIRE(combined["items"].size() == 3);
+        CHECK(string(combined["items"][1]["id"].s()) == "r2");
+        REQUIRE(combined["facets"]["rating"].size() == 2);
+        CHECK(string(combined["facets"]["rating"][0]["value"].s()) == "4");
+        CHECK(combined["facets"]["rating"][0]["count"].i() == 2);
+        bookMap.clear();
+        rebuildFacets();
+    }
+}
+
+TEST_CASE("Reviews - Rating ranges from per-rating postings") {
+    SUBCASE("Matches a brute-force scan through writes") {
+        userMap.clear();
+        bookMap.clear();
+        reviewMap.clear();
+        recommendationMap.clear();
+        flushRecommendations();
+        const char* names[] = {"Ada", "ada", "Bo", "Cy"};
+        for (int u = 0; u < 4; u++) {
+            string id = "u95-" + to_string(u);
+            userMap[id] = User(id, names[u], id + "@example.com", {"Fiction"});
+        }
+        const char* genres[] = {"Classic", "classic", "Mystery", ""};
+        const char* authors[] = {"Ann", "Ben", "Cat"};
+        mt19937 rng(95);
+        for (int i = 0; i < 60; i++) {
+            string id = "b95-" + to_string(i);
+            bookMap[id] = Book(id, "T" + to_string(i), authors[rng() % 3], genres[rng() % 4], "");
+        }
+        // Writes reject ratings outside 1..5, but loaded files can still carry strays
+        int ratings[] = {1, 2, 3, 4, 5, 5, 4, 0, 10, -3};
+        auto addReview = [&](int n, bool loaded) {
+            auto book = bookMap.begin();
+            advance(book, rng() % bookMap.size());
+            string id = "r95-" + to_string(n);
+            string userId = "u95-" + to_string(rng() % 4);
+            int rating = ratings[rng() % 10];
+            request post;
+            post.body = "{\"id\":\"" + id + "\",\"user\":{\"id\":\"" + userId + "\"},\"book\":{\"id\":\"" +
+                        book->first + "\"},\"rating\":" + to_string(rating) + ",\"comment\":\"Fine\"}";
+            bool valid = rating >= 1 && rating <= 5;
+            if (loaded && !valid) {
+                reviewMap.insert_or_assign(id, Review(id, userMap[userId], book->second, rating, "Fine"));
+            } else {
+                CHECK(createReview(post).code == (valid ? 201 : 400));
+            }
+        };
+        int nextReview = 0;
+        while (nextReview < 600) {
+            addReview(nextReview++, true);
+        }
+        rebuildFacets();
+
+        const char* bounds[] = {nullptr, "-3", "0", "3", "4", "5", "9"};
+        const char* filters[][2] = {{nullptr, nullptr}, {"genre", "CLASSIC"}, {"genre", "mystery"}, {"genre", "Poetry"},
+                                    {"author", "ben"}, {"user", "ADA"}, {"user", "Bo"}, {"rating", "5"}};
+        auto checkAll = [&]() {
+            for (const char* low : bounds) {
+                for (const char* high : bounds) {
+                    if (!low && !high) {
+                        continue;
+                    }
+                    for (auto& filter : filters) {
+                        string url = "/api/reviews?";
+                        if (low) {
+                            url += string("minRating=") + low + "&";
+                        }
+                        if (high) {
+                            url += string("maxRating=") + high + "&";
+                        }
+                        if (filter[0]) {
+                            url += string("filterKey=") + filter[0] + "&filterValue=" + filter[1];
+                        }
+                        request req;
+                        req.url_params = query_string(url);
+                        response res = readAllReviews(req);
+                        REQUIRE(res.code == 200);
+                        json::rvalue list = json::load(res.body);
+                        vector<string> got;
+                        for (json::rvalue& item : list) {
+                            got.push_back(item["id"].s());
+                        }
+
+                        vector<string> expected;
+                        for (auto& entry : reviewMap) {
+                            Review& r = entry.second;
+                            Book b = r.getBook();
+                            string key = filter[0] ? filter[0] : "";
+                            string value = filter[1] ? toLower(filter[1]) : "";
+                            bool kept = (!low || r.getRating() >= atoi(low)) && (!high || r.getRating() <= atoi(high)) &&
+                                        (key.empty() || (key == "genre" && toLower(b.getGenre()) == value) ||
+                                         (key == "author" && toLower(b.getAuthor()) == value) ||
+                                         (key == "user" && toLower(r.getUser().getName()) == value));
+                            if (kept) {
+                                expected.push_back(entry.first);
+                            }
+                        }
+                        INFO(url);
+                        CHECK(got == expected);
+                    }
+                }
+            }
+        };
+        checkAll();
+
+        for (int step = 0; step < 200; step++) {
+            int action = rng() % 4;
+            if (action == 0) {
+                addReview(nextReview++, false);
+            } else if (action == 1 && !reviewMap.empty()) {
+                auto review = reviewMap.begin();
+                advance(review, rng() % reviewMap.size());
+                deleteReview(review->first);
+            } else if (action == 2 && !reviewMap.empty()) {
+                auto review = reviewMap.begin();
+                advance(review, rng() % reviewMap.size());
+                request rerate;
+                rerate.body = "{\"rating\":" + to_string(ratings[rng() % 10]) + ",\"comment\":\"Changed\"}";
+                response rerated;
+                updateReview(rerate, rerated, review->first);
+            } else {
+                auto book = bookMap.begin();
+                advance(book, rng() % bookMap.size());
+                request update;
+                update.body = string("{\"title\":\"Re\",\"author\":\"") + authors[rng() % 3] + "\",\"genre\":\"" +
+                              genres[rng() % 4] + "\",\"isbn\":\"\"}";
+                response updated;
+                updateBook(update, updated, book->first);
+            }
+        }
+        checkAll();
+        flushRecommendations();
+    }
+
+    SUBCASE("Combines with search, sort and facets but not q") {
+        userMap.clear();
+        bookMap.clear();
+        reviewMap.clear();
+        User reader("u96", "Reader", "reader96@example.com", {"Fiction"});
+        userMap["u96"] = reader;
+        bookMap["b96"] = Book("b96", "Dune", "Frank", "SciFi", "");
+        reviewMap.insert_or_assign("r1", Review("r1", reader, bookMap["b96"], 2, "Slow pacing"));
+        reviewMap.insert_or_assign("r2", Review("r2", reader, bookMap["b96"], 5, "Great pacing"));
+        reviewMap.insert_or_assign("r3", Review("r3", reader, bookMap["b96"], 4, "Loved it"));
+        rebuildFacets();
+
+        request req;
+        req.url_params = query_string("/api/reviews?search=pacing&minRating=3");
+        json::rvalue list = json::load(readAllReviews(req).body);
+        REQUIRE(list.size() == 1);
+        CHECK(string(list[0]["id"].s()) == "r2");
+
+        req.url_params = query_string("/api/reviews?sort=rating&maxRating=4");
+        list = json::load(readAllReviews(req).body);
+        REQUIRE(list.size() == 2);
+        CHECK(string(list[0]["id"].s()) == "r3");
+        CHECK(string(list[1]["id"].s()) == "r1");
+
+        req.url_params = query_string("/api/reviews?minRating=4&facets=rating");
+        json::rvalue body = json::load(readAllReviews(req).body);
+        CHECK(body["items"].size() == 2);
+        CHECK(body["facets"]["rating"].size() == 2);
+
+        req.url_params = query_string("/api/reviews?minRating=four");
+        CHECK(readAllReviews(req).code == 400);
+        req.url_params = query_string("/api/reviews?maxRating=");
+        CHECK(readAllReviews(req).code == 400);
+        req.url_params = query_string("/api/reviews?q=pacing&minRating=4");
+        CHECK(readAllReviews(req).code == 400);
+        req.url_params = query_string("/api/reviews?minRating=4");
+        response unfiltered;
+        unsigned long long version;
+        CHECK(!readListSnapshot("/api/reviews", req, unfiltered, version));
+        reviewMap.clear();
+        rebuildFacets();
+    }
+}
+
+TEST_CASE("Trace - Sampled spans export as Chrome trace events") {
+    SUBCASE("Nothing is recorded while sampling is disabled") {
+        traceSampleEvery = 0;
+        {
+            TraceRoot root("untraced-root");
+            TraceSpan span("untraced-phase");
+        }
+        CHECK(renderTraceJson().find("untraced-phase") == string::npos);
+    }
+
+    SUBCASE("Sampled roots record nested phases") {
+        traceSampleEvery = 1;
+        {
+            TraceRoot root("traced-root");
+            TraceSpan span("traced-phase");
+        }
+        traceSampleEvery = 0;
+        CHECK_FALSE(traceActive);
+
+        json::rvalue trace = json::load(renderTraceJson());
+        REQUIRE(trace);
+        bool foundRoot = false;
+        bool foundPhase = false;
+        for (json::rvalue& event : trace["traceEvents"]) {
+            string name = event["name"].s();
+            foundRoot = foundRoot || name == "traced-root";
+            foundPhase = foundPhase || name == "traced-phase";
+            CHECK(string(event["ph"].s()) == "X");
+        }
+        CHECK(foundRoot);
+        CHECK(foundPhase);
+    }
+}
+
+TEST_CASE("Recommendations - Background recomputation") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+
+    request userReq;
+    userReq.body = "{\"id\":\"u70\",\"name\":\"Lena\",\"email\":\"lena@example.com\",\"preferences\":[\"Fantasy\"]}";
+    request bookReq;
+    bookReq.body = "{\"id\":\"b70\",\"title\":\"Earthsea\",\"author\":\"Ursula K. Le Guin\",\"genre\":\"Fantasy\",\"isbn\":\"9780547773742\"}";
+
+    SUBCASE("Writes enqueue and a flush applies them as one batch") {
+        unsigned long long before = getRecommendationStatus().generation;
+        CHECK(createUser(userReq).code == 201);
+        CHECK(createBook(bookReq).code == 201);
+        CHECK(createBook(bookReq).code == 201);
+
+        CHECK(recommendationMap.empty());
+        CHECK(getRecommendationStatus().pendingTasks == 3);
+
+        flushRecommendations();
+        RecommendationStatus status = getRecommendationStatus();
+        CHECK(status.generation == before + 1);
+        CHECK(status.pendingTasks == 0);
+        CHECK(status.stalenessMillis == 0);
+        REQUIRE(recommendationMap.size() == 1);
+        CHECK(recommendationMap["001"].getUser().getId() == "u70");
+        CHECK(recommendationMap["001"].getBook().getId() == "b70");
+
+        response res = readAllRecommendations(request());
+        CHECK(res.get_header_value("X-Recommendation-Generation") == to_string(status.generation));
+        CHECK(res.get_header_value("X-Recommendation-Pending") == "0");
+    }
+
+    SUBCASE("The worker drains the queue in the background") {
+        createUser(userReq);
+        createBook(bookReq);
+        flushRecommendations();
+        REQUIRE(recommendationMap.size() == 1);
+
+        startRecommendationWorker();
+        response res;
+        request updateReq;
+        updateReq.body = "{\"title\":\"Earthsea\",\"author\":\"Ursula K. Le Guin\",\"genre\":\"Horror\",\"isbn\":\"9780547773742\"}";
+        {
+            DataLock lock(true);
+            updateBook(updateReq, res, "b70");
+        }
+        flushRecommendations();
+        stopRecommendationWorker();
+
+        CHECK(res.code == 200);
+        CHECK(recommendationMap.empty());
+        CHECK(getRecommendationStatus().pendingTasks == 0);
+    }
+
+    SUBCASE("Compressed hits report the queue at the time of the request") {
+        createUser(userReq);
+        createBook(bookReq);
+        flushRecommendations();
+        dataVersion++;
+        size_t minBytes = compressionOptions.minBytes;
+        compressionOptions.minBytes = 0;
+
+        auto getAll = instrument("GET", "/api/recommendations", readAllRecommendations);
+        request gzipReq;
+        gzipReq.raw_url = "/api/recommendations";
+        gzipReq.add_header("Accept-Encoding", "gzip");
+        response first = getAll(gzipReq);
+        CHECK(first.get_header_value("Content-Encoding") == "gzip");
+
+        enqueueRecommendationsForUser("u70");
+        response second = getAll(gzipReq);
+        CHECK(second.body == first.body);
+        CHECK(second.get_header_value("X-Recommendation-Pending") == "1");
+
+        flushRecommendations();
+        compressionOptions.minBytes = minBytes;
+    }
+
+    SUBCASE("Deletes are queued and log only the recommendations they remove") {
+        userMap.clear();
+        recommendationMap.clear();
+        createBook(bookReq);
+        for (int i = 0; i < 3; i++) {
+            request reader;
+            reader.body = "{\"id\":\"u7" + to_string(i + 1) + "\",\"name\":\"Reader\",\"email\":\"r" + to_string(i) +
+                          "@example.com\",\"preferences\":[\"Fantasy\"]}";
+            REQUIRE(createUser(reader).code == 201);
+        }
+        flushRecommendations();
+        REQUIRE(recommendationMap.size() == 3);
+        CHECK(recommendationMap["002"].getUser().getId() == "u72");
+
+        unsigned long long start = latestChangeSeq();
+        CHECK(deleteUser("u72").code == 204);
+        CHECK(recommendationMap.size() == 3);
+        CHECK(getRecommendationStatus().pendingTasks == 1);
+        flushRecommendations();
+
+        REQUIRE(recommendationMap.size() == 2);
+        CHECK(recommendationMap["001"].getUser().getId() == "u71");
+        CHECK(recommendationMap["003"].getUser().getId() == "u73");
+        request feedReq;
+        feedReq.url_params = query_string("/api/changes?since=" + to_string(start));
+        json::rvalue feed = json::load(readChanges(feedReq).body);
+        REQUIRE(feed["changes"].size() == 2);
+        CHECK(string(feed["changes"][(size_t)0]["collection"].s()) == "users");
+        CHECK(string(feed["changes"][(size_t)1]["op"].s()) == "delete");
+        CHECK(string(feed["changes"][(size_t)1]["id"].s()) == "002");
+
+        // New pairs are numbered past the highest id in use
+        request another;
+        another.body = "{\"id\":\"u74\",\"name\":\"Reader\",\"email\":\"r4@example.com\",\"preferences\":[\"Fantasy\"]}";
+        createUser(another);
+        flushRecommendations();
+        CHECK(recommendationMap["004"].getUser().getId() == "u74");
+        CHECK(recommendationMap.count("002") == 0);
+    }
+
+    userMap.clear();
+    bookMap.clear();
+    recommendationMap.clear();
+}
+
+TEST_CASE("Startup - Parallel loading and readiness") {
+    SUBCASE("Arrays split into runs of whole elements") {
+        string text = " [";
+        for (int i = 0; i < 200; i++) {
+            text += string(i ? "," : "") + "{\"id\":\"b" + to_string(i) + "\",\"title\":\"a ] , } \\\" \\\\\",\"x\":[[{}]]}";
+        }
+        text += "] \n";
+        for (size_t parts = 1; parts <= 9; parts++) {
+            INFO(parts);
+            vector<JsonRun> runs;
+            REQUIRE(splitJsonArray(text.data(), text.data() + text.size(), parts, runs));
+            CHECK(runs.size() <= parts);
+            CHECK(*runs.front().begin == '[');
+            CHECK(runs.back().end[-1] == ']');
+            size_t count = 0;
+            for (unsigned int i = 0; i < runs.size(); i++) {
+                CHECK((i == 0 || *runs[i].begin == ','));
+                CHECK((i == 0 || runs[i].begin == runs[i - 1].end));
+                CHECK(readJsonRun<Book>(runs[i], [&](Book& book) { CHECK(book.getId() == "b" + to_string(count++)); }));
+            }
+            CHECK(count == 200);
+        }
+
+        const char* bad[] = {"", "{}", "[{}", "[{}] x", "[\"open]", "[}]"};
+        for (const char* text : bad) {
+            vector<JsonRun> runs;
+            CHECK_FALSE(splitJsonArray(text, text + strlen(text), 4, runs));
+        }
+        string empty = "[ ]";
+        vector<JsonRun> runs;
+        REQUIRE(splitJsonArray(empty.data(), empty.data() + empty.size(), 4, runs));
+        int elements = 0;
+        CHECK(readJsonRun<Book>(runs[0], [&](Book&) { elements++; }));
+        CHECK(elements == 0);
+    }
+
+    SUBCASE("Chunked loads match at any thread count") {
+        map<string, Book> books;
+        for (int i = 0; i < 3000; i++) {
+            string id = "b" + to_string(100000 + i);
+            books[id] = Book(id, "Title " + string(60, 'a' + i % 26), "Author", i % 2 ? "Poetry" : "Drama", "");
+        }
+        saveBookToFile(books, "test_parallel_books.json");
+        for (int threads : {1, 3, 8}) {
+            INFO(threads);
+            map<string, Book> loaded = loadMapFile<Book>("test_parallel_books.json", threads);
+            REQUIRE(loaded.size() == books.size());
+            CHECK(loaded.begin()->second.getJsonFragment() == books.begin()->second.getJsonFragment());
+            CHECK(loaded.rbegin()->second.getJsonFragment() == books.rbegin()->second.getJsonFragment());
+        }
+
+        // Out of order and repeated ids still land where they belong; the last copy wins
+        ofstream("test_parallel_books.json")
+            << "[{\"id\":\"b2\",\"title\":\"first\"},{\"id\":\"b1\"},{\"id\":\"b3\"},{\"id\":\"b2\",\"title\":\"last\"}]";
+        map<string, Book> loaded = loadMapFile<Book>("test_parallel_books.json", 4);
+        REQUIRE(loaded.size() == 3);
+        CHECK(loaded["b2"].getTitle() == "last");
+
+        ofstream("test_parallel_books.json") << "[{\"id\":\"b1\"},{\"id\":2}]";
+        CHECK(loadMapFile<Book>("test_parallel_books.json", 4).empty());
+        remove("test_parallel_books.json");
+        CHECK(loadMapFile<Book>("test_parallel_books.json", 4).empty());
+    }
+
+    SUBCASE("The four files load at once") {
+        map<string, User> users = {{"u1", User("u1", "Ada", "ada@example.com", {"Poetry"})}};
+        map<string, Book> books = {{"b1", Book("b1", "Ariel", "Plath", "Poetry", "")}};
+        map<string, Review> reviews = {{"r1", Review("r1", users["u1"], books["b1"], 5, "Sharp")}};
+        map<string, Recommendation> recommendations = {{"rec1", Recommendation("rec1", users["u1"], books["b1"])}};
+        saveUserToFile(users, "test_parallel_users.json");
+        saveBookToFile(books, "test_parallel_books.json");
+        saveReviewToFile(reviews, "test_parallel_reviews.json");
+        saveRecommendationToFile(recommendations, "test_parallel_recommendations.json");
+
+        loadDataFiles("test_parallel_books.json", "test_parallel_users.json", "test_parallel_reviews.json",
+                      "test_parallel_recommendations.json", 4);
+        CHECK(userMap.size() == 1);
+        CHECK(bookMap.size() == 1);
+        REQUIRE(reviewMap.size() == 1);
+        CHECK(reviewMap.find("r1")->second.getJsonFragment() == reviews["r1"].getJsonFragment());
+        CHECK(recommendationMap.size() == 1);
+        remove("test_parallel_users.json");
+        remove("test_parallel_books.json");
+        remove("test_parallel_reviews.json");
+        remove("test_parallel_recommendations.json");
+    }
+
+    SUBCASE("Every task runs once") {
+        vector<atomic<int>> runs(100);
+        vector<function<void()>> tasks;
+        for (int i = 0; i < 100; i++) {
+            tasks.push_back([&runs, i]() { runs[i]++; });
+        }
+        runParallel(tasks, 7);
+        for (int i = 0; i < 100; i++) {
+            CHECK(runs[i] == 1);
+        }
+    }
+
+    SUBCASE("Routes answer 503 until loading is done") {
+        bookMap.clear();
+        auto getBook = instrument("GET", "/api/books/<id>", readBook);
+        atomic<bool> release(false);
+        startLoading([&]() {
+            bookMap["b1"] = Book("b1", "Ariel", "Plath", "Poetry", "");
+            while (!release) {
+                this_thread::yield();
+            }
+        });
+        CHECK(isLoading());
+        CHECK(readReadiness().code == 503);
+        response waiting = getBook("b1");
+        CHECK(waiting.code == 503);
+        CHECK(waiting.get_header_value("Retry-After") == to_string(admissionOptions.retryAfterSeconds));
+
+        release = true;
+        waitForLoading();
+        CHECK_FALSE(isLoading());
+        CHECK(readReadiness().code == 200);
+        CHECK(getBook("b1").code == 200);
+        bookMap.clear();
+    }
+
+    userMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+}
+
+TEST_CASE("ReviewStore - Paged reviews") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+    userMap["u1"] = User("u1", "Ada", "ada@example.com", {"Fiction"});
+    userMap["u2"] = User("u2", "Bo", "bo@example.com", {"Poetry"});
+    bookMap["b1"] = Book("b1", "Beloved", "Morrison", "Fiction", "");
+    bookMap["b2"] = Book("b2", "Ariel", "Plath", "Poetry", "");
+
+    // A budget of a few reviews and small segments, so nearly every read goes to disk
+    ReviewStoreOptions options;
+    options.dir = "test_review_store";
+    options.cacheBytes = 4096;
+    options.segmentBytes = 8192;
+    REQUIRE(reviewMap.open(options));
+    REQUIRE(reviewMap.paged());
+
+    map<string, string> expected; // id -> JSON, as the handlers returned it
+    for (int i = 0; i < 200; i++) {
+        string id = "r" + to_string(1000 + i);
+        request post;
+        post.body = "{\"id\":\"" + id + "\",\"user\":{\"id\":\"u" + to_string(1 + i % 2) + "\"},\"book\":{\"id\":\"b" +
+                    to_string(1 + i % 2) + "\"},\"rating\":" + to_string(1 + i % 5) + ",\"comment\":\"Note " +
+                    to_string(i) + "\"}";
+        response created = createReview(post);
+        REQUIRE(created.code == 201);
+        expected[id] = created.body;
+    }
+    auto checkAll = [&]() {
+        REQUIRE(reviewMap.size() == expected.size());
+        for (map<string, string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+            response read = readReview(it->first);
+            REQUIRE(read.code == 200);
+            CHECK(read.body == it->second);
+        }
+    };
+
+    SUBCASE("Handlers work on top of the store") {
+        checkAll();
+        ReviewStoreStats stats = reviewMap.stats();
+        CHECK(stats.cachedBytes <= 4096 + 2048);
+        CHECK(stats.misses > 0);
+        CHECK(stats.appends >= 200);
+        CHECK(stats.segments > 1);
+
+        for (int i = 0; i < 200; i += 3) {
+            string id = "r" + to_string(1000 + i);
+            request put;
+            put.body = "{\"rating\":5,\"comment\":\"Changed " + to_string(i) + "\"}";
+            response res;
+            updateReview(put, res, id);
+            REQUIRE(res.code == 200);
+            expected[id] = res.body;
+        }
+        for (int i = 1; i < 200; i += 7) {
+            string id = "r" + to_string(1000 + i);
+            CHECK(deleteReview(id).code == 204);
+            CHECK(readReview(id).code == 404);
+            expected.erase(id);
+        }
+        // Changed reviews were written back as they left the cache
+        checkAll();
+        checkAll();
+
+        request req;
+        req.url_params = query_string("/api/reviews");
+        json::rvalue all = json::load(readAllReviews(req).body);
+        CHECK(all.size() == expected.size());
+        map<string, string>::iterator next = expected.begin();
+        for (json::rvalue& item : all) {
+            CHECK(item["id"].s() == next->first);
+            ++next;
+        }
+        req.url_params = query_string("/api/reviews?sort=rating");
+        json::rvalue sorted = json::load(readAllReviews(req).body);
+        REQUIRE(sorted.size() == expected.size());
+        for (size_t i = 1; i < sorted.size(); i++) {
+            CHECK(sorted[i - 1]["rating"].i() >= sorted[i]["rating"].i());
+        }
+        req.url_params = query_string("/api/reviews?filterKey=user&filterValue=bo");
+        size_t byBo = 0;
+        for (map<string, string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+            byBo += it->second.find("\"name\":\"Bo\"") != string::npos;
+        }
+        CHECK(json::load(readAllReviews(req).body).size() == byBo);
+    }
+
+    SUBCASE("Pinned reviews stay in memory") {
+        ReviewPins pins;
+        vector<pair<string, Review*> > held;
+        for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end(); ++it) {
+            held.push_back(make_pair(it.key(), reviewMap.pin(it)));
+        }
+        CHECK(reviewMap.stats().cachedReviews == held.size());
+        for (unsigned int i = 0; i < held.size(); i++) {
+            CHECK(held[i].second->getJsonFragment() == expected[held[i].first]);
+        }
+    }
+
+    SUBCASE("Concurrent readers") {
+        atomic<int> wrong(0);
+        vector<thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.emplace_back([&, t]() {
+                for (int round = 0; round < 3; round++) {
+                    for (map<string, string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+                        response read = readReview(it->first);
+                        wrong += read.code != 200 || read.body != it->second;
+                    }
+                }
+            });
+        }
+        for (unsigned int t = 0; t < readers.size(); t++) {
+            readers[t].join();
+        }
+        CHECK(wrong == 0);
+    }
+
+    SUBCASE("Compaction keeps the current records") {
+        for (int round = 0; round < 3; round++) {
+            for (map<string, string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+                request put;
+                put.body = "{\"comment\":\"Round " + to_string(round) + "\"}";
+                response res;
+                updateReview(put, res, it->first);
+                it->second = res.body;
+            }
+            checkAll();
+        }
+        reviewMap.compact();
+        ReviewStoreStats stats = reviewMap.stats();
+        CHECK(stats.compactions > 0);
+        CHECK(stats.liveBytes * 100 >= stats.diskBytes * 30);
+        checkAll();
+    }
+
+    SUBCASE("Lists and fan-outs read one review at a time") {
+        request req;
+        req.url_params = query_string("/api/reviews?sort=title");
+        CHECK(json::load(readAllReviews(req).body).size() == expected.size());
+        CHECK(reviewMap.stats().cachedBytes <= 4096 + 2048);
+        req.url_params = query_string("/api/reviews?search=note&facets=rating");
+        CHECK(readAllReviews(req).code == 200);
+        CHECK(reviewMap.stats().cachedBytes <= 4096 + 2048);
+
+        // A retitle reads in the reviews of that book and no others
+        vector<string> ofAriel;
+        for (map<string, string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+            if (it->second.find("\"id\":\"b2\"") != string::npos) {
+                ofAriel.push_back(it->first);
+            }
+        }
+        unsigned long long misses = reviewMap.stats().misses;
+        request retitle;
+        retitle.body = "{\"title\":\"Ariel, Restored\"}";
+        response retitled;
+        updateBook(retitle, retitled, "b2");
+        REQUIRE(retitled.code == 200);
+        CHECK(reviewMap.stats().misses - misses <= ofAriel.size());
+        for (unsigned int i = 0; i < ofAriel.size(); i++) {
+            expected[ofAriel[i]] = readReview(ofAriel[i]).body;
+            CHECK(expected[ofAriel[i]].find("Ariel, Restored") != string::npos);
+        }
+        CHECK(readReview("r1000").body.find("Ariel, Restored") == string::npos);
+    }
+
+    SUBCASE("Saves and loads without decoding every review") {
+        saveUserToFile(userMap, "test_store_users.json");
+        saveBookToFile(bookMap, "test_store_books.json");
+        saveReviewToFile(reviewMap, "test_store_reviews.json");
+        map<string, Review> reference;
+        for (map<string, string>::iterator it = expected.begin(); it != expected.end(); ++it) {
+            reference[it->first] = Review();
+            JsonReader in(it->second);
+            REQUIRE(readJson(in, reference[it->first]));
+        }
+        saveReviewToFile(reference, "test_store_reference.json");
+        ifstream saved("test_store_reviews.json"), wanted("test_store_reference.json");
+        CHECK(string(istreambuf_iterator<char>(saved), istreambuf_iterator<char>()) ==
+              string(istreambuf_iterator<char>(wanted), istreambuf_iterator<char>()));
+
+        unsigned long long appends = reviewMap.stats().appends;
+        loadDataFiles("test_store_books.json", "test_store_users.json", "test_store_reviews.json",
+                      "test_store_recommendations.json", 2);
+        CHECK(reviewMap.paged());
+        CHECK(reviewMap.stats().appends == appends + expected.size());
+        CHECK(reviewMap.stats().cachedReviews == 0);
+        checkAll();
+        remove("test_store_users.json");
+        remove("test_store_books.json");
+        remove("test_store_reviews.json");
+        remove("test_store_reference.json");
+    }
+
+    reviewMap.close();
+    CHECK_FALSE(reviewMap.paged());
+    CHECK(reviewMap.stats().segments == 0);
+    checkAll();
+    CHECK(rmdir("test_review_store") == 0);
+
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+}
+
+TEST_CASE("Memory accounting - Estimates by collection and field") {
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+    flushRecommendations();
+
+    // Built straight into the maps, so the allocator's growth is theirs alone
+    unsigned long long before = getAllocatorStats().liveBytes;
+    for (int i = 0; i < 400; i++) {
+        string id = "u" + to_string(1000 + i);
+        vector<string> preferences;
+        for (int p = 0; p < i % 4; p++) {
+            preferences.push_back(p % 2 ? "Science Fiction and Fantasy" : "Poetry");
+        }
+        userMap[id] = User(id, "User " + string(i % 40, 'n'), "user" + to_string(i) + "@example.com", preferences);
+        userMap[id].getJsonFragment();
+    }
+    for (int i = 0; i < 200; i++) {
+        string id = "b" + to_string(1000 + i);
+        bookMap[id] = Book(id, "Title " + string(i % 70, 't'), "Author " + to_string(i), "Fiction", "");
+        bookMap[id].getJsonFragment();
+    }
+    for (int i = 0; i < 2000; i++) {
+        string id = "review-" + to_string(1000000000 + i);
+        reviewMap.insert_or_assign(id, Review(id, userMap["u" + to_string(1000 + i % 400)], bookMap["b" + to_string(1000 + i % 200)],
+                                              1 + i % 5, string(i % 120, 'c')));
+        if (i % 3) {
+            reviewMap.find(id)->second.getJsonFragment();
+        }
+    }
+    for (int i = 0; i < 300; i++) {
+        string id = "rec" + to_string(i);
+        recommendationMap[id] = Recommendation(id, userMap["u" + to_string(1000 + i)], bookMap["b" + to_string(1000 + i % 200)]);
+    }
+    unsigned long long grown = getAllocatorStats().liveBytes - before;
+
+    SUBCASE("Estimates track the allocator") {
+        map<string, CollectionMemory> collections = measureCollections(1);
+        REQUIRE(collections.size() == 4);
+        CHECK(collections["users"].entities == 400);
+        CHECK(collections["reviews"].measured == 2000);
+
+        unsigned long long estimated = 0;
+        for (map<string, CollectionMemory>::iterator it = collections.begin(); it != collections.end(); ++it) {
+            for (map<string, MemoryUsage>::iterator type = it->second.byType.begin(); type != it->second.byType.end(); ++type) {
+                estimated += type->second.total();
+            }
+        }
+        INFO(estimated, grown);
+        CHECK(estimated > grown * 0.98);
+        CHECK(estimated < grown * 1.02);
+
+        MemoryUsage& users = collections["users"].byType["User"];
+        CHECK(users.bytes[MEMORY_VECTORS] > 0);
+        CHECK(users.bytes[MEMORY_JSON] > 0);
+        CHECK(users.bytes[MEMORY_KEYS] == 0); // Ids this short stay inside the string
+        CHECK(collections["reviews"].byType["Review"].bytes[MEMORY_KEYS] > 0);
+        CHECK(collections["reviews"].byType.count("User") == 1);
+        CHECK(collections["reviews"].byType.count("Book") == 1);
+        CHECK(collections["recommendations"].byType["Recommendation"].bytes[MEMORY_JSON] == 0);
+
+        // Sampling scales what it measured up to the whole collection
+        map<string, CollectionMemory> sampled = measureCollections(7);
+        CHECK(sampled["reviews"].entities == 2000);
+        CHECK(sampled["reviews"].measured == 286);
+        double full = collections["reviews"].byType["Review"].total();
+        double scaled = sampled["reviews"].byType["Review"].total();
+        CHECK(fabs(scaled - full) < full * 0.05);
+    }
+
+    SUBCASE("Endpoint reports collections, types and the allocator") {
+        request req;
+        req.url_params = query_string("/api/admin/memory?sample=2");
+        response res = readMemoryUsage(req);
+        REQUIRE(res.code == 200);
+        json::rvalue body = json::load(res.body);
+        CHECK(body["sample"].i() == 2);
+        CHECK(body["collections"]["reviews"]["entities"].i() == 2000);
+        CHECK(body["collections"]["reviews"]["types"]["Book"]["strings"].i() > 0);
+        CHECK(body["types"]["User"]["bytes"].i() > body["collections"]["users"]["bytes"].i());
+        CHECK(body["classes"]["bytes"].i() > 0);
+        CHECK(body["estimatedBytes"].i() >= body["classes"]["bytes"].i());
+        CHECK(body["allocator"]["liveBytes"].i() > 0);
+        CHECK(body["allocator"]["allocations"].i() >= body["allocator"]["frees"].i());
+        CHECK(body["rssBytes"].i() > 0);
+
+        req.url_params = query_string("/api/admin/memory?sample=0");
+        CHECK(readMemoryUsage(req).code == 400);
+    }
+
+    SUBCASE("Writers get in between chunks") {
+        atomic<bool> done(false);
+        int writes = 0;
+        thread writer([&]() {
+            while (!done) {
+                DataLock lock(true);
+                string id = "u" + to_string(5000 + writes % 50);
+                if (writes++ % 2) {
+                    userMap.erase(id);
+                } else {
+                    userMap[id] = User(id, "Writer", id + "@example.com", {});
+                }
+            }
+        });
+        for (int i = 0; i < 20; i++) {
+            map<string, CollectionMemory> collections = measureCollections(1);
+            CHECK(collections["users"].entities >= 400);
+            CHECK(collections["users"].entities <= 450);
+            CHECK(collections["reviews"].entities == 2000);
+        }
+        done = true;
+        writer.join();
+        CHECK(writes > 0);
+    }
+
+    SUBCASE("A paged store counts the reviews it holds") {
+        unsigned long long resident = measureCollections(1)["reviews"].byType["Review"].total();
+        ReviewStoreOptions options;
+        options.dir = "test_memory_store";
+        options.cacheBytes = 16384;
+        REQUIRE(reviewMap.open(options));
+        for (ReviewStore::iterator it = reviewMap.begin(); it != reviewMap.end(); ++it) {
+            it->second.getRating();
+        }
+        map<string, CollectionMemory> collections = measureCollections(1);
+        CHECK(collections["reviews"].entities == 2000);
+        CHECK(collections["reviews"].byType["Review"].total() < resident / 2);
+        CHECK(collections["reviews"].byType["Review"].bytes[MEMORY_STRINGS] > 0);
+        reviewMap.close();
+        CHECK(rmdir("test_memory_store") == 0);
+    }
+
+    userMap.clear();
+    bookMap.clear();
+    reviewMap.clear();
+    recommendationMap.clear();
+}
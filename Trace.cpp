@@ -0,0 +1,129 @@
+#include "Trace.h"
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+
+// Spans kept per thread; older spans are overwritten once the ring wraps
+static const unsigned long long TRACE_RING_SIZE = 16384;
+
+static unsigned int initialSampling() {
+    const char* env = getenv("TRACE_SAMPLE_EVERY");
+    return env ? (unsigned int)strtoul(env, nullptr, 10) : 0;
+}
+
+atomic<unsigned int> traceSampleEvery(initialSampling());
+thread_local bool traceActive = false;
+
+// Fields are relaxed atomics so a dump racing with the owning thread reads
+// a stale or mixed span at worst, never a torn pointer.
+struct TraceEvent {
+    atomic<const char*> name;
+    atomic<long long> start;
+    atomic<long long> end;
+};
+
+struct TraceRing {
+    int tid;
+    unsigned long long sampleCounter = 0;
+    atomic<unsigned long long> head;
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+static mutex ringsMutex;
+static vector<TraceRing*> rings;
+static deque<string> internedNames;
+
+// Rings are never freed: Crow's worker threads live as long as the process
+static TraceRing& localRing() {
+    thread_local TraceRing* ring = nullptr;
+    if (!ring) {
+        ring = new TraceRing();
+        lock_guard<mutex> lock(ringsMutex);
+        ring->tid = (int)rings.size() + 1;
+        rings.push_back(ring);
+    }
+    return *ring;
+}
+
+long long traceNowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void traceRecord(const char* name, long long startNanos, long long endNanos) {
+    TraceRing& ring = localRing();
+    unsigned long long head = ring.head.load(memory_order_relaxed);
+    TraceEvent& event = ring.events[head % TRACE_RING_SIZE];
+    event.name.store(name, memory_order_relaxed);
+    event.start.store(startNanos, memory_order_relaxed);
+    event.end.store(endNanos, memory_order_relaxed);
+    ring.head.store(head + 1, memory_order_release);
+}
+
+bool traceSampleRoot() {
+    unsigned int every = traceSampleEvery.load(memory_order_relaxed);
+    TraceRing& ring = localRing();
+    return every != 0 && ring.sampleCounter++ % every == 0;
+}
+
+const char* internTraceName(string name) {
+    lock_guard<mutex> lock(ringsMutex);
+    internedNames.push_back(name);
+    return internedNames.back().c_str();
+}
+
+string renderTraceJson() {
+    vector<TraceRing*> snapshot;
+    {
+        lock_guard<mutex> lock(ringsMutex);
+        snapshot = rings;
+    }
+
+    string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (unsigned int i = 0; i < snapshot.size(); i++) {
+        TraceRing* ring = snapshot[i];
+        unsigned long long head = ring->head.load(memory_order_acquire);
+        unsigned long long begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (unsigned long long n = begin; n < head; n++) {
+            TraceEvent& event = ring->events[n % TRACE_RING_SIZE];
+            const char* name = event.name.load(memory_order_relaxed);
+            long long start = event.start.load(memory_order_relaxed);
+            long long end = event.end.load(memory_order_relaxed);
+            if (!name || end < start) {
+                continue;
+            }
+
+            json::wvalue j;
+            j["name"] = name;
+            j["ph"] = "X";
+            j["pid"] = 1;
+            j["tid"] = ring->tid;
+            j["ts"] = start / 1000.0;
+            j["dur"] = (end - start) / 1000.0;
+            if (!first) {
+                out += ',';
+            }
+            out += j.dump();
+            first = false;
+        }
+    }
+    out += "]}";
+    return out;
+}
+
+response readTrace() {
+    response res(renderTraceJson());
+    res.set_header("Content-Type", "application/json");
+    return res;
+}
+
+response updateTraceSampling(request req) {
+    char* sampleParam = req.url_params.get("sample");
+    if (!sampleParam) {
+        return response(400, "Missing sample parameter");
+    }
+    traceSampleEvery.store((unsigned int)strtoul(sampleParam, nullptr, 10), memory_order_relaxed);
+    return response(204);
+}
@@ -0,0 +1,79 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <crow.h>
+
+using namespace std;
+using namespace crow;
+
+// 0 disables tracing; N samples every Nth root span on each thread
+extern atomic<unsigned int> traceSampleEvery;
+
+// True while the current thread is inside a sampled root span
+extern thread_local bool traceActive;
+
+long long traceNowNanos();
+void traceRecord(const char* name, long long startNanos, long long endNanos);
+bool traceSampleRoot();
+
+// Returns a pointer that stays valid for the life of the process
+const char* internTraceName(string name);
+
+// Times one phase of a sampled request. When the thread is not sampling,
+// construction and destruction cost a single branch on traceActive.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : name(traceActive ? name : nullptr), start(0) {
+        if (this->name) {
+            start = traceNowNanos();
+        }
+    }
+    ~TraceSpan() { end(); }
+
+    // Closes the span early so phases can be marked without extra scopes
+    void end() {
+        if (name) {
+            traceRecord(name, start, traceNowNanos());
+            name = nullptr;
+        }
+    }
+
+private:
+    const char* name;
+    long long start;
+};
+
+// Outermost span of a request or persistence call: decides whether this
+// unit of work is sampled, and acts as a plain span when already nested.
+class TraceRoot {
+public:
+    explicit TraceRoot(const char* name) : owner(claim()), span(name) {}
+    ~TraceRoot() {
+        span.end();
+        if (owner) {
+            traceActive = false;
+        }
+    }
+
+private:
+    static bool claim() {
+        if (traceActive || traceSampleEvery.load(memory_order_relaxed) == 0) {
+            return false;
+        }
+        traceActive = traceSampleRoot();
+        return traceActive;
+    }
+
+    bool owner;
+    TraceSpan span;
+};
+
+// Chrome trace_event JSON of every buffered span, viewable in Perfetto
+string renderTraceJson();
+response readTrace();
+response updateTraceSampling(request req);
+
+#endif
@@ -2,166 +2,214 @@
 #include "Book.h"
 #include "Recommendation.h"
 #include "Review.h"
+#include "ReviewStore.h"
+#include "Metrics.h"
+#include "Startup.h"
+#include "Trace.h"
+#include "ChangeLog.h"
+
+#include <unordered_map>
 
 extern map<string, User> userMap;
 extern map<string, Recommendation> recommendationMap;
 extern map<string, Book> bookMap;
-extern map<string, Review> reviewMap;
-
-json::wvalue convertUserToJson(User user) {
-    json::wvalue j;
-    j["id"] = user.getId();
-    j["name"] = user.getName();
-    j["email"] = user.getEmail();
-    j["preferences"] = user.getPreferences();
-    return j;
+extern ReviewStore reviewMap;
+
+// Lowercased email to the id of the user that has it
+static unordered_map<string, string> emailIndex;
+
+const string& User::getJsonFragment() {
+    if (__atomic_load_n(&cachedVersion, __ATOMIC_ACQUIRE) != version + 1) {
+        lock_guard<mutex> lock(fragmentLock(this));
+        if (cachedVersion != version + 1) {
+            string json;
+            writeJsonFields(json, *this);
+            cachedJson = make_shared<const string>(move(json));
+            __atomic_store_n(&cachedVersion, version + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return *cachedJson;
+}
+
+shared_ptr<const string> User::getSharedJsonFragment() {
+    getJsonFragment();
+    return cachedJson;
+}
+
+shared_ptr<const string> User::getJsonCache() const {
+    lock_guard<mutex> lock(fragmentLock(this));
+    return cachedJson;
+}
+
+// The user the index names for a lowercased email, as long as userMap still agrees
+static map<string, User>::iterator findEmailOwner(const string& folded) {
+    unordered_map<string, string>::iterator known = emailIndex.find(folded);
+    if (known == emailIndex.end()) {
+        return userMap.end();
+    }
+    map<string, User>::iterator it = userMap.find(known->second);
+    if (it == userMap.end() || toLower(it->second.getEmail()) != folded) {
+        return userMap.end();
+    }
+    return it;
 }
 
-// Template helper method to remove entries associated with a specific user
-template <typename T>
-void removeEntriesWithUser(map<string, T>& m, const string& userId) {
-    map<string, T> updatedMap;
-    for (auto it = m.begin(); it != m.end(); ++it) {
-        if (it->second.getUser().getId() != userId) {
-            updatedMap[it->first] = it->second;
+size_t rebuildEmailIndex() {
+    emailIndex.clear();
+    emailIndex.reserve(userMap.size());
+    size_t duplicates = 0;
+    for (map<string, User>::iterator it = userMap.begin(); it != userMap.end(); ++it) {
+        string folded = toLower(it->second.getEmail());
+        if (!folded.empty() && !emailIndex.emplace(folded, it->first).second) {
+            duplicates++;
+        }
+    }
+    return duplicates;
+}
+
+void indexUserEmail(User& user) {
+    string folded = toLower(user.getEmail());
+    if (!folded.empty()) {
+        emailIndex[folded] = user.getId();
+    }
+}
+
+void unindexUserEmail(User& user) {
+    unordered_map<string, string>::iterator known = emailIndex.find(toLower(user.getEmail()));
+    if (known != emailIndex.end() && known->second == user.getId()) {
+        emailIndex.erase(known);
+    }
+}
+
+// Removes the reviews of a user. Reviews of other users are not read in.
+static void removeEntriesWithUser(ReviewStore& m, const string& userId, const string& collection) {
+    TraceSpan span("removeEntriesWithUser");
+    // Erased in place: other entries keep their nodes, which indexes point into
+    for (ReviewStore::iterator it = m.begin(); it != m.end();) {
+        if (!m.refersToUser(it, userId)) {
+            ++it;
+        } else {
+            string removed = it->first;
+            it = m.erase(it);
+            recordDelete(collection, removed);
         }
     }
-    m = updatedMap;
 }
 
 response searchUsers(string searchStr) {
-    vector<User> foundUsers;
+    TraceSpan span("searchUsers");
+    vector<const string*> foundUsers;
     string loweredSearch = toLower(searchStr);
 
     map<string, User>::iterator it;
     for (it = userMap.begin(); it != userMap.end(); ++it) {
-        User u = it->second;
+        User& u = it->second;
         if (toLower(u.getName()).find(loweredSearch) != string::npos ||
             toLower(u.getEmail()).find(loweredSearch) != string::npos) {
-            foundUsers.push_back(u);
+            foundUsers.push_back(&u.getJsonFragment());
         }
     }
 
-    json::wvalue json;
-    int index = 0;
-    for (unsigned int i = 0; i < foundUsers.size(); i++) {
-        json[index++] = convertUserToJson(foundUsers[i]);
-    }
-
-    return std::move(response(json.dump()));
+    return std::move(response(joinJsonFragments(foundUsers)));
 }
 
 response sortUsers(string sortKey) {
-    vector<pair<string, User> > sortedItems;
+    TraceSpan span("sortUsers");
+    vector<User*> sortedItems;
 
     map<string, User>::iterator it;
     for (it = userMap.begin(); it != userMap.end(); ++it) {
-        sortedItems.push_back(make_pair(it->first, it->second));
+        sortedItems.push_back(&it->second);
     }
 
+    // Users with the same name or email stay in id order
     if (sortKey == "name") {
-        sort(sortedItems.begin(), sortedItems.end(), [](pair<string, User>& a, pair<string, User>& b) {
-            return a.second.getName() < b.second.getName();
+        stable_sort(sortedItems.begin(), sortedItems.end(), [](User* a, User* b) {
+            return a->getName() < b->getName();
         });
     } else if (sortKey == "email") {
-        sort(sortedItems.begin(), sortedItems.end(), [](pair<string, User>& a, pair<string, User>& b) {
-            return a.second.getEmail() < b.second.getEmail();
+        stable_sort(sortedItems.begin(), sortedItems.end(), [](User* a, User* b) {
+            return a->getEmail() < b->getEmail();
         });
     }
 
-    json::wvalue json;
-    int index = 0;
+    vector<const string*> fragments;
     for (unsigned int i = 0; i < sortedItems.size(); i++) {
-        json[index++] = convertUserToJson(sortedItems[i].second);
+        fragments.push_back(&sortedItems[i]->getJsonFragment());
     }
 
-    return std::move(response(json.dump()));
+    return std::move(response(joinJsonFragments(fragments)));
 }
 
 response filterUsers(string key, string value) {
-    vector<User> filteredUsers;
-    string loweredVal = toLower(value);
-
-    map<string, User>::iterator it;
-    for (it = userMap.begin(); it != userMap.end(); ++it) {
-        User u = it->second;
-        if ((key == "email" && toLower(u.getEmail()) == loweredVal)) {
-            filteredUsers.push_back(u);
+    TraceSpan span("filterUsers");
+    vector<const string*> filteredUsers;
+
+    // Emails are unique, so the index has the one possible match
+    if (key == "email") {
+        map<string, User>::iterator it = findEmailOwner(toLower(value));
+        if (it != userMap.end()) {
+            filteredUsers.push_back(&it->second.getJsonFragment());
         }
     }
 
-    json::wvalue json;
-    int index = 0;
-    for (unsigned int i = 0; i < filteredUsers.size(); i++) {
-        json[index++] = convertUserToJson(filteredUsers[i]);
-    }
-
-    return std::move(response(json.dump()));
+    return std::move(response(joinJsonFragments(filteredUsers)));
 }
 
 response createUser(request req) {
-    json::rvalue body = json::load(req.body);
-    if (!body) {
-        return std::move(response(400, "Invalid JSON"));
+    TraceSpan parseSpan("readJson");
+    User user;
+    response invalid;
+    bool parsed = readJsonBody(req.body, user, jsonRequiredFields<User>(), nullptr, invalid);
+    parseSpan.end();
+    if (!parsed) {
+        return invalid;
     }
 
-    string id = body["id"].s();
-
-    vector<string> preferences;
-    for (int i = 0; i < (int)body["preferences"].size(); i++) {
-        preferences.push_back(body["preferences"][(size_t)i].s());
+    string id = user.getId();
+    map<string, User>::iterator owner = findEmailOwner(toLower(user.getEmail()));
+    if (owner != userMap.end() && owner->first != id) {
+        return std::move(response(409, "Email already belongs to user " + owner->first));
     }
 
-    User user(id, body["name"].s(), body["email"].s(), preferences);
+    user.getJsonFragment(); // Serialize once so every copy fanned out below carries it
+    map<string, User>::iterator replaced = userMap.find(id);
+    if (replaced != userMap.end()) {
+        unindexUserEmail(replaced->second);
+    }
     userMap[id] = user;
+    indexUserEmail(user);
+    recordUpsert("users", id, user.getJsonFragment());
 
+    TraceSpan fanOutSpan("review fan-out");
     // Step 1: Update existing Reviews that reference this User
     for (auto it = reviewMap.begin(); it != reviewMap.end(); ++it) {
-        if (it->second.getUser().getId() == id) {
+        if (reviewMap.refersToUser(it, id)) {
             it->second.setUser(user); // Reassign the updated user to existing review
+            recordUpsert("reviews", it->first, it->second.getJsonFragment());
         }
     }
 
-    // Step 2: Remove all Recommendations associated with this User
-    removeEntriesWithUser(recommendationMap, id);
-
-    // Step 3: Rebuild Recommendations
-    vector<Recommendation> keptRecs;
-    for (auto it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        keptRecs.push_back(it->second);
-    }
-
-    // Add new Recommendations based on User preferences
-    for (auto it = bookMap.begin(); it != bookMap.end(); ++it) {
-        Book book = it->second;
-        for (int i = 0; i < (int)preferences.size(); i++) {
-            if (book.getGenre() == preferences[i]) {
-                Recommendation newRec("", user, book); // ID to be set during reindexing
-                keptRecs.push_back(newRec);
-                break;
-            }
-        }
-    }
+    fanOutSpan.end();
 
-    // Step 4: Reindex all Recommendations
-    map<string, Recommendation> updatedRecommendationMap;
-    for (int i = 0; i < (int)keptRecs.size(); ++i) {
-        stringstream ss;
-        ss << setfill('0') << setw(3) << (i + 1);
-        string recId = ss.str();
-        keptRecs[i].setId(recId);
-        updatedRecommendationMap[recId] = keptRecs[i];
-    }
-    recommendationMap = updatedRecommendationMap;
+    // Step 2: Recommendations are rebuilt off the request path
+    enqueueRecommendationsForUser(id);
 
-    return std::move(response(201, convertUserToJson(user).dump()));
+    return std::move(response(201, user.getJsonFragment()));
 }
 
 response readUser(string id) {
     map<string, User>::iterator it = userMap.find(id);
     if (it != userMap.end()) {
-        User user = it->second;
-        return std::move(response(convertUserToJson(user).dump()));
+        return std::move(response(it->second.getJsonFragment()));
+    }
+    return std::move(response(404, "User Not Found"));
+}
+
+response readUserByEmail(string email) {
+    map<string, User>::iterator it = findEmailOwner(toLower(email));
+    if (it != userMap.end()) {
+        return std::move(response(it->second.getJsonFragment()));
     }
     return std::move(response(404, "User Not Found"));
 }
@@ -182,14 +230,13 @@ response readAllUsers(request req) {
         return filterUsers(string(filterKey), string(filterValue));
     }
 
-    json::wvalue json;
-    int index = 0;
+    vector<const string*> fragments;
     map<string, User>::iterator it;
     for (it = userMap.begin(); it != userMap.end(); ++it) {
-        json[index++] = convertUserToJson(it->second);
+        fragments.push_back(&it->second.getJsonFragment());
     }
 
-    return std::move(response(json.dump()));
+    return std::move(response(joinJsonFragments(fragments)));
 }
 
 void updateUser(request req, response& res, string id) {
@@ -200,64 +247,55 @@ void updateUser(request req, response& res, string id) {
         return;
     }
 
-    json::rvalue body = json::load(req.body);
-    if (!body) {
-        res.code = 400;
-        res.end("Invalid JSON");
+    // Members left out of the body keep their value
+    TraceSpan parseSpan("readJson");
+    User patch;
+    unsigned seen;
+    bool parsed = readJsonBody(req.body, patch, 0, &seen, res);
+    parseSpan.end();
+    if (!parsed) {
+        res.end();
         return;
     }
 
     User& user = it->second;
-    user.setName(body["name"].s());
-    user.setEmail(body["email"].s());
+    string email = seen & jsonFieldBit<User>("email") ? patch.getEmail() : user.getEmail();
+    map<string, User>::iterator owner = findEmailOwner(toLower(email));
+    if (owner != userMap.end() && owner->first != id) {
+        res.code = 409;
+        res.end("Email already belongs to user " + owner->first);
+        return;
+    }
 
-    vector<string> preferences;
-    for (unsigned int i = 0; i < body["preferences"].size(); i++) {
-        preferences.push_back(body["preferences"][(size_t)i].s());
+    unindexUserEmail(user);
+    if (seen & jsonFieldBit<User>("name")) {
+        user.setName(patch.getName());
+    }
+    user.setEmail(email);
+    indexUserEmail(user);
+    if (seen & jsonFieldBit<User>("preferences")) {
+        user.setPreferences(patch.getPreferences());
     }
-    user.setPreferences(preferences);
-        // Step 1: Update existing Reviews that reference this User
+    user.getJsonFragment(); // Serialize once so every copy fanned out below carries it
+    recordUpsert("users", id, user.getJsonFragment());
+
+    TraceSpan fanOutSpan("review fan-out");
+    // Step 1: Update existing Reviews that reference this User
     for (auto it = reviewMap.begin(); it != reviewMap.end(); ++it) {
-        if (it->second.getUser().getId() == id) {
+        if (reviewMap.refersToUser(it, id)) {
             it->second.setUser(user); // Reassign the updated user to existing review
+            recordUpsert("reviews", it->first, it->second.getJsonFragment());
         }
     }
 
-    // Step 2: Remove all Recommendations associated with this User
-    removeEntriesWithUser(recommendationMap, id);
+    fanOutSpan.end();
 
-    // Step 3: Rebuild Recommendations
-    vector<Recommendation> keptRecs;
-    for (auto it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        keptRecs.push_back(it->second);
-    }
-
-    // Add new Recommendations based on User preferences
-    for (auto it = bookMap.begin(); it != bookMap.end(); ++it) {
-        Book book = it->second;
-        for (int i = 0; i < (int)preferences.size(); i++) {
-            if (book.getGenre() == preferences[i]) {
-                Recommendation newRec("", user, book); // ID to be set during reindexing
-                keptRecs.push_back(newRec);
-                break;
-            }
-        }
-    }
-
-    // Step 4: Reindex all Recommendations
-    map<string, Recommendation> updatedRecommendationMap;
-    for (int i = 0; i < (int)keptRecs.size(); ++i) {
-        stringstream ss;
-        ss << setfill('0') << setw(3) << (i + 1);
-        string recId = ss.str();
-        keptRecs[i].setId(recId);
-        updatedRecommendationMap[recId] = keptRecs[i];
-    }
-    recommendationMap = updatedRecommendationMap;
+    // Step 2: Recommendations are rebuilt off the request path
+    enqueueRecommendationsForUser(id);
 
     res.code = 200;
     res.set_header("Content-Type", "application/json");
-    res.write(convertUserToJson(user).dump());
+    res.write(user.getJsonFragment());
     res.end();
 }
 
@@ -269,73 +307,47 @@ response deleteUser(string id) {
     }
 
     // Step 1: Erase the user
+    unindexUserEmail(it->second);
     userMap.erase(it);
+    recordDelete("users", id);
 
     // Step 2: Remove all reviews associated with the user
-    removeEntriesWithUser(reviewMap, id);
+    removeEntriesWithUser(reviewMap, id, "reviews");
 
-    // Step 3: Remove all recommendations associated with the user
-    removeEntriesWithUser(recommendationMap, id);
-
-    // Step 4: Reindex remaining recommendations
-    vector<Recommendation> keptRecs;
-    for (auto it = recommendationMap.begin(); it != recommendationMap.end(); ++it) {
-        keptRecs.push_back(it->second);
-    }
-
-    map<string, Recommendation> reindexedMap;
-    for (int i = 0; i < (int)keptRecs.size(); i++) {
-        stringstream ss;
-        ss << setfill('0') << setw(3) << (i + 1);
-        string newId = ss.str();
-        keptRecs[i].setId(newId);
-        reindexedMap[newId] = keptRecs[i];
-    }
-
-    recommendationMap = reindexedMap;
+    // Step 3: Its recommendations are dropped off the request path
+    enqueueRecommendationsForUser(id);
 
     return response(204);
 }
 
 void saveUserToFile(map<string, User> data, string filename) {
+    TraceRoot trace("saveUserToFile");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
     ofstream file(filename);
     if (file.is_open()) {
-        json::wvalue json;
-        int index = 0;
+        vector<const string*> fragments;
         map<string, User>::iterator it;
         for (it = data.begin(); it != data.end(); ++it) {
-            json[index++] = convertUserToJson(it->second);
+            fragments.push_back(&it->second.getJsonFragment());
         }
-        file << json.dump();
+        string json = joinJsonFragments(fragments);
+
+        TraceSpan writeSpan("write file");
+        file << json;
         file.close();
     }
+    recordPersistence(SAVE_USERS, start);
 }
 
-map<string, User> loadUserFromFile(string filename) {
-    map<string, User> data;
-    ifstream file(filename);
-
-    if (file.is_open()) {
-        ostringstream ss;
-        ss << file.rdbuf();
-        file.close();
-
-        json::rvalue json = json::load(ss.str());
-
-        for (json::rvalue& item : json) {
-            string id = item["id"].s();
-            string name = item["name"].s();
-            string email = item["email"].s();
-
-            vector<string> preferences;
-            for (json::rvalue& pref : item["preferences"]) {
-                preferences.push_back(pref.s());
-            }
-
-            User user(id, name, email, preferences);
-            data[user.getId()] = user;
-        }
-    }
+bool parseUserJson(const json::rvalue& item, User& user) {
+    return readJson(item, user);
+}
 
+map<string, User> loadUserFromFile(string filename) {
+    TraceRoot trace("loadUserFromFile");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    // Cut into runs parsed side by side; a file that does not parse loads nothing
+    map<string, User> data = loadMapFile<User>(filename, loadThreadCount());
+    recordPersistence(LOAD_USERS, start);
     return data;
 }
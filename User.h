@@ -21,28 +21,52 @@ public:
     string getEmail() { return email; }
     vector<string> getPreferences() { return preferences; }
 
-    void setName(string value) { name = value; }
-    void setEmail(string value) { email = value; }
-    void setPreferences(vector<string> value) { preferences = value; }
+    void setName(string value) { name = value; version++; }
+    void setEmail(string value) { email = value; version++; }
+    void setPreferences(vector<string> value) { preferences = value; version++; }
+
+    // Serialized JSON, rebuilt lazily once a setter has moved the version on
+    unsigned long getVersion() { return version; }
+    const string& getJsonFragment();
+    shared_ptr<const string> getSharedJsonFragment(); // The same bytes, for holders that outlive this version
+    shared_ptr<const string> getJsonCache() const; // For memory accounting; null until built
+
+    static constexpr auto jsonFields() {
+        return make_tuple(jsonField("id", &User::id, JSON_REQUIRED),
+                          jsonField("name", &User::name, JSON_REQUIRED),
+                          jsonField("email", &User::email, JSON_REQUIRED),
+                          jsonField("preferences", &User::preferences));
+    }
 
 private:
     string id;
     string name;
     string email;
     vector<string> preferences;
+
+    unsigned long version = 0;
+    unsigned long cachedVersion = 0; // version + 1 once cachedJson is built
+    shared_ptr<const string> cachedJson; // Shared with the list snapshots
 };
 
-// JSON conversion
-json::wvalue convertUserToJson(User user);
 // CRUD + extended functionality
 response createUser(request req);
 response readUser(string id);
+response readUserByEmail(string email); // Any letter case
 response readAllUsers(request req);
 void updateUser(request req, response& res, string id);
 response deleteUser(string id);
 
 void saveUserToFile(map<string, User> data, string filename);
 map<string, User> loadUserFromFile(string filename);
+bool parseUserJson(const json::rvalue& item, User& user);
+
+// Unique index from lowercased email to user id, kept by the user handlers.
+// Rebuild after replacing userMap wholesale; returns the users whose email
+// was already taken (the first user by id keeps it).
+size_t rebuildEmailIndex();
+void indexUserEmail(User& user);
+void unindexUserEmail(User& user);
 
 
 
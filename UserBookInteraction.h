@@ -2,6 +2,7 @@
 #define USERBOOKINTERACTION_H
 
 #include <string>
+#include <mutex>
 #include "User.h"
 #include "Book.h"
 #include <crow.h>
@@ -18,15 +19,31 @@ public:
     string getId() { return interaction_ID; }
     User getUser() { return user; }
     Book getBook() { return book; }
+    string getUserId() { return user.getId(); } // Without copying the whole user
+    string getBookId() { return book.getId(); }
 
-    void setId(string value) { interaction_ID = value;}
-    void setUser(User value) { user = value; }
-    void setBook(Book value) { book = value; }
+    void setId(string value) { interaction_ID = value; version++; }
+    void setUser(User value) { user = value; version++; }
+    void setBook(Book value) { book = value; version++; }
+
+    unsigned long getVersion() { return version; }
+
+    // For memory accounting; the fragment is built under the same lock
+    shared_ptr<const string> getJsonCache() const {
+        lock_guard<mutex> lock(fragmentLock(this));
+        return cachedJson;
+    }
 
 protected:
     string interaction_ID;
     User user;
     Book book;
+
+    // Embedded user/book only change through setUser/setBook, so the
+    // interaction's own version is enough to stamp its cached fragment
+    unsigned long version = 0;
+    unsigned long cachedVersion = 0; // version + 1 once cachedJson is built
+    shared_ptr<const string> cachedJson; // Shared with the list snapshots
 };
 
 #endif
@@ -0,0 +1,65 @@
+#!/bin/bash
+# Scaling efficiency of the sharded deployment: for 1, 2, 4 and 8 shards behind
+# the router, drives the same open-loop load and reports achieved throughput and
+# p99. Efficiency is throughput(N) / (N * throughput(1)).
+# Build with `make all bench loadgen` first.
+#   ./bench_shards.sh [scenario] [offered rate per shard] [seconds]
+set -u
+
+SCENARIO=${1:-browse}
+RATE_PER_SHARD=${2:-4000}
+DURATION=${3:-20}
+USERS=${USERS:-20000}
+BOOKS=${BOOKS:-5000}
+REVIEWS=${REVIEWS:-200000}
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+PIDS=""
+trap 'kill $PIDS 2>/dev/null; wait 2>/dev/null; rm -rf "$WORK"' EXIT
+
+"$DIR/bench" --users=$USERS --books=$BOOKS --reviews=$REVIEWS --seed=7 --generate-only --data-dir="$WORK/data" > /dev/null
+
+wait_for() {
+    for i in $(seq 1 300); do
+        curl -s -o /dev/null "http://127.0.0.1:$1$2" && return 0
+        sleep 0.2
+    done
+    echo "server on port $1 did not come up" >&2
+    return 1
+}
+
+field() {
+    echo "$1" | sed -n "s/.*\"$2\":\([0-9.e+-]*\).*/\1/p"
+}
+
+printf "%-7s %14s %14s %10s %11s\n" "shards" "offered req/s" "achieved req/s" "p99 us" "efficiency"
+base=""
+for N in 1 2 4 8; do
+    rm -rf "$WORK/run" && cp -r "$WORK/data" "$WORK/run"
+    list=""
+    PIDS=""
+    for i in $(seq 0 $((N - 1))); do
+        (cd "$WORK/run" && exec "$DIR/bookReviewAPI" --shard=$i/$N --port=$((18701 + i)) --stream-port=$((18801 + i))) \
+            > "$WORK/shard$i.log" 2>&1 &
+        PIDS="$PIDS $!"
+        list="$list,127.0.0.1:$((18701 + i))"
+    done
+    for i in $(seq 0 $((N - 1))); do
+        wait_for $((18701 + i)) /metrics || exit 1
+    done
+    "$DIR/router" --port=18700 --shards="${list#,}" > "$WORK/router.log" 2>&1 &
+    PIDS="$PIDS $!"
+    wait_for 18700 /api/books/probe || exit 1
+
+    rate=$((RATE_PER_SHARD * N))
+    report=$("$DIR/loadgen" --target=127.0.0.1:18700 --scenario=$SCENARIO --rate=$rate --threads=64 \
+             --duration=$DURATION --users=$USERS --books=$BOOKS --reviews=$REVIEWS --json)
+    achieved=$(field "$report" achieved_rate)
+    p99=$(echo "$report" | sed -n 's/.*"overall":{[^}]*"p99_us":\([0-9]*\).*/\1/p')
+    [ -z "$base" ] && base=$achieved
+    efficiency=$(awk -v a="$achieved" -v b="$base" -v n=$N 'BEGIN { printf "%.2f", a / (n * b) }')
+    printf "%-7s %14s %14.0f %10s %11s\n" "$N" "$rate" "$achieved" "$p99" "$efficiency"
+
+    kill $PIDS 2>/dev/null
+    wait 2>/dev/null
+done
@@ -1,56 +1,177 @@
 #include "Book.h"
 #include "User.h"
 #include "Review.h"
+#include "ReviewStore.h"
 #include "Recommendation.h"
+#include "Instrument.h"
+#include "AdmissionControl.h"
+#include "SingleFlight.h"
+#include "Compression.h"
+#include "ChangeLog.h"
+#include "ChangeStream.h"
+#include "Replication.h"
+#include "Sharding.h"
+#include "ListSnapshot.h"
+#include "ReviewSearch.h"
+#include "BookSuggest.h"
+#include "Facets.h"
+#include "Startup.h"
+#include "MemoryAccounting.h"
 #include <crow.h>
 #include <vector>
+#include <shared_mutex>
+#include <atomic>
+#include <fstream>
+#include <functional>
 
 using namespace crow;
 using namespace std;
 
 map<string, Book> bookMap;
 map<string, User> userMap;
-map<string, Review> reviewMap;
+ReviewStore reviewMap;
 map<string, Recommendation> recommendationMap;
+shared_mutex dataMutex;
+atomic<unsigned long long> dataVersion(0);
 
-int main() {
-    bookMap = loadBookFromFile("books.json");
-    userMap = loadUserFromFile("users.json");
-    reviewMap = loadReviewFromFile("reviews.json");
-    recommendationMap = loadRecommendationFromFile("recommendations.json");
+int main(int argc, char* argv[]) {
+    int port = 18525;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 7, "--port=") == 0) {
+            port = atoi(arg.c_str() + 7);
+            continue;
+        }
+        if (!parseAdmissionFlag(argv[i]) && !parseCoalescingFlag(argv[i]) && !parseCompressionFlag(argv[i]) &&
+            !parseChangeLogFlag(argv[i]) && !parseChangeStreamFlag(argv[i]) && !parseReplicationFlag(argv[i]) &&
+            !parseShardFlag(argv[i]) && !parseListSnapshotFlag(argv[i]) && !parseStartupFlag(argv[i]) &&
+            !parseReviewStoreFlag(argv[i])) {
+            cerr << "unknown or malformed option: " << argv[i] << "\n"
+                 << "options: --threads=N --reserved-threads=N --queue-timeout-ms=N --retry-after=S\n"
+                 << "         --adaptive-latency-ms=N --route-limit=\"METHOD /path=CONCURRENCY:QUEUE\" --coalesce=on|off\n"
+                 << "         --compression-level=0-9 --compress-min-bytes=N --compress-cache-mb=N --change-log-size=N\n"
+                 << "         --stream-port=N --stream-buffer-kb=N --stream-heartbeat-s=N --port=N --replica-of=HOST:PORT\n"
+                 << "         --shard=I/N --snapshot-lists=on|off --load-threads=N --review-store=DIR --review-cache-mb=N\n";
+            return 1;
+        }
+    }
+
+    if (!reviewStoreOptions.dir.empty() && !reviewMap.open(reviewStoreOptions)) {
+        cerr << "review store: cannot write to " << reviewStoreOptions.dir << "\n";
+        return 1;
+    }
+
+    // Loading runs behind the server, which answers 503 until it is done.
+    // A replica starts empty and fills itself from the primary's snapshot.
+    // A shard reads its own files once it has saved them, and until then
+    // takes its partition out of the unsharded ones.
+    addChangeListener(publishChange);
+    startLoading([]() {
+        int threads = loadThreadCount();
+        vector<function<void()>> builds = {rebuildReviewIndex, rebuildBookSuggestions, rebuildFacets};
+        size_t sharedIsbns = 0;
+        size_t sharedEmails = 0;
+        if (!isReadOnlyReplica()) {
+            bool partitioned = !isSharded() || ifstream(shardFileName("users.json")).good();
+            loadDataFiles(partitioned ? shardFileName("books.json") : "books.json",
+                          partitioned ? shardFileName("users.json") : "users.json",
+                          partitioned ? shardFileName("reviews.json") : "reviews.json",
+                          partitioned ? shardFileName("recommendations.json") : "recommendations.json", threads);
+            if (!partitioned) {
+                keepOwnedPartition();
+            }
+            builds.push_back([&]() { sharedIsbns = rebuildIsbnIndex(); });
+            builds.push_back([&]() { sharedEmails = rebuildEmailIndex(); });
+            // A replica applies changes without going through the change log, so
+            // its list GETs keep reading the maps under the lock
+            builds.push_back(startListSnapshots);
+        }
+        runParallel(builds, threads);
+        if (sharedIsbns > 0) {
+            cerr << "warning: " << sharedIsbns << " books repeat another book's ISBN; lookups by ISBN return the first" << endl;
+        }
+        if (sharedEmails > 0) {
+            cerr << "warning: " << sharedEmails << " users repeat another user's email; lookups by email return the first" << endl;
+        }
+    });
 
     SimpleApp app;
 
     // User endpoints
-    CROW_ROUTE(app, "/api/users").methods(HTTPMethod::POST)(createUser);
-    CROW_ROUTE(app, "/api/users").methods(HTTPMethod::GET)(readAllUsers);
-    CROW_ROUTE(app, "/api/users/<string>").methods(HTTPMethod::GET)(readUser);
-    CROW_ROUTE(app, "/api/users/<string>").methods(HTTPMethod::PUT)(updateUser);
-    CROW_ROUTE(app, "/api/users/<string>").methods(HTTPMethod::DELETE)(deleteUser);
+    CROW_ROUTE(app, "/api/users").methods(HTTPMethod::POST)(instrument("POST", "/api/users", createUser));
+    CROW_ROUTE(app, "/api/users").methods(HTTPMethod::GET)(instrument("GET", "/api/users", readAllUsers));
+    CROW_ROUTE(app, "/api/users/by-email/<string>").methods(HTTPMethod::GET)(instrument("GET", "/api/users/by-email/<id>", readUserByEmail));
+    CROW_ROUTE(app, "/api/users/<string>").methods(HTTPMethod::GET)(instrument("GET", "/api/users/<id>", readUser));
+    CROW_ROUTE(app, "/api/users/<string>").methods(HTTPMethod::PUT)(instrument("PUT", "/api/users/<id>", updateUser));
+    CROW_ROUTE(app, "/api/users/<string>").methods(HTTPMethod::DELETE)(instrument("DELETE", "/api/users/<id>", deleteUser));
 
     // Book endpoints
-    CROW_ROUTE(app, "/api/books").methods(HTTPMethod::POST)(createBook);
-    CROW_ROUTE(app, "/api/books").methods(HTTPMethod::GET)(readAllBooks);
-    CROW_ROUTE(app, "/api/books/<string>").methods(HTTPMethod::GET)(readBook);
-    CROW_ROUTE(app, "/api/books/<string>").methods(HTTPMethod::PUT)(updateBook);
-    CROW_ROUTE(app, "/api/books/<string>").methods(HTTPMethod::DELETE)(deleteBook);
+    CROW_ROUTE(app, "/api/books").methods(HTTPMethod::POST)(instrument("POST", "/api/books", createBook));
+    CROW_ROUTE(app, "/api/books").methods(HTTPMethod::GET)(instrument("GET", "/api/books", readAllBooks));
+    // Ahead of /api/books/<string>, which would otherwise take "suggest" for an id
+    CROW_ROUTE(app, "/api/books/suggest").methods(HTTPMethod::GET)(instrument("GET", "/api/books/suggest", readBookSuggestions));
+    CROW_ROUTE(app, "/api/books/isbn/<string>").methods(HTTPMethod::GET)(instrument("GET", "/api/books/isbn/<id>", readBookByIsbn));
+    CROW_ROUTE(app, "/api/books/<string>").methods(HTTPMethod::GET)(instrument("GET", "/api/books/<id>", readBook));
+    CROW_ROUTE(app, "/api/books/<string>").methods(HTTPMethod::PUT)(instrument("PUT", "/api/books/<id>", updateBook));
+    CROW_ROUTE(app, "/api/books/<string>").methods(HTTPMethod::DELETE)(instrument("DELETE", "/api/books/<id>", deleteBook));
 
     // Review endpoints
-    CROW_ROUTE(app, "/api/reviews").methods(HTTPMethod::POST)(createReview);
-    CROW_ROUTE(app, "/api/reviews").methods(HTTPMethod::GET)(readAllReviews);
-    CROW_ROUTE(app, "/api/reviews/<string>").methods(HTTPMethod::GET)(readReview);
-    CROW_ROUTE(app, "/api/reviews/<string>").methods(HTTPMethod::PUT)(updateReview);
-    CROW_ROUTE(app, "/api/reviews/<string>").methods(HTTPMethod::DELETE)(deleteReview);
+    CROW_ROUTE(app, "/api/reviews").methods(HTTPMethod::POST)(instrument("POST", "/api/reviews", createReview));
+    CROW_ROUTE(app, "/api/reviews").methods(HTTPMethod::GET)(instrument("GET", "/api/reviews", readAllReviews));
+    CROW_ROUTE(app, "/api/reviews/<string>").methods(HTTPMethod::GET)(instrument("GET", "/api/reviews/<id>", readReview));
+    CROW_ROUTE(app, "/api/reviews/<string>").methods(HTTPMethod::PUT)(instrument("PUT", "/api/reviews/<id>", updateReview));
+    CROW_ROUTE(app, "/api/reviews/<string>").methods(HTTPMethod::DELETE)(instrument("DELETE", "/api/reviews/<id>", deleteReview));
 
     // Recommendation endpoints (GET only)
-    CROW_ROUTE(app, "/api/recommendations").methods(HTTPMethod::GET)(readAllRecommendations);
-    CROW_ROUTE(app, "/api/recommendations/<string>").methods(HTTPMethod::GET)(readRecommendation);
-
-    app.port(18525).multithreaded().run();
-    
-    saveBookToFile(bookMap, "books.json");
-    saveUserToFile(userMap, "users.json");
-    saveReviewToFile(reviewMap, "reviews.json");
-    saveRecommendationToFile(recommendationMap, "recommendations.json");
+    CROW_ROUTE(app, "/api/recommendations").methods(HTTPMethod::GET)(instrument("GET", "/api/recommendations", readAllRecommendations));
+    CROW_ROUTE(app, "/api/recommendations/<string>").methods(HTTPMethod::GET)(instrument("GET", "/api/recommendations/<id>", readRecommendation));
+
+    // Change feed: upserts and tombstones after ?since=<seq>, 410 once that is compacted away
+    CROW_ROUTE(app, "/api/changes").methods(HTTPMethod::GET)(instrument("GET", "/api/changes", readChanges));
+
+    // Live server-sent events of the same changes, served from the stream port
+    CROW_ROUTE(app, "/api/stream").methods(HTTPMethod::GET)(redirectToChangeStream);
+
+    // Replication: bootstrap snapshot, state digest for consistency checks, role and lag
+    CROW_ROUTE(app, "/api/replication/snapshot").methods(HTTPMethod::GET)(instrument("GET", "/api/replication/snapshot", readReplicationSnapshot));
+    CROW_ROUTE(app, "/api/replication/digest").methods(HTTPMethod::GET)(instrument("GET", "/api/replication/digest", readStateDigest));
+    CROW_ROUTE(app, "/api/replication/status").methods(HTTPMethod::GET)(readReplicationStatus);
+
+    // Prometheus scrape endpoint
+    CROW_ROUTE(app, "/metrics").methods(HTTPMethod::GET)(readMetrics);
+
+    // Readiness for load balancers: 503 while loading, 200 after
+    CROW_ROUTE(app, "/ready").methods(HTTPMethod::GET)(readReadiness);
+
+    // Estimated heap per collection, entity type and field class, with the allocator's totals.
+    // Walks the maps a chunk at a time under the shared lock; ?sample=N measures every Nth entity.
+    CROW_ROUTE(app, "/api/admin/memory").methods(HTTPMethod::GET)(readMemoryUsage);
+
+    // Chrome trace_event dump of sampled spans; POST ?sample=N samples every Nth request (0 disables)
+    CROW_ROUTE(app, "/debug/trace").methods(HTTPMethod::GET)(readTrace);
+    CROW_ROUTE(app, "/debug/trace").methods(HTTPMethod::POST)(updateTraceSampling);
+
+    if (!isReadOnlyReplica() && !startChangeStream()) {
+        cerr << "change stream: cannot listen on port " << changeStreamOptions.port << "\n";
+    }
+    // Recommendations on a replica arrive from the primary like everything else
+    if (isReadOnlyReplica()) {
+        startReplication();
+    } else {
+        startRecommendationWorker();
+    }
+    app.port(port).concurrency(admissionOptions.workerThreads).run();
+    waitForLoading();
+    stopReplication();
+    stopRecommendationWorker();
+    stopChangeStream();
+    stopListSnapshots();
+
+    if (!isReadOnlyReplica()) {
+        saveBookToFile(bookMap, shardFileName("books.json"));
+        saveUserToFile(userMap, shardFileName("users.json"));
+        saveReviewToFile(reviewMap, shardFileName("reviews.json"));
+        saveRecommendationToFile(recommendationMap, shardFileName("recommendations.json"));
+    }
     return 0;
 }
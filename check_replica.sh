@@ -0,0 +1,73 @@
+#!/bin/bash
+# Runs a primary and a read replica side by side, writes to the primary, waits for
+# the replica to catch up and compares their state digests. Build with `make` first.
+#   ./check_replica.sh [writes]
+set -u
+
+WRITES=${1:-300}
+BIN=$(cd "$(dirname "$0")" && pwd)/bookReviewAPI
+PRIMARY=127.0.0.1:18625
+REPLICA=127.0.0.1:18635
+WORK=$(mktemp -d)
+mkdir -p "$WORK/primary" "$WORK/replica"
+
+(cd "$WORK/primary" && exec "$BIN" --port=18625 --stream-port=18626) > "$WORK/primary.log" 2>&1 &
+PRIMARY_PID=$!
+(cd "$WORK/replica" && exec "$BIN" --port=18635 --stream-port=18636 --replica-of=$PRIMARY) > "$WORK/replica.log" 2>&1 &
+REPLICA_PID=$!
+trap 'kill $PRIMARY_PID $REPLICA_PID 2>/dev/null; wait 2>/dev/null; rm -rf "$WORK"' EXIT
+
+field() {
+    # field <json> <name>: value of a top-level number or string field
+    echo "$1" | sed -n "s/.*\"$2\":\"\{0,1\}\([^\",}]*\).*/\1/p"
+}
+
+for i in $(seq 1 50); do
+    curl -sf http://$PRIMARY/api/replication/status > /dev/null && curl -sf http://$REPLICA/api/replication/status > /dev/null && break
+    sleep 0.2
+done
+
+# Creates, updates and deletes across every collection, including cascades
+for i in $(seq 1 "$WRITES"); do
+    genre=$([ $((i % 2)) -eq 0 ] && echo Fiction || echo History)
+    curl -sf -X POST http://$PRIMARY/api/users -d "{\"id\":\"cu$i\",\"name\":\"User $i\",\"email\":\"cu$i@example.com\",\"preferences\":[\"$genre\"]}" > /dev/null
+    curl -sf -X POST http://$PRIMARY/api/books -d "{\"id\":\"cb$i\",\"title\":\"Book $i\",\"author\":\"Author $i\",\"genre\":\"$genre\",\"isbn\":\"978000000$i\"}" > /dev/null
+    curl -sf -X POST http://$PRIMARY/api/reviews -d "{\"id\":\"cr$i\",\"user\":{\"id\":\"cu$i\"},\"book\":{\"id\":\"cb$i\"},\"rating\":$((i % 5 + 1)),\"comment\":\"Review $i\"}" > /dev/null
+    if [ $((i % 7)) -eq 0 ]; then
+        curl -sf -X PUT http://$PRIMARY/api/books/cb$((i - 1)) -d "{\"title\":\"Book $i revised\",\"author\":\"Author $i\",\"genre\":\"Fiction\",\"isbn\":\"978000000$i\"}" > /dev/null
+        curl -sf -X DELETE http://$PRIMARY/api/users/cu$((i - 3)) > /dev/null
+    fi
+done
+
+# Writes through the replica must be redirected, not applied
+code=$(curl -s -o /dev/null -w '%{http_code}' -X POST http://$REPLICA/api/books -d '{"id":"x"}')
+if [ "$code" != "307" ]; then
+    echo "FAIL: replica answered a write with $code instead of 307"
+    exit 1
+fi
+
+# Quiescence: the primary's sequence stops moving once background rebuilds are applied
+previous=""
+for i in $(seq 1 100); do
+    seq=$(field "$(curl -sf http://$PRIMARY/api/replication/status)" seq)
+    [ -n "$seq" ] && [ "$seq" = "$previous" ] && break
+    previous=$seq
+    sleep 0.1
+done
+
+for i in $(seq 1 100); do
+    status=$(curl -sf http://$REPLICA/api/replication/status)
+    [ "$(field "$status" appliedSeq)" = "$seq" ] && break
+    sleep 0.1
+done
+echo "replica status: $status"
+
+primary_digest=$(curl -sf http://$PRIMARY/api/replication/digest)
+replica_digest=$(curl -sf http://$REPLICA/api/replication/digest)
+if [ "$(field "$primary_digest" digest)" != "$(field "$replica_digest" digest)" ] || [ -z "$(field "$primary_digest" digest)" ]; then
+    echo "FAIL: replica diverged"
+    echo "primary: $primary_digest"
+    echo "replica: $replica_digest"
+    exit 1
+fi
+echo "OK: replica matches primary at seq $seq (digest $(field "$primary_digest" digest))"
@@ -1,9 +1,14 @@
 #include "User.h"
 #include "Book.h"
 #include "Review.h"
+#include "ReviewStore.h"
 #include "Recommendation.h"
+#include <shared_mutex>
+#include <atomic>
 
 map<string, User> userMap;
 map<string, Book> bookMap;
-map<string, Review> reviewMap;
+ReviewStore reviewMap;
 map<string, Recommendation> recommendationMap;
+shared_mutex dataMutex;
+atomic<unsigned long long> dataVersion(0);